@@ -9,23 +9,24 @@ typedef double rvar_type_t;
 /*
  * Random variable datastructures
  *
- * There are two types of random variables:
+ * There are four types of random variables:
  *
  * 1) Sampled: where the sampled data is kept in an array (lossless).
  * 2) Bucketed: where a summary of data is kept in a histogram (lossy).
+ * 3) Sketched: where a quantile sketch of the data is kept in bounded memory
+ * (lossy, but mergeable and the data can be streamed into it).
+ * 4) Sparse: a point mass at zero plus a (bucketed) tail, for distributions
+ * that are mostly zero, e.g., violation costs.
  *
  * Most operations (e.g., convolutions) on the sampled data result in a
  * bucketed output to save memory space.
  *
- * TODO: Can probably extend to add a sparse random variable too, incase the
- * probability distribution is too skewed.
- *
  * TODO: Should add a warning when the bucket size is too small (or
  * automatically choose the bucket size somehow).
  */
 
 enum RVAR_TYPE {
-  SAMPLED, BUCKETED,
+  SAMPLED, BUCKETED, SKETCHED, SPARSE,
 };
 
 struct rvar_t {
@@ -66,9 +67,10 @@ struct rvar_t {
 /* A random variable that uses "sampled" values for its calculations. */
 struct rvar_sample_t {
   struct rvar_t;
-  rvar_type_t low, high;
+  rvar_type_t low, high;    /* Only valid once sorted */
   uint32_t num_samples;
   rvar_type_t *vals;
+  int sorted;               /* Are the vals sorted yet (see rvar_sample_create) */
 };
 
 struct bucket_t {
@@ -84,13 +86,52 @@ struct rvar_bucket_t {
   rvar_type_t bucket_size;  /* Size of each bucket */
 };
 
+/* A random variable that keeps a KLL quantile sketch of the data.
+ *
+ * Items in levels[h] each stand for 2^h samples.  The memory usage is bounded
+ * by roughly 3k items, and the rank error of the percentiles is O(1/k).  The
+ * expected value, low, and high are exact. */
+struct rvar_sketch_t {
+  struct rvar_t;            /* Sketched rvar is a rvar_t */
+  unsigned k;               /* Capacity of the top level (accuracy knob) */
+  unsigned nlevels;         /* Number of levels (compactors) */
+  rvar_type_t **levels;     /* Items in each level */
+  unsigned *sizes;          /* Number of items in each level */
+  unsigned *caps;           /* Allocated size of each level */
+  unsigned *limits;         /* Number of items that triggers compacting a level */
+  struct bucket_t *sorted;  /* Items sorted by value with their cumulative
+                               weight in prob (0 if the sketch changed) */
+  unsigned nsorted;
+  unsigned coin;            /* Alternates the items we promote on compaction */
+  uint64_t count;           /* Number of samples added to the sketch */
+  rvar_type_t sum;          /* Sum of the samples */
+  rvar_type_t low, high;    /* Min and max of the samples */
+};
+
+#define RVAR_SKETCH_DEFAULT_K 200
+
+/* A random variable with a point mass at zero and a histogram for the rest */
+struct rvar_sparse_t {
+  struct rvar_t;            /* Sparse rvar is a rvar_t */
+  rvar_type_t zero;         /* Probability of the value being zero */
+  struct bucket_t *tail;    /* Non-zero buckets (sorted) */
+  unsigned ntail;           /* Number of non-zero buckets */
+  rvar_type_t bucket_size;  /* Size of each bucket */
+};
+
 /* Deserialize the string into a random variable */
 struct rvar_t *rvar_deserialize(char const *data);
+/* Sampled rvar that owns vals.  The vals are sorted (in place) right away so
+ * the rvar can be shared between threads */
 struct rvar_t *rvar_sample_create_with_vals(rvar_type_t *vals, uint32_t nvals);
+/* Same as above but the caller promises that the vals are already sorted */
+struct rvar_t *rvar_sample_create_with_sorted_vals(rvar_type_t *vals, uint32_t nvals);
 struct rvar_t *rvar_zero(void);
 struct rvar_t *rvar_fixed(rvar_type_t value);
 
-/* Create a sampled random variable */
+/* Create a sampled random variable, the caller fills the vals.  The vals are
+ * sorted by the first percentile/to_bucket/serialize call, which writes to
+ * the rvar, so don't share it between threads before then */
 struct rvar_t *rvar_sample_create(unsigned);
 
 /* Create an empty bucketized random variable---typically shouldn't be needed or used */
@@ -107,12 +148,74 @@ struct rvar_t *rvar_compose_with_distributions(
     double *dists,
     unsigned len);
 
+/* Same as rvar_compose_with_distributions, but writes the composed (sorted
+ * and compressed) buckets into out and returns the number of buckets.  out
+ * should have room for at least rvar_compose_size(rvars, len) buckets.  The
+ * bucket size of the composition is returned in ret_bucket_size (if not
+ * null).
+ *
+ * The rvars are already sorted so they are k-way merged, i.e., this takes
+ * O(N log(len)) as opposed to sorting all the N buckets. */
+unsigned rvar_compose_with_distributions_into(
+    struct rvar_t **rvars,
+    double *dists,
+    unsigned len,
+    struct bucket_t *out,
+    rvar_type_t *ret_bucket_size);
+
+/* Returns the number of buckets that composing rvars may need */
+unsigned rvar_compose_size(struct rvar_t **rvars, unsigned len);
+
 /* Creates a new rvar from a list of buckets */
 struct rvar_t *rvar_from_buckets(
     struct bucket_t *buckets,
     unsigned nbuckets,
     rvar_type_t bucket_size);
 
+/* Returns the k-fold convolution of rv with itself, i.e., rv + rv + ... + rv
+ * (k times).  Uses O(log(k)) convolutions.  The returned rvar is bucketed
+ * (unless k == 1, where it is a copy of rv) and k == 0 returns a zero rvar. */
+struct rvar_t *rvar_power(
+    struct rvar_t const *rv,
+    unsigned k,
+    rvar_type_t bucket_size);
+
+/* Create an empty sketched random variable with accuracy k */
+struct rvar_t *rvar_sketch_create(unsigned k);
+
+/* Add a sample to a sketched random variable */
+void rvar_sketch_add(struct rvar_t *rv, rvar_type_t val);
+
+/* Merge the src sketch into the dst sketch */
+void rvar_sketch_merge(struct rvar_t *dst, struct rvar_t const *src);
+
+/* Create a sketched random variable from a list of values */
+struct rvar_t *rvar_sketch_from_vals(
+    rvar_type_t const *vals, uint32_t nvals, unsigned k);
+
+/* Returns a new sketch with func applied to every item of the sketch. */
+struct rvar_t *rvar_sketch_map(
+    struct rvar_t const *rv,
+    rvar_type_t (*func)(void *, rvar_type_t),
+    void *data);
+
+/* Create a sparse copy of rv: the zero bucket becomes the zero spike. */
+struct rvar_t *rvar_to_sparse(struct rvar_t const *rv, rvar_type_t bucket_size);
+
+/* Returns the probability of rv being zero */
+rvar_type_t rvar_zero_mass(struct rvar_t const *rv);
+
+/* Sets the maximum number of buckets that a bucketed rvar (or the tail of a
+ * sparse rvar) can have.  Rvars that grow larger (e.g., through convolution)
+ * are re-binned to this size while keeping their mass and mean.  0 means
+ * unbounded, which is the default. */
+void rvar_bucket_limit_set(unsigned max_buckets);
+unsigned rvar_bucket_limit(void);
+
+/* Returns the total error (Wasserstein-1 distance) introduced by re-binning
+ * since the last reset.  Resets the error if reset is non-zero. */
+rvar_type_t rvar_rebin_error(int reset);
+
 //rvar_bucket_t *rvar_to_bucket(struct
 
 #endif // _ALGO_RANDVAR_H_   
@@ -24,6 +24,10 @@ struct expr_cache_t {
   /* Rvar directory */
   char const *rvar_directory;
 
+  /* If non-zero, long-term rvars are loaded into sketches of this accuracy
+   * instead of keeping all the samples */
+  unsigned rvar_sketch_k;
+
   /* Predictor directories */
   char const *ewma_directory;
   char const *perfect_directory;
@@ -75,6 +79,21 @@ struct expr_t {
   struct network_t *network;
   trace_time_t mop_duration;
 
+  // Number of simulation threads (0 for get_ncores() - 1)
+  unsigned num_threads;
+
+  // Pin the simulation threads and keep their memory on their NUMA node
+  int numa;
+
+  // Byte budget (in MB) of the TM cache of every trace (0 for the default)
+  unsigned trace_cache_mb;
+
+  // Number of TMs to read ahead of sequential trace iterators (0 is off)
+  unsigned trace_prefetch;
+
+  // Keyframe interval of the packed traces we write (0 writes raw TMs)
+  unsigned trace_compress;
+
   // Predictor stuff
   float ewma_coeff;
   char *predictor_string;
@@ -131,6 +150,10 @@ struct expr_t {
   // Pug related configuration
   trace_time_t pug_backtrack_traffic_count;
   int          pug_is_backtrack;
+  double       pug_sparse_zero_mass;
+  unsigned     pug_max_buckets;
+  unsigned     pug_adaptive_round;
+  double       pug_adaptive_error;
 
   // Failure configuration
   char *   failure_mode;
@@ -2,6 +2,7 @@
 #define _TYPES_H_
 
 #include "algo/rvar.h"
+#include <stddef.h>
 #include <stdint.h>
 
 /* Max path length for each flow */
@@ -45,6 +46,13 @@ struct flow_t {
   struct flow_t *next, *prev;
 };
 
+/* Memory block of the dataplane arena */
+struct dataplane_block_t {
+  struct dataplane_block_t *next;
+  size_t size, used;
+  _Alignas(16) char data[];
+};
+
 /* Dataplane representation */
 struct dataplane_t {
   /* Structure holding the links per flow.  This is a 2D structure where routing
@@ -78,11 +86,24 @@ struct dataplane_t {
 
   struct flow_t *smallest_flow;
   struct link_t *smallest_link;
+
+  /* Arena backing the routing, links, flows, and the flow lists of the links.
+   * The same dataplane is rebuilt for every traffic matrix, so instead of
+   * freeing and mallocing these every time the arena is rewound and the
+   * memory is reused. */
+  struct dataplane_block_t *arena;
 };
 
+/* Release the current dataplane (the memory stays in the arena) */
 void dataplane_init(struct dataplane_t *);
+
+/* Release the dataplane and its arena */
 void dataplane_free_resources(struct dataplane_t *);
 
+/* Allocate size bytes from the dataplane arena.  The memory is valid until
+ * the next dataplane_init. */
+void *dataplane_alloc(struct dataplane_t *, size_t size);
+
 // Returns the number of violations of a dataplane
 int dataplane_count_violations(struct dataplane_t const *dp, float max_bandwidth);
 rvar_type_t dataplane_mlu(struct dataplane_t const *dp);
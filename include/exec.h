@@ -6,10 +6,12 @@
 #include "dataplane.h"
 #include "plan.h"
 #include "plans/jupiter.h"
+#include "predictor.h"
 #include "risk.h"
 #include "traffic.h"
 
 struct expr_t;
+struct pool_t;
 
 struct exec_result_t {
   risk_cost_t   cost;         // Cost of the planner
@@ -22,6 +24,15 @@ struct exec_output_t {
   struct array_t *result;     // An array_t of exec_result_t
 };
 
+/* A network and the dataplane used for simulating it */
+struct exec_net_dp_t {
+  struct dataplane_t dp;
+  struct network_t *net;
+
+  /* Mop currently applied on net by exec_simulate_stream (0 if none) */
+  struct mop_t *mop;
+};
+
 /* Exec is the context in which we run the experiments in */
 struct exec_t {
   /* Explain what this exec does---this should be presented on the screen in
@@ -34,19 +45,29 @@ struct exec_t {
   /* Run the experiment */
   struct exec_output_t * (*run) (struct exec_t *, struct expr_t const *expr);
 
+  /* Release the exec specific state, called by exec_free (0 if none) */
+  void (*release)  (struct exec_t *);
+
   struct traffic_matrix_trace_t *trace;
   struct traffic_matrix_trace_t *trace_training;
 
-  /* A list holding network/dataplane instances.
+  /* Network/dataplane instances: one per pool worker plus one (the last one)
+   * for the main thread.  Each worker owns its instance for the lifetime of
+   * the pool.
    * This is mainly used in concurrent execution of monte-carlo simulations
    * across different cores.
    *
-   * The main reason for having this class is that both dataplane and network
-   * are heavy to build and initiate (less so true about dataplane, but network
-   * can be rather heavy).  So instead of release and creating new instances
-   * we just pass ownership to each simulation instances.
+   * The main reason for having these around is that both dataplane and
+   * network are heavy to build and initiate (less so true about dataplane,
+   * but network can be rather heavy).  So instead of release and creating new
+   * instances each worker keeps reusing its own (indexed by pool_worker_id),
+   * without any locking.
    */
-  struct freelist_repo_t *net_dp;
+  struct exec_net_dp_t *net_dp;
+  unsigned nnet_dp;
+
+  /* Thread pool shared by all the parallel simulations (see exec_pool) */
+  struct pool_t *pool;
 };
 
 /* Traffic stats structures */
@@ -100,6 +121,23 @@ struct predictor_t *exec_perfect_cache_build_or_load(struct exec_t *, struct exp
  * */
 struct predictor_t *exec_predictor_create(struct exec_t *exec, struct expr_t const *expr, char const *value);
 
+/* Returns the exec's thread pool, creates it (with expr->num_threads workers)
+ * on first use */
+struct pool_t *exec_pool(struct exec_t *exec, struct expr_t const *expr);
+
+/* Releases the exec, its pool, and its networks */
+void exec_free(struct exec_t *exec);
+
+/* Returns the network/dataplane of the calling pool worker (or the main
+ * thread's).  Requires the networks to be created, e.g., through exec_mop_pre
+ * or one of the exec_simulate functions. */
+struct exec_net_dp_t *exec_worker_net_dp(struct exec_t *exec);
+
+/* Apply (pre) or revert (post) the mop on the network of every pool worker.
+ * Each worker applies the mop to its own network. */
+void exec_mop_pre(struct exec_t *exec, struct expr_t const *expr, struct mop_t *mop);
+void exec_mop_post(struct exec_t *exec, struct expr_t const *expr, struct mop_t *mop);
+
 /* Returns the cost of a plan 
  *
  * expr_t: the setting/config of the experiment.
@@ -114,6 +152,28 @@ risk_cost_t exec_plan_cost(
     struct exec_t *exec, struct expr_t const *expr, struct mop_t **mops,
     uint32_t nmops, trace_time_t start);
 
+/* Metrics collected by exec_simulate_multi.  Pod p's throughput (total
+ * bandwidth of the flows leaving the pod) is at SIM_POD_THROUGHPUT + p. */
+enum EXEC_SIM_METRIC {
+  SIM_VIOLATIONS = 0,       /* Fraction of pairs that didn't get their demand */
+  SIM_PROMISED_VIOLATIONS,  /* ... and got less than the promised throughput */
+  SIM_MLU,                  /* Max link utilization */
+  SIM_POD_THROUGHPUT,       /* Per pod throughput */
+};
+
+/* Simulates the network (with the mop applied, if mop is not null) once per
+ * traffic matrix and returns all the EXEC_SIM_METRICs of each interval:
+ * ret[metric][i] is the metric for the i'th traffic matrix.  ret_nvars is set
+ * to the number of metrics (SIM_POD_THROUGHPUT + num_pods). */
+rvar_type_t **
+exec_simulate_multi(
+    struct exec_t *exec,
+    struct expr_t const *expr,
+    struct mop_t *mop,
+    struct traffic_matrix_t **tms,
+    uint32_t trace_length,
+    uint32_t *ret_nvars);
+
 /* Returns the MLU of the network for each interval */
 rvar_type_t *
 exec_simulate_mlu(
@@ -132,6 +192,26 @@ exec_simulate_ordered(
     struct traffic_matrix_t **tms,
     uint32_t trace_length);
 
+/* Simulates the cross product of mops and nsamples samples pulled from the
+ * predictor iterator (starting at its current sample, the iterator is left
+ * after the last sample pulled): ret[m][s] is the violation cost of the s'th
+ * sample (mop_duration traffic matrices) under mops[m].
+ *
+ * The calling thread runs the predictor and streams the samples through a
+ * bounded queue to the pool workers, so the prediction overlaps with the
+ * simulation and only a few samples (a couple per worker) are in memory at
+ * any point.  The traffic matrix buffers are recycled across samples.  Each
+ * worker simulates its sample under every mop, switching the mop applied on
+ * its own network, so there is no barrier between the mops. */
+rvar_type_t **
+exec_simulate_stream(
+    struct exec_t *exec,
+    struct expr_t const *expr,
+    struct mop_t **mops,
+    uint32_t nmops,
+    struct predictor_iterator_t *iter,
+    uint32_t nsamples);
+
 /* Similar to simulate_ordered but returns a random variable */
 struct rvar_t *
 exec_simulate(
@@ -2,6 +2,7 @@
 #define _EXEC_PUG_H_
 #include "exec.h"
 
+struct monte_carlo_hist_t;
 struct plan_repo_t;
 
 enum PUG_TYPE {
@@ -45,9 +46,14 @@ struct exec_pug_t {
   struct rvar_t      **steady_packet_loss;
   /* Long term cost random variables per subplan */
   struct rvar_t      **steady_cost;
+  /* Lazily computed k-fold self convolution of steady_cost per subplan, where
+   * k is steady_cost_pow_k (i.e., the mop_duration) */
+  struct rvar_t      **steady_cost_pow;
+  unsigned             steady_cost_pow_k;
 
-  /* Short term risk computation function for subplan at trace_time_t */
-  struct rvar_t * (*short_term_risk) (struct exec_t *exec, struct expr_t const *expr, unsigned subplan, trace_time_t);
+  /* Short term risk computation function at trace_time_t: sets ret[i] to the
+   * short term risk of subplan i for all the subplans */
+  void (*short_term_risk) (struct exec_t *exec, struct expr_t const *expr, trace_time_t, struct rvar_t **ret);
 
   /* Prepares the steady cost (i.e., long term costs) at step trace_time_t.
    * For, pug-lookback this translates to the last n-steps.  For pug-long and
@@ -75,6 +81,28 @@ struct exec_t *exec_pug_create_long_term_only(void);
 /* pug-lookback */
 struct exec_t *exec_pug_create_lookback(void);
 
+/* Short term cost samples of one subplan (see adaptive-round): the costs go
+ * straight into a histogram, the running sums drive the stopping rule */
+struct pug_sampling_t {
+  struct monte_carlo_hist_t *hist;
+  unsigned nvals;
+  double sum, sumsq;
+  int active;
+};
+
+void   pug_sampling_init(struct pug_sampling_t *);
+void   pug_sampling_free(struct pug_sampling_t *);
+void   pug_sampling_add(struct pug_sampling_t *, rvar_type_t const *vals, unsigned nvals);
+double pug_sampling_mean(struct pug_sampling_t const *);
+/* Half width of the confidence interval of the mean */
+double pug_sampling_halfwidth(struct pug_sampling_t const *);
+
+/* Stop sampling the subplans whose cost has converged or that can't be the
+ * cheapest subplan anymore.  Subplan 0 (the empty subplan) is never a
+ * candidate so it doesn't count towards the cheapest. */
+void pug_sampling_stop(struct expr_t const *expr,
+    struct pug_sampling_t *samples, unsigned subplan_count);
+
 /*
  * A plan repository of possible plans of length max_plan_size for pug.
  *
@@ -45,6 +45,13 @@ struct predictor_iterator_t {
 
   struct traffic_matrix_trace_iter_t* (*cur)(
       struct predictor_iterator_t *);
+
+  /* Writes the traffic matrices of the current sample into tms and returns
+   * their count.  Non-null entries of tms are used as buffers when possible
+   * (and freed otherwise), so that a pipeline can recycle the same buffers
+   * across samples. */
+  unsigned (*cur_into)(
+      struct predictor_iterator_t *, struct traffic_matrix_t **tms);
 };
 
 struct predictor_t {
@@ -0,0 +1,107 @@
+#ifndef _ROLLUP_H_
+#define _ROLLUP_H_
+
+#include <stdint.h>
+
+#include "traffic.h"
+
+/* Pod level rollup of a traffic trace.
+ *
+ * For every TM of the trace the rollup keeps the pod x pod aggregate of the ToR
+ * traffic, and prefix sums (over time) of the traffic leaving/entering every
+ * pod and crossing the core.  The sum over any window of TMs is then a
+ * difference of two rows instead of a scan of every ToR pair of every TM.
+ *
+ * Rollups are saved next to the trace (NAME.rollup) and tied to the index of
+ * the trace and the pod mapping they were built with: a rollup that doesn't
+ * match either is rebuilt (see trace_rollup_get).
+ *
+ * For the min/max over a window the rollup also keeps (in memory only) the
+ * totals of every TM, taken from the pod matrices, the min/max of every
+ * TRACE_ROLLUP_BLOCK TMs, and a sparse table over the blocks.
+ */
+
+/* Columns of a prefix row: out of every pod, into every pod, then the core */
+#define TRACE_ROLLUP_COLS(num_pods) (2 * (num_pods) + 1)
+#define TRACE_ROLLUP_OUT(pod)            (pod)
+#define TRACE_ROLLUP_IN(num_pods, pod)   ((num_pods) + (pod))
+#define TRACE_ROLLUP_CORE(num_pods)      (2 * (num_pods))
+
+/* Number of TMs per min/max block */
+#define TRACE_ROLLUP_BLOCK 32
+
+struct trace_rollup_t {
+  uint32_t num_tors, num_pods;
+  uint64_t num_tms;
+
+  /* (num_tms + 1) rows of TRACE_ROLLUP_COLS(num_pods) */
+  double const *prefix;
+
+  /* num_tms pod x pod matrices */
+  bw_t const   *pods;
+
+  /* Checksums of the trace index and the pod mapping the rollup was built from */
+  uint32_t index_crc, pods_crc;
+
+  /* num_tms rows of TRACE_ROLLUP_COLS(num_pods): the totals of every TM */
+  double *_totals;
+
+  /* _nlevels x _nblocks rows of TRACE_ROLLUP_COLS(num_pods): level l holds the
+   * min/max over the 2^l blocks starting at every block */
+  double *_block_min, *_block_max;
+  uint32_t _nblocks, _nlevels;
+
+  void   *_mem;
+  size_t  _mem_size;
+  int     _mapped;
+};
+
+/* min/max/mean of one column over a window of TMs */
+struct trace_rollup_stats_t {
+  double min, max, mean;
+};
+
+/* Builds the rollup of the trace.  pod_of_tor has num_tors entries and every
+ * TM of the trace should have num_tors * num_tors pairs. */
+struct trace_rollup_t *trace_rollup_build(
+    struct traffic_matrix_trace_t *trace,
+    uint32_t num_tors, uint32_t num_pods, uint32_t const *pod_of_tor);
+
+/* Returns SUCCESS or FAILURE */
+int trace_rollup_save(struct trace_rollup_t const *rollup, char const *name);
+
+/* Maps the rollup saved for the trace.  Returns 0 if there is none or if it
+ * wasn't built from the same index and pod mapping. */
+struct trace_rollup_t *trace_rollup_load(
+    struct traffic_matrix_trace_t *trace,
+    uint32_t num_tors, uint32_t num_pods, uint32_t const *pod_of_tor);
+
+/* Loads the rollup of the trace, or builds (and saves) it if it's missing or
+ * stale */
+struct trace_rollup_t *trace_rollup_get(
+    struct traffic_matrix_trace_t *trace,
+    uint32_t num_tors, uint32_t num_pods, uint32_t const *pod_of_tor);
+
+/* Same as trace_rollup_get, but the rollup is kept on the trace (and freed
+ * with it): later calls with the same pod mapping reuse it as long as no TM
+ * was added to the trace.  Don't free the returned rollup.  Not thread safe. */
+struct trace_rollup_t *trace_rollup_cached(
+    struct traffic_matrix_trace_t *trace,
+    uint32_t num_tors, uint32_t num_pods, uint32_t const *pod_of_tor);
+
+/* Pod x pod matrix of the nth TM */
+bw_t const *trace_rollup_pod_matrix(struct trace_rollup_t const *rollup, uint64_t nth);
+
+/* Sums of every column over the TMs [start, start + ntms): O(num_pods) */
+void trace_rollup_sum(struct trace_rollup_t const *rollup,
+    uint64_t start, uint64_t ntms, double *sums);
+
+/* Stats of every column over the TMs [start, start + ntms).  The means come
+ * from the prefix sums, min and max take O(TRACE_ROLLUP_BLOCK * num_pods)
+ * whatever the size of the window. */
+void trace_rollup_window(struct trace_rollup_t const *rollup,
+    uint64_t start, uint64_t ntms, struct trace_rollup_stats_t *stats);
+
+void trace_rollup_free(struct trace_rollup_t *rollup);
+
+#endif // _ROLLUP_H_
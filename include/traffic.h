@@ -2,6 +2,9 @@
 #define _TRAFFIC_H_
 
 #include "dataplane.h"
+#include "util/cache2q.h"
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -43,7 +46,8 @@ void traffic_matrix_save(struct traffic_matrix_t *, FILE *);
 // Load a TM from the passed file.
 struct traffic_matrix_t * traffic_matrix_load(FILE *);
 
-// Index data structure for the trace
+// Index data structure for the trace.  Version 2 .index files store these
+// verbatim (the layout is fixed: 32 bytes, no padding).
 struct traffic_matrix_trace_index_t {
   // Location of the TM in the .data file
   uint64_t                seek;
@@ -51,20 +55,52 @@ struct traffic_matrix_trace_index_t {
   trace_time_t            time;
   // Size of the TM, i.e., how much should we read :)
   uint64_t                size;
+  // CRC-32 of the record in the .data file (if TRACE_INDEX_CHECKSUM is set)
+  uint32_t                checksum;
+  uint32_t                flags;
 };
 
-/* Cache structure for the trace */
-struct traffic_matrix_trace_cache_t {
-  trace_time_t time;
-  struct traffic_matrix_t *tm;
-  uint8_t is_set;
+#define TRACE_INDEX_CHECKSUM 0x1
+// In memory only: the record matched its checksum on an earlier read, so the
+// following reads don't checksum it again.  Never saved.
+#define TRACE_INDEX_VERIFIED 0x2
+
+// Trace format versions.  Version 1 files are the raw index dump (count
+// followed by seek/time/size entries) and don't have a header.
+#define TRACE_VERSION_1 1
+#define TRACE_VERSION_2 2
+
+// Trace metadata kept in the header of version 2 .index files.  It can be read
+// without loading the trace (see traffic_matrix_trace_read_meta).
+struct traffic_matrix_trace_meta_t {
+  uint32_t     version;
+  uint64_t     num_indices;
+
+  // Number of ToRs and pods (0 if unknown) and the pod of every ToR (only
+  // set if num_pods is)
+  uint32_t     num_tors, num_pods;
+  uint32_t    *pod_of_tor;
+
+  // Distance between consecutive TMs (0 if they are not evenly spaced)
+  trace_time_t time_step;
 };
 
+/* Number of shards of the cache of a trace.  Each shard is a 2Q cache with
+ * its own lock, so that concurrent readers rarely contend. */
+#define TRACE_CACHE_SHARDS 16
+
 /* Adds two traffic matrices and outputs a new one */
 struct traffic_matrix_t *traffic_matrix_add(
     struct traffic_matrix_t const *,
     struct traffic_matrix_t const *);
 
+/* Same as traffic_matrix_add but writes the output to out (which should
+ * have the same number of pairs) or allocates a new one if out is null */
+struct traffic_matrix_t *traffic_matrix_add_into(
+    struct traffic_matrix_t *out,
+    struct traffic_matrix_t const *,
+    struct traffic_matrix_t const *);
+
 /* Multiplies all entries in a traffic matrix by a constant valueand outputs a
  * new one */
 struct traffic_matrix_t *traffic_matrix_multiply(
@@ -76,6 +112,9 @@ struct traffic_matrix_trace_iter_t {
     uint32_t state;
     uint32_t _begin, _end;
 
+    // Next position to hand to the read-ahead thread of the trace (if any)
+    uint32_t _ahead;
+
     void (*begin)(struct traffic_matrix_trace_iter_t *);
     void (*go_to)(struct traffic_matrix_trace_iter_t *, trace_time_t);
     unsigned (*length)(struct traffic_matrix_trace_iter_t *);
@@ -84,6 +123,8 @@ struct traffic_matrix_trace_iter_t {
     void (*get)(struct traffic_matrix_trace_iter_t *, struct traffic_matrix_t **);
     void (*free)(struct traffic_matrix_trace_iter_t *);
 
+    // Read-only view of the current TM, or 0 if there is none (see
+    // traffic_matrix_trace_get_nocopy), in which case use get
     struct traffic_matrix_t* (*get_nocopy)(struct traffic_matrix_trace_iter_t *);
 };
 
@@ -93,21 +134,77 @@ struct traffic_matrix_trace_iter_tms_t {
   uint32_t tms_length;
 };
 
-// Append only data-structure for working with traffic matrix traces
+/* Access pattern hints for mapped traces (see traffic_matrix_trace_map) */
+enum TRACE_ACCESS {
+  TRACE_ACCESS_NORMAL = 0,
+  TRACE_ACCESS_SEQUENTIAL,
+  TRACE_ACCESS_RANDOM,
+};
+
+struct trace_prefetcher_t;
+struct trace_rollup_t;
+
+// Append only data-structure for working with traffic matrix traces.
+//
+// Reads (get, get_nocopy, get_nth_key, for_each and the iterators) are safe to
+// call from multiple threads at once: TMs are pread from the data file, the
+// cache is sharded, and the index is sorted at most once.  Adding to the trace
+// while others are reading from it is not.
 struct traffic_matrix_trace_t {
   struct traffic_matrix_trace_index_t *indices;
-  struct traffic_matrix_trace_cache_t *caches;
+  struct cache2q_t                    *caches[TRACE_CACHE_SHARDS];
 
   uint64_t                             num_indices, cap_indices;
   uint16_t                             num_caches;
+  // Byte budget of the cache (split evenly across the shards).  If zero, the
+  // cache holds num_caches TMs worth of bytes.
+  size_t                               cache_budget;
   uint64_t                             largest_seek;
 
-  // Index and data files
+  // Index and data files, and their path without the suffix (0 if the trace
+  // has no files)
   FILE                                *fdata, *findex;
+  char                                *name;
 
   // Whether the indices are optimized (as in sorted) or not.
   uint8_t _optimized;
 
+  // Distance between consecutive keys if they are evenly spaced (0 otherwise),
+  // which lets lookups go straight to the index entry.  Set when optimizing.
+  trace_time_t _step;
+
+  // Guards sorting the index and the cache shards (see TRACE_CACHE_SHARDS)
+  pthread_mutex_t                      optimize_lock;
+  pthread_mutex_t                      cache_locks[TRACE_CACHE_SHARDS];
+
+  // Bulk writer appending to the trace (see traffic_matrix_trace_writer_open)
+  struct traffic_matrix_trace_writer_t *writer;
+
+  // Read-ahead thread for sequential iterators (see traffic_matrix_trace_prefetch)
+  struct trace_prefetcher_t           *prefetcher;
+
+  // Time spent waiting on the data file (or the map) and the number of
+  // read-ahead TMs
+  uint64_t                             stall_ns, prefetched;
+
+  // Header of the .index file
+  struct traffic_matrix_trace_meta_t   meta;
+
+  // TMs added to the trace are packed with a keyframe every keyframe_interval
+  // TMs (0 writes raw TMs).  See traffic_matrix_trace_compress.
+  unsigned                             keyframe_interval;
+  struct traffic_matrix_t             *_keyframe;
+  uint64_t                             _keyframe_seek, _keyframe_size;
+  unsigned                             _since_keyframe;
+
+  // Read-only mapping of the .data file (0 if the trace is not mapped).  TMs
+  // added after mapping the trace are read from the file.
+  char const                          *map;
+  size_t                               map_size;
+
+  // Pod rollup of the trace (see trace_rollup_cached)
+  struct trace_rollup_t               *rollup;
+
   struct traffic_matrix_trace_iter_t * (*iter)(struct traffic_matrix_trace_t *);
 };
 
@@ -122,25 +219,143 @@ void traffic_matrix_trace_add(
     struct traffic_matrix_t *,
     trace_time_t key);
 
+// Bulk appends.  traffic_matrix_trace_add flushes the .data file after every
+// TM and looks the key up in the trace to reject duplicates; the writer buffers
+// the data (buffer bytes, 0 for TRACE_WRITER_DEFAULT_BUFFER), keeps the keys
+// in a hash set, and saves the index once when it's closed.  The TMs added
+// through the writer can't be read back before closing it.  One writer per
+// trace, and don't mix it with traffic_matrix_trace_add.
+#define TRACE_WRITER_DEFAULT_BUFFER (4 << 20)
+
+struct traffic_matrix_trace_writer_t;
+
+struct traffic_matrix_trace_writer_t *traffic_matrix_trace_writer_open(
+    struct traffic_matrix_trace_t *, size_t buffer);
+
+void traffic_matrix_trace_writer_add(
+    struct traffic_matrix_trace_writer_t *,
+    struct traffic_matrix_t const *,
+    trace_time_t key);
+
+// Flushes the data, saves the trace and frees the writer
+void traffic_matrix_trace_writer_close(struct traffic_matrix_trace_writer_t *);
+
 // Returns a TM associated with a key
 void traffic_matrix_trace_get(
     struct traffic_matrix_trace_t *,
     trace_time_t key,
     struct traffic_matrix_t **);
 
+// Returns a read-only view of the TM associated with key that points directly
+// into the mapped .data file, or 0 if the key doesn't exist, the trace isn't
+// mapped, or the TM is packed (see traffic_matrix_trace_compress).  The TM is
+// checked against its checksum on the first view, like on the first get.  The
+// view is valid until the trace is freed; don't free or modify it (and don't
+// call its save function).
+struct traffic_matrix_t const *traffic_matrix_trace_get_nocopy(
+    struct traffic_matrix_trace_t *,
+    trace_time_t key);
+
+// Map the .data file of the trace read-only so that gets of raw TMs are
+// served from the page cache without any reads or caching, and views are
+// possible.  Packed TMs are still decoded into the cache.  The
+// access hint is passed on to madvise.  Returns SUCCESS or FAILURE (e.g.,
+// an empty trace); the trace keeps working through the file either way.
+int traffic_matrix_trace_map(
+    struct traffic_matrix_trace_t *,
+    enum TRACE_ACCESS);
+
+// Change the access hint of a mapped trace (e.g., sequential for a full pass
+// over the trace, random for the predictors)
+void traffic_matrix_trace_advise(
+    struct traffic_matrix_trace_t *,
+    enum TRACE_ACCESS);
+
 int traffic_matrix_trace_get_nth_key(
     struct traffic_matrix_trace_t *,
     uint32_t, trace_time_t *);
 
+// Position of key in the (sorted) trace: O(1) for evenly spaced keys and a
+// binary search otherwise.  Returns SUCCESS or FAILURE (no such key).
+int traffic_matrix_trace_find_key(
+    struct traffic_matrix_trace_t *,
+    trace_time_t, uint32_t *);
+
 // Creates a traffic matrix trace with the specified number of cache_slots and
 // initiailized to have a specific number of indices.  The string passed is the
-// prefix for the .index and .data files.  Number of elements in the cache is
-// always rounded up to the nearest power of two
+// prefix for the .index and .data files.  The cache is sized to hold
+// cache_slots TMs unless a default byte budget is set (see below).
 struct traffic_matrix_trace_t *traffic_matrix_trace_create(
     uint16_t, uint16_t, const char *);
 
+// Byte budget of the caches of the traces created (or loaded) from now on.
+// Zero (the default) sizes the caches by their number of cache_slots.
+void traffic_matrix_trace_set_default_cache_budget(size_t bytes);
+
+// Change the byte budget of the cache of a trace (0 goes back to sizing it by
+// the number of cache_slots).
+void traffic_matrix_trace_set_cache_budget(
+    struct traffic_matrix_trace_t *, size_t bytes);
+
+// Hit/miss/eviction counters of the cache of a trace, summed over the shards.
+// Gets of raw TMs of a mapped trace don't go through the cache.
+void traffic_matrix_trace_cache_stats(
+    struct traffic_matrix_trace_t *, struct cache2q_stats_t *);
+
+// Start a background thread that reads the next depth TMs of the iterators of
+// the trace as they move forward (next), so that they hit in the cache (or,
+// for raw TMs of mapped traces, in the page cache).  A depth of 0 stops the
+// thread.
+void traffic_matrix_trace_prefetch(
+    struct traffic_matrix_trace_t *, unsigned depth);
+
+// Read-ahead depth of the traces loaded from now on (0, the default, is off)
+void traffic_matrix_trace_set_default_prefetch(unsigned depth);
+
+// Keyframe interval of the traces written by traffic_compressor -p
+#define TRACE_DEFAULT_KEYFRAME_INTERVAL 32
+
+// Pack the TMs added to the trace from now on: a bitmap of the stored pairs
+// and their values.  Every keyframe_interval'th TM stores its non-zero pairs,
+// the rest store the pairs that changed since the last keyframe (XOR'ed with
+// it).  The values are bit packed, keeping only the bits between their
+// leading and trailing zeros.  Reads handle packed and raw TMs alike, but
+// packed TMs are decoded into copies (get_nocopy returns 0 for them).  0 goes
+// back to raw TMs.
+void traffic_matrix_trace_compress(
+    struct traffic_matrix_trace_t *, unsigned keyframe_interval);
+
+// Keyframe interval of the traces created from now on (0, the default, is raw)
+void traffic_matrix_trace_set_default_compression(unsigned keyframe_interval);
+
+// Set the network metadata saved with the trace.  pod_of_tor (num_tors
+// entries) is copied and can be 0 if num_pods is 0.
+void traffic_matrix_trace_set_meta(
+    struct traffic_matrix_trace_t *,
+    uint32_t num_tors, uint32_t num_pods, uint32_t const *pod_of_tor);
+
+// Read the metadata (and the index, if indices isn't 0) of the trace name
+// without touching its .data file.  The caller frees *indices and the
+// metadata (traffic_matrix_trace_meta_free).  Returns SUCCESS or FAILURE.
+int traffic_matrix_trace_read_meta(
+    char const *name,
+    struct traffic_matrix_trace_meta_t *meta,
+    struct traffic_matrix_trace_index_t **indices);
+
+void traffic_matrix_trace_meta_free(struct traffic_matrix_trace_meta_t *meta);
+
+// Check the checksums of every TM of the trace.  Returns the number of
+// corrupted TMs (TMs without a checksum, e.g., from version 1 traces, are
+// skipped).  The TMs that match aren't checksummed again by later reads.
+uint64_t traffic_matrix_trace_verify(struct traffic_matrix_trace_t *);
+
+// Log the cache counters (and the time spent waiting on the disk) of a trace
+void traffic_matrix_trace_cache_report(
+    struct traffic_matrix_trace_t *, char const *name);
+
 // Load a trace (with the specified number of cache_slots) from the specified
-// prefix file.
+// prefix file.  The data file is mapped (see traffic_matrix_trace_map) when
+// possible.
 struct traffic_matrix_trace_t *traffic_matrix_trace_load(
     uint16_t, const char *);
 
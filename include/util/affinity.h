@@ -0,0 +1,34 @@
+#ifndef _UTIL_AFFINITY_H_
+#define _UTIL_AFFINITY_H_
+
+#include <stddef.h>
+
+/* CPU pinning and NUMA placement helpers.
+ *
+ * When compiled with HAVE_LIBNUMA (make NUMA=1) these use libnuma for the
+ * topology and memory placement.  Otherwise pinning falls back to
+ * sched_setaffinity, the topology to sysfs, and the placement to first-touch:
+ * memory allocated (and first written) by a pinned worker ends up on the
+ * worker's node anyway, which covers the per worker dataplanes and arenas.
+ */
+
+/* Number of CPUs this process is allowed to run on */
+unsigned affinity_ncpus(void);
+
+/* The n'th CPU (mod affinity_ncpus) this process is allowed to run on */
+int affinity_cpu(unsigned n);
+
+/* Pin the calling thread to cpu.  Returns 0 on success. */
+int affinity_pin_self(int cpu);
+
+/* NUMA node of cpu, or -1 if unknown */
+int affinity_node_of_cpu(int cpu);
+
+/* Allocate memory on the calling thread's node; release with affinity_free */
+void *affinity_alloc_local(size_t size);
+void affinity_free(void *ptr, size_t size);
+
+/* Spread the pages of shared read-only data across all the nodes */
+void affinity_interleave(void *ptr, size_t size);
+
+#endif // _UTIL_AFFINITY_H_
@@ -0,0 +1,55 @@
+#ifndef _UTIL_CACHE2Q_H_
+#define _UTIL_CACHE2Q_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A byte-budgeted 2Q cache keyed by int64s.
+ *
+ * New entries go to a FIFO (A1in) that holds at most a quarter of the budget.
+ * Entries evicted from the FIFO leave their key behind in a ghost list
+ * (A1out), and only keys that are asked for again while they are ghosts make
+ * it to the LRU (Am).  A one-off sequential sweep therefore only churns the
+ * FIFO and doesn't flush the entries that are actually reused.
+ *
+ * The cache is not thread-safe; wrap it in a lock (or shard it, as the traffic
+ * traces do).
+ */
+struct cache2q_t;
+
+struct cache2q_stats_t {
+  uint64_t hits, misses, evictions;
+
+  /* Misses on keys that were recently evicted from the FIFO */
+  uint64_t ghost_hits;
+
+  size_t   bytes, entries;
+};
+
+typedef void (*cache2q_free_t)(void *);
+
+/* Values are released with free_value when they are evicted */
+struct cache2q_t *cache2q_create(size_t budget, cache2q_free_t free_value);
+
+size_t cache2q_budget(struct cache2q_t const *cache);
+
+/* Changing the budget evicts the entries that no longer fit */
+void cache2q_set_budget(struct cache2q_t *cache, size_t budget);
+
+/* Returns the value associated with key or 0.  The value is owned by the cache
+ * and is valid until the next put. */
+void *cache2q_get(struct cache2q_t *cache, int64_t key);
+
+/* Whether key has a value in the cache.  Unlike cache2q_get, this neither
+ * counts as an access nor touches the recency of the key. */
+int cache2q_contains(struct cache2q_t const *cache, int64_t key);
+
+/* Takes the ownership of value (of size bytes).  Replaces the existing value
+ * of key if there is one. */
+void cache2q_put(struct cache2q_t *cache, int64_t key, void *value, size_t size);
+
+void cache2q_stats(struct cache2q_t const *cache, struct cache2q_stats_t *stats);
+
+void cache2q_free(struct cache2q_t *cache);
+
+#endif // _UTIL_CACHE2Q_H_
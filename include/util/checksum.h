@@ -0,0 +1,11 @@
+#ifndef _UTIL_CHECKSUM_H_
+#define _UTIL_CHECKSUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32 (IEEE 802.3) of data.  Pass 0 as crc to start, or the previous
+ * result to continue a checksum over several buffers. */
+uint32_t checksum_crc32(uint32_t crc, void const *data, size_t size);
+
+#endif // _UTIL_CHECKSUM_H_
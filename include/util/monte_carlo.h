@@ -1,10 +1,16 @@
 #ifndef _UTIL_MONTE_CARLO_H_
 #define _UTIL_MONTE_CARLO_H_
 
+#include <stdint.h>
+
 #include "algo/rvar.h"
 
+struct pool_t;
+
 typedef rvar_type_t (*monte_carlo_run_t)(void *);
-typedef void (*monte_carlo_run_multi_t)(void *, rvar_type_t **, unsigned);
+/* Multi-variable runner: stores the value of the j'th variable of the run in
+ * *vals[j] (j < nvars) */
+typedef void (*monte_carlo_run_multi_t)(void *data, rvar_type_t **vals, unsigned nvars);
 
 // Monte carlo methods for keeping single or multiple RVs
 struct rvar_sample_t *monte_carlo_rvar(
@@ -22,7 +28,7 @@ struct rvar_sample_t *monte_carlo_parallel_rvar(
     void *data,            // Data to pass to each instance of monte-carlo run (this should be an array of size nsteps)
     unsigned nsteps,       // Amount of data
     unsigned size,         // Size of each data segment
-    unsigned num_threads   // Number of thread to use or 0 for automatic calculation
+    struct pool_t *pool    // Thread pool to run the simulations on
 );
 
 rvar_type_t *monte_carlo_parallel_ordered_rvar(
@@ -30,8 +36,62 @@ rvar_type_t *monte_carlo_parallel_ordered_rvar(
     void *data,            // Data to pass to each instance of monte-carlo run (this should be an array of size nsteps)
     unsigned nsteps,            // Amount of data
     unsigned size,              // Size of each data segment
-    unsigned num_threads        // Number of thread to use or 0 for automatic calculation
+    struct pool_t *pool         // Thread pool to run the simulations on
+);
+
+// Runs the multi-variable monte carlo simulation in parallel.  Returns nvars
+// arrays of nsteps values each: ret[j][i] is the j'th variable of the i'th
+// run (in the order the data was passed).
+rvar_type_t **monte_carlo_parallel_ordered_multi_rvar(
+    monte_carlo_run_multi_t run, // Monte carlo runner
+    void *data,            // Data to pass to each instance of monte-carlo run (this should be an array of size nsteps)
+    unsigned nsteps,       // Amount of data
+    unsigned size,         // Size of each data segment
+    unsigned nvars,        // Number of variables each run produces
+    struct pool_t *pool    // Thread pool to run the simulations on
+);
+
+// Sparse histogram of samples in buckets of bucket_size.  Only the non-empty
+// buckets are kept, so the memory is O(distinct buckets) no matter how far
+// apart the samples are.  Non-finite samples are rejected (panic).
+struct monte_carlo_hist_t;
+
+struct monte_carlo_hist_t *monte_carlo_hist_create(rvar_type_t bucket_size);
+void monte_carlo_hist_add(struct monte_carlo_hist_t *, rvar_type_t val);
+void monte_carlo_hist_merge(struct monte_carlo_hist_t *, struct monte_carlo_hist_t const *);
+uint64_t monte_carlo_hist_count(struct monte_carlo_hist_t const *);
+// Bucketed rvar of the samples added so far
+struct rvar_bucket_t *monte_carlo_hist_rvar(struct monte_carlo_hist_t const *);
+void monte_carlo_hist_free(struct monte_carlo_hist_t *);
+
+// Runs the monte carlo simulation in parallel and accumulates the results
+// into per-chunk histograms (monte_carlo_hist_t) that are merged at the end.
+// Nothing is stored per sample, so the memory is O(buckets).
+struct rvar_bucket_t *monte_carlo_parallel_bucket_rvar(
+    monte_carlo_run_t run, // Monte carlo runner
+    void *data,            // Data to pass to each instance of monte-carlo run (this should be an array of size nsteps)
+    unsigned nsteps,       // Amount of data
+    unsigned size,         // Size of each data segment
+    struct pool_t *pool,   // Thread pool to run the simulations on
+    rvar_type_t bucket_size // Size of each bucket
+);
+
+// Monte carlo methods that accumulate the results into a sketched rvar
+// (bounded memory) as opposed to keeping every sample around.
+struct rvar_sketch_t *monte_carlo_sketch_rvar(
+    monte_carlo_run_t run,
+    unsigned nsteps,
+    void *data,
+    unsigned k             // Accuracy of the sketch (see rvar_sketch_create)
 );
 
+struct rvar_sketch_t *monte_carlo_parallel_sketch_rvar(
+    monte_carlo_run_t run, // Monte carlo runner
+    void *data,            // Data to pass to each instance of monte-carlo run (this should be an array of size nsteps)
+    unsigned nsteps,       // Amount of data
+    unsigned size,         // Size of each data segment
+    struct pool_t *pool,   // Thread pool to run the simulations on
+    unsigned k             // Accuracy of the sketch (see rvar_sketch_create)
+);
 
 #endif
@@ -0,0 +1,78 @@
+#ifndef _UTIL_POOL_H_
+#define _UTIL_POOL_H_
+
+#include <pthread.h>
+
+/* A persistent thread pool.
+ *
+ * The pool is created once (typically by the exec, see exec_pool) and is
+ * shared by every parallel simulation, so we don't pay for creating and
+ * joining the threads on every monte carlo call.
+ *
+ * Completion is tracked through futures: every job is submitted against a
+ * future and pool_future_wait blocks until all the jobs of that future are
+ * done.  Different callers can share the pool with their own futures.
+ *
+ * Each worker has its own deque of jobs: a worker runs its own jobs first
+ * (newest first) and steals the oldest jobs of the other workers when it runs
+ * out.  Jobs submitted from outside the pool are spread round robin across the
+ * deques, jobs submitted by a worker go to its own deque.
+ *
+ * Jobs should not wait on futures of the same pool---if all the workers are
+ * waiting nobody is left to run the jobs.
+ */
+typedef void (*pool_func_t)(void *arg);
+
+struct pool_future_t {
+  pthread_mutex_t lock;
+  pthread_cond_t  done;
+  unsigned        pending;  /* Number of jobs that haven't finished yet */
+};
+
+struct pool_t;
+
+/* Create a pool of nthreads workers (0 for get_ncores() - 1) */
+struct pool_t *pool_create(unsigned nthreads);
+
+/* Number of workers in the pool */
+unsigned pool_size(struct pool_t const *pool);
+
+/* Id of the calling worker in [0, pool_size) or POOL_NOT_A_WORKER if the
+ * caller isn't a pool worker.  Useful for keeping per worker state (e.g.,
+ * networks) that jobs can use without locking. */
+#define POOL_NOT_A_WORKER ((unsigned)-1)
+unsigned pool_worker_id(void);
+
+/* Submit func(arg) to the pool, and mark it as a pending job of future */
+void pool_submit(struct pool_t *pool, struct pool_future_t *future,
+    pool_func_t func, void *arg);
+
+/* Run func(arg) once on every worker of the pool and wait for all of them to
+ * finish, e.g., to set up or modify the per worker state.  Shouldn't be
+ * called from a pool worker. */
+void pool_broadcast(struct pool_t *pool, pool_func_t func, void *arg);
+
+/* Pin worker i to the i'th allowed cpu (wrapping around) so that the per
+ * worker state (dataplanes, arenas) stays local to one core and NUMA node.
+ * Memory the workers allocate and touch after this lands on their node. */
+void pool_pin(struct pool_t *pool);
+
+/* cpu and NUMA node of worker id, -1 if it isn't pinned or unknown */
+int pool_worker_cpu(struct pool_t const *pool, unsigned id);
+int pool_worker_node(struct pool_t const *pool, unsigned id);
+
+/* Log the jobs, steals, and utilization of every worker */
+void pool_report(struct pool_t const *pool);
+
+/* Wait for the workers to finish the jobs and join them */
+void pool_free(struct pool_t *pool);
+
+/* Futures */
+void pool_future_init(struct pool_future_t *future);
+
+/* Blocks until all the jobs submitted against future are done */
+void pool_future_wait(struct pool_future_t *future);
+
+void pool_future_destroy(struct pool_future_t *future);
+
+#endif // _UTIL_POOL_H_
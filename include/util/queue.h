@@ -0,0 +1,30 @@
+#ifndef _UTIL_QUEUE_H_
+#define _UTIL_QUEUE_H_
+
+/* A bounded blocking queue of pointers for producer/consumer pipelines.
+ *
+ * Pushing to a full queue blocks until a consumer pops an item, so the
+ * producer can never run more than cap items ahead of the consumers (e.g.,
+ * the predictor in exec_simulate_stream).  Once the producer closes the
+ * queue, the consumers drain what is left and then queue_pop returns 0.
+ */
+struct queue_t;
+
+struct queue_t *queue_create(unsigned cap);
+
+/* Blocks while the queue is full */
+void queue_push(struct queue_t *queue, void *item);
+
+/* Same as queue_push but returns 0 instead of blocking if the queue is full */
+int queue_try_push(struct queue_t *queue, void *item);
+
+/* Blocks while the queue is empty.  Returns 0 if the queue is closed and
+ * there is nothing left to pop, 1 otherwise. */
+int queue_pop(struct queue_t *queue, void **item);
+
+/* No more pushes: wake up the consumers waiting on an empty queue */
+void queue_close(struct queue_t *queue);
+
+void queue_free(struct queue_t *queue);
+
+#endif // _UTIL_QUEUE_H_
@@ -326,7 +326,7 @@ static void populate_and_sort_links(struct dataplane_t *dataplane) {
         struct link_t *link = flow->links[j];
         /* create the flows data-structure if it doesn't exist */
         if (link->flows == 0) {
-          link->flows = malloc(link->nflows * sizeof(struct flow_t *));
+          link->flows = dataplane_alloc(dataplane, link->nflows * sizeof(struct flow_t *));
           link->nactive_flows = 0;
         }
 
@@ -350,7 +350,7 @@ static void populate_and_sort_links(struct dataplane_t *dataplane) {
 
   {
     /* create sortable links */
-    struct link_t **links = malloc(sizeof(struct link_t *) * dataplane->num_links);
+    struct link_t **links = dataplane_alloc(dataplane, sizeof(struct link_t *) * dataplane->num_links);
     struct link_t *link = dataplane->links;
     for (int i = 0; i < dataplane->num_links; ++i, ++link) {
       links[i] = link;
@@ -376,7 +376,6 @@ static void populate_and_sort_links(struct dataplane_t *dataplane) {
       }
     }
     prev->next = 0;
-    free(links);
   }
 }
 
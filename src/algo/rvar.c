@@ -22,6 +22,12 @@
 #define ROUND_TO_BUCKET(val, bs) (floor((val) * (bs))/(bs))
 #define RVAR_PLOT_PATH "/tmp/planner.rvar.XXXXXX"
 
+/* Maximum number of buckets in a bucketed rvar (0 means unbounded) and the
+ * accumulated error of re-binning the rvars to that size. */
+static unsigned _bucket_limit = 0;
+static rvar_type_t _rebin_error = 0;
+static pthread_mutex_t _rebin_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* TODO: Maybe can use http://people.ece.umn.edu/users/parhi/SLIDES/chap8.pdf
  * to improve the convolution speed.  Right now, it's so so ... bad.
  *
@@ -42,6 +48,15 @@
  *
  * - Omid 04/05/2019 */
 
+struct rvar_t *_rvar_deserialize_sketch(char const *data);
+struct rvar_t *_rvar_deserialize_sparse(char const *data);
+static struct rvar_t *_sparse_compose(struct rvar_t **, double *, unsigned);
+static struct rvar_t *_rvar_from_sorted_buckets(struct bucket_t const *, unsigned, rvar_type_t);
+static unsigned _buckets_kway_merge(struct bucket_t const **, unsigned const *,
+    rvar_type_t const *, unsigned, struct bucket_t *);
+
+static void _rvar_sample_sort(struct rvar_sample_t *);
+
 static char *_rvar_header(enum RVAR_TYPE type, char *buffer) {
   *(enum RVAR_TYPE*)buffer = type;
   return (buffer + HEADER_SIZE);
@@ -49,6 +64,7 @@ static char *_rvar_header(enum RVAR_TYPE type, char *buffer) {
 
 static char *_sample_serialize(struct rvar_t *rvar, size_t *size) {
   struct rvar_sample_t *rv = (struct rvar_sample_t*)rvar;
+  _rvar_sample_sort(rv);
   *size = HEADER_SIZE + sizeof(rv->num_samples) + rv->num_samples * sizeof(rvar_type_t);
   char *buffer = malloc(*size);
   char *ptr = _rvar_header(rv->_type, buffer);
@@ -71,6 +87,10 @@ static struct rvar_t *_sample_copy(struct rvar_t const *rvar) {
   size_t size = sizeof(rvar_type_t) * rv->num_samples;
   rvar_type_t *vals = malloc(size);
   memcpy(vals, rv->vals, size);
+
+  /* Don't lose the ordering if we already paid for it */
+  if (rv->sorted)
+    return rvar_sample_create_with_sorted_vals(vals, rv->num_samples);
   return rvar_sample_create_with_vals(vals, rv->num_samples);
 }
 
@@ -120,6 +140,7 @@ _setup_gnuplot(gnuplot_ctrl *h1) {
 static void 
 _sample_plot(struct rvar_t const *rs) {
   struct rvar_sample_t const *sample = (struct rvar_sample_t const*)(rs);
+  _rvar_sample_sort((struct rvar_sample_t *)sample);
   char buffer[] = RVAR_PLOT_PATH;
   int fd = mkstemp(buffer);
   if (fd == -1)
@@ -162,6 +183,7 @@ _sample_plot(struct rvar_t const *rs) {
 static rvar_type_t
 _sample_percentile(struct rvar_t const *rs, float percentile) {
     struct rvar_sample_t *r = (struct rvar_sample_t *)rs;
+    _rvar_sample_sort(r);
     float fidx = percentile * (r->num_samples - 1);
     float hidx = ceil(fidx);
     float lidx = floor(fidx);
@@ -190,6 +212,7 @@ _sample_expected(struct rvar_t const *rs) {
 static struct rvar_bucket_t *
 _sample_to_bucket(struct rvar_t const *rs, rvar_type_t bucket_size) {
     struct rvar_sample_t *r = (struct rvar_sample_t *)rs;
+    _rvar_sample_sort(r);
 
     // Maximum number of buckets required
     unsigned max_num_buckets = (unsigned)(ceil((r->high - r->low)/bucket_size)) + 1;
@@ -243,14 +266,9 @@ void _sample_free(struct rvar_t *rs) {
 static
 struct rvar_t *_sample_convolve(struct rvar_t const *left, struct rvar_t const *right, rvar_type_t bucket_size) {
     // we know that left is always SAMPLED
-    struct rvar_bucket_t *rr = (struct rvar_bucket_t *)right;
-    if (right->_type == SAMPLED)
-        rr = right->to_bucket(right, bucket_size);
     struct rvar_bucket_t *ll = left->to_bucket(left, bucket_size);
     struct rvar_t *ret = ll->convolve(
-        (struct rvar_t const *)ll, 
-        (struct rvar_t const *)rr, 
-        bucket_size);
+        (struct rvar_t const *)ll, right, bucket_size);
     ll->free((struct rvar_t *)ll);
     return ret;
 
@@ -266,19 +284,102 @@ _float_comp(const void *v1, const void *v2) {
     else              return  0;
 }
 
-/* TODO: This is so stupid, we shouldn't need to do this sorting ... it
- * should be done automatically, sort of.  Or be done lazily, if data gets
- * added to rvar and it isn't "optimized."
- * - Omid 1/22/2019
+/* Below this many values qsort beats the eight counting passes */
+#define RADIX_SORT_CUTOFF 256
+
+/* Map a double to an unsigned key with the same ordering: flip every bit of
+ * the negative numbers and only the sign bit of the positive ones. */
+static inline uint64_t _radix_key(rvar_type_t val) {
+  uint64_t bits = 0;
+  memcpy(&bits, &val, sizeof(bits));
+  if (bits & 0x8000000000000000ULL)
+    return ~bits;
+  return bits | 0x8000000000000000ULL;
+}
+
+static inline rvar_type_t _radix_val(uint64_t key) {
+  if (key & 0x8000000000000000ULL)
+    key &= ~0x8000000000000000ULL;
+  else
+    key = ~key;
+
+  rvar_type_t val = 0;
+  memcpy(&val, &key, sizeof(val));
+  return val;
+}
+
+/* LSD radix sort on the bit pattern of the doubles, one byte per pass.
+ * Passes where every key has the same byte (common for the high bytes of
+ * similar valued samples) are skipped. */
+static void _radix_sort(rvar_type_t *vals, uint32_t n) {
+  if (n < RADIX_SORT_CUTOFF) {
+    qsort(vals, n, sizeof(rvar_type_t), _float_comp);
+    return;
+  }
+
+  uint64_t *keys = malloc(sizeof(uint64_t) * n);
+  uint64_t *tmp  = malloc(sizeof(uint64_t) * n);
+  uint32_t (*counts)[256] = calloc(8, sizeof(uint32_t[256]));
+
+  for (uint32_t i = 0; i < n; ++i) {
+    keys[i] = _radix_key(vals[i]);
+    for (int b = 0; b < 8; ++b)
+      counts[b][(keys[i] >> (b * 8)) & 0xff]++;
+  }
+
+  for (int b = 0; b < 8; ++b) {
+    unsigned shift = (unsigned)b * 8;
+    uint32_t *count = counts[b];
+    if (count[(keys[0] >> shift) & 0xff] == n)
+      continue;
+
+    uint32_t offset = 0;
+    for (int d = 0; d < 256; ++d) {
+      uint32_t c = count[d];
+      count[d] = offset;
+      offset += c;
+    }
+
+    for (uint32_t i = 0; i < n; ++i)
+      tmp[count[(keys[i] >> shift) & 0xff]++] = keys[i];
+
+    uint64_t *swap = keys; keys = tmp; tmp = swap;
+  }
+
+  for (uint32_t i = 0; i < n; ++i)
+    vals[i] = _radix_val(keys[i]);
+
+  free(counts);
+  free(keys);
+  free(tmp);
+}
+
+static int _vals_sorted(rvar_type_t const *vals, uint32_t n) {
+  for (uint32_t i = 1; i < n; ++i)
+    if (vals[i] < vals[i-1])
+      return 0;
+  return 1;
+}
+
+/* Sampled rvars are sorted when they are created (or deserialized), before
+ * they can be shared between threads, so the const accessors below never
+ * write to the rvar.  The check is O(n) so the (many) callers that hand us
+ * in-order data don't pay for a sort at all.
  *
- * Ack got this removed in most places so at least we can make it static.
- * */
-static void _rvar_sample_finalize(struct rvar_sample_t *rv, uint32_t nsteps) {
-    /* TODO: This is so stupid, we shouldn't need to do this */
-    rv->num_samples = nsteps;
-    qsort(rv->vals, nsteps, sizeof(rvar_type_t), _float_comp);
-    rv->low = rv->vals[0];
-    rv->high = rv->vals[nsteps-1];
+ * The accessors still call this for rvars made through rvar_sample_create,
+ * whose vals are filled in by the caller after the fact. */
+static void _rvar_sample_sort(struct rvar_sample_t *rv) {
+    if (rv->sorted)
+      return;
+
+    if (!_vals_sorted(rv->vals, rv->num_samples))
+      _radix_sort(rv->vals, rv->num_samples);
+
+    if (rv->num_samples) {
+      rv->low = rv->vals[0];
+      rv->high = rv->vals[rv->num_samples-1];
+    }
+    rv->sorted = 1;
 }
 
 static
@@ -312,8 +413,24 @@ struct rvar_t *rvar_sample_create_with_vals(
     ret->vals = vals;
     ret->num_samples = nsize;
     rvar_sample_init(ret);
-    _rvar_sample_finalize(ret, nsize);
-    
+    _rvar_sample_sort(ret);
+
+    return (struct rvar_t*)ret;
+}
+
+struct rvar_t *rvar_sample_create_with_sorted_vals(
+    rvar_type_t *vals, uint32_t nsize) {
+    struct rvar_sample_t *ret = malloc(sizeof(struct rvar_sample_t));
+    memset(ret, 0, sizeof(struct rvar_sample_t));
+    ret->vals = vals;
+    ret->num_samples = nsize;
+    rvar_sample_init(ret);
+    if (nsize) {
+      ret->low = vals[0];
+      ret->high = vals[nsize-1];
+    }
+    ret->sorted = 1;
+
     return (struct rvar_t*)ret;
 }
 
@@ -394,9 +511,10 @@ static void _bucket_free(struct rvar_t *rs) {
 
 static struct rvar_t *_bucket_convolve(struct rvar_t const *left, struct rvar_t const *right, rvar_type_t bucket_size) {
     // we know that left is always BUCKETED
+    struct rvar_bucket_t *tmp = 0;
     struct rvar_bucket_t const *rr = (struct rvar_bucket_t *)right;
-    if (right->_type == SAMPLED)
-        rr = right->to_bucket(right, bucket_size);
+    if (right->_type != BUCKETED)
+        rr = tmp = right->to_bucket(right, bucket_size);
     struct rvar_bucket_t const *ll = (struct rvar_bucket_t *)left;
 
     struct array_t *arr = array_create(
@@ -424,6 +542,9 @@ static struct rvar_t *_bucket_convolve(struct rvar_t const *left, struct rvar_t
     array_transfer_ownership(arr, (void**)&buckets);
     array_free(arr);
 
+    if (tmp)
+      tmp->free((struct rvar_t *)tmp);
+
     if (cdf < 1 - PROB_ERR || cdf > 1 + PROB_ERR) {
       rvar_type_t sum = 0;
       rvar_type_t ratio = 1/cdf;
@@ -471,8 +592,9 @@ struct rvar_t *_rvar_deserialize_sample(char const *data) {
     ptr += sizeof(rvar_type_t);
   }
 
+  /* We always serialize the sorted values */
   rv->num_samples = nsamples;
-  _rvar_sample_finalize(rv, nsamples);
+  _rvar_sample_sort(rv);
 
   return (struct rvar_t *)rv;
 }
@@ -489,6 +611,7 @@ struct rvar_t *_rvar_deserialize_bucket(char const *data) {
   struct rvar_bucket_t *rv = (struct rvar_bucket_t *)rvar_bucket_create(bucket_size);
   size_t size = sizeof(struct bucket_t) * nbuckets;
   rv->buckets = malloc(size);
+  rv->nbuckets = nbuckets;
   memcpy(rv->buckets, ptr, size);
 
   return (struct rvar_t *)rv;
@@ -504,6 +627,10 @@ struct rvar_t *rvar_deserialize(char const *data) {
     return _rvar_deserialize_sample(ptr);
   } else if (type == BUCKETED) {
     return _rvar_deserialize_bucket(ptr);
+  } else if (type == SKETCHED) {
+    return _rvar_deserialize_sketch(ptr);
+  } else if (type == SPARSE) {
+    return _rvar_deserialize_sparse(ptr);
   }
 
   panic("Unknown rvar_type_t: %d", type);
@@ -517,7 +644,7 @@ struct rvar_t *rvar_zero(void) {
 struct rvar_t *rvar_fixed(rvar_type_t value) {
   rvar_type_t *vals = malloc(sizeof(rvar_type_t));
   *vals = value;
-  return rvar_sample_create_with_vals(vals, 1);
+  return rvar_sample_create_with_sorted_vals(vals, 1);
 }
 
 int _sort_buckets(void const *p1, void const *p2) {
@@ -529,92 +656,1145 @@ int _sort_buckets(void const *p1, void const *p2) {
   else { return 0; }
 }
 
-struct rvar_t *rvar_compose_with_distributions(
+/* Re-bins the sorted buckets (in place) to at most _bucket_limit buckets.
+ *
+ * The range of the buckets is split into _bucket_limit equal-width cells and
+ * the buckets in each cell are replaced with a single bucket at their mean,
+ * so the total mass and the mean are unchanged.  The Wasserstein-1 distance
+ * between the input and the output, i.e., sum(prob * |val - new_val|), is
+ * added to _rebin_error.
+ *
+ * Returns the new number of buckets. */
+static unsigned
+_buckets_rebin(struct bucket_t *buckets, unsigned nbuckets) {
+  unsigned limit = _bucket_limit;
+  if (limit == 0 || nbuckets <= limit)
+    return nbuckets;
+
+  rvar_type_t low = buckets[0].val;
+  rvar_type_t width = (buckets[nbuckets - 1].val - low) / limit;
+  if (width <= 0)
+    return nbuckets;
+
+  rvar_type_t error = 0;
+  unsigned nout = 0;
+  unsigned i = 0;
+  while (i < nbuckets) {
+    unsigned cell = MIN(limit - 1, (unsigned)((buckets[i].val - low) / width));
+    rvar_type_t prob = 0, sum = 0;
+
+    unsigned j = i;
+    for (; j < nbuckets; ++j) {
+      unsigned jcell = MIN(limit - 1, (unsigned)((buckets[j].val - low) / width));
+      if (jcell != cell)
+        break;
+      prob += buckets[j].prob;
+      sum += buckets[j].val * buckets[j].prob;
+    }
+
+    rvar_type_t mean = (prob > 0) ? sum / prob : buckets[i].val;
+    for (unsigned k = i; k < j; ++k) {
+      error += buckets[k].prob * fabs(buckets[k].val - mean);
+    }
+
+    /* nout <= i, so we never overwrite a bucket we haven't read */
+    buckets[nout].val = mean;
+    buckets[nout].prob = prob;
+    nout++;
+    i = j;
+  }
+
+  pthread_mutex_lock(&_rebin_lock);
+  _rebin_error += error;
+  pthread_mutex_unlock(&_rebin_lock);
+
+  return nout;
+}
+
+void rvar_bucket_limit_set(unsigned max_buckets) {
+  _bucket_limit = max_buckets;
+}
+
+unsigned rvar_bucket_limit(void) {
+  return _bucket_limit;
+}
+
+rvar_type_t rvar_rebin_error(int reset) {
+  pthread_mutex_lock(&_rebin_lock);
+  rvar_type_t ret = _rebin_error;
+  if (reset)
+    _rebin_error = 0;
+  pthread_mutex_unlock(&_rebin_lock);
+  return ret;
+}
+
+/* Merges and compresses the sorted buckets in "in" into "out".  Returns the
+ * number of buckets written to out.  in and out can be the same buffer: we
+ * never write past the bucket we are reading. */
+static unsigned
+_buckets_compress(struct bucket_t const *in, unsigned nbuckets,
+    struct bucket_t *out, rvar_type_t bucket_size) {
+  unsigned nout = 0;
+  struct bucket_t bucket;
+  bucket.val = in[0].val * in[0].prob;
+  bucket.prob = in[0].prob;
+  rvar_type_t acc = 0;
+
+  /* bucket.val holds the probability weighted sum of the merged entries, so
+   * keep the last raw value around to find the overlapping buckets.  If the
+   * bucket only holds one value, use that value as is---the weighted average
+   * may fall just short of it and get rounded down to the previous bucket. */
+  rvar_type_t last = in[0].val;
+  int mixed = 0;
+
+  for (unsigned i = 1; i < nbuckets; ++i) {
+    struct bucket_t cur = in[i];
+
+    /* Merge buckets that overlap */
+    if (cur.val == last) {
+      // Accumulate
+      bucket.prob += cur.prob;
+      bucket.val += cur.val * cur.prob;
+      continue;
+    }
+
+    /* Compression of RVAR: If we haven't added up enough entries, mash up a
+     * few entries together */
+    if (bucket.prob <= PROB_ERR) {
+      bucket.prob += cur.prob;
+      bucket.val += cur.val * cur.prob;
+      last = cur.val;
+      mixed = 1;
+      continue;
+    }
+
+    acc += bucket.prob;
+    bucket.val = mixed ? bucket.val / bucket.prob : last;
+    bucket.val = ROUND_TO_BUCKET(bucket.val, bucket_size);
+    out[nout++] = bucket;
+    bucket.val = cur.val * cur.prob;
+    bucket.prob = cur.prob;
+    last = cur.val;
+    mixed = 0;
+  }
+  acc += bucket.prob;
+  ASSERT_DIST(acc);
+
+  // append the last bit
+  bucket.val = mixed ? bucket.val / bucket.prob : last;
+  bucket.val = ROUND_TO_BUCKET(bucket.val, bucket_size);
+  out[nout++] = bucket;
+
+  return _buckets_rebin(out, nout);
+}
+
+/* A min-heap over the heads of k sorted bucket lists */
+struct _bucket_heap_t {
+  struct bucket_t const **lists; /* Sorted lists */
+  unsigned const *sizes;         /* Size of each list */
+  unsigned *pos;                 /* Position of the head of each list */
+  unsigned *heap;                /* Heap of list indices */
+  unsigned nheap;                /* Number of lists in the heap */
+};
+
+#define HEAD_VAL(h, idx) ((h)->lists[idx][(h)->pos[idx]].val)
+
+static void
+_bucket_heap_sift_down(struct _bucket_heap_t *h, unsigned i) {
+  while (1) {
+    unsigned l = 2 * i + 1, r = l + 1, min = i;
+    if (l < h->nheap && HEAD_VAL(h, h->heap[l]) < HEAD_VAL(h, h->heap[min])) min = l;
+    if (r < h->nheap && HEAD_VAL(h, h->heap[r]) < HEAD_VAL(h, h->heap[min])) min = r;
+    if (min == i)
+      return;
+
+    unsigned tmp = h->heap[i];
+    h->heap[i] = h->heap[min];
+    h->heap[min] = tmp;
+    i = min;
+  }
+}
+
+/* k-way merges the sorted lists (each scaled by scales[i]) into out.  out
+ * should have room for all the buckets.  Returns the number of buckets. */
+static unsigned
+_buckets_kway_merge(struct bucket_t const **lists, unsigned const *sizes,
+    rvar_type_t const *scales, unsigned k, struct bucket_t *out) {
+  struct _bucket_heap_t h;
+  h.lists = lists;
+  h.sizes = sizes;
+  h.pos = malloc(sizeof(unsigned) * k);
+  h.heap = malloc(sizeof(unsigned) * k);
+  h.nheap = 0;
+
+  for (unsigned i = 0; i < k; ++i) {
+    h.pos[i] = 0;
+    if (sizes[i] != 0)
+      h.heap[h.nheap++] = i;
+  }
+
+  for (unsigned i = h.nheap / 2; i-- > 0;) {
+    _bucket_heap_sift_down(&h, i);
+  }
+
+  unsigned nout = 0;
+  while (h.nheap) {
+    unsigned idx = h.heap[0];
+    struct bucket_t const *b = &lists[idx][h.pos[idx]];
+    out[nout].val = b->val;
+    out[nout].prob = b->prob * scales[idx];
+    nout++;
+
+    if (++h.pos[idx] == sizes[idx])
+      h.heap[0] = h.heap[--h.nheap];
+    _bucket_heap_sift_down(&h, 0);
+  }
+
+  free(h.pos);
+  free(h.heap);
+  return nout;
+}
+
+#undef HEAD_VAL
+
+unsigned rvar_compose_size(struct rvar_t **rvars, unsigned len) {
+  unsigned nbuckets = 0;
+  for (unsigned i = 0; i < len; ++i) {
+    if (rvars[i]->_type == BUCKETED)
+      nbuckets += ((struct rvar_bucket_t *)rvars[i])->nbuckets;
+    else if (rvars[i]->_type == SPARSE)
+      nbuckets += ((struct rvar_sparse_t *)rvars[i])->ntail + 1;
+    else
+      panic("Unsupported rvar type in composition: %d", rvars[i]->_type);
+  }
+  return nbuckets;
+}
+
+unsigned rvar_compose_with_distributions_into(
     struct rvar_t **rvars,
     double *dists,
-    unsigned len) {
+    unsigned len,
+    struct bucket_t *out,
+    rvar_type_t *ret_bucket_size) {
   if (len == 0 || dists == 0 || rvars == 0)
     panic_txt("Passing nulls to rvar_compose_with_distribution");
 
-  double bucket_size = INFINITY;
-  // Get the total number of buckets and create a large enough space to hold
-  // them all
-  unsigned nbuckets = 0;
+  struct bucket_t const **lists = malloc(sizeof(struct bucket_t *) * len);
+  unsigned *sizes = malloc(sizeof(unsigned) * len);
+  rvar_type_t *scales = calloc(len, sizeof(rvar_type_t));
+  struct rvar_bucket_t **tmp = malloc(sizeof(struct rvar_bucket_t *) * len);
+
   rvar_type_t scale_sum = 0;
-  for (int i = 0; i < len; ++i) {
-    struct rvar_bucket_t *rv = (struct rvar_bucket_t *)rvars[i];
-    nbuckets += rv->nbuckets;
-    bucket_size = MIN(bucket_size, rv->bucket_size);
+  for (unsigned i = 0; i < len; ++i) {
     scale_sum += dists[i];
   }
-
   scale_sum = 1/scale_sum;
 
+  double bucket_size = INFINITY;
+  for (unsigned i = 0; i < len; ++i) {
+    struct rvar_bucket_t *rv = (struct rvar_bucket_t *)rvars[i];
+    tmp[i] = 0;
+
+    /* Sparse rvars go through their bucketed representation */
+    if (rvars[i]->_type == SPARSE) {
+      struct rvar_sparse_t *sp = (struct rvar_sparse_t *)rvars[i];
+      rv = tmp[i] = sp->to_bucket(rvars[i], sp->bucket_size);
+    } else if (rvars[i]->_type != BUCKETED) {
+      panic("Unsupported rvar type in composition: %d", rvars[i]->_type);
+    }
+
+    lists[i] = rv->buckets;
+    sizes[i] = rv->nbuckets;
+    scales[i] = dists[i] * scale_sum;
+    bucket_size = MIN(bucket_size, rv->bucket_size);
+  }
+
+  unsigned nbuckets = _buckets_kway_merge(lists, sizes, scales, len, out);
   if (nbuckets == 0) {
     panic_txt("Number of buckets in the composition is zero.");
   }
+  nbuckets = _buckets_compress(out, nbuckets, out, bucket_size);
 
-  struct bucket_t *buckets = malloc(sizeof(struct bucket_t) * nbuckets);
-  struct bucket_t *ptr = buckets;
+  for (unsigned i = 0; i < len; ++i) {
+    if (tmp[i])
+      tmp[i]->free((struct rvar_t *)tmp[i]);
+  }
+  free(tmp);
+  free(scales);
+  free(sizes);
+  free(lists);
+
+  if (ret_bucket_size)
+    *ret_bucket_size = bucket_size;
+  return nbuckets;
+}
+
+struct rvar_t *rvar_compose_with_distributions(
+    struct rvar_t **rvars,
+    double *dists,
+    unsigned len) {
+  if (len == 0 || dists == 0 || rvars == 0)
+    panic_txt("Passing nulls to rvar_compose_with_distribution");
+
+  /* Compose sparse rvars without touching their zero spikes */
+  int all_sparse = 1;
   for (int i = 0; i < len; ++i) {
-    struct rvar_bucket_t *rv = (struct rvar_bucket_t *)rvars[i];
-    rvar_type_t scale = dists[i] * scale_sum;
-    for (int j = 0; j < rv->nbuckets; ++j) {
-      ptr[j].val = rv->buckets[j].val;
-      ptr[j].prob = rv->buckets[j].prob * scale;
-    }
-    ptr += rv->nbuckets;
+    all_sparse &= (rvars[i]->_type == SPARSE);
   }
+  if (all_sparse)
+    return _sparse_compose(rvars, dists, len);
+
+  unsigned nbuckets = rvar_compose_size(rvars, len);
+  struct bucket_t *buckets = malloc(sizeof(struct bucket_t) * (nbuckets ? nbuckets : 1));
+
+  rvar_type_t bucket_size = 0;
+  nbuckets = rvar_compose_with_distributions_into(
+      rvars, dists, len, buckets, &bucket_size);
 
-  return rvar_from_buckets(buckets, nbuckets, bucket_size);
+  struct rvar_bucket_t *ret = (struct rvar_bucket_t *)rvar_bucket_create(bucket_size);
+  ret->buckets = realloc(buckets, sizeof(struct bucket_t) * nbuckets);
+  ret->nbuckets = nbuckets;
+  return (struct rvar_t *)ret;
+}
+
+/* Same as rvar_from_buckets but the buckets are already sorted */
+static struct rvar_t *
+_rvar_from_sorted_buckets(
+    struct bucket_t const *buckets,
+    unsigned nbuckets, rvar_type_t bucket_size) {
+  struct bucket_t *out = malloc(sizeof(struct bucket_t) * nbuckets);
+  unsigned nout = _buckets_compress(buckets, nbuckets, out, bucket_size);
+
+  struct rvar_bucket_t *ret = (struct rvar_bucket_t *)rvar_bucket_create(bucket_size);
+  ret->nbuckets = nout;
+  ret->buckets = realloc(out, sizeof(struct bucket_t) * nout);
+  return (struct rvar_t *)ret;
 }
 
 struct rvar_t *rvar_from_buckets(
     struct bucket_t *buckets,
     unsigned nbuckets, rvar_type_t bucket_size) {
   qsort(buckets, nbuckets, sizeof(struct bucket_t), _sort_buckets);
-  struct array_t *arr = array_create(sizeof(struct bucket_t), nbuckets);
+  return _rvar_from_sorted_buckets(buckets, nbuckets, bucket_size);
+}
+
+
+struct rvar_t *rvar_power(
+    struct rvar_t const *rv, unsigned k, rvar_type_t bucket_size) {
+  if (k == 0) {
+    struct rvar_t *zero = rvar_zero();
+    struct rvar_t *ret = (struct rvar_t *)zero->to_bucket(zero, bucket_size);
+    zero->free(zero);
+    return ret;
+  }
+
+  /* Exponentiation by squaring: the k-fold convolution of rv takes
+   * O(log(k)) convolutions instead of k.  base holds rv^(2^i) and ret
+   * accumulates the powers matching the set bits of k. */
+  struct rvar_t *base = rv->copy(rv);
+  struct rvar_t *ret = 0, *tmp = 0;
+
+  while (1) {
+    if (k & 1) {
+      if (ret) {
+        tmp = ret->convolve(ret, base, bucket_size);
+        ret->free(ret);
+        ret = tmp;
+      } else {
+        ret = base->copy(base);
+      }
+    }
+
+    k >>= 1;
+    if (k == 0)
+      break;
+
+    tmp = base->convolve(base, base, bucket_size);
+    base->free(base);
+    base = tmp;
+  }
+
+  base->free(base);
+  return ret;
+}
+
+/* Sketched random variables: a KLL quantile sketch.
+ *
+ * The sketch keeps a stack of compactors (levels).  Items at level h each
+ * represent 2^h samples.  When a level fills up, it is sorted and every other
+ * item (alternating between odd and even positions) is promoted to the next
+ * level.  Lower levels get geometrically smaller capacities, so the memory is
+ * O(k) in practice, regardless of the number of samples added.  The rank
+ * error is roughly O(1/k).
+ *
+ * We keep the exact sum, min, and max of the samples on the side so the
+ * expected value and the extremes are exact.
+ *
+ * Quantile queries go through a sorted view of the items that is only rebuilt
+ * after the sketch changes. */
+#define SKETCH_MIN_CAP 2
+
+/* The limits only depend on the depth of the level, so they change when a
+ * level is added */
+static void
+_sketch_set_limits(struct rvar_sketch_t *sk) {
+  double cap = sk->k;
+  for (unsigned h = sk->nlevels; h-- > 0; cap *= 2.0/3.0) {
+    double limit = ceil(cap);
+    sk->limits[h] = limit < SKETCH_MIN_CAP ? SKETCH_MIN_CAP : (unsigned)limit;
+  }
+}
+
+static void
+_sketch_add_level(struct rvar_sketch_t *sk) {
+  unsigned h = sk->nlevels++;
+  sk->levels = realloc(sk->levels, sizeof(rvar_type_t *) * sk->nlevels);
+  sk->sizes = realloc(sk->sizes, sizeof(unsigned) * sk->nlevels);
+  sk->caps = realloc(sk->caps, sizeof(unsigned) * sk->nlevels);
+  sk->limits = realloc(sk->limits, sizeof(unsigned) * sk->nlevels);
+
+  sk->caps[h] = sk->k;
+  sk->sizes[h] = 0;
+  sk->levels[h] = malloc(sizeof(rvar_type_t) * sk->caps[h]);
+  _sketch_set_limits(sk);
+}
+
+static void
+_sketch_invalidate(struct rvar_sketch_t *sk) {
+  free(sk->sorted);
+  sk->sorted = 0;
+  sk->nsorted = 0;
+}
+
+static inline void
+_sketch_push(struct rvar_sketch_t *sk, unsigned h, rvar_type_t val) {
+  if (sk->sorted)
+    _sketch_invalidate(sk);
+
+  if (sk->sizes[h] == sk->caps[h]) {
+    sk->caps[h] *= 2;
+    sk->levels[h] = realloc(sk->levels[h], sizeof(rvar_type_t) * sk->caps[h]);
+  }
+  sk->levels[h][sk->sizes[h]++] = val;
+}
+
+/* Promote half of level h to level h+1.  If the level has an odd number of
+ * items, the largest one stays behind. */
+static void
+_sketch_compact_level(struct rvar_sketch_t *sk, unsigned h) {
+  if (h + 1 == sk->nlevels)
+    _sketch_add_level(sk);
+
+  rvar_type_t *items = sk->levels[h];
+  unsigned n = sk->sizes[h];
+  qsort(items, n, sizeof(rvar_type_t), _float_comp);
+
+  unsigned npairs = n / 2;
+  for (unsigned i = 0; i < npairs; ++i) {
+    _sketch_push(sk, h + 1, items[2 * i + sk->coin]);
+  }
+  sk->coin ^= 1;
+
+  if (n % 2 == 1) {
+    items[0] = items[n - 1];
+    sk->sizes[h] = 1;
+  } else {
+    sk->sizes[h] = 0;
+  }
+}
+
+static void
+_sketch_compress(struct rvar_sketch_t *sk) {
+  for (unsigned h = 0; h < sk->nlevels; ++h) {
+    if (sk->sizes[h] >= sk->limits[h])
+      _sketch_compact_level(sk, h);
+  }
+}
+
+/* Returns the items of the sketch sorted by value.  prob holds the cumulative
+ * weight of the items up to (and including) each item, i.e., the number of
+ * samples they represent.
+ *
+ * The view is cached in the sketch (and dropped when an item is pushed), so
+ * like the sampled rvars, this mutates a "const" sketch: don't share a sketch
+ * between threads before querying it once. */
+static struct bucket_t const *
+_sketch_sorted_items(struct rvar_sketch_t const *csk, unsigned *nitems) {
+  struct rvar_sketch_t *sk = (struct rvar_sketch_t *)csk;
+  if (sk->sorted) {
+    *nitems = sk->nsorted;
+    return sk->sorted;
+  }
+
+  unsigned n = 0;
+  for (unsigned h = 0; h < sk->nlevels; ++h) {
+    n += sk->sizes[h];
+  }
+
+  struct bucket_t *items = malloc(sizeof(struct bucket_t) * (n ? n : 1));
+  struct bucket_t *ptr = items;
+  for (unsigned h = 0; h < sk->nlevels; ++h) {
+    rvar_type_t weight = (rvar_type_t)(1ull << h);
+    for (unsigned i = 0; i < sk->sizes[h]; ++i) {
+      ptr->val = sk->levels[h][i];
+      ptr->prob = weight;
+      ptr++;
+    }
+  }
+
+  qsort(items, n, sizeof(struct bucket_t), _sort_buckets);
+  for (unsigned i = 1; i < n; ++i)
+    items[i].prob += items[i - 1].prob;
+
+  sk->sorted = items;
+  sk->nsorted = n;
+  *nitems = n;
+  return items;
+}
+
+static rvar_type_t
+_sketch_expected(struct rvar_t const *rs) {
+  struct rvar_sketch_t const *sk = (struct rvar_sketch_t const *)rs;
+  if (sk->count == 0)
+    return 0;
+  return sk->sum / (rvar_type_t)sk->count;
+}
+
+static rvar_type_t
+_sketch_percentile(struct rvar_t const *rs, float percentile) {
+  struct rvar_sketch_t const *sk = (struct rvar_sketch_t const *)rs;
+  if (sk->count == 0)
+    return 0;
+  if (percentile <= 0)
+    return sk->low;
+  if (percentile >= 1)
+    return sk->high;
+
+  unsigned n = 0;
+  struct bucket_t const *items = _sketch_sorted_items(sk, &n);
+
+  /* Same rank convention as the sampled rvar: rank = p * (count - 1).  Find
+   * the first item whose cumulative weight goes past the rank. */
+  rvar_type_t rank = percentile * (rvar_type_t)(sk->count - 1);
+  unsigned lo = 0, hi = n;
+  while (lo < hi) {
+    unsigned mid = lo + (hi - lo) / 2;
+    if (items[mid].prob > rank) hi = mid;
+    else lo = mid + 1;
+  }
+
+  return lo < n ? items[lo].val : sk->high;
+}
+
+static struct rvar_bucket_t *
+_sketch_to_bucket(struct rvar_t const *rs, rvar_type_t bucket_size) {
+  struct rvar_sketch_t const *sk = (struct rvar_sketch_t const *)rs;
+  unsigned n = 0;
+  struct bucket_t const *items = _sketch_sorted_items(sk, &n);
+
+  struct array_t *buckets = array_create(sizeof(struct bucket_t), n ? n : 1);
+  rvar_type_t total = (rvar_type_t)sk->count;
+
   struct bucket_t bucket;
-  bucket.val = buckets[0].val * buckets[0].prob;
-  bucket.prob = buckets[0].prob;
-  rvar_type_t acc = 0;
+  bucket.prob = 0; bucket.val = ROUND_TO_BUCKET(sk->low, bucket_size);
 
-  for (int i = 1; i < nbuckets; ++i) {
-    /* Merge buckets that overlap */
-    if (buckets[i].val == bucket.val) {
-      // Accumulate
-      bucket.prob += buckets[i].prob;
-      continue;
+  for (unsigned i = 0; i < n; ++i) {
+    rvar_type_t weight = items[i].prob - (i ? items[i - 1].prob : 0);
+    if (items[i].val >= bucket.val + bucket_size) {
+      if (bucket.prob != 0) {
+        bucket.prob /= total;
+        array_append(buckets, &bucket);
+      }
+      bucket.prob = weight; bucket.val = ROUND_TO_BUCKET(items[i].val, bucket_size);
+    } else {
+      bucket.prob += weight;
     }
+  }
 
-    /* Compression of RVAR: If we haven't added up enough entries, mash up a
-     * few entries together */
-    if (bucket.prob <= PROB_ERR) {
-      bucket.prob += buckets[i].prob;
-      bucket.val += buckets[i].val * buckets[i].prob;
+  if (bucket.prob != 0) {
+    bucket.prob /= total;
+    array_append(buckets, &bucket);
+  }
+
+  struct rvar_bucket_t *ret = (struct rvar_bucket_t *)rvar_bucket_create(bucket_size);
+  ret->nbuckets = array_size(buckets);
+  array_transfer_ownership(buckets, (void**)(&ret->buckets));
+  array_free(buckets);
+
+  return ret;
+}
+
+static struct rvar_t *
+_sketch_convolve(struct rvar_t const *left, struct rvar_t const *right, rvar_type_t bucket_size) {
+  struct rvar_bucket_t *ll = left->to_bucket(left, bucket_size);
+  struct rvar_t *ret = ll->convolve(
+      (struct rvar_t const *)ll, right, bucket_size);
+  ll->free((struct rvar_t *)ll);
+  return ret;
+}
+
+static void
+_sketch_free(struct rvar_t *rs) {
+  struct rvar_sketch_t *sk = (struct rvar_sketch_t *)rs;
+  if (!sk) return;
+
+  for (unsigned h = 0; h < sk->nlevels; ++h) {
+    free(sk->levels[h]);
+  }
+  free(sk->levels);
+  free(sk->sizes);
+  free(sk->caps);
+  free(sk->limits);
+  free(sk->sorted);
+  free(sk);
+}
+
+static struct rvar_t *
+_sketch_copy(struct rvar_t const *rs) {
+  struct rvar_sketch_t const *sk = (struct rvar_sketch_t const *)rs;
+  struct rvar_sketch_t *ret = (struct rvar_sketch_t *)rvar_sketch_create(sk->k);
+
+  for (unsigned h = 1; h < sk->nlevels; ++h) {
+    _sketch_add_level(ret);
+  }
+
+  for (unsigned h = 0; h < sk->nlevels; ++h) {
+    for (unsigned i = 0; i < sk->sizes[h]; ++i) {
+      _sketch_push(ret, h, sk->levels[h][i]);
+    }
+  }
+
+  ret->count = sk->count;
+  ret->sum = sk->sum;
+  ret->low = sk->low;
+  ret->high = sk->high;
+  ret->coin = sk->coin;
+
+  return (struct rvar_t *)ret;
+}
+
+static char *
+_sketch_serialize(struct rvar_t *rvar, size_t *size) {
+  struct rvar_sketch_t *sk = (struct rvar_sketch_t *)rvar;
+  *size = HEADER_SIZE
+    + sizeof(uint32_t) /* k */
+    + sizeof(uint32_t) /* nlevels */
+    + sizeof(uint32_t) /* coin */
+    + sizeof(uint64_t) /* count */
+    + sizeof(rvar_type_t) * 3 /* sum, low, high */;
+  for (unsigned h = 0; h < sk->nlevels; ++h) {
+    *size += sizeof(uint32_t) + sizeof(rvar_type_t) * sk->sizes[h];
+  }
+
+  char *buffer = malloc(*size);
+  char *ptr = _rvar_header(sk->_type, buffer);
+
+  *(uint32_t *)ptr = sk->k; ptr += sizeof(uint32_t);
+  *(uint32_t *)ptr = sk->nlevels; ptr += sizeof(uint32_t);
+  *(uint32_t *)ptr = sk->coin; ptr += sizeof(uint32_t);
+  *(uint64_t *)ptr = sk->count; ptr += sizeof(uint64_t);
+  *(rvar_type_t *)ptr = sk->sum; ptr += sizeof(rvar_type_t);
+  *(rvar_type_t *)ptr = sk->low; ptr += sizeof(rvar_type_t);
+  *(rvar_type_t *)ptr = sk->high; ptr += sizeof(rvar_type_t);
+
+  for (unsigned h = 0; h < sk->nlevels; ++h) {
+    *(uint32_t *)ptr = sk->sizes[h];
+    ptr += sizeof(uint32_t);
+    memcpy(ptr, sk->levels[h], sizeof(rvar_type_t) * sk->sizes[h]);
+    ptr += sizeof(rvar_type_t) * sk->sizes[h];
+  }
+
+  return buffer;
+}
+
+static void
+_sketch_plot(struct rvar_t const *rs) {
+  struct rvar_bucket_t *rb = rs->to_bucket(rs, 1);
+  rb->plot((struct rvar_t *)rb);
+  rb->free((struct rvar_t *)rb);
+}
+
+struct rvar_t *rvar_sketch_create(unsigned k) {
+  struct rvar_sketch_t *ret = malloc(sizeof(struct rvar_sketch_t));
+  memset(ret, 0, sizeof(struct rvar_sketch_t));
+
+  if (k < SKETCH_MIN_CAP)
+    k = SKETCH_MIN_CAP;
+
+  ret->k = k;
+  ret->low = INFINITY;
+  ret->high = -INFINITY;
+  _sketch_add_level(ret);
+
+  ret->_type = SKETCHED;
+  ret->expected = _sketch_expected;
+  ret->percentile = _sketch_percentile;
+  ret->convolve = _sketch_convolve;
+  ret->to_bucket = _sketch_to_bucket;
+  ret->serialize = _sketch_serialize;
+  ret->free = _sketch_free;
+  ret->plot = _sketch_plot;
+  ret->copy = _sketch_copy;
+
+  return (struct rvar_t *)ret;
+}
+
+void rvar_sketch_add(struct rvar_t *rv, rvar_type_t val) {
+  struct rvar_sketch_t *sk = (struct rvar_sketch_t *)rv;
+  assert(rv->_type == SKETCHED);
+
+  sk->count += 1;
+  sk->sum += val;
+  sk->low = MIN(sk->low, val);
+  sk->high = MAX(sk->high, val);
+
+  _sketch_push(sk, 0, val);
+  if (sk->sizes[0] >= sk->limits[0])
+    _sketch_compress(sk);
+}
+
+void rvar_sketch_merge(struct rvar_t *dst, struct rvar_t const *src) {
+  struct rvar_sketch_t *sk = (struct rvar_sketch_t *)dst;
+  struct rvar_sketch_t const *other = (struct rvar_sketch_t const *)src;
+  assert(dst->_type == SKETCHED && src->_type == SKETCHED);
+
+  while (sk->nlevels < other->nlevels)
+    _sketch_add_level(sk);
+
+  for (unsigned h = 0; h < other->nlevels; ++h) {
+    for (unsigned i = 0; i < other->sizes[h]; ++i) {
+      _sketch_push(sk, h, other->levels[h][i]);
+    }
+  }
+
+  sk->count += other->count;
+  sk->sum += other->sum;
+  sk->low = MIN(sk->low, other->low);
+  sk->high = MAX(sk->high, other->high);
+
+  _sketch_compress(sk);
+}
+
+struct rvar_t *rvar_sketch_from_vals(
+    rvar_type_t const *vals, uint32_t nvals, unsigned k) {
+  struct rvar_t *ret = rvar_sketch_create(k);
+  for (uint32_t i = 0; i < nvals; ++i) {
+    rvar_sketch_add(ret, vals[i]);
+  }
+  return ret;
+}
+
+struct rvar_t *rvar_sketch_map(struct rvar_t const *rv,
+    rvar_type_t (*func)(void *, rvar_type_t), void *data) {
+  struct rvar_sketch_t *sk = (struct rvar_sketch_t *)rv->copy(rv);
+  if (sk->count == 0)
+    return (struct rvar_t *)sk;
+
+  /* The mapped items are an equally good sketch of the mapped samples, but
+   * the sum is no longer exact: rebuild it from the weighted items. */
+  _sketch_invalidate(sk);
+  sk->sum = 0;
+  sk->low = func(data, sk->low);
+  sk->high = func(data, sk->high);
+  for (unsigned h = 0; h < sk->nlevels; ++h) {
+    rvar_type_t weight = (rvar_type_t)(1ull << h);
+    for (unsigned i = 0; i < sk->sizes[h]; ++i) {
+      rvar_type_t val = func(data, sk->levels[h][i]);
+      sk->levels[h][i] = val;
+      sk->sum += val * weight;
+      sk->low = MIN(sk->low, val);
+      sk->high = MAX(sk->high, val);
+    }
+  }
+
+  return (struct rvar_t *)sk;
+}
+
+struct rvar_t *_rvar_deserialize_sketch(char const *data) {
+  char const *ptr = data;
+
+  uint32_t k = *(uint32_t *)ptr; ptr += sizeof(uint32_t);
+  uint32_t nlevels = *(uint32_t *)ptr; ptr += sizeof(uint32_t);
+
+  struct rvar_sketch_t *sk = (struct rvar_sketch_t *)rvar_sketch_create(k);
+  sk->coin = *(uint32_t *)ptr; ptr += sizeof(uint32_t);
+  sk->count = *(uint64_t *)ptr; ptr += sizeof(uint64_t);
+  sk->sum = *(rvar_type_t *)ptr; ptr += sizeof(rvar_type_t);
+  sk->low = *(rvar_type_t *)ptr; ptr += sizeof(rvar_type_t);
+  sk->high = *(rvar_type_t *)ptr; ptr += sizeof(rvar_type_t);
+
+  for (uint32_t h = 0; h < nlevels; ++h) {
+    if (h >= sk->nlevels)
+      _sketch_add_level(sk);
+
+    uint32_t size = *(uint32_t *)ptr;
+    ptr += sizeof(uint32_t);
+    for (uint32_t i = 0; i < size; ++i) {
+      _sketch_push(sk, h, *(rvar_type_t *)ptr);
+      ptr += sizeof(rvar_type_t);
+    }
+  }
+
+  return (struct rvar_t *)sk;
+}
+
+/* Sparse random variables: a point mass at zero plus a compressed tail.
+ *
+ * Violation costs are mostly zero with a thin tail.  A bucketed rvar pays for
+ * the spike in every convolution, i.e., (n+1)*(m+1) products, and the
+ * PROB_ERR compression tends to smear the thin tail into a single bucket.  A
+ * sparse rvar keeps the spike on the side:
+ *
+ *   (z1, T1) + (z2, T2) = (z1*z2, z2*T1 U z1*T2 U T1+T2)
+ *
+ * The first two parts of the tail are scaled copies of the inputs and only
+ * T1+T2 requires products.  The tail is compressed relative to its own mass so
+ * it stays small (about 1/PROB_ERR entries) without losing its shape. */
+static struct rvar_sparse_t *
+_sparse_create(rvar_type_t bucket_size);
+
+/* Builds a sparse rvar from a zero mass and a list of tail buckets.  The
+ * buckets are normalized, sorted (unless already sorted), and compressed. */
+static struct rvar_t *
+_sparse_from_buckets(rvar_type_t zero, struct bucket_t *buckets,
+    unsigned nbuckets, rvar_type_t bucket_size, int sorted) {
+  struct rvar_sparse_t *ret = _sparse_create(bucket_size);
+
+  rvar_type_t tail = 0;
+  for (unsigned i = 0; i < nbuckets; ++i) {
+    tail += buckets[i].prob;
+  }
+
+  rvar_type_t total = zero + tail;
+  if (total <= 0)
+    panic_txt("Creating a sparse rvar with no mass.");
+
+  ret->zero = zero / total;
+  if (nbuckets == 0 || tail <= 0)
+    return (struct rvar_t *)ret;
+
+  /* Compress the tail as if it were a distribution on its own */
+  rvar_type_t scale = 1/tail;
+  for (unsigned i = 0; i < nbuckets; ++i) {
+    buckets[i].prob *= scale;
+  }
+
+  struct rvar_bucket_t *rb = (struct rvar_bucket_t *)(sorted ?
+      _rvar_from_sorted_buckets(buckets, nbuckets, bucket_size) :
+      rvar_from_buckets(buckets, nbuckets, bucket_size));
+
+  scale = tail / total;
+  unsigned ntail = 0;
+  for (unsigned i = 0; i < rb->nbuckets; ++i) {
+    rb->buckets[i].prob *= scale;
+    /* Rounding can move a tail bucket to zero */
+    if (rb->buckets[i].val == 0) {
+      ret->zero += rb->buckets[i].prob;
       continue;
     }
+    rb->buckets[ntail++] = rb->buckets[i];
+  }
 
-    acc += bucket.prob;
-    bucket.val /= bucket.prob;
-    bucket.val = ROUND_TO_BUCKET(bucket.val, bucket_size);
-    array_append(arr, &bucket);
-    bucket.val = buckets[i].val * buckets[i].prob;
-    bucket.prob = buckets[i].prob;
+  ret->tail = rb->buckets;
+  ret->ntail = ntail;
+  rb->buckets = 0;
+  rb->free((struct rvar_t *)rb);
+
+  return (struct rvar_t *)ret;
+}
+
+/* Number of tail buckets with a negative value, i.e., where the zero spike
+ * goes in the sorted order */
+static unsigned
+_sparse_zero_pos(struct rvar_sparse_t const *sp) {
+  unsigned pos = 0;
+  while (pos < sp->ntail && sp->tail[pos].val < 0)
+    pos++;
+  return pos;
+}
+
+static rvar_type_t
+_sparse_expected(struct rvar_t const *rs) {
+  struct rvar_sparse_t const *sp = (struct rvar_sparse_t const *)rs;
+  rvar_type_t exp = 0;
+  for (unsigned i = 0; i < sp->ntail; ++i) {
+    exp += sp->tail[i].val * sp->tail[i].prob;
   }
-  acc += bucket.prob;
-  ASSERT_DIST(acc);
+  return exp;
+}
 
-  // append the last bit
-  bucket.val /= bucket.prob;
-  bucket.val = ROUND_TO_BUCKET(bucket.val, bucket_size);
-  array_append(arr, &bucket);
+/* Same as the bucketed percentile with the zero spike as a bucket */
+static rvar_type_t
+_sparse_percentile(struct rvar_t const *rs, float percentile) {
+  struct rvar_sparse_t const *sp = (struct rvar_sparse_t const *)rs;
+  unsigned zpos = _sparse_zero_pos(sp);
+  rvar_type_t cdf = 0;
+  struct bucket_t zero = {0, sp->zero};
+  struct bucket_t const *bucket = 0;
+
+  for (unsigned i = 0; i < sp->ntail + 1; ++i) {
+    if (i == zpos)       bucket = &zero;
+    else if (i < zpos)   bucket = &sp->tail[i];
+    else                 bucket = &sp->tail[i - 1];
+
+    if (bucket->prob > 0 && cdf + bucket->prob > percentile)
+      return bucket->val + sp->bucket_size * (percentile - cdf) / bucket->prob;
+    cdf += bucket->prob;
+  }
+
+  if (sp->ntail == 0 || zpos == sp->ntail)
+    return sp->bucket_size;
+  return sp->bucket_size + sp->tail[sp->ntail - 1].val;
+}
+
+/* Append val to the sorted buckets, merging it with the last bucket if they
+ * fall in the same bucket */
+static void
+_buckets_append_merge(struct bucket_t *buckets, unsigned *nbuckets,
+    rvar_type_t val, rvar_type_t prob) {
+  if (*nbuckets > 0 && buckets[*nbuckets - 1].val == val) {
+    buckets[*nbuckets - 1].prob += prob;
+    return;
+  }
+  buckets[*nbuckets].val = val;
+  buckets[*nbuckets].prob = prob;
+  (*nbuckets)++;
+}
+
+static struct rvar_bucket_t *
+_sparse_to_bucket(struct rvar_t const *rs, rvar_type_t bucket_size) {
+  struct rvar_sparse_t const *sp = (struct rvar_sparse_t const *)rs;
+  unsigned zpos = _sparse_zero_pos(sp);
+  unsigned nbuckets = sp->ntail + (sp->zero > 0);
 
   struct rvar_bucket_t *ret = (struct rvar_bucket_t *)rvar_bucket_create(bucket_size);
-  ret->nbuckets = array_size(arr);
-  array_transfer_ownership(arr, (void**)&ret->buckets);
-  array_free(arr);
-  
+  ret->buckets = malloc(sizeof(struct bucket_t) * (nbuckets ? nbuckets : 1));
+  ret->nbuckets = 0;
+
+  /* The tail is sorted so the values that round to the same bucket are next
+   * to each other */
+  for (unsigned i = 0; i < zpos; ++i)
+    _buckets_append_merge(ret->buckets, &ret->nbuckets,
+        ROUND_TO_BUCKET(sp->tail[i].val, bucket_size), sp->tail[i].prob);
+  if (sp->zero > 0)
+    _buckets_append_merge(ret->buckets, &ret->nbuckets, 0, sp->zero);
+  for (unsigned i = zpos; i < sp->ntail; ++i)
+    _buckets_append_merge(ret->buckets, &ret->nbuckets,
+        ROUND_TO_BUCKET(sp->tail[i].val, bucket_size), sp->tail[i].prob);
+
+  return ret;
+}
+
+static struct rvar_t *
+_sparse_convolve(struct rvar_t const *left, struct rvar_t const *right, rvar_type_t bucket_size) {
+  struct rvar_sparse_t *tmp = 0;
+  struct rvar_sparse_t const *ll = (struct rvar_sparse_t const *)left;
+  struct rvar_sparse_t const *rr = (struct rvar_sparse_t const *)right;
+  if (right->_type != SPARSE)
+    rr = tmp = (struct rvar_sparse_t *)rvar_to_sparse(right, bucket_size);
+
+  unsigned nbuckets = ll->ntail + rr->ntail + ll->ntail * rr->ntail;
+  struct bucket_t *buckets = malloc(sizeof(struct bucket_t) * (nbuckets ? nbuckets : 1));
+  struct bucket_t *ptr = buckets;
+
+  /* Tail of the left side while the right side is zero */
+  for (unsigned i = 0; i < ll->ntail; ++i) {
+    ptr->val = ll->tail[i].val;
+    ptr->prob = ll->tail[i].prob * rr->zero;
+    ptr++;
+  }
+
+  /* Tail of the right side while the left side is zero */
+  for (unsigned j = 0; j < rr->ntail; ++j) {
+    ptr->val = rr->tail[j].val;
+    ptr->prob = rr->tail[j].prob * ll->zero;
+    ptr++;
+  }
+
+  /* Both tails */
+  for (unsigned i = 0; i < ll->ntail; ++i) {
+    for (unsigned j = 0; j < rr->ntail; ++j) {
+      ptr->val = ll->tail[i].val + rr->tail[j].val;
+      ptr->prob = ll->tail[i].prob * rr->tail[j].prob;
+      ptr++;
+    }
+  }
+
+  struct rvar_t *ret = _sparse_from_buckets(
+      ll->zero * rr->zero, buckets, nbuckets, bucket_size, 0);
+  free(buckets);
+
+  if (tmp)
+    tmp->free((struct rvar_t *)tmp);
+
+  return ret;
+}
+
+static struct rvar_t *
+_sparse_compose(struct rvar_t **rvars, double *dists, unsigned len) {
+  rvar_type_t bucket_size = INFINITY;
+  rvar_type_t scale_sum = 0;
+  unsigned nbuckets = 0;
+
+  struct bucket_t const **lists = malloc(sizeof(struct bucket_t *) * len);
+  unsigned *sizes = malloc(sizeof(unsigned) * len);
+  rvar_type_t *scales = malloc(sizeof(rvar_type_t) * len);
+
+  for (unsigned i = 0; i < len; ++i) {
+    struct rvar_sparse_t *sp = (struct rvar_sparse_t *)rvars[i];
+    nbuckets += sp->ntail;
+    lists[i] = sp->tail;
+    sizes[i] = sp->ntail;
+    bucket_size = MIN(bucket_size, sp->bucket_size);
+    scale_sum += dists[i];
+  }
+  scale_sum = 1/scale_sum;
+
+  rvar_type_t zero = 0;
+  for (unsigned i = 0; i < len; ++i) {
+    struct rvar_sparse_t *sp = (struct rvar_sparse_t *)rvars[i];
+    scales[i] = dists[i] * scale_sum;
+    zero += sp->zero * scales[i];
+  }
+
+  /* The tails are sorted, so merge them instead of sorting them */
+  struct bucket_t *buckets = malloc(sizeof(struct bucket_t) * (nbuckets ? nbuckets : 1));
+  nbuckets = _buckets_kway_merge(lists, sizes, scales, len, buckets);
+
+  struct rvar_t *ret = _sparse_from_buckets(zero, buckets, nbuckets, bucket_size, 1);
+  free(buckets);
+  free(scales);
+  free(sizes);
+  free(lists);
+  return ret;
+}
+
+static void
+_sparse_free(struct rvar_t *rs) {
+  struct rvar_sparse_t *sp = (struct rvar_sparse_t *)rs;
+  if (!sp) return;
+
+  free(sp->tail);
+  free(sp);
+}
+
+static struct rvar_t *
+_sparse_copy(struct rvar_t const *rs) {
+  struct rvar_sparse_t const *sp = (struct rvar_sparse_t const *)rs;
+  struct rvar_sparse_t *ret = _sparse_create(sp->bucket_size);
+  size_t size = sizeof(struct bucket_t) * sp->ntail;
+
+  ret->zero = sp->zero;
+  ret->ntail = sp->ntail;
+  ret->tail = malloc(size ? size : 1);
+  memcpy(ret->tail, sp->tail, size);
+  return (struct rvar_t *)ret;
+}
+
+static char *
+_sparse_serialize(struct rvar_t *rvar, size_t *size) {
+  struct rvar_sparse_t *sp = (struct rvar_sparse_t *)rvar;
+  *size = HEADER_SIZE
+    + sizeof(uint32_t) /* ntail */
+    + sizeof(rvar_type_t) /* bucket_size */
+    + sizeof(rvar_type_t) /* zero */
+    + sizeof(struct bucket_t) * sp->ntail;
+
+  char *buffer = malloc(*size);
+  char *ptr = _rvar_header(sp->_type, buffer);
+
+  *(uint32_t *)ptr = sp->ntail; ptr += sizeof(uint32_t);
+  *(rvar_type_t *)ptr = sp->bucket_size; ptr += sizeof(rvar_type_t);
+  *(rvar_type_t *)ptr = sp->zero; ptr += sizeof(rvar_type_t);
+  memcpy(ptr, sp->tail, sizeof(struct bucket_t) * sp->ntail);
+
+  return buffer;
+}
+
+static void
+_sparse_plot(struct rvar_t const *rs) {
+  struct rvar_bucket_t *rb = rs->to_bucket(rs, 1);
+  rb->plot((struct rvar_t *)rb);
+  rb->free((struct rvar_t *)rb);
+}
+
+static struct rvar_sparse_t *
+_sparse_create(rvar_type_t bucket_size) {
+  struct rvar_sparse_t *ret = malloc(sizeof(struct rvar_sparse_t));
+  memset(ret, 0, sizeof(struct rvar_sparse_t));
+  ret->bucket_size = bucket_size;
+
+  ret->_type = SPARSE;
+  ret->expected = _sparse_expected;
+  ret->percentile = _sparse_percentile;
+  ret->convolve = _sparse_convolve;
+  ret->to_bucket = _sparse_to_bucket;
+  ret->serialize = _sparse_serialize;
+  ret->free = _sparse_free;
+  ret->plot = _sparse_plot;
+  ret->copy = _sparse_copy;
+
+  return ret;
+}
+
+struct rvar_t *rvar_to_sparse(struct rvar_t const *rv, rvar_type_t bucket_size) {
+  if (rv->_type == SPARSE)
+    return rv->copy(rv);
+
+  struct rvar_bucket_t *tmp = 0;
+  struct rvar_bucket_t const *rb = (struct rvar_bucket_t const *)rv;
+  if (rv->_type != BUCKETED)
+    rb = tmp = rv->to_bucket(rv, bucket_size);
+
+  struct rvar_sparse_t *ret = _sparse_create(rb->bucket_size);
+  ret->tail = malloc(sizeof(struct bucket_t) * (rb->nbuckets ? rb->nbuckets : 1));
+  for (unsigned i = 0; i < rb->nbuckets; ++i) {
+    if (rb->buckets[i].val == 0) {
+      ret->zero += rb->buckets[i].prob;
+      continue;
+    }
+    ret->tail[ret->ntail++] = rb->buckets[i];
+  }
+
+  if (tmp)
+    tmp->free((struct rvar_t *)tmp);
+
   return (struct rvar_t *)ret;
 }
 
+rvar_type_t rvar_zero_mass(struct rvar_t const *rv) {
+  if (rv->_type == SPARSE)
+    return ((struct rvar_sparse_t const *)rv)->zero;
+
+  if (rv->_type == BUCKETED) {
+    struct rvar_bucket_t const *rb = (struct rvar_bucket_t const *)rv;
+    rvar_type_t mass = 0;
+    for (unsigned i = 0; i < rb->nbuckets; ++i) {
+      if (rb->buckets[i].val == 0)
+        mass += rb->buckets[i].prob;
+    }
+    return mass;
+  }
+
+  struct rvar_bucket_t *rb = rv->to_bucket(rv, 1);
+  rvar_type_t mass = rvar_zero_mass((struct rvar_t *)rb);
+  rb->free((struct rvar_t *)rb);
+  return mass;
+}
+
+struct rvar_t *_rvar_deserialize_sparse(char const *data) {
+  char const *ptr = data;
+
+  uint32_t ntail = *(uint32_t *)ptr; ptr += sizeof(uint32_t);
+  rvar_type_t bucket_size = *(rvar_type_t *)ptr; ptr += sizeof(rvar_type_t);
+
+  struct rvar_sparse_t *sp = _sparse_create(bucket_size);
+  sp->zero = *(rvar_type_t *)ptr; ptr += sizeof(rvar_type_t);
+  sp->ntail = ntail;
+
+  size_t size = sizeof(struct bucket_t) * ntail;
+  sp->tail = malloc(size ? size : 1);
+  memcpy(sp->tail, ptr, size);
+
+  return (struct rvar_t *)sp;
+}
@@ -218,6 +218,16 @@ static int config_handler(void *data,
     expr->traffic_training = strdup(value);
   } else if (MATCH("general", "mop-duration")) {
     expr->mop_duration = atoi(value);
+  } else if (MATCH("general", "threads")) {
+    expr->num_threads = strtoul(value, 0, 0);
+  } else if (MATCH("general", "numa")) {
+    expr->numa = atoi(value);
+  } else if (MATCH("general", "trace-cache")) {
+    expr->trace_cache_mb = strtoul(value, 0, 0);
+  } else if (MATCH("general", "trace-prefetch")) {
+    expr->trace_prefetch = strtoul(value, 0, 0);
+  } else if (MATCH("general", "trace-compress")) {
+    expr->trace_compress = strtoul(value, 0, 0);
   } else if (MATCH("predictor", "ewma-coeff")) {
     expr->ewma_coeff = atof(value);
   } else if (MATCH("predictor", "type")) {
@@ -248,6 +258,14 @@ static int config_handler(void *data,
     } else {
       panic("Invalid [pug]->backtrack_direction: %s", value);
     }
+  } else if (MATCH("pug", "sparse-zero-mass")) {
+    expr->pug_sparse_zero_mass = atof(value);
+  } else if (MATCH("pug", "max-buckets")) {
+    expr->pug_max_buckets = strtoul(value, 0, 0);
+  } else if (MATCH("pug", "adaptive-round")) {
+    expr->pug_adaptive_round = strtoul(value, 0, 0);
+  } else if (MATCH("pug", "adaptive-error")) {
+    expr->pug_adaptive_error = atof(value);
   } else if (MATCH("general", "network")) {
     info("Parsing jupiter config: %s", value);
     expr->network_string = strdup(value);
@@ -269,6 +287,8 @@ static int config_handler(void *data,
     expr->scenario.time_step = strtoul(value, 0, 0);
   } else if (MATCH("cache", "rv-cache-dir")) {
     expr->cache.rvar_directory = strdup(value);
+  } else if (MATCH("cache", "rv-cache-sketch")) {
+    expr->cache.rvar_sketch_k = strtoul(value, 0, 0);
   } else if (MATCH("cache", "ewma-cache-dir")) {
     expr->cache.ewma_directory = strdup(value);
   } else if (MATCH("cache", "perfect-cache-dir")) {
@@ -382,12 +402,22 @@ static void _jupiter_build_failure_model(struct expr_t *expr) {
 /* Set some sensible defaults for experiments */
 static void _expr_set_default_values(struct expr_t *expr) {
   expr->verbose = 0;
+  expr->num_threads = 0;
+  expr->numa = 0;
+  expr->trace_cache_mb = 0;
+  expr->trace_prefetch = 0;
+  expr->trace_compress = 0;
   expr->pug_is_backtrack = 1;
   expr->pug_backtrack_traffic_count = 10;
+  expr->pug_sparse_zero_mass = 0;
+  expr->pug_max_buckets = 0;
+  expr->pug_adaptive_round = 0;
+  expr->pug_adaptive_error = 0.05;
   expr->failure_max_concurrent = 0;
   expr->failure_switch_probability = 0;
   expr->failure_mode = 0;
   expr->failure_warm_cost = 0;
+  expr->cache.rvar_sketch_k = 0;
 }
 
 void config_parse(char const *ini_file, struct expr_t *expr, int argc, char *const *argv) {
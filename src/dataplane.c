@@ -2,49 +2,91 @@
 #include <stdlib.h>
 
 #include "algo/rvar.h"
+#include "util/affinity.h"
 #include "util/common.h"
 #include "util/log.h"
 #include "dataplane.h"
 
-#define SAFE_FREE(p) {\
-  if (p) { \
-    free((p));\
-  }\
-  (p) = 0;\
-}
+#define DATAPLANE_ALIGN 16
+#define DATAPLANE_MIN_BLOCK (64 * 1024)
 
-void dataplane_init(struct dataplane_t *plane) {
-  if (plane->links) {
-    struct link_t *link = plane->links;
-    for (uint32_t i = 0; i < plane->num_links; ++i) {
-      SAFE_FREE(link->flows);
-      link++;
-    }
-  }
-  SAFE_FREE(plane->flows);
-  SAFE_FREE(plane->links);
-  SAFE_FREE(plane->routing);
+static void _dataplane_reset(struct dataplane_t *plane) {
+  plane->flows = 0;
+  plane->links = 0;
+  plane->routing = 0;
   plane->smallest_flow = 0;
   plane->smallest_link = 0;
   plane->num_links = 0;
   plane->num_flows = 0;
 }
 
-void dataplane_free_resources(struct dataplane_t *plane) {
-  if (plane->links) {
-    struct link_t *link = plane->links;
-    for (uint32_t i = 0; i < plane->num_links; ++i) {
-      SAFE_FREE(link->flows);
-      link++;
+/* The blocks are allocated by the thread that uses the dataplane so with
+ * pinned workers they end up on the worker's NUMA node. */
+static struct dataplane_block_t *_dataplane_block(size_t size) {
+  struct dataplane_block_t *block = affinity_alloc_local(sizeof(struct dataplane_block_t) + size);
+  if (!block)
+    panic("Couldn't allocate %zu bytes for the dataplane.", size);
+  block->next = 0;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+void dataplane_init(struct dataplane_t *plane) {
+  _dataplane_reset(plane);
+
+  struct dataplane_block_t *block = plane->arena;
+  if (!block)
+    return;
+
+  /* If the last dataplane didn't fit in one block, replace the blocks with
+   * one big enough block so that we stop growing */
+  if (block->next) {
+    size_t size = 0;
+    while (block) {
+      struct dataplane_block_t *next = block->next;
+      size += block->size;
+      affinity_free(block, sizeof(struct dataplane_block_t) + block->size);
+      block = next;
     }
+    plane->arena = _dataplane_block(size);
+    return;
   }
-  SAFE_FREE(plane->flows);
-  SAFE_FREE(plane->links);
-  SAFE_FREE(plane->routing);
-  plane->smallest_flow = 0;
-  plane->smallest_link = 0;
-  plane->num_links = 0;
-  plane->num_flows = 0;
+
+  block->used = 0;
+}
+
+void dataplane_free_resources(struct dataplane_t *plane) {
+  _dataplane_reset(plane);
+
+  struct dataplane_block_t *block = plane->arena;
+  while (block) {
+    struct dataplane_block_t *next = block->next;
+    affinity_free(block, sizeof(struct dataplane_block_t) + block->size);
+    block = next;
+  }
+  plane->arena = 0;
+}
+
+void *dataplane_alloc(struct dataplane_t *plane, size_t size) {
+  size = (size + DATAPLANE_ALIGN - 1) & ~(size_t)(DATAPLANE_ALIGN - 1);
+
+  /* New blocks are added to the front, the older blocks are never touched
+   * again so that the pointers we handed out stay valid */
+  struct dataplane_block_t *block = plane->arena;
+  if (!block || block->size - block->used < size) {
+    size_t bsize = MAX(size, DATAPLANE_MIN_BLOCK);
+    if (block)
+      bsize = MAX(bsize, block->size * 2);
+
+    struct dataplane_block_t *nblock = _dataplane_block(bsize);
+    nblock->next = block;
+    plane->arena = block = nblock;
+  }
+
+  void *ret = block->data + block->used;
+  block->used += size;
+  return ret;
 }
 
 rvar_type_t dataplane_mlu(struct dataplane_t const *dp) {
@@ -7,12 +7,14 @@
 #include "algo/array.h"
 #include "algo/maxmin.h"
 #include "config.h"
-#include "freelist.h"
 #include "network.h"
 #include "predictors/rotating_ewma.h"
 #include "predictors/perfect.h"
+#include "rollup.h"
 #include "util/common.h"
 #include "util/monte_carlo.h"
+#include "util/pool.h"
+#include "util/queue.h"
 
 #include "exec.h"
 
@@ -20,7 +22,7 @@ struct _rvar_cache_builder_parallel {
   struct traffic_matrix_t **tms;
   uint32_t index;
   struct expr_t const *expr;
-  struct freelist_repo_t *network_freelist;
+  struct exec_t *exec;
   pthread_mutex_t *lock;
 };
 
@@ -136,6 +138,13 @@ exec_rvar_cache_load(struct expr_t const *expr, unsigned *count) {
     rvar_type_t *vals = 0;
     unsigned nvals = array_transfer_ownership(arr[i], (void**)&vals);
     free(arr[i]);
+
+    if (expr->cache.rvar_sketch_k) {
+      ret[i] = rvar_sketch_from_vals(vals, nvals, expr->cache.rvar_sketch_k);
+      free(vals);
+      continue;
+    }
+
     ret[i] = rvar_sample_create_with_vals(vals, nvals);
   }
 
@@ -143,60 +152,174 @@ exec_rvar_cache_load(struct expr_t const *expr, unsigned *count) {
   return ret;
 }
 
-struct _network_dp_t {
-  struct dataplane_t dp;
-  struct network_t *net;
-};
+struct exec_net_dp_t *exec_worker_net_dp(struct exec_t *exec) {
+  unsigned id = pool_worker_id();
+  if (id >= exec->nnet_dp - 1)
+    id = exec->nnet_dp - 1;
+  return &exec->net_dp[id];
+}
 
-static rvar_type_t _sim_network_for_trace_parallel(void *data) {
+/* Collects all the exec_simulate_multi metrics from one max-min solve */
+static void _sim_network_multi(void *data, rvar_type_t **vals, unsigned nvars) {
   struct _rvar_cache_builder_parallel* builder = (struct _rvar_cache_builder_parallel*)data;
-  struct traffic_matrix_t *tm = 0;
+  struct expr_t const *expr = builder->expr;
+  struct traffic_matrix_t *tm = builder->tms[builder->index];
+  float promised = expr->promised_throughput;
+  if (promised == 0)
+    promised = INFINITY;
+
+  for (uint32_t j = SIM_POD_THROUGHPUT; j < nvars; ++j) {
+    *vals[j] = 0;
+  }
 
-  // Get the next traffic matrix
-  tm = builder->tms[builder->index];
+  struct exec_net_dp_t *np = exec_worker_net_dp(builder->exec);
+  np->net->set_traffic(np->net, tm);
+  np->net->get_dataplane(np->net, &np->dp);
+
+  maxmin(&np->dp);
+
+  /* One pass over the flows for the violations and the pod throughputs */
+  int violations = 0, promised_violations = 0;
+  struct dataplane_t const *dp = &np->dp;
+  for (pair_id_t f = 0; f < dp->num_flows; ++f) {
+    struct flow_t const *flow = &dp->flows[f];
+    if (flow->bw < flow->demand) {
+      violations += 1;
+      if (flow->bw < promised)
+        promised_violations += 1;
+    }
 
-  int violations = 0;
-  {
-    // Simulate the network
-    struct _network_dp_t *np = freelist_get(builder->network_freelist);
-    np->net->set_traffic(np->net, tm);
+    uint32_t pod = flow->stor / expr->num_tors_per_pod;
+    if (SIM_POD_THROUGHPUT + pod < nvars)
+      *vals[SIM_POD_THROUGHPUT + pod] += flow->bw;
+  }
+
+  *vals[SIM_VIOLATIONS] = (rvar_type_t)violations/(rvar_type_t)(tm->num_pairs);
+  *vals[SIM_PROMISED_VIOLATIONS] = (rvar_type_t)promised_violations/(rvar_type_t)(tm->num_pairs);
+  *vals[SIM_MLU] = dataplane_mlu(dp);
+
+}
+
+/* Simulates mop_duration consecutive traffic matrices and returns their total
+ * violation cost */
+static rvar_type_t _sim_cost(struct expr_t const *expr,
+    struct exec_net_dp_t *np, struct traffic_matrix_t **tms) {
+  struct risk_cost_func_t *func = expr->risk_violation_cost;
+
+  rvar_type_t cost = 0;
+  for (uint32_t i = 0; i < expr->mop_duration; ++i) {
+    np->net->set_traffic(np->net, tms[i]);
     np->net->get_dataplane(np->net, &np->dp);
 
     maxmin(&np->dp);
 
-    violations = dataplane_count_violations(&np->dp, builder->expr->promised_throughput);
-    freelist_return(builder->network_freelist, np);
+    int violations = dataplane_count_violations(&np->dp, expr->promised_throughput);
+    cost += func->cost(func, (rvar_type_t)violations/(rvar_type_t)(tms[i]->num_pairs));
   }
 
-  // Count the violations
-  rvar_type_t percentage = (rvar_type_t)violations/(rvar_type_t)(tm->num_pairs);
+  return cost;
+}
+
+/* Switch the mop applied on the worker's network to mop */
+static void _exec_net_dp_apply_mop(struct exec_net_dp_t *np, struct mop_t *mop) {
+  if (np->mop == mop)
+    return;
+
+  if (np->mop)
+    np->mop->post(np->mop, np->net);
+  if (mop)
+    mop->pre(mop, np->net);
+  np->mop = mop;
+}
 
-  return percentage;
+static void _exec_stream_revert_worker(void *data) {
+  _exec_net_dp_apply_mop(exec_worker_net_dp((struct exec_t *)data), 0);
 }
 
+/* Samples in flight per worker in exec_simulate_stream */
+#define EXEC_STREAM_SLOTS_PER_WORKER 2
 
-static rvar_type_t _sim_network_for_mlu(void *data) {
-  struct _rvar_cache_builder_parallel* builder = (struct _rvar_cache_builder_parallel*)data;
-  struct traffic_matrix_t *tm = 0;
+/* A predicted sample (mop_duration traffic matrices) in exec_simulate_stream */
+struct _exec_stream_slot_t {
+  struct traffic_matrix_t **tms;
+  uint32_t index;
+};
 
-  // Get the next traffic matrix
-  tm = builder->tms[builder->index];
+struct _exec_stream_t {
+  struct exec_t *exec;
+  struct expr_t const *expr;
+  struct mop_t **mops;
+  uint32_t nmops;
 
-  rvar_type_t mlu = 0;
-  {
-    // Simulate the network
-    struct _network_dp_t *np = freelist_get(builder->network_freelist);
-    np->net->set_traffic(np->net, tm);
-    np->net->get_dataplane(np->net, &np->dp);
+  struct queue_t *ready;  /* Predicted samples waiting to be simulated */
+  struct queue_t *empty;  /* Slots whose buffers can be reused */
 
-    maxmin(&np->dp);
+  rvar_type_t **ret;
+};
+
+/* Consumer: simulates the samples under every mop as they arrive */
+static void _exec_stream_worker(void *data) {
+  struct _exec_stream_t *stream = (struct _exec_stream_t *)data;
+  struct exec_net_dp_t *np = exec_worker_net_dp(stream->exec);
+  struct _exec_stream_slot_t *slot = 0;
 
-    mlu = dataplane_mlu(&np->dp);
-    freelist_return(builder->network_freelist, np);
+  while (queue_pop(stream->ready, (void **)&slot)) {
+    for (uint32_t m = 0; m < stream->nmops; ++m) {
+      _exec_net_dp_apply_mop(np, stream->mops[m]);
+      stream->ret[m][slot->index] = _sim_cost(stream->expr, np, slot->tms);
+    }
+    queue_push(stream->empty, slot);
   }
+}
+
+struct pool_t *exec_pool(struct exec_t *exec, struct expr_t const *expr) {
+  if (!exec->pool) {
+    exec->pool = pool_create(expr->num_threads);
+    info("Created a pool of %u simulation threads.", pool_size(exec->pool));
 
-  // Count the violations
-  return mlu;
+    /* Pin before the workers build their networks and dataplanes so that
+     * their memory is allocated on their own node */
+    if (expr->numa)
+      pool_pin(exec->pool);
+  }
+  return exec->pool;
+}
+
+static void
+_exec_net_dp_free(struct exec_t *exec) {
+  for (uint32_t i = 0; i < exec->nnet_dp; ++i) {
+    struct exec_net_dp_t *network = &exec->net_dp[i];
+    dataplane_free_resources(&network->dp);
+    network->net->free(network->net);
+  }
+  free(exec->net_dp);
+  exec->net_dp = 0;
+  exec->nnet_dp = 0;
+}
+
+void exec_free(struct exec_t *exec) {
+  if (exec->release)
+    exec->release(exec);
+
+  _exec_net_dp_free(exec);
+  if (exec->pool)
+    pool_free(exec->pool);
+  exec->pool = 0;
+
+  free(exec);
+}
+
+struct _exec_net_dp_init_t {
+  struct exec_t *exec;
+  struct expr_t const *expr;
+};
+
+static void _exec_net_dp_init_worker(void *data) {
+  struct _exec_net_dp_init_t *init = (struct _exec_net_dp_init_t *)data;
+  struct exec_net_dp_t *np = exec_worker_net_dp(init->exec);
+  np->net = init->expr->clone_network(init->expr);
+  np->mop = 0;
+  memset(&np->dp, 0, sizeof(struct dataplane_t));
 }
 
 static void
@@ -204,141 +327,209 @@ _exec_net_dp_create(
     struct exec_t *exec,
     struct expr_t const *expr) {
 
-  unsigned nthreads = get_ncores() - 1;
-  exec->net_dp = freelist_create(nthreads);
-  struct _network_dp_t *networks = malloc(sizeof(struct _network_dp_t) * nthreads);
+  /* One network per worker (and one for the main thread) so that the workers
+   * never wait for a network.  The workers build their own network so the
+   * memory is local to the worker. */
+  struct pool_t *pool = exec_pool(exec, expr);
+  unsigned nnetworks = pool_size(pool) + 1;
+  exec->net_dp = malloc(sizeof(struct exec_net_dp_t) * nnetworks);
+  exec->nnet_dp = nnetworks;
+
+  struct _exec_net_dp_init_t init = {exec, expr};
+  pool_broadcast(pool, _exec_net_dp_init_worker, &init);
+  _exec_net_dp_init_worker(&init);
+}
 
-  for (uint32_t i = 0; i < nthreads; ++i) {
-    networks[i].net = expr->clone_network(expr);
-    memset(&networks[i].dp, 0, sizeof(struct dataplane_t));
-    freelist_return(exec->net_dp, &networks[i]);
-  }
+struct _exec_mop_apply_t {
+  struct exec_t *exec;
+  struct mop_t *mop;
+};
+
+static void _exec_mop_pre_worker(void *data) {
+  struct _exec_mop_apply_t *apply = (struct _exec_mop_apply_t *)data;
+  apply->mop->pre(apply->mop, exec_worker_net_dp(apply->exec)->net);
 }
 
-static void __attribute__((unused))
-_exec_net_dp_free(
-    struct exec_t *exec,
-    struct expr_t *expr) {
-  uint32_t nthreads = exec->net_dp->size;
-  for (uint32_t i = 0; i < nthreads; ++i) {
-    struct _network_dp_t *network = freelist_get(exec->net_dp);
-    network->net->free(network->net);
-  }
+static void _exec_mop_post_worker(void *data) {
+  struct _exec_mop_apply_t *apply = (struct _exec_mop_apply_t *)data;
+  apply->mop->post(apply->mop, exec_worker_net_dp(apply->exec)->net);
 }
 
-rvar_type_t *
-exec_simulate_ordered(
+void exec_mop_pre(struct exec_t *exec, struct expr_t const *expr, struct mop_t *mop) {
+  if (!exec->net_dp)
+    _exec_net_dp_create(exec, expr);
+
+  struct _exec_mop_apply_t apply = {exec, mop};
+  pool_broadcast(exec->pool, _exec_mop_pre_worker, &apply);
+}
+
+void exec_mop_post(struct exec_t *exec, struct expr_t const *expr, struct mop_t *mop) {
+  if (!exec->net_dp)
+    _exec_net_dp_create(exec, expr);
+
+  struct _exec_mop_apply_t apply = {exec, mop};
+  pool_broadcast(exec->pool, _exec_mop_post_worker, &apply);
+}
+
+rvar_type_t **
+exec_simulate_multi(
     struct exec_t *exec,
     struct expr_t const *expr,
     struct mop_t *mop,
     struct traffic_matrix_t **tms,
-    uint32_t trace_length) {
-  pthread_mutex_t mut;
-  if (pthread_mutex_init(&mut, 0) != 0)
-    panic("Couldn't initiate the mutex: %p", &mut);
-
+    uint32_t trace_length,
+    uint32_t *ret_nvars) {
   if (!exec->net_dp)
     _exec_net_dp_create(exec, expr);
 
-  uint32_t nthreads = freelist_size(exec->net_dp);
-  struct freelist_repo_t *repo = exec->net_dp;
-  struct _network_dp_t **networks = malloc(sizeof(struct _network_dp_t *) * nthreads);
-
-  /* Build a list of available networks */
-  for (uint32_t i = 0; i < nthreads; ++i) { 
-    networks[i] = freelist_get(repo);
-  }
-
-  for (uint32_t i = 0; i < nthreads; ++i) { 
-    freelist_return(repo, networks[i]);
-  }
-
   /* Apply the mop on the network */
-  for (uint32_t j = 0; j < nthreads; ++j) {
-    mop->pre(mop, networks[j]->net);
-  }
-
+  if (mop)
+    exec_mop_pre(exec, expr, mop);
 
   /* Fill out the data structure for parallel execution */
   struct _rvar_cache_builder_parallel *data = 
     malloc(sizeof(struct _rvar_cache_builder_parallel) * trace_length);
 
   for (uint32_t j = 0; j < trace_length; ++j ){
-    data[j].lock = &mut;
+    data[j].lock = 0;
     data[j].tms = tms;
     data[j].index = j;
-    data[j].network_freelist = repo;
+    data[j].exec = exec;
     data[j].expr = expr;
   }
 
-  rvar_type_t *vals = monte_carlo_parallel_ordered_rvar(
-      _sim_network_for_trace_parallel, 
+  uint32_t nvars = SIM_POD_THROUGHPUT + expr->num_pods;
+  rvar_type_t **vals = monte_carlo_parallel_ordered_multi_rvar(
+      _sim_network_multi, 
       data, trace_length,
-      sizeof(struct _rvar_cache_builder_parallel), 0);
+      sizeof(struct _rvar_cache_builder_parallel), nvars, exec_pool(exec, expr));
 
-  for (uint32_t j = 0; j < nthreads; ++j) {
-    mop->post(mop, networks[j]->net);
-  }
+  if (mop)
+    exec_mop_post(exec, expr, mop);
 
-  // Free the dataplane resources used during simulation
-  for (uint32_t i = 0; i < nthreads; ++i) {
-    dataplane_free_resources(&networks[i]->dp);
-  }
+  free(data);
 
-  free(networks);
+  if (ret_nvars)
+    *ret_nvars = nvars;
   return vals;
 }
 
+/* Returns the metric'th output of exec_simulate_multi and frees the rest */
+static rvar_type_t *
+_exec_simulate_metric(
+    struct exec_t *exec,
+    struct expr_t const *expr,
+    struct mop_t *mop,
+    struct traffic_matrix_t **tms,
+    uint32_t trace_length,
+    enum EXEC_SIM_METRIC metric) {
+  uint32_t nvars = 0;
+  rvar_type_t **vals = exec_simulate_multi(exec, expr, mop, tms, trace_length, &nvars);
+  rvar_type_t *ret = vals[metric];
+  for (uint32_t i = 0; i < nvars; ++i) {
+    if (i != metric)
+      free(vals[i]);
+  }
+  free(vals);
+  return ret;
+}
+
+rvar_type_t *
+exec_simulate_ordered(
+    struct exec_t *exec,
+    struct expr_t const *expr,
+    struct mop_t *mop,
+    struct traffic_matrix_t **tms,
+    uint32_t trace_length) {
+  return _exec_simulate_metric(exec, expr, mop, tms, trace_length, SIM_PROMISED_VIOLATIONS);
+}
+
 rvar_type_t *
 exec_simulate_mlu(
     struct exec_t *exec,
     struct expr_t const *expr,
     struct traffic_matrix_t **tms,
     uint32_t trace_length) {
-  pthread_mutex_t mut;
-  if (pthread_mutex_init(&mut, 0) != 0)
-    panic("Couldn't initiate the mutex: %p", &mut);
+  return _exec_simulate_metric(exec, expr, 0, tms, trace_length, SIM_MLU);
+}
 
+rvar_type_t **
+exec_simulate_stream(
+    struct exec_t *exec,
+    struct expr_t const *expr,
+    struct mop_t **mops,
+    uint32_t nmops,
+    struct predictor_iterator_t *iter,
+    uint32_t nsamples) {
   if (!exec->net_dp)
     _exec_net_dp_create(exec, expr);
 
-  uint32_t nthreads = freelist_size(exec->net_dp);
-  struct freelist_repo_t *repo = exec->net_dp;
-  struct _network_dp_t **networks = malloc(sizeof(struct _network_dp_t *) * nthreads);
+  struct pool_t *pool = exec_pool(exec, expr);
+  unsigned nworkers = pool_size(pool);
+  unsigned nslots = nworkers * EXEC_STREAM_SLOTS_PER_WORKER;
+
+  struct _exec_stream_t stream = {
+    .exec = exec, .expr = expr, .mops = mops, .nmops = nmops,
+    .ready = queue_create(nslots), .empty = queue_create(nslots),
+  };
 
-  /* Build a list of available networks */
-  for (uint32_t i = 0; i < nthreads; ++i) { 
-    networks[i] = freelist_get(repo);
+  stream.ret = malloc(sizeof(rvar_type_t *) * nmops);
+  for (uint32_t m = 0; m < nmops; ++m) {
+    stream.ret[m] = malloc(sizeof(rvar_type_t) * (nsamples ? nsamples : 1));
   }
 
-  for (uint32_t i = 0; i < nthreads; ++i) { 
-    freelist_return(repo, networks[i]);
+  size_t tms_size = sizeof(struct traffic_matrix_t *) * (size_t)expr->mop_duration;
+  struct _exec_stream_slot_t *slots = malloc(sizeof(struct _exec_stream_slot_t) * nslots);
+  for (uint32_t i = 0; i < nslots; ++i) {
+    slots[i].tms = malloc(tms_size);
+    memset(slots[i].tms, 0, tms_size);
+    queue_push(stream.empty, &slots[i]);
   }
 
-  /* Fill out the data structure for parallel execution */
-  struct _rvar_cache_builder_parallel *data = 
-    malloc(sizeof(struct _rvar_cache_builder_parallel) * trace_length);
+  /* The consumers block on the queue, which is fine as we (the producer) are
+   * not a worker of the pool */
+  struct pool_future_t future;
+  pool_future_init(&future);
+  for (uint32_t i = 0; i < nworkers; ++i) {
+    pool_submit(pool, &future, _exec_stream_worker, &stream);
+  }
 
-  for (uint32_t j = 0; j < trace_length; ++j ){
-    data[j].lock = &mut;
-    data[j].tms = tms;
-    data[j].index = j;
-    data[j].network_freelist = repo;
-    data[j].expr = expr;
+  for (uint32_t s = 0; s < nsamples; ++s) {
+    if (iter->end(iter))
+      panic("Predictor ran out of samples after %u samples.", s);
+
+    struct _exec_stream_slot_t *slot = 0;
+    queue_pop(stream.empty, (void **)&slot);
+
+    unsigned ntms = iter->cur_into(iter, slot->tms);
+    if (ntms != expr->mop_duration)
+      panic("Predictor returned %u traffic matrices, expected %u.",
+          ntms, (unsigned)expr->mop_duration);
+
+    slot->index = s;
+    queue_push(stream.ready, slot);
+    iter->next(iter);
   }
 
-  rvar_type_t *vals = monte_carlo_parallel_ordered_rvar(
-      _sim_network_for_mlu, 
-      data, trace_length,
-      sizeof(struct _rvar_cache_builder_parallel), 0);
+  queue_close(stream.ready);
+  pool_future_wait(&future);
+  pool_future_destroy(&future);
 
-  // Free the dataplane resources used during simulation
-  for (uint32_t i = 0; i < nthreads; ++i) {
-    dataplane_free_resources(&networks[i]->dp);
+  /* Leave the networks as we found them */
+  pool_broadcast(pool, _exec_stream_revert_worker, exec);
+
+  for (uint32_t i = 0; i < nslots; ++i) {
+    for (uint32_t j = 0; j < expr->mop_duration; ++j) {
+      if (slots[i].tms[j])
+        traffic_matrix_free(slots[i].tms[j]);
+    }
+    free(slots[i].tms);
   }
+  free(slots);
+  queue_free(stream.ready);
+  queue_free(stream.empty);
 
-  free(networks);
-  return vals;
+  return stream.ret;
 }
 
 struct rvar_t *
@@ -352,6 +543,21 @@ exec_simulate(
   return rvar_sample_create_with_vals(vals, trace_length);
 }
 
+/* A view of the TM if the trace has one (mapped raw TMs), a copy otherwise.
+ * Returns whether tm is a copy that _exec_iter_put should free. */
+static int _exec_iter_get(
+    struct traffic_matrix_trace_iter_t *iter, struct traffic_matrix_t **tm) {
+  if ((*tm = iter->get_nocopy(iter)))
+    return 0;
+  iter->get(iter, tm);
+  return 1;
+}
+
+static void _exec_iter_put(struct traffic_matrix_t *tm, int owned) {
+  if (owned)
+    traffic_matrix_free(tm);
+}
+
 risk_cost_t exec_plan_cost(
     struct exec_t *exec,
     struct expr_t const *expr, struct mop_t **mops,
@@ -359,7 +565,7 @@ risk_cost_t exec_plan_cost(
   if (!exec->net_dp)
     _exec_net_dp_create(exec, expr);
 
-  struct _network_dp_t *net_dp = freelist_get(exec->net_dp);
+  struct exec_net_dp_t *net_dp = exec_worker_net_dp(exec);
   struct network_t *net = net_dp->net;
   struct dataplane_t *dp = &net_dp->dp;
   risk_cost_t cost = 0;
@@ -371,6 +577,7 @@ risk_cost_t exec_plan_cost(
   iter->go_to(iter, start + 1);
 
   struct traffic_matrix_t *tm = 0;
+  int owned = 0;
   uint32_t num_tors = expr->num_pods * expr->num_tors_per_pod;
   uint32_t num_tor_pairs = num_tors * num_tors;
 
@@ -381,7 +588,7 @@ risk_cost_t exec_plan_cost(
     bw_t subplan_cost = 0;
 
     for (uint32_t step = 0; step < expr->mop_duration; ++step) {
-      iter->get(iter, &tm);
+      owned = _exec_iter_get(iter, &tm);
 
       if (!tm)
         panic("Traffic matrix is nil.  Possibly reached the end of the trace: %d", step);
@@ -395,10 +602,9 @@ risk_cost_t exec_plan_cost(
       violations = dataplane_count_violations(dp, 0);
       subplan_cost += expr->risk_violation_cost->cost( expr->risk_violation_cost,
           ((rvar_type_t)violations/(rvar_type_t)(num_tor_pairs)));
-      dataplane_free_resources(dp);
 
       iter->next(iter);
-      traffic_matrix_free(tm);
+      _exec_iter_put(tm, owned);
     }
 
     info("%d(th) subplan (%d switches) cost is: %f", 
@@ -410,7 +616,7 @@ risk_cost_t exec_plan_cost(
 
   // Include the rest of the idol time as part of the cost of the mop
   for (uint32_t i = running_time; i < expr->criteria_time->steps; ++i) {
-      iter->get(iter, &tm);
+      owned = _exec_iter_get(iter, &tm);
       if (!tm)
         panic("Traffic matrix is nil.  Possibly reached the end of the trace: %d", i);
 
@@ -423,13 +629,11 @@ risk_cost_t exec_plan_cost(
       violations = dataplane_count_violations(dp, 0);
       cost += expr->risk_violation_cost->cost( expr->risk_violation_cost,
           ((rvar_type_t)violations/(rvar_type_t)(num_tor_pairs)));
-      dataplane_free_resources(dp);
 
       iter->next(iter);
-      traffic_matrix_free(tm);
+      _exec_iter_put(tm, owned);
   }
 
-  freelist_return(exec->net_dp, net_dp);
 
   // Include the number of mops as time cost criteria
   risk_cost_t time_cost = expr->criteria_time->cost(expr->criteria_time, nmops);
@@ -447,6 +651,73 @@ risk_cost_t exec_plan_cost(
   (x).mean /= (y); \
 }\
 
+/* Fills the stats of the pods and the core from the pod rollup of the trace
+ * that iter walks, and moves iter past the window.  Returns the number of TMs
+ * in the window. */
+static uint32_t _exec_traffic_stats_rollup(
+    struct expr_t const *expr,
+    struct traffic_matrix_trace_iter_t *iter,
+    uint32_t ntms,
+    struct traffic_stats_t *pods,
+    struct traffic_stats_t *core) {
+  uint32_t num_pods = expr->num_pods;
+  uint32_t num_tors = num_pods * expr->num_tors_per_pod;
+
+  /* The simulations lay the ToRs out pod by pod, so the stats should too.
+   * The pod mapping recorded in the trace (e.g., from key.tsv) is only used
+   * if it agrees with that. */
+  struct traffic_matrix_trace_meta_t const *meta = &iter->trace->meta;
+  uint32_t *pod_of_tor = 0;
+  if (meta->pod_of_tor && meta->num_pods == num_pods && meta->num_tors == num_tors) {
+    pod_of_tor = meta->pod_of_tor;
+    for (uint32_t i = 0; i < num_tors; ++i) {
+      if (pod_of_tor[i] == i / expr->num_tors_per_pod)
+        continue;
+      warn("The trace puts ToR %u in pod %u but the network has it in pod %u, "
+          "using the network's pods.", i, pod_of_tor[i], i / expr->num_tors_per_pod);
+      pod_of_tor = 0;
+      break;
+    }
+  }
+
+  if (!pod_of_tor) {
+    pod_of_tor = malloc(sizeof(uint32_t) * MAX(num_tors, 1));
+    for (uint32_t i = 0; i < num_tors; ++i)
+      pod_of_tor[i] = i / expr->num_tors_per_pod;
+  }
+
+  struct trace_rollup_t *rollup = trace_rollup_cached(
+      iter->trace, num_tors, num_pods, pod_of_tor);
+  if (pod_of_tor != meta->pod_of_tor)
+    free(pod_of_tor);
+
+  // Same window as walking the iterator: [state, _end)
+  uint32_t start = iter->state;
+  uint32_t count = MIN(ntms, iter->_end - start);
+
+  struct trace_rollup_stats_t *stats = malloc(
+      sizeof(struct trace_rollup_stats_t) * TRACE_ROLLUP_COLS(num_pods));
+  trace_rollup_window(rollup, start, count, stats);
+
+#define FROM_ROLLUP(x, s) { \
+  (x).min  = (bw_t)(s).min; \
+  (x).max  = (bw_t)(s).max; \
+  (x).mean = (bw_t)(s).mean; \
+}
+  for (uint32_t i = 0; i < num_pods; ++i) {
+    FROM_ROLLUP(pods[i].out, stats[TRACE_ROLLUP_OUT(i)]);
+    FROM_ROLLUP(pods[i].in, stats[TRACE_ROLLUP_IN(num_pods, i)]);
+  }
+  FROM_ROLLUP(core->out, stats[TRACE_ROLLUP_CORE(num_pods)]);
+  FROM_ROLLUP(core->in, stats[TRACE_ROLLUP_CORE(num_pods)]);
+#undef FROM_ROLLUP
+
+  free(stats);
+
+  iter->state = start + count;
+  return count;
+}
+
 void exec_traffic_stats(
     struct exec_t const *exec,
     struct expr_t const *expr,
@@ -473,9 +744,20 @@ void exec_traffic_stats(
   core->in.min = INFINITY;
   core->out.min = INFINITY;
 
+  // Traces have a pod rollup: no need to go through every ToR pair
+  if (iter->trace && !iter->end(iter) && ntms > 0) {
+    tidx = _exec_traffic_stats_rollup(expr, iter, ntms, pods, core);
+
+    *ret_pod_stats = pods;
+    *ret_npods = expr->num_pods;
+    *ret_core_stats = core;
+    return;
+  }
+
   while (!iter->end(iter) && tidx < ntms) {
     iter->get(iter, &tm);
     iter->next(iter);
+    assert(tm->num_pairs == num_tors * num_tors);
 
     for (uint32_t sp = 0; sp < expr->num_pods; ++sp) {
       spod = &pods[sp];
@@ -507,6 +789,7 @@ void exec_traffic_stats(
 
     STATS(core->in);
     STATS(core->out);
+    traffic_matrix_free(tm);
     tidx++;
   }
 
@@ -519,8 +802,6 @@ void exec_traffic_stats(
   FIX_AVG(core->out, tidx);
   FIX_AVG(core->in, tidx);
 
-  assert(tm->num_pairs == num_tors * num_tors);
-
   *ret_pod_stats = pods;
   *ret_npods = expr->num_pods;
   *ret_core_stats = core;
@@ -1,5 +1,4 @@
 #include <assert.h>
-#include <pthread.h>
 #include <stdlib.h>
 
 #include "algo/array.h"
@@ -7,10 +6,10 @@
 #include "config.h"
 #include "dataplane.h"
 #include "network.h"
-#include "freelist.h"
 #include "plan.h"
 #include "util/common.h"
 #include "util/monte_carlo.h"
+#include "util/pool.h"
 
 #include "exec/longterm.h"
 
@@ -22,53 +21,50 @@ struct _rvar_cache_builder_parallel {
   struct traffic_matrix_trace_t *trace;
   uint32_t index;
   struct expr_t const *expr;
-  struct freelist_repo_t *network_freelist;
-  pthread_mutex_t *lock;
-};
-
-struct _network_dp_t {
-  struct dataplane_t dp;
-  struct network_t *net;
+  struct exec_t *exec;
 };
 
 static rvar_type_t _sim_network_for_trace_parallel(void *data) {
   struct _rvar_cache_builder_parallel* builder = (struct _rvar_cache_builder_parallel*)data;
-  struct traffic_matrix_t *tm = 0;
+  struct traffic_matrix_t *copy = 0;
+  struct traffic_matrix_t const *tm = 0;
   trace_time_t time = 0;
 
   {
-    // Get the next traffic matrix
-    pthread_mutex_lock(builder->lock);
-
+    // Get the next traffic matrix: a view if the trace is mapped, otherwise a
+    // copy that we own.  Trace reads are thread-safe.
     traffic_matrix_trace_get_nth_key(builder->trace, builder->index, &time);
-    traffic_matrix_trace_get(builder->trace, time, &tm);
-    pthread_mutex_unlock(builder->lock);
+    tm = traffic_matrix_trace_get_nocopy(builder->trace, time);
+    if (!tm) {
+      traffic_matrix_trace_get(builder->trace, time, &copy);
+      tm = copy;
+    }
   }
 
   int violations = 0;
   {
     // Simulate the network
-    struct _network_dp_t *np = freelist_get(builder->network_freelist);
+    struct exec_net_dp_t *np = exec_worker_net_dp(builder->exec);
     np->net->set_traffic(np->net, tm);
     np->net->get_dataplane(np->net, &np->dp);
 
     maxmin(&np->dp);
 
     violations = dataplane_count_violations(&np->dp, builder->expr->promised_throughput);
-    freelist_return(builder->network_freelist, np);
   }
 
   // Count the violations
   rvar_type_t percentage = (rvar_type_t)violations/(rvar_type_t)(tm->num_pairs);
 
   // And free the traffic matrix
-  traffic_matrix_free(tm);
+  if (copy)
+    traffic_matrix_free(copy);
 
   return percentage;
 }
 
 
-static void _build_rvar_cache_parallel(struct expr_t const *expr) {
+static void _build_rvar_cache_parallel(struct exec_t *exec, struct expr_t const *expr) {
   struct jupiter_switch_plan_enumerator_t *en = 
     jupiter_switch_plan_enumerator_create(
         expr->upgrade_list.num_switches,
@@ -79,23 +75,12 @@ static void _build_rvar_cache_parallel(struct expr_t const *expr) {
   struct traffic_matrix_trace_t *trace = traffic_matrix_trace_load(400, expr->traffic_test);
   struct plan_iterator_t *iter = en->iter((struct plan_t *)en);
   unsigned subplan_count = (unsigned)iter->subplan_count(iter);
-  pthread_mutex_t mut;
-
-  if (pthread_mutex_init(&mut, 0) != 0)
-    panic_txt("Couldn't initiate the mutex.");
 
   uint32_t trace_length = trace->num_indices;
-  uint32_t nthreads = get_ncores() - 1;
-  struct freelist_repo_t *repo = freelist_create(nthreads);
-  struct _network_dp_t *networks = malloc(sizeof(struct _network_dp_t) * nthreads);
+  traffic_matrix_trace_advise(trace, TRACE_ACCESS_SEQUENTIAL);
+  struct pool_t *pool = exec_pool(exec, expr);
   char path[PATH_MAX] = {0};
 
-  for (uint32_t i = 0; i < nthreads; ++i) {
-    networks[i].net = expr->clone_network(expr);
-    memset(&networks[i].dp, 0, sizeof(struct dataplane_t));
-    freelist_return(repo, &networks[i]);
-  }
-
   /* Get the range of subplans we are going through */
   // unsigned subplan_start = MIN(subplan_count-1, expr->cache.subplan_start);
   //unsigned subplan_end = MIN(subplan_count-1, expr->cache.subplan_end);
@@ -111,26 +96,22 @@ static void _build_rvar_cache_parallel(struct expr_t const *expr) {
     struct _rvar_cache_builder_parallel *data = 
       malloc(sizeof(struct _rvar_cache_builder_parallel) * trace_length);
 
-    for (uint32_t j = 0; j < nthreads; ++j) {
-      mop->pre(mop, networks[j].net);
-    }
+    exec_mop_pre(exec, expr, mop);
 
     for (uint32_t j = 0; j < trace_length; ++j ){
-      data[j].lock = &mut;
       data[j].trace = trace;
       data[j].index = j;
-      data[j].network_freelist = repo;
+      data[j].exec = exec;
       data[j].expr = expr;
     }
 
     rvar_type_t *vals = monte_carlo_parallel_ordered_rvar(
         _sim_network_for_trace_parallel, 
         data, trace_length,
-        sizeof(struct _rvar_cache_builder_parallel), 0);
+        sizeof(struct _rvar_cache_builder_parallel), pool);
+    free(data);
 
-    for (uint32_t j = 0; j < nthreads; ++j) {
-      mop->post(mop, networks[j].net);
-    }
+    exec_mop_post(exec, expr, mop);
 
     size_t ser_size = 0;
     struct array_t *arr_data = array_from_vals(vals, sizeof(rvar_type_t), trace_length);
@@ -159,21 +140,13 @@ static void _build_rvar_cache_parallel(struct expr_t const *expr) {
     free(mop);
   }
 
-  // Free the free list of networks
-  for (uint32_t i = 0; i < nthreads; ++i) {
-    struct _network_dp_t *np = freelist_get(repo);
-    dataplane_free_resources(&np->dp);
-  }
-  free(networks);
-  freelist_free(repo);
-
   traffic_matrix_trace_free(trace);
   info_txt("Done generating the rvars");
 }
 
 static struct exec_output_t*
 _exec_longterm_runner(struct exec_t *exec, struct expr_t const *expr) {
-  _build_rvar_cache_parallel(expr);
+  _build_rvar_cache_parallel(exec, expr);
   return 0;
 }
 
@@ -200,9 +173,11 @@ _exec_longterm_explain(struct exec_t const *exec) {
 struct exec_t *exec_longterm_create(void) {
   struct exec_t *exec = malloc(sizeof(struct exec_longterm_t));
   exec->net_dp = 0;
+  exec->pool = 0;
 
   exec->validate = _exec_longterm_validate;
   exec->run = _exec_longterm_runner;
+  exec->release = 0;
   exec->explain = _exec_longterm_explain;
 
   return exec;
@@ -121,9 +121,11 @@ _exec_ltg_explain(struct exec_t const *exec) {
 struct exec_t *exec_ltg_create(void) {
   struct exec_t *exec = malloc(sizeof(struct exec_ltg_t));
   exec->net_dp = 0;
+  exec->pool = 0;
 
   exec->validate = _exec_ltg_validate;
   exec->run = _exec_ltg_runner;
+  exec->release = 0;
   exec->explain = _exec_ltg_explain;
 
   return exec;
@@ -7,6 +7,7 @@
 #include "algo/maxmin.h"
 #include "util/common.h"
 #include "util/debug.h"
+#include "util/monte_carlo.h"
 #include "config.h"
 #include "dataplane.h"
 #include "failure.h"
@@ -30,6 +31,9 @@
 
 #define BUCKET_SIZE 1
 
+/* z-score of the confidence intervals used by the adaptive sampling (95%) */
+#define PUG_ADAPTIVE_Z 1.96
+
 // TODO: Criteria are in effect here ... Can add new criteria here or
 // .. change later.  Too messy at the moment.
 //
@@ -202,71 +206,222 @@ _plans_get(struct exec_t *exec, struct expr_t const *expr) {
   return out;
 }
 
+/* Turns a bucketed cost rvar into a sparse rvar if most of its mass is at
+ * zero.  Takes the ownership of rv. */
 static struct rvar_t *
+_cost_rvar_sparsify(struct expr_t const *expr, struct rvar_t *rv) {
+  if (expr->pug_sparse_zero_mass <= 0)
+    return rv;
+
+  if (rvar_zero_mass(rv) < expr->pug_sparse_zero_mass)
+    return rv;
+
+  struct rvar_t *ret = rvar_to_sparse(rv, BUCKET_SIZE);
+  rv->free(rv);
+  return ret;
+}
+
+static void
+_steady_cost_power_release(struct exec_t *exec) {
+  TO_PUG(exec);
+  if (!pug->steady_cost_pow)
+    return;
+
+  for (uint32_t i = 0; i < pug->plans->_subplan_count; ++i) {
+    struct rvar_t *rv = pug->steady_cost_pow[i];
+    if (rv)
+      rv->free(rv);
+  }
+
+  free(pug->steady_cost_pow);
+  pug->steady_cost_pow = 0;
+  pug->steady_cost_pow_k = 0;
+}
+
+static void
 _short_term_risk_using_long_term_cache(struct exec_t *exec, 
-    struct expr_t const *expr, unsigned subplan, trace_time_t now) {
+    struct expr_t const *expr, trace_time_t now, struct rvar_t **ret) {
   TO_PUG(exec);
-  struct rvar_t *rv = pug->steady_cost[subplan];
-  struct rvar_t *ret = rv->copy(rv);
-  return ret;
+  for (uint32_t i = 0; i < pug->plans->_subplan_count; ++i) {
+    struct rvar_t *rv = pug->steady_cost[i];
+    ret[i] = rv->copy(rv);
+  }
 }
 
-static struct rvar_t *
+void
+pug_sampling_init(struct pug_sampling_t *s) {
+  memset(s, 0, sizeof(struct pug_sampling_t));
+  s->hist = monte_carlo_hist_create(BUCKET_SIZE);
+  s->active = 1;
+}
+
+void
+pug_sampling_free(struct pug_sampling_t *s) {
+  monte_carlo_hist_free(s->hist);
+  s->hist = 0;
+}
+
+void
+pug_sampling_add(struct pug_sampling_t *s, rvar_type_t const *vals, unsigned nvals) {
+  s->nvals += nvals;
+  for (uint32_t i = 0; i < nvals; ++i) {
+    monte_carlo_hist_add(s->hist, vals[i]);
+    s->sum += vals[i];
+    s->sumsq += (double)vals[i] * (double)vals[i];
+  }
+}
+
+double
+pug_sampling_mean(struct pug_sampling_t const *s) {
+  return s->nvals ? s->sum / s->nvals : 0;
+}
+
+double
+pug_sampling_halfwidth(struct pug_sampling_t const *s) {
+  if (s->nvals < 2)
+    return INFINITY;
+
+  double n = s->nvals;
+  double var = (s->sumsq - s->sum * s->sum / n) / (n - 1);
+  if (var < 0)
+    var = 0;
+  return PUG_ADAPTIVE_Z * sqrt(var / n);
+}
+
+void
+pug_sampling_stop(struct expr_t const *expr,
+    struct pug_sampling_t *samples, unsigned subplan_count) {
+  double best_upper = INFINITY;
+  for (uint32_t i = 1; i < subplan_count; ++i) {
+    double upper = pug_sampling_mean(&samples[i]) + pug_sampling_halfwidth(&samples[i]);
+    best_upper = MIN(best_upper, upper);
+  }
+
+  for (uint32_t i = 0; i < subplan_count; ++i) {
+    struct pug_sampling_t *s = &samples[i];
+    if (!s->active)
+      continue;
+
+    double mean = pug_sampling_mean(s);
+    double hw = pug_sampling_halfwidth(s);
+    if (hw <= MAX(expr->pug_adaptive_error * fabs(mean), BUCKET_SIZE))
+      s->active = 0;
+    else if (i != 0 && mean - hw > best_upper)
+      s->active = 0;
+  }
+}
+
+static void
 _short_term_risk_using_predictor(struct exec_t *exec, struct expr_t const *expr,
-    unsigned subplan, trace_time_t now) {
+    trace_time_t now, struct rvar_t **ret) {
   TO_PUG(exec);
-  struct mop_t *mop = pug->iter->mop_for(pug->iter, subplan);
+  unsigned subplan_count = pug->plans->_subplan_count;
 
+  /* The predictions don't depend on the subplan, so we predict once.  The
+   * samples are streamed to the simulations as they are predicted. */
   struct predictor_t *pred = pug->pred;
   struct predictor_iterator_t *iter = pred->predict(pred, now, now + expr->mop_duration);
-
   unsigned num_samples = iter->length(iter);
-  unsigned tm_count = num_samples * expr->mop_duration;
-  struct traffic_matrix_t **tms = malloc(
-      sizeof(struct traffic_matrix_t *) * tm_count);
-  unsigned index = 0;
+  iter->begin(iter);
 
-  for (iter->begin(iter); !iter->end(iter); iter->next(iter)) {
-    struct traffic_matrix_trace_iter_t *titer = iter->cur(iter);
-    for (titer->begin(titer); !titer->end(titer); titer->next(titer)) {
-      struct traffic_matrix_t *tm = 0;
-      titer->get(titer, &tm);
-      tms[index++] = tm;
-    }
-    titer->free(titer);
+  struct mop_t **mops = malloc(sizeof(struct mop_t *) * subplan_count);
+  struct pug_sampling_t *samples = malloc(sizeof(struct pug_sampling_t) * subplan_count);
+  for (uint32_t i = 0; i < subplan_count; ++i) {
+    mops[i] = pug->iter->mop_for(pug->iter, i);
+    pug_sampling_init(&samples[i]);
   }
-  iter->free(iter);
-  assert(tm_count == index);
 
-  /* The returned rvar_types are in the order they were passed to exec_simulate_ordered */
-  rvar_type_t *vals = exec_simulate_ordered(exec, expr, mop, tms, tm_count);
+  /* Simulate the (subplan, sample) pairs of the active subplans one round at
+   * a time: each sample is the total cost of mop_duration consecutive traffic
+   * matrices.  Without adaptive sampling everything is one round. */
+  unsigned round = expr->pug_adaptive_round;
+  if (round == 0)
+    round = num_samples;
+
+  struct mop_t **active_mops = malloc(sizeof(struct mop_t *) * subplan_count);
+  unsigned *active = malloc(sizeof(unsigned) * subplan_count);
+  for (unsigned lo = 0, hi = 0; lo < num_samples; lo = hi) {
+    hi = MIN(lo + round, num_samples);
+
+    unsigned nactive = 0;
+    for (uint32_t i = 0; i < subplan_count; ++i) {
+      if (!samples[i].active)
+        continue;
+      active[nactive] = i;
+      active_mops[nactive] = mops[i];
+      nactive++;
+    }
+
+    if (nactive == 0)
+      break;
+
+    rvar_type_t **costs = exec_simulate_stream(
+        exec, expr, active_mops, nactive, iter, hi - lo);
+    for (uint32_t i = 0; i < nactive; ++i) {
+      pug_sampling_add(&samples[active[i]], costs[i], hi - lo);
+      free(costs[i]);
+    }
+    free(costs);
 
-  /* Free the allocated traffic matrices */
-  for (uint32_t i = 0; i < tm_count; ++i) {
-    traffic_matrix_free(tms[i]);
+    if (expr->pug_adaptive_round)
+      pug_sampling_stop(expr, samples, subplan_count);
   }
+  free(active);
+  free(active_mops);
+  iter->free(iter);
 
-  /* Build the rvar for the cost of the short term planner */
-  index = 0;
-  struct risk_cost_func_t *func = expr->risk_violation_cost;
-  rvar_type_t *costs = malloc(sizeof(rvar_type_t) * num_samples);
-  for (uint32_t i = 0; i < num_samples; ++i) {
-    costs[i] = 0;
-    for (uint32_t j = 0; j < expr->mop_duration; ++j) {
-      costs[i] += func->cost(func, vals[index]);
-      index++;
+  unsigned total_samples = 0;
+  for (uint32_t i = 0; i < subplan_count; ++i) {
+    ret[i] = (struct rvar_t *)monte_carlo_hist_rvar(samples[i].hist);
+    ret[i] = _cost_rvar_sparsify(expr, ret[i]);
+    total_samples += samples[i].nvals;
+
+    if (expr->pug_adaptive_round && expr->verbose >= VERBOSE_SUBPLANS) {
+      info("Subplan %u: %u/%u samples, expected cost: %f (+/- %f)",
+          i, samples[i].nvals, num_samples, pug_sampling_mean(&samples[i]),
+          pug_sampling_halfwidth(&samples[i]));
     }
+
+    pug_sampling_free(&samples[i]);
+    mops[i]->free(mops[i]);
   }
+  free(samples);
+  free(mops);
 
-  struct rvar_t *cost_rv = rvar_sample_create_with_vals(costs, num_samples);
-  struct rvar_t *ret = (struct rvar_t *)cost_rv->to_bucket(cost_rv, BUCKET_SIZE);
-  //info("Prob failure for %d before: %f", subplan, cost_rv->expected(cost_rv));
-  cost_rv->free(cost_rv);
-  mop->free(mop);
-  return ret;
+  if (expr->pug_adaptive_round) {
+    info("Adaptive sampling simulated %u of %u samples (%.2f%%).",
+        total_samples, num_samples * subplan_count,
+        100.0 * total_samples / MAX(1, num_samples * subplan_count));
+  }
 }
 
 
+/* Returns the cost of running subplan for mop_duration steps, i.e., the
+ * mop_duration-fold convolution of its steady cost.  The result is cached per
+ * subplan until the steady costs are released. */
+static struct rvar_t *
+_steady_cost_power(struct exec_t *exec, struct expr_t const *expr, unsigned subplan) {
+  TO_PUG(exec);
+  unsigned subplan_count = pug->plans->_subplan_count;
+
+  if (pug->steady_cost_pow && pug->steady_cost_pow_k != expr->mop_duration)
+    _steady_cost_power_release(exec);
+
+  if (!pug->steady_cost_pow) {
+    size_t size = sizeof(struct rvar_t *) * subplan_count;
+    pug->steady_cost_pow = malloc(size);
+    memset(pug->steady_cost_pow, 0, size);
+    pug->steady_cost_pow_k = expr->mop_duration;
+  }
+
+  if (!pug->steady_cost_pow[subplan]) {
+    pug->steady_cost_pow[subplan] = rvar_power(
+        pug->steady_cost[subplan], expr->mop_duration, BUCKET_SIZE);
+  }
+
+  return pug->steady_cost_pow[subplan];
+}
+
 static risk_cost_t
 _term_best_plan_to_finish(struct exec_t *exec, struct expr_t const *expr, 
     struct rvar_t *rvar, unsigned idx, unsigned *ret_plan_idx, unsigned *ret_plan_length,
@@ -294,12 +449,10 @@ _term_best_plan_to_finish(struct exec_t *exec, struct expr_t const *expr,
 
     // Build the cost of the remainder of the plan, aka, long-term
     for (uint32_t j = idx; j < max_plan_length; ++j) {
-      for (uint32_t dur = 0; dur < expr->mop_duration; ++dur) {
-        cost_rvar_tmp = pug->steady_cost[ptr[j]];
-        cost_rvar_tmp = cost_rvar_tmp->convolve(cost_rvar_tmp, cost_rvar, BUCKET_SIZE);
-        cost_rvar->free(cost_rvar);
-        cost_rvar = cost_rvar_tmp;
-      }
+      cost_rvar_tmp = _steady_cost_power(exec, expr, ptr[j]);
+      cost_rvar_tmp = cost_rvar_tmp->convolve(cost_rvar_tmp, cost_rvar, BUCKET_SIZE);
+      cost_rvar->free(cost_rvar);
+      cost_rvar = cost_rvar_tmp;
 
       // If there are no subplans left don't count it towards the length of the plan.
       if (ptr[j] == 0)
@@ -388,9 +541,7 @@ _exec_pug_find_best_next_subplan(struct exec_t *exec,
   int finished = 1;
 
   struct rvar_t **rcache = malloc(sizeof(struct rvar_t *) * pug->plans->_subplan_count);
-  for (uint32_t i = 0; i < pug->plans->_subplan_count; ++i) {
-    rcache[i] = pug->short_term_risk(exec, expr, i, at);
-  }
+  pug->short_term_risk(exec, expr, at, rcache);
 
 #ifndef ROLLBACK_EXPERIMENT
   for (uint32_t i = 1; i < pug->plans->_subplan_count; ++i) {
@@ -593,6 +744,7 @@ _exec_pug_validate(struct exec_t *exec, struct expr_t const *expr) {
     panic("Couldn't load the training traffic matrix file: %s", expr->traffic_test);
 
   pug->pred = exec_predictor_create(exec, expr, expr->predictor_string);
+  rvar_bucket_limit_set(expr->pug_max_buckets);
 
   if (expr->criteria_time == 0)
     panic_txt("Time criteria not set.");
@@ -656,6 +808,11 @@ _exec_pug_runner(struct exec_t *exec, struct expr_t const *expr) {
     info("[%4d] Actual cost of the best plan (%02d) is: %4.3f : %4.3f",
         at, pug->nmops, actual_cost, estimated_cost);
 
+    if (expr->pug_max_buckets) {
+      info("[%4d] Re-binning error (max-buckets = %u) is: %4.3f",
+          at, expr->pug_max_buckets, rvar_rebin_error(1));
+    }
+
     result.at = i;
     result.num_steps = pug->nmops;
     result.description = 0;
@@ -670,6 +827,11 @@ _exec_pug_runner(struct exec_t *exec, struct expr_t const *expr) {
   pug->mops = 0;
   free(best_plan_subplans);
 
+  if (expr->verbose) {
+    traffic_matrix_trace_cache_report(pug->trace, "test");
+    traffic_matrix_trace_cache_report(pug->trace_training, "training");
+  }
+
   return res;
 }
 
@@ -727,6 +889,7 @@ prepare_steady_cost_static(struct exec_t *exec, struct expr_t const *expr, trace
 #endif
     
     rcache[i] = (struct rvar_t *)rv->to_bucket(rv, BUCKET_SIZE);
+    rcache[i] = _cost_rvar_sparsify(expr, rcache[i]);
     rv->free(rv);
   }
 
@@ -817,6 +980,7 @@ prepare_steady_cost_dynamic(struct exec_t *exec, struct expr_t const *expr, trac
     struct rvar_t *rv = expr->risk_violation_cost->rvar_to_rvar(
         expr->risk_violation_cost, pug->steady_packet_loss[i], 0);
     rcache[i] = (struct rvar_t *)rv->to_bucket(rv, BUCKET_SIZE);
+    rcache[i] = _cost_rvar_sparsify(expr, rcache[i]);
     rv->free(rv);
   }
 
@@ -840,6 +1004,8 @@ release_steady_cost_dynamic(struct exec_t *exec, struct expr_t const *expr, trac
   if (!pug->steady_packet_loss)
     return;
 
+  _steady_cost_power_release(exec);
+
   for (int i = 0; i < pug->plans->_subplan_count; ++i) {
     struct rvar_t *rv = pug->steady_packet_loss[i];
     rv->free(rv);
@@ -855,17 +1021,25 @@ release_steady_cost_dynamic(struct exec_t *exec, struct expr_t const *expr, trac
   pug->steady_cost = 0;
 }
 
+static void _exec_pug_release(struct exec_t *exec) {
+  _steady_cost_power_release(exec);
+}
+
 struct exec_t *exec_pug_create_short_and_long_term(void) {
   struct exec_t *exec = malloc(sizeof(struct exec_pug_t));
   exec->net_dp = 0;
+  exec->pool = 0;
 
   exec->validate = _exec_pug_validate;
   exec->run = _exec_pug_runner;
+  exec->release = _exec_pug_release;
   exec->explain = _exec_pug_short_and_long_explain;
 
   TO_PUG(exec);
   pug->steady_packet_loss = 0;
   pug->steady_cost = 0;
+  pug->steady_cost_pow = 0;
+  pug->steady_cost_pow_k = 0;
   pug->short_term_risk = _short_term_risk_using_predictor;
   pug->prepare_steady_cost = prepare_steady_cost_static;
   pug->release_steady_cost = release_steady_cost_static;
@@ -878,14 +1052,18 @@ struct exec_t *exec_pug_create_short_and_long_term(void) {
 struct exec_t *exec_pug_create_long_term_only(void) {
   struct exec_t *exec = malloc(sizeof(struct exec_pug_t));
   exec->net_dp = 0;
+  exec->pool = 0;
 
   exec->validate = _exec_pug_validate;
   exec->run = _exec_pug_runner;
+  exec->release = _exec_pug_release;
   exec->explain = _exec_pug_long_explain;
 
   TO_PUG(exec);
   pug->steady_packet_loss = 0;
   pug->steady_cost = 0;
+  pug->steady_cost_pow = 0;
+  pug->steady_cost_pow_k = 0;
   pug->short_term_risk = _short_term_risk_using_long_term_cache;
   pug->prepare_steady_cost = prepare_steady_cost_static;
   pug->release_steady_cost = release_steady_cost_static;
@@ -898,14 +1076,18 @@ struct exec_t *exec_pug_create_long_term_only(void) {
 struct exec_t *exec_pug_create_lookback(void) {
   struct exec_t *exec = malloc(sizeof(struct exec_pug_t));
   exec->net_dp = 0;
+  exec->pool = 0;
 
   exec->validate = _exec_pug_validate;
   exec->run = _exec_pug_runner;
+  exec->release = _exec_pug_release;
   exec->explain = _exec_pug_lookback_explain;
 
   TO_PUG(exec);
   pug->steady_packet_loss = 0;
   pug->steady_cost = 0;
+  pug->steady_cost_pow = 0;
+  pug->steady_cost_pow_k = 0;
   pug->short_term_risk = _short_term_risk_using_predictor;
   pug->prepare_steady_cost = prepare_steady_cost_dynamic;
   pug->release_steady_cost = release_steady_cost_dynamic;
@@ -17,40 +17,70 @@ static int _pod_sort(void const *v1, void const *v2) {
 
 static void _exec_stats_validator(struct exec_t *exec, struct expr_t const *expr) {}
 
-static void _calc_mlu(struct exec_t *exec, struct expr_t const *expr) {
+/* Simulates the trace once and reports every metric from the same run */
+static void _calc_sim_stats(struct exec_t *exec, struct expr_t const *expr) {
   struct traffic_matrix_trace_iter_t *iter = exec->trace->iter(exec->trace);
   unsigned tm_count = iter->length(iter);
 
   struct traffic_matrix_t **tms = malloc(
       sizeof(struct traffic_matrix_t *) * tm_count);
+  uint8_t *owned = malloc(sizeof(uint8_t) * tm_count);
+
+  /* Mapped (raw) TMs are simulated in place, the rest are copied */
+  if (exec->trace->map)
+    traffic_matrix_trace_advise(exec->trace, TRACE_ACCESS_SEQUENTIAL);
 
   unsigned index = 0;
   for (iter->begin(iter); !iter->end(iter); iter->next(iter)) {
-    struct traffic_matrix_t *tm = 0;
-    iter->get(iter, &tm);
+    struct traffic_matrix_t *tm = iter->get_nocopy(iter);
+    owned[index] = (tm == 0);
+    if (!tm)
+      iter->get(iter, &tm);
     assert(tm != 0);
     tms[index++] = tm;
   }
   iter->free(iter);
 
-  /* The returned rvar_types are in the order they were passed to exec_simulate_ordered */
-  rvar_type_t *vals = exec_simulate_mlu(exec, expr, tms, index);
+  /* The returned rvar_types are in the order they were passed to exec_simulate_multi */
+  uint32_t nvars = 0;
+  rvar_type_t **vals = exec_simulate_multi(exec, expr, 0, tms, index, &nvars);
 
   /* Free the allocated traffic matrices */
-  for (uint32_t i = 0; i < tm_count; ++i) {
-    traffic_matrix_free(tms[i]);
+  for (uint32_t i = 0; i < index; ++i) {
+    if (owned[i])
+      traffic_matrix_free(tms[i]);
   }
-
-  rvar_type_t maxm = 0;
-  rvar_type_t avgm = 0;
-  for (uint32_t i = 0; i < tm_count; ++i) {
-    maxm = MAX(maxm, vals[i]);
-    avgm += vals[i];
+  free(owned);
+  free(tms);
+
+  rvar_type_t *maxs = malloc(sizeof(rvar_type_t) * nvars);
+  rvar_type_t *avgs = malloc(sizeof(rvar_type_t) * nvars);
+  for (uint32_t j = 0; j < nvars; ++j) {
+    maxs[j] = 0; avgs[j] = 0;
+    for (uint32_t i = 0; i < index; ++i) {
+      maxs[j] = MAX(maxs[j], vals[j][i]);
+      avgs[j] += vals[j][i];
+    }
+    avgs[j] /= index;
+    free(vals[j]);
   }
-  avgm /= tm_count;
   free(vals);
 
-  info("Max MLU: %f, Avg MLU: %f", maxm, avgm);
+  info("Max MLU: %f, Avg MLU: %f", maxs[SIM_MLU], avgs[SIM_MLU]);
+  info("Max violations: %f, Avg violations: %f",
+      maxs[SIM_VIOLATIONS], avgs[SIM_VIOLATIONS]);
+  info("Max violations (promised throughput): %f, Avg violations (promised throughput): %f",
+      maxs[SIM_PROMISED_VIOLATIONS], avgs[SIM_PROMISED_VIOLATIONS]);
+
+  bw_t pod_cap = expr->network->pod_capacity(expr->network);
+  for (uint32_t p = 0; p + SIM_POD_THROUGHPUT < nvars; ++p) {
+    info("Pod  [%2d] throughput: (%14.2f, %14.2f) (%.2f, %.2f)", p,
+        avgs[SIM_POD_THROUGHPUT + p], maxs[SIM_POD_THROUGHPUT + p],
+        avgs[SIM_POD_THROUGHPUT + p]/pod_cap, maxs[SIM_POD_THROUGHPUT + p]/pod_cap);
+  }
+
+  free(maxs);
+  free(avgs);
 }
 
 static struct exec_output_t *
@@ -91,7 +121,7 @@ _exec_stats_runner(struct exec_t *exec, struct expr_t const *expr) {
       core->out.min/core_cap, core->out.mean/core_cap, core->out.max/core_cap);
 
   exec->trace = traffic_matrix_trace_load(400, expr->traffic_test);
-  _calc_mlu(exec, expr);
+  _calc_sim_stats(exec, expr);
   traffic_matrix_trace_free(exec->trace);
   return 0;
 }
@@ -104,9 +134,11 @@ _exec_stats_explain(struct exec_t const *exec) {
 struct exec_t *exec_traffic_stats_create(void) {
   struct exec_t *exec = malloc(sizeof(struct exec_t));
   exec->net_dp = 0;
+  exec->pool = 0;
 
   exec->validate = _exec_stats_validator;
   exec->run = _exec_stats_runner;
+  exec->release = 0;
   exec->explain = _exec_stats_explain;
 
   return exec;
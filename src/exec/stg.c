@@ -163,8 +163,10 @@ struct exec_t *exec_stg_create(void) {
   struct exec_t *exec = malloc(sizeof(struct exec_stg_t));
 
   exec->net_dp = 0;
+  exec->pool = 0;
   exec->validate = _exec_stg_validate;
   exec->run = _exec_stg_runner;
+  exec->release = 0;
 
   return exec;
 }
@@ -13,8 +13,10 @@
 #include "exec/ltg.h"
 #include "exec/pug.h"
 #include "exec/stats.h"
+#include "traffic.h"
 #include "util/common.h"
 #include "util/log.h"
+#include "util/pool.h"
 
 void usage(const char *fname) {
   const char *usage_message = ""
@@ -98,11 +100,16 @@ int main(int argc, char **argv) {
 
   struct expr_t expr = {0};
   config_parse(argv[1], &expr, argc - 1, argv + 1);
+  traffic_matrix_trace_set_default_cache_budget((size_t)expr.trace_cache_mb << 20);
+  traffic_matrix_trace_set_default_prefetch(expr.trace_prefetch);
+  traffic_matrix_trace_set_default_compression(expr.trace_compress);
   struct exec_t *exec = executor(&expr);
 
   if (!expr.explain) {
     exec->validate(exec, &expr);
     struct exec_output_t *out = exec->run(exec, &expr);
+    if (exec->pool && (expr.numa || expr.verbose))
+      pool_report(exec->pool);
     if (out) {
       summarize_result(out);
       array_free(out->result);
@@ -113,5 +120,7 @@ int main(int argc, char **argv) {
     exec->explain(exec);
   }
 
+  exec_free(exec);
+
   return EXIT_SUCCESS;
 }
@@ -91,14 +91,14 @@ inline static void _setup_routing_for_pair(
 }
 
 uint32_t static _setup_bandwidth_for_links(
-    struct jupiter_network_t *jup, struct link_t **out) {
+    struct jupiter_network_t *jup, struct dataplane_t *dp, struct link_t **out) {
   uint32_t active_aggs_per_pod[MAX_PODS];
   for (uint32_t pod = 0; pod < jup->pod; ++pod) {
     active_aggs_per_pod[pod] = _num_active_aggs_jupiter(jup, pod);
   }
   uint32_t active_cores = _num_active_cores_jupiter(jup);
   size_t size = (jup->pod * 2 + jup->pod * jup->tor * 2)  * sizeof(struct link_t);
-  struct link_t *links = malloc(size);
+  struct link_t *links = dataplane_alloc(dp, size);
   memset(links, 0, size);
   *out = links;
 
@@ -129,7 +129,7 @@ uint32_t static _setup_bandwidth_for_links(
 }
 
 uint32_t static _setup_bandwidth_for_flows(
-    struct jupiter_network_t *jup, struct flow_t **out) {
+    struct jupiter_network_t *jup, struct dataplane_t *dp, struct flow_t **out) {
   /* Init the flows */
   struct flow_t *flows = 0;
   size_t size = sizeof(struct flow_t) * jup->tm->num_pairs;
@@ -138,7 +138,7 @@ uint32_t static _setup_bandwidth_for_flows(
 
   pair_id_t num_tors = jup->tor * jup->pod;
 
-  flows = malloc(size);
+  flows = dataplane_alloc(dp, size);
   memset(flows, 0, size);
   *out = flows;
   for (uint32_t i = 0; i < jup->tm->num_pairs; ++i) {
@@ -255,7 +255,7 @@ int jupiter_get_dataplane(struct network_t *net, struct dataplane_t *dp) {
    */
 
   /* setup the routing */
-  link_id_t      *routing = malloc(sizeof(link_id_t) * jup->tm->num_pairs * (MAX_PATH_LENGTH + 1));
+  link_id_t      *routing = dataplane_alloc(dp, sizeof(link_id_t) * jup->tm->num_pairs * (MAX_PATH_LENGTH + 1));
   link_id_t      *ptr = routing;
   struct pair_bw_t const *pair = jup->tm->bws;
   pair_id_t num_tors = jup->tor * jup->pod;
@@ -277,8 +277,8 @@ int jupiter_get_dataplane(struct network_t *net, struct dataplane_t *dp) {
   struct flow_t *flows = 0;
   struct link_t *links = 0;
 
-  uint32_t num_links = _setup_bandwidth_for_links(jup, &links);
-  uint32_t num_flows = _setup_bandwidth_for_flows(jup, &flows);
+  uint32_t num_links = _setup_bandwidth_for_links(jup, dp, &links);
+  uint32_t num_flows = _setup_bandwidth_for_flows(jup, dp, &flows);
 
   (dp)->num_flows = num_flows;
   (dp)->num_links = num_links;
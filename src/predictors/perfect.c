@@ -45,6 +45,22 @@ static struct traffic_matrix_trace_iter_t * _pe_cur(
   return titer;
 }
 
+static unsigned _pe_cur_into(
+    struct predictor_iterator_t *pi, struct traffic_matrix_t **tms) {
+  /* The trace hands out fresh copies anyway, so there is nothing to reuse */
+  struct traffic_matrix_trace_iter_t *titer = _pe_cur(pi);
+  unsigned count = 0;
+  for (titer->begin(titer); !titer->end(titer); titer->next(titer)) {
+    if (tms[count])
+      traffic_matrix_free(tms[count]);
+    titer->get(titer, &tms[count]);
+    count++;
+  }
+  titer->free(titer);
+
+  return count;
+}
+
 static void _pe_free(
     struct predictor_iterator_t *pe) {
   TO_PI(pe);
@@ -65,6 +81,7 @@ predictor_perfect_predict(struct predictor_t *pre, trace_time_t s, trace_time_t
   iter->end = _pe_end;
   iter->free = _pe_free;
   iter->cur = _pe_cur;
+  iter->cur_into = _pe_cur_into;
   iter->next = _pe_next;
   iter->length = _pe_length;
 
@@ -71,6 +71,39 @@ static struct traffic_matrix_trace_iter_t * _pe_cur(
   return ret;
 }
 
+static unsigned _pe_cur_into(
+    struct predictor_iterator_t *pi, struct traffic_matrix_t **tms) {
+  TO_PI(pi);
+  TO_E(iter->predictor);
+
+  trace_time_t offset = iter->num_samples / 2;
+
+  for (uint32_t step = 1; step < pe->steps; ++step) {
+    /* Read the error straight out of the mapped trace if we can */
+    trace_time_t key = iter->s + iter->pos - offset;
+    struct traffic_matrix_t *copy = 0;
+    struct traffic_matrix_t const *tm = traffic_matrix_trace_get_nocopy(
+        pe->error_traces[step], key);
+    if (!tm) {
+      traffic_matrix_trace_get(pe->error_traces[step], key, &copy);
+      tm = copy;
+    }
+    assert(tm != 0);
+    assert(iter->tm_now != 0);
+
+    struct traffic_matrix_t *out = tms[step-1];
+    if (out && out->num_pairs != tm->num_pairs) {
+      traffic_matrix_free(out);
+      out = 0;
+    }
+    tms[step-1] = traffic_matrix_add_into(out, tm, iter->tm_now);
+    if (copy)
+      traffic_matrix_free(copy);
+  }
+
+  return pe->steps - 1;
+}
+
 static void _pe_free(
     struct predictor_iterator_t *pe) {
   TO_PI(pe);
@@ -104,6 +137,7 @@ static struct predictor_iterator_t *predictor_rotating_ewma_predict(
   iter->end = _pe_end;
   iter->free = _pe_free;
   iter->cur = _pe_cur;
+  iter->cur_into = _pe_cur_into;
   iter->next = _pe_next;
   iter->length = _pe_length;
 
@@ -128,6 +162,10 @@ struct _rotating_ewma_rotating_predictor_t {
   uint16_t size;
   struct predictor_rotating_ewma_t *rotating_ewma;
   trace_time_t keys[EWMA_MAX_TM_STRIDE];
+
+  // Bulk writers of the prediction and error traces
+  struct traffic_matrix_trace_writer_t *pred_writers[EWMA_MAX_TM_STRIDE];
+  struct traffic_matrix_trace_writer_t *error_writers[EWMA_MAX_TM_STRIDE];
 };
 
 int _rotating_ewma_predictor_rotating_func(
@@ -192,10 +230,10 @@ int _rotating_ewma_predictor_rotating_func(
   for (uint32_t i = 1; i < setting->size; ++i) {
     // We have padded the first i pred with i zero matrices for the first i key.
     // The ith prediction is time + ith key
-    traffic_matrix_trace_add(pe->pred_traces[i], 
+    traffic_matrix_trace_writer_add(setting->pred_writers[i], 
         setting->pred[i], setting->keys[INDEX(index+i, setting->size)]);
 
-    traffic_matrix_trace_add(pe->error_traces[i], 
+    traffic_matrix_trace_writer_add(setting->error_writers[i], 
         setting->error[i], setting->keys[INDEX(index+i, setting->size)]);
   }
 
@@ -239,8 +277,15 @@ void predictor_rotating_ewma_build(
     .size = pe->steps,
     .rotating_ewma = pe,
     .keys = {0},
+    .pred_writers = {0},
+    .error_writers = {0},
   };
 
+  for (uint32_t i = 0; i < rpt.size; ++i) {
+    rpt.pred_writers[i] = traffic_matrix_trace_writer_open(pe->pred_traces[i], 0);
+    rpt.error_writers[i] = traffic_matrix_trace_writer_open(pe->error_traces[i], 0);
+  }
+
   for (uint32_t i = 0; i < rpt.size; ++i) {
     if (traffic_matrix_trace_get_nth_key(trace, i, &rpt.keys[i]) != SUCCESS)
       panic_txt("Couldn't find enough data in the trace.");
@@ -262,7 +307,7 @@ void predictor_rotating_ewma_build(
       /* Setup the zero matrix */
       trace_time_t key = 0;
       traffic_matrix_trace_get_nth_key(trace, j, &key);
-      traffic_matrix_trace_add(pe->pred_traces[i], zero_tm, key);
+      traffic_matrix_trace_writer_add(rpt.pred_writers[i], zero_tm, key);
     }
 
     /* Setup the initial error matrix values */
@@ -271,7 +316,7 @@ void predictor_rotating_ewma_build(
       traffic_matrix_trace_get_nth_key(trace, j, &key);
       struct traffic_matrix_t *tm = 0;
       traffic_matrix_trace_get(trace, key, &tm);
-      traffic_matrix_trace_add(pe->error_traces[i], tm, key);
+      traffic_matrix_trace_writer_add(rpt.error_writers[i], tm, key);
       traffic_matrix_free(tm);
     }
   }
@@ -319,7 +364,12 @@ void predictor_rotating_ewma_build(
   }
 
   traffic_matrix_free(zero_tm);
-  predictor_rotating_ewma_save(p);
+
+  // Closing the writers saves the traces (see predictor_rotating_ewma_save)
+  for (uint32_t i = 0; i < rpt.size; ++i) {
+    traffic_matrix_trace_writer_close(rpt.pred_writers[i]);
+    traffic_matrix_trace_writer_close(rpt.error_writers[i]);
+  }
 }
 
 void predictor_rotating_ewma_save(struct predictor_t *predictor) {
@@ -387,6 +437,7 @@ struct predictor_rotating_ewma_t *predictor_rotating_ewma_load(
     char fpath[PATH_MAX] = {0};
     sprintf(fpath, "%s" PATH_SEPARATOR "%s" ERROR_SUFFIX "%d", dir, fname, i);
     rotating_ewma->error_traces[i] = traffic_matrix_trace_load(cache_size, fpath);
+    traffic_matrix_trace_advise(rotating_ewma->error_traces[i], TRACE_ACCESS_RANDOM);
   }
 
   return rotating_ewma;
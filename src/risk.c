@@ -17,6 +17,11 @@ risk_cost_t _default_rvar_to_cost (struct risk_cost_func_t *f, struct rvar_t *rv
   return rvar->expected(rvar);
 }
 
+static rvar_type_t _sketch_cost(void *data, rvar_type_t val) {
+  struct risk_cost_func_t *f = (struct risk_cost_func_t *)data;
+  return f->cost(f, val);
+}
+
 struct rvar_t *_default_rvar_to_rvar(struct risk_cost_func_t *f, struct rvar_t *rvar, rvar_type_t bucket_size) {
   if (bucket_size == 0)
     bucket_size = 1;
@@ -60,6 +65,9 @@ struct rvar_t *_default_rvar_to_rvar(struct risk_cost_func_t *f, struct rvar_t *
     array_free(arr);
 
     ret = rvar_from_buckets(buckets, rs->nbuckets, bucket_size);
+  } else if (rvar->_type == SKETCHED) {
+    /* If sketched, translate each item of the sketch */
+    ret = rvar_sketch_map(rvar, _sketch_cost, f);
   }
 
   return ret;
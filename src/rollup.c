@@ -0,0 +1,414 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util/checksum.h"
+#include "util/common.h"
+#include "util/log.h"
+
+#include "rollup.h"
+
+#define ROLLUP_MAGIC "JANUSRLP"
+#define ROLLUP_VERSION 1
+#define ROLLUP_ENDIAN_MARK 0x01020304u
+
+/* NAME.rollup:
+ *
+ *   struct _rollup_header_t
+ *   double prefix[num_tms + 1][TRACE_ROLLUP_COLS(num_pods)]
+ *   bw_t   pods[num_tms][num_pods][num_pods]
+ */
+struct _rollup_header_t {
+  char     magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint64_t num_tms;
+  uint32_t num_tors, num_pods;
+  uint32_t index_crc, pods_crc;
+};
+
+_Static_assert(sizeof(struct _rollup_header_t) % sizeof(double) == 0,
+    "Rollup prefix sums should stay aligned.");
+
+static size_t _rollup_prefix_size(uint64_t num_tms, uint32_t num_pods) {
+  return sizeof(double) * (size_t)(num_tms + 1) * TRACE_ROLLUP_COLS(num_pods);
+}
+
+static size_t _rollup_pods_size(uint64_t num_tms, uint32_t num_pods) {
+  return sizeof(bw_t) * (size_t)num_tms * num_pods * num_pods;
+}
+
+static void _rollup_path(char const *name, char *path) {
+  path[0] = 0;
+  (void) strncat(path, name, PATH_MAX - 1);
+  (void) strncat(path, ".rollup", PATH_MAX - 1);
+}
+
+/* Checksum of the (sorted) trace index: the rollup is stale if a TM was added,
+ * removed or rewritten */
+static uint32_t _rollup_index_crc(struct traffic_matrix_trace_t *trace) {
+  trace_time_t key = 0;
+  if (trace->num_indices)
+    traffic_matrix_trace_get_nth_key(trace, 0, &key); // Sorts the index
+
+  /* Without the in-memory flags, which change as the TMs are read */
+  uint32_t crc = 0;
+  for (uint64_t i = 0; i < trace->num_indices; ++i) {
+    struct traffic_matrix_trace_index_t index = trace->indices[i];
+    index.flags &= ~(uint32_t)TRACE_INDEX_VERIFIED;
+    crc = checksum_crc32(crc, &index, sizeof(index));
+  }
+  return crc;
+}
+
+static uint32_t _rollup_pods_crc(uint32_t num_tors, uint32_t num_pods,
+    uint32_t const *pod_of_tor) {
+  uint32_t crc = checksum_crc32(0, &num_pods, sizeof(num_pods));
+  return checksum_crc32(crc, pod_of_tor, sizeof(uint32_t) * num_tors);
+}
+
+/* Totals of the pod x pod matrix: out of and into every pod, and the core */
+static void _rollup_tm_totals(bw_t const *matrix, uint32_t num_pods, double *totals) {
+  memset(totals, 0, sizeof(double) * TRACE_ROLLUP_COLS(num_pods));
+  for (uint32_t sp = 0; sp < num_pods; ++sp) {
+    for (uint32_t dp = 0; dp < num_pods; ++dp) {
+      bw_t tr = matrix[sp * num_pods + dp];
+      totals[TRACE_ROLLUP_OUT(sp)] += tr;
+      totals[TRACE_ROLLUP_IN(num_pods, dp)] += tr;
+      if (sp != dp)
+        totals[TRACE_ROLLUP_CORE(num_pods)] += tr;
+    }
+  }
+}
+
+/* Fills the per TM totals and the min/max blocks (and their sparse table) of
+ * the rollup from its pod matrices */
+static void _rollup_index_blocks(struct trace_rollup_t *rollup) {
+  uint32_t num_pods = rollup->num_pods;
+  uint32_t cols = TRACE_ROLLUP_COLS(num_pods);
+  uint64_t num_tms = rollup->num_tms;
+
+  rollup->_totals = malloc(sizeof(double) * MAX(num_tms * cols, 1));
+  for (uint64_t n = 0; n < num_tms; ++n)
+    _rollup_tm_totals(trace_rollup_pod_matrix(rollup, n), num_pods,
+        &rollup->_totals[n * cols]);
+
+  uint32_t nblocks = (uint32_t)((num_tms + TRACE_ROLLUP_BLOCK - 1) / TRACE_ROLLUP_BLOCK);
+  uint32_t nlevels = 1;
+  while (((uint64_t)1 << nlevels) <= nblocks)
+    nlevels++;
+  rollup->_nblocks = nblocks;
+  rollup->_nlevels = nlevels;
+
+  size_t size = sizeof(double) * MAX((size_t)nlevels * nblocks * cols, 1);
+  double *bmin = rollup->_block_min = malloc(size);
+  double *bmax = rollup->_block_max = malloc(size);
+
+  for (uint32_t b = 0; b < nblocks; ++b) {
+    uint64_t end = MIN((uint64_t)(b + 1) * TRACE_ROLLUP_BLOCK, num_tms);
+    double *lo = &bmin[b * cols], *hi = &bmax[b * cols];
+    for (uint32_t c = 0; c < cols; ++c) {
+      lo[c] = INFINITY;
+      hi[c] = -INFINITY;
+    }
+    for (uint64_t n = (uint64_t)b * TRACE_ROLLUP_BLOCK; n < end; ++n) {
+      double const *tot = &rollup->_totals[n * cols];
+      for (uint32_t c = 0; c < cols; ++c) {
+        lo[c] = MIN(lo[c], tot[c]);
+        hi[c] = MAX(hi[c], tot[c]);
+      }
+    }
+  }
+
+  for (uint32_t l = 1; l < nlevels; ++l) {
+    uint32_t half = 1u << (l - 1);
+    for (uint32_t b = 0; b + (1u << l) <= nblocks; ++b) {
+      size_t row = ((size_t)l * nblocks + b) * cols;
+      size_t left = ((size_t)(l - 1) * nblocks + b) * cols;
+      size_t right = ((size_t)(l - 1) * nblocks + b + half) * cols;
+      for (uint32_t c = 0; c < cols; ++c) {
+        bmin[row + c] = MIN(bmin[left + c], bmin[right + c]);
+        bmax[row + c] = MAX(bmax[left + c], bmax[right + c]);
+      }
+    }
+  }
+}
+
+struct trace_rollup_t *trace_rollup_build(
+    struct traffic_matrix_trace_t *trace,
+    uint32_t num_tors, uint32_t num_pods, uint32_t const *pod_of_tor) {
+  uint64_t num_tms = trace->num_indices;
+  uint32_t cols = TRACE_ROLLUP_COLS(num_pods);
+  size_t prefix_size = _rollup_prefix_size(num_tms, num_pods);
+  size_t pods_size = _rollup_pods_size(num_tms, num_pods);
+
+  for (uint32_t i = 0; i < num_tors; ++i) {
+    if (pod_of_tor[i] >= num_pods)
+      panic("ToR %u is in pod %u (out of %u pods).", i, pod_of_tor[i], num_pods);
+  }
+
+  struct trace_rollup_t *rollup = malloc(sizeof(struct trace_rollup_t));
+  memset(rollup, 0, sizeof(struct trace_rollup_t));
+  rollup->num_tors = num_tors;
+  rollup->num_pods = num_pods;
+  rollup->num_tms = num_tms;
+  rollup->index_crc = _rollup_index_crc(trace);
+  rollup->pods_crc = _rollup_pods_crc(num_tors, num_pods, pod_of_tor);
+  rollup->_mem_size = prefix_size + pods_size;
+  rollup->_mem = malloc(MAX(rollup->_mem_size, 1));
+  memset(rollup->_mem, 0, rollup->_mem_size);
+
+  double *prefix = rollup->_mem;
+  bw_t *pods = (bw_t *)((char *)rollup->_mem + prefix_size);
+  rollup->prefix = prefix;
+  rollup->pods = pods;
+
+  for (uint64_t n = 0; n < num_tms; ++n) {
+    trace_time_t key = 0;
+    struct traffic_matrix_t *copy = 0;
+    traffic_matrix_trace_get_nth_key(trace, (uint32_t)n, &key);
+    struct traffic_matrix_t const *tm = traffic_matrix_trace_get_nocopy(trace, key);
+    if (!tm) {
+      traffic_matrix_trace_get(trace, key, &copy);
+      tm = copy;
+    }
+
+    if (tm->num_pairs != num_tors * num_tors)
+      panic("TM at %ld has %u pairs instead of %u.",
+          (long)key, tm->num_pairs, num_tors * num_tors);
+
+    /* Pod x pod aggregate */
+    bw_t *matrix = &pods[n * num_pods * num_pods];
+    struct pair_bw_t const *bw = tm->bws;
+    for (uint32_t s = 0; s < num_tors; ++s) {
+      bw_t *row = &matrix[pod_of_tor[s] * num_pods];
+      for (uint32_t d = 0; d < num_tors; ++d, ++bw)
+        row[pod_of_tor[d]] += bw->bw;
+    }
+
+    if (copy)
+      traffic_matrix_free(copy);
+  }
+
+  _rollup_index_blocks(rollup);
+
+  /* Totals of every TM on top of the previous prefix row */
+  for (uint64_t n = 0; n < num_tms; ++n) {
+    double const *prev = &prefix[n * cols];
+    double const *tot = &rollup->_totals[n * cols];
+    double *cur = &prefix[(n + 1) * cols];
+    for (uint32_t c = 0; c < cols; ++c)
+      cur[c] = prev[c] + tot[c];
+  }
+
+  return rollup;
+}
+
+int trace_rollup_save(struct trace_rollup_t const *rollup, char const *name) {
+  char path[PATH_MAX] = {0};
+  _rollup_path(name, path);
+
+  FILE *file = fopen(path, "wb");
+  if (!file)
+    return FAILURE;
+
+  struct _rollup_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, ROLLUP_MAGIC, sizeof(hdr.magic));
+  hdr.version = ROLLUP_VERSION;
+  hdr.endian = ROLLUP_ENDIAN_MARK;
+  hdr.num_tms = rollup->num_tms;
+  hdr.num_tors = rollup->num_tors;
+  hdr.num_pods = rollup->num_pods;
+  hdr.index_crc = rollup->index_crc;
+  hdr.pods_crc = rollup->pods_crc;
+
+  size_t prefix_size = _rollup_prefix_size(rollup->num_tms, rollup->num_pods);
+  size_t pods_size = _rollup_pods_size(rollup->num_tms, rollup->num_pods);
+  int ret = SUCCESS;
+  if (fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+      fwrite(rollup->prefix, 1, prefix_size, file) != prefix_size ||
+      fwrite(rollup->pods, 1, pods_size, file) != pods_size)
+    ret = FAILURE;
+
+  if (fclose(file) != 0)
+    ret = FAILURE;
+  if (ret != SUCCESS)
+    remove(path);
+  return ret;
+}
+
+struct trace_rollup_t *trace_rollup_load(
+    struct traffic_matrix_trace_t *trace,
+    uint32_t num_tors, uint32_t num_pods, uint32_t const *pod_of_tor) {
+  if (!trace->name)
+    return 0;
+
+  char path[PATH_MAX] = {0};
+  _rollup_path(trace->name, path);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+  struct _rollup_header_t hdr;
+  if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof(hdr) ||
+      pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+    close(fd);
+    return 0;
+  }
+
+  size_t expected = sizeof(hdr) +
+    _rollup_prefix_size(hdr.num_tms, hdr.num_pods) +
+    _rollup_pods_size(hdr.num_tms, hdr.num_pods);
+
+  if (memcmp(hdr.magic, ROLLUP_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.version != ROLLUP_VERSION ||
+      hdr.endian != ROLLUP_ENDIAN_MARK ||
+      (size_t)st.st_size != expected ||
+      hdr.num_tms != trace->num_indices ||
+      hdr.num_tors != num_tors || hdr.num_pods != num_pods ||
+      hdr.pods_crc != _rollup_pods_crc(num_tors, num_pods, pod_of_tor) ||
+      hdr.index_crc != _rollup_index_crc(trace)) {
+    close(fd);
+    return 0;
+  }
+
+  void *mem = mmap(0, expected, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+    return 0;
+
+  struct trace_rollup_t *rollup = malloc(sizeof(struct trace_rollup_t));
+  memset(rollup, 0, sizeof(struct trace_rollup_t));
+  rollup->num_tors = num_tors;
+  rollup->num_pods = num_pods;
+  rollup->num_tms = hdr.num_tms;
+  rollup->index_crc = hdr.index_crc;
+  rollup->pods_crc = hdr.pods_crc;
+  rollup->_mem = mem;
+  rollup->_mem_size = expected;
+  rollup->_mapped = 1;
+  rollup->prefix = (double const *)((char const *)mem + sizeof(hdr));
+  rollup->pods = (bw_t const *)((char const *)rollup->prefix +
+      _rollup_prefix_size(hdr.num_tms, hdr.num_pods));
+  _rollup_index_blocks(rollup);
+  return rollup;
+}
+
+struct trace_rollup_t *trace_rollup_get(
+    struct traffic_matrix_trace_t *trace,
+    uint32_t num_tors, uint32_t num_pods, uint32_t const *pod_of_tor) {
+  struct trace_rollup_t *rollup = trace_rollup_load(
+      trace, num_tors, num_pods, pod_of_tor);
+  if (rollup)
+    return rollup;
+
+  info("Building the pod rollup of %.40s.", trace->name ? trace->name : "trace");
+  rollup = trace_rollup_build(trace, num_tors, num_pods, pod_of_tor);
+  if (trace->name && trace_rollup_save(rollup, trace->name) != SUCCESS)
+    warn("Couldn't save the rollup of %.40s.", trace->name);
+  return rollup;
+}
+
+struct trace_rollup_t *trace_rollup_cached(
+    struct traffic_matrix_trace_t *trace,
+    uint32_t num_tors, uint32_t num_pods, uint32_t const *pod_of_tor) {
+  struct trace_rollup_t *rollup = trace->rollup;
+  if (rollup && rollup->num_tors == num_tors && rollup->num_pods == num_pods &&
+      rollup->num_tms == trace->num_indices &&
+      rollup->pods_crc == _rollup_pods_crc(num_tors, num_pods, pod_of_tor))
+    return rollup;
+
+  if (rollup)
+    trace_rollup_free(rollup);
+  trace->rollup = trace_rollup_get(trace, num_tors, num_pods, pod_of_tor);
+  return trace->rollup;
+}
+
+bw_t const *trace_rollup_pod_matrix(struct trace_rollup_t const *rollup, uint64_t nth) {
+  if (nth >= rollup->num_tms)
+    return 0;
+  return &rollup->pods[nth * rollup->num_pods * rollup->num_pods];
+}
+
+void trace_rollup_sum(struct trace_rollup_t const *rollup,
+    uint64_t start, uint64_t ntms, double *sums) {
+  uint32_t cols = TRACE_ROLLUP_COLS(rollup->num_pods);
+  uint64_t end = MIN(start + ntms, rollup->num_tms);
+  start = MIN(start, end);
+
+  double const *first = &rollup->prefix[start * cols];
+  double const *last = &rollup->prefix[end * cols];
+  for (uint32_t c = 0; c < cols; ++c)
+    sums[c] = last[c] - first[c];
+}
+
+/* Folds the per TM totals of [start, end) into the min/max */
+static void _rollup_scan(struct trace_rollup_t const *rollup,
+    uint64_t start, uint64_t end, struct trace_rollup_stats_t *stats) {
+  uint32_t cols = TRACE_ROLLUP_COLS(rollup->num_pods);
+  for (uint64_t n = start; n < end; ++n) {
+    double const *tot = &rollup->_totals[n * cols];
+    for (uint32_t c = 0; c < cols; ++c) {
+      stats[c].min = MIN(stats[c].min, tot[c]);
+      stats[c].max = MAX(stats[c].max, tot[c]);
+    }
+  }
+}
+
+void trace_rollup_window(struct trace_rollup_t const *rollup,
+    uint64_t start, uint64_t ntms, struct trace_rollup_stats_t *stats) {
+  uint32_t cols = TRACE_ROLLUP_COLS(rollup->num_pods);
+  uint64_t end = MIN(start + ntms, rollup->num_tms);
+  start = MIN(start, end);
+
+  double const *first = &rollup->prefix[start * cols];
+  double const *last = &rollup->prefix[end * cols];
+  for (uint32_t c = 0; c < cols; ++c) {
+    stats[c].min = INFINITY;
+    stats[c].max = 0;
+    stats[c].mean = (last[c] - first[c]) / (double)(end - start);
+  }
+
+  /* The blocks that are fully in the window go through the sparse table, the
+   * TMs on either side of them through the totals */
+  uint64_t fblock = (start + TRACE_ROLLUP_BLOCK - 1) / TRACE_ROLLUP_BLOCK;
+  uint64_t lblock = end / TRACE_ROLLUP_BLOCK;
+  if (fblock >= lblock) {
+    _rollup_scan(rollup, start, end, stats);
+    return;
+  }
+
+  _rollup_scan(rollup, start, fblock * TRACE_ROLLUP_BLOCK, stats);
+  _rollup_scan(rollup, lblock * TRACE_ROLLUP_BLOCK, end, stats);
+
+  uint32_t level = 0;
+  while (((uint64_t)2 << level) <= lblock - fblock)
+    level++;
+
+  uint32_t nblocks = rollup->_nblocks;
+  size_t left = ((size_t)level * nblocks + fblock) * cols;
+  size_t right = ((size_t)level * nblocks + lblock - (1u << level)) * cols;
+  for (uint32_t c = 0; c < cols; ++c) {
+    stats[c].min = MIN(stats[c].min, MIN(rollup->_block_min[left + c], rollup->_block_min[right + c]));
+    stats[c].max = MAX(stats[c].max, MAX(rollup->_block_max[left + c], rollup->_block_max[right + c]));
+  }
+}
+
+void trace_rollup_free(struct trace_rollup_t *rollup) {
+  free(rollup->_totals);
+  free(rollup->_block_min);
+  free(rollup->_block_max);
+  if (rollup->_mapped)
+    munmap(rollup->_mem, rollup->_mem_size);
+  else
+    free(rollup->_mem);
+  free(rollup);
+}
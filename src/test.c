@@ -1,7 +1,9 @@
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "twiddle/twiddle.h"
 
@@ -13,11 +15,20 @@
 #include "plans/jupiter.h"
 #include "networks/jupiter.h"
 #include "predictors/rotating_ewma.h"
+#include "util/affinity.h"
+#include "util/cache2q.h"
 #include "util/monte_carlo.h"
+#include "util/pool.h"
+#include "util/queue.h"
 #include "util/common.h"
 #include "util/log.h"
 
+#include "config.h"
+#include "dataplane.h"
+#include "exec.h"
+#include "exec/pug.h"
 #include "plan.h"
+#include "rollup.h"
 #include "traffic.h"
 
 #define RUN_COUNT 10
@@ -120,7 +131,7 @@ void test_jupiter_cluster(void) {
     jupiter_get_dataplane(net, (&dp));
     maxmin(&dp);
   }
-  dataplane_init(&dp);
+  dataplane_free_resources(&dp);
   jupiter_network_free((struct network_t*)net);
   free(tm);
 }
@@ -217,6 +228,674 @@ void test_tm_trace(void) {
   traffic_matrix_trace_free(trace2);
 }
 
+void test_config(void) {
+  FILE *ini = fopen("sample-config.ini", "w");
+  fprintf(ini,
+      "[general]\n"
+      "threads = 3\n"
+      "numa = 1\n"
+      "[failure]\n"
+      "failure-mode = independent\n");
+  fclose(ini);
+
+  struct expr_t expr;
+  memset(&expr, 0, sizeof(expr));
+  char *argv[] = {"test", 0};
+  optind = 1;
+  config_parse("sample-config.ini", &expr, 1, argv);
+
+  /* Knobs from the ini should survive parsing the command line */
+  assert(expr.num_threads == 3);
+  assert(expr.numa == 1);
+
+  remove("sample-config.ini");
+}
+
+void test_tm_trace_mmap(void) {
+  uint16_t num_indices = 50;
+  struct traffic_matrix_trace_t *trace1 = gen_sample_trace(10, "sample-mmap-trace", num_indices);
+  struct traffic_matrix_trace_t *trace2 = load_sample_trace(10, "sample-mmap-trace");
+  assert(trace2->map != 0);
+  assert(traffic_matrix_trace_get_nocopy(trace2, 50) == 0);
+
+  struct traffic_matrix_t *tm1 = 0, *tm2 = 0;
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    /* Views are checksummed on their first use */
+    assert(!(trace2->indices[i].flags & TRACE_INDEX_VERIFIED));
+    struct traffic_matrix_t const *view = traffic_matrix_trace_get_nocopy(trace2, i * 100);
+    assert(view != 0);
+    assert(trace2->indices[i].flags & TRACE_INDEX_VERIFIED);
+
+    traffic_matrix_trace_get(trace1, i * 100, &tm1);
+    traffic_matrix_trace_get(trace2, i * 100, &tm2);
+    is_tm_equal(tm1, tm2);
+    is_tm_equal(tm1, (struct traffic_matrix_t *)view);
+
+    traffic_matrix_free(tm1);
+    traffic_matrix_free(tm2);
+  }
+
+  /* Copies out of the map count as stalls too */
+  assert(trace2->stall_ns > 0);
+
+  /* Iterators hand out the same views */
+  traffic_matrix_trace_advise(trace2, TRACE_ACCESS_SEQUENTIAL);
+  struct traffic_matrix_trace_iter_t *iter = trace2->iter(trace2);
+  uint32_t count = 0;
+  for (iter->begin(iter); !iter->end(iter); iter->next(iter)) {
+    struct traffic_matrix_t *view = iter->get_nocopy(iter);
+    assert(view == traffic_matrix_trace_get_nocopy(trace2, count * 100));
+    count++;
+  }
+  assert(count == num_indices);
+  iter->free(iter);
+
+  /* Unmapped traces have no views, their iterators fall back to get */
+  assert(trace1->map == 0);
+  iter = trace1->iter(trace1);
+  iter->begin(iter);
+  assert(iter->get_nocopy(iter) == 0);
+  iter->free(iter);
+
+  traffic_matrix_trace_free(trace1);
+  traffic_matrix_trace_free(trace2);
+  remove("sample-mmap-trace.index");
+  remove("sample-mmap-trace.data");
+
+  /* Odd number of pairs: raw records are padded so the views stay aligned */
+  struct traffic_matrix_trace_t *odd = traffic_matrix_trace_create(10, 1000, "sample-odd-trace");
+  struct traffic_matrix_t *tms[5];
+  for (uint32_t i = 0; i < 5; ++i) {
+    traffic_matrix_random(&tms[i], 7, 10, 0.5);
+    traffic_matrix_trace_add(odd, tms[i], i * 100);
+  }
+  traffic_matrix_trace_save(odd);
+  traffic_matrix_trace_free(odd);
+
+  odd = load_sample_trace(10, "sample-odd-trace");
+  assert(odd->map != 0);
+  for (uint32_t i = 0; i < 5; ++i) {
+    struct traffic_matrix_t const *view = traffic_matrix_trace_get_nocopy(odd, i * 100);
+    assert(view != 0 && ((uintptr_t)view % 8) == 0);
+    is_tm_equal(tms[i], (struct traffic_matrix_t *)view);
+
+    struct traffic_matrix_t *tm = 0;
+    traffic_matrix_trace_get(odd, i * 100, &tm);
+    is_tm_equal(tms[i], tm);
+    traffic_matrix_free(tm);
+    traffic_matrix_free(tms[i]);
+  }
+  traffic_matrix_trace_free(odd);
+  remove("sample-odd-trace.index");
+  remove("sample-odd-trace.data");
+}
+
+struct _tm_trace_reader_t {
+  struct traffic_matrix_trace_t *trace;
+  struct traffic_matrix_t **expected;
+  uint32_t num_indices;
+  uint32_t offset;
+};
+
+static void _tm_trace_read(void *data) {
+  struct _tm_trace_reader_t *reader = (struct _tm_trace_reader_t *)data;
+  for (uint32_t i = 0; i < 4 * reader->num_indices; ++i) {
+    uint32_t idx = (reader->offset + i * 7) % reader->num_indices;
+    struct traffic_matrix_t *tm = 0;
+    traffic_matrix_trace_get(reader->trace, idx * 100, &tm);
+    assert(tm != 0);
+    is_tm_equal(tm, reader->expected[idx]);
+    traffic_matrix_free(tm);
+  }
+}
+
+void test_tm_trace_concurrent(void) {
+  uint16_t num_indices = 50;
+  /* A tiny cache so that the readers keep evicting each other */
+  struct traffic_matrix_trace_t *trace = gen_sample_trace(4, "sample-concurrent-trace", num_indices);
+  assert(trace->map == 0);
+
+  struct traffic_matrix_t *expected[50] = {0};
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    traffic_matrix_trace_get(trace, i * 100, &expected[i]);
+    assert(expected[i] != 0);
+  }
+
+  struct pool_t *pool = pool_create(4);
+  struct pool_future_t future;
+  pool_future_init(&future);
+  struct _tm_trace_reader_t readers[16];
+  for (uint32_t i = 0; i < 16; ++i) {
+    readers[i].trace = trace;
+    readers[i].expected = expected;
+    readers[i].num_indices = num_indices;
+    readers[i].offset = i * 3;
+    pool_submit(pool, &future, _tm_trace_read, &readers[i]);
+  }
+  pool_future_wait(&future);
+  pool_future_destroy(&future);
+  pool_free(pool);
+
+  for (uint32_t i = 0; i < num_indices; ++i)
+    traffic_matrix_free(expected[i]);
+  traffic_matrix_trace_free(trace);
+  remove("sample-concurrent-trace.index");
+  remove("sample-concurrent-trace.data");
+}
+
+static uint32_t _cache2q_freed = 0;
+static void _cache2q_free_value(void *value) {
+  _cache2q_freed++;
+  free(value);
+}
+
+static int _cache2q_lookup(struct cache2q_t *cache, int64_t key) {
+  if (cache2q_get(cache, key))
+    return 1;
+  int64_t *value = malloc(sizeof(int64_t));
+  *value = key;
+  cache2q_put(cache, key, value, 1);
+  return 0;
+}
+
+void test_cache2q(void) {
+  struct cache2q_t *cache = cache2q_create(10, _cache2q_free_value);
+
+  /* A few hot keys interleaved with a long sequential scan */
+  uint32_t hot_hits = 0;
+  for (int64_t round = 0; round < 20; ++round) {
+    for (int64_t key = 0; key < 4; ++key) {
+      hot_hits += (uint32_t)_cache2q_lookup(cache, key);
+    }
+    for (int64_t key = 0; key < 10; ++key) {
+      assert(_cache2q_lookup(cache, 100 + round * 10 + key) == 0);
+    }
+  }
+
+  /* The scans don't flush the hot keys once they are promoted */
+  assert(hot_hits == 18 * 4);
+
+  struct cache2q_stats_t stats = {0};
+  cache2q_stats(cache, &stats);
+  assert(stats.hits == hot_hits);
+  assert(stats.misses == 20 * 14 - hot_hits);
+  assert(stats.ghost_hits == 4);
+  assert(stats.bytes <= 10 && stats.entries == stats.bytes);
+
+  /* Shrinking the budget evicts the values that don't fit */
+  cache2q_set_budget(cache, 4);
+  cache2q_stats(cache, &stats);
+  assert(stats.bytes <= 4);
+  assert(_cache2q_freed == stats.misses - stats.entries);
+
+  cache2q_free(cache);
+  assert(_cache2q_freed == stats.misses);
+}
+
+void test_tm_trace_prefetch(void) {
+  uint16_t num_indices = 50;
+  struct traffic_matrix_trace_t *trace = gen_sample_trace(100, "sample-prefetch-trace", num_indices);
+  traffic_matrix_trace_prefetch(trace, 8);
+
+  /* Moving forward (to 1) hands the next 8 positions (2 to 9) to the
+   * read-ahead thread and stopping the thread drains them */
+  struct traffic_matrix_trace_iter_t *iter = trace->iter(trace);
+  iter->begin(iter);
+  iter->next(iter);
+  traffic_matrix_trace_prefetch(trace, 0);
+  assert(trace->prefetched == 8);
+
+  struct cache2q_stats_t before = {0}, after = {0};
+  traffic_matrix_trace_cache_stats(trace, &before);
+  for (uint32_t i = 2; i <= 9; ++i) {
+    struct traffic_matrix_t *tm = 0;
+    traffic_matrix_trace_get(trace, i * 100, &tm);
+    assert(tm != 0);
+    traffic_matrix_free(tm);
+  }
+  traffic_matrix_trace_cache_stats(trace, &after);
+  assert(after.hits - before.hits == 8);
+  assert(after.misses == before.misses);
+
+  /* A full walk with the read-ahead on still sees every TM */
+  struct traffic_matrix_trace_t *loaded = load_sample_trace(100, "sample-prefetch-trace");
+  traffic_matrix_trace_prefetch(loaded, 4);
+  struct traffic_matrix_trace_iter_t *liter = loaded->iter(loaded);
+  uint32_t count = 0;
+  for (liter->begin(liter); !liter->end(liter); liter->next(liter)) {
+    struct traffic_matrix_t *tm = 0, *expected = 0;
+    liter->get(liter, &tm);
+    traffic_matrix_trace_get(trace, count * 100, &expected);
+    is_tm_equal(tm, expected);
+    traffic_matrix_free(tm);
+    traffic_matrix_free(expected);
+    count++;
+  }
+  assert(count == num_indices);
+  liter->free(liter);
+  iter->free(iter);
+
+  traffic_matrix_trace_free(loaded);
+  traffic_matrix_trace_free(trace);
+  remove("sample-prefetch-trace.index");
+  remove("sample-prefetch-trace.data");
+}
+
+void test_tm_trace_find(void) {
+  uint16_t num_indices = 50;
+
+  /* Evenly spaced keys are looked up directly */
+  struct traffic_matrix_trace_t *regular = gen_sample_trace(10, "sample-find-trace", num_indices);
+  uint32_t nth = 0;
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    assert(traffic_matrix_trace_find_key(regular, i * 100, &nth) == SUCCESS);
+    assert(nth == i);
+  }
+  assert(regular->_step == 100);
+  assert(traffic_matrix_trace_find_key(regular, 50, &nth) == FAILURE);
+  assert(traffic_matrix_trace_find_key(regular, -100, &nth) == FAILURE);
+  assert(traffic_matrix_trace_find_key(regular, num_indices * 100, &nth) == FAILURE);
+
+  struct traffic_matrix_trace_iter_t *iter = regular->iter(regular);
+  iter->go_to(iter, 1700);
+  assert(iter->state == 17);
+  iter->go_to(iter, 1750);
+  assert(iter->end(iter));
+  iter->free(iter);
+
+  /* Otherwise they go through a binary search (on the sorted index).  The
+   * keys are far enough apart that their differences don't fit in an int. */
+  struct traffic_matrix_trace_t *irregular = traffic_matrix_trace_create(10, 10, "sample-find-irregular-trace");
+  struct traffic_matrix_t *tm = 0;
+  traffic_matrix_random(&tm, 16, 10, 0.1);
+  for (int64_t i = num_indices - 1; i >= 0; --i) {
+    traffic_matrix_trace_add(irregular, tm, (i * i) << 32);
+  }
+  traffic_matrix_free(tm);
+
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    assert(traffic_matrix_trace_find_key(irregular, (trace_time_t)(i * i) << 32, &nth) == SUCCESS);
+    assert(nth == i);
+  }
+  assert(irregular->_step == 0);
+  assert(traffic_matrix_trace_find_key(irregular, 2, &nth) == FAILURE);
+
+  traffic_matrix_trace_free(regular);
+  traffic_matrix_trace_free(irregular);
+  remove("sample-find-trace.index");
+  remove("sample-find-trace.data");
+  remove("sample-find-irregular-trace.index");
+  remove("sample-find-irregular-trace.data");
+}
+
+void test_tm_trace_packed(void) {
+  uint16_t num_indices = 40;
+  uint32_t num_tors = 48;
+
+  /* Mostly empty TMs that change a little from one interval to the next */
+  struct traffic_matrix_t *base = 0;
+  traffic_matrix_random(&base, num_tors, 10, 0.3);
+  struct traffic_matrix_t **tms = malloc(sizeof(struct traffic_matrix_t *) * num_indices);
+  struct traffic_matrix_trace_t *trace = traffic_matrix_trace_create(10, 10, "sample-packed-trace");
+  traffic_matrix_trace_compress(trace, 8);
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    tms[i] = malloc(sizeof(struct traffic_matrix_t) + sizeof(struct pair_bw_t) * base->num_pairs);
+    memcpy(tms[i], base, sizeof(struct traffic_matrix_t) + sizeof(struct pair_bw_t) * base->num_pairs);
+    for (uint32_t j = 0; j < base->num_pairs / 20; ++j) {
+      tms[i]->bws[(uint32_t)rand() % base->num_pairs].bw = (bw_t)rand() / (bw_t)RAND_MAX;
+    }
+    traffic_matrix_trace_add(trace, tms[i], i * 100);
+  }
+  traffic_matrix_trace_save(trace);
+
+  /* Way smaller than the raw TMs: only the pairs that changed are stored */
+  size_t raw_size = num_indices *
+    (sizeof(struct traffic_matrix_t) + sizeof(struct pair_bw_t) * base->num_pairs);
+  assert(trace->largest_seek * 3 < raw_size);
+
+  /* Read back through the file and through the map */
+  struct traffic_matrix_trace_t *loaded = load_sample_trace(10, "sample-packed-trace");
+  assert(loaded->map != 0);
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    struct traffic_matrix_t *tm1 = 0, *tm2 = 0;
+    traffic_matrix_trace_get(trace, i * 100, &tm1);
+    traffic_matrix_trace_get(loaded, i * 100, &tm2);
+    is_tm_equal(tm1, tms[i]);
+    is_tm_equal(tm2, tms[i]);
+    assert(traffic_matrix_trace_get_nocopy(loaded, i * 100) == 0);
+    traffic_matrix_free(tm1);
+    traffic_matrix_free(tm2);
+  }
+
+  /* Packed TMs of mapped traces are decoded once into the cache */
+  struct cache2q_stats_t stats = {0};
+  traffic_matrix_trace_cache_stats(loaded, &stats);
+  assert(stats.misses == num_indices && stats.hits == 0 && stats.entries > 0);
+  struct traffic_matrix_t *again = 0;
+  traffic_matrix_trace_get(loaded, (num_indices - 1) * 100, &again);
+  is_tm_equal(again, tms[num_indices - 1]);
+  traffic_matrix_free(again);
+  traffic_matrix_trace_cache_stats(loaded, &stats);
+  assert(stats.hits == 1);
+
+  /* The read-ahead thread decodes them into the cache as well */
+  struct traffic_matrix_trace_t *ahead = load_sample_trace(10, "sample-packed-trace");
+  traffic_matrix_trace_prefetch(ahead, 8);
+  struct traffic_matrix_trace_iter_t *iter = ahead->iter(ahead);
+  iter->begin(iter);
+  iter->next(iter);
+  traffic_matrix_trace_prefetch(ahead, 0);
+  assert(ahead->prefetched == 8);
+  for (uint32_t i = 2; i <= 9; ++i) {
+    struct traffic_matrix_t *tm = 0;
+    traffic_matrix_trace_get(ahead, i * 100, &tm);
+    is_tm_equal(tm, tms[i]);
+    traffic_matrix_free(tm);
+  }
+  traffic_matrix_trace_cache_stats(ahead, &stats);
+  assert(stats.hits == 8 && stats.misses == 0);
+  iter->free(iter);
+  traffic_matrix_trace_free(ahead);
+
+  for (uint32_t i = 0; i < num_indices; ++i)
+    traffic_matrix_free(tms[i]);
+  free(tms);
+  traffic_matrix_free(base);
+  traffic_matrix_trace_free(loaded);
+  traffic_matrix_trace_free(trace);
+  remove("sample-packed-trace.index");
+  remove("sample-packed-trace.data");
+
+  /* Denser traffic: 40% of the pairs are busy and every busy pair changes a
+   * bit on every interval, so the deltas store as many pairs as the
+   * keyframes.  The values only differ in their low bits though. */
+  uint32_t num_pairs = num_tors * num_tors, nbusy = 0;
+  struct traffic_matrix_t *cur = traffic_matrix_zero(num_pairs);
+  for (uint32_t i = 0; i < num_pairs; ++i) {
+    if (rand() % 10 < 4) {
+      cur->bws[i].bw = 1 + 99 * (bw_t)rand() / (bw_t)RAND_MAX;
+      nbusy++;
+    }
+  }
+
+  num_indices = 64;
+  size_t tm_size = sizeof(struct traffic_matrix_t) + sizeof(struct pair_bw_t) * num_pairs;
+  struct traffic_matrix_trace_t *dense = traffic_matrix_trace_create(10, 10, "sample-packed-dense-trace");
+  traffic_matrix_trace_compress(dense, TRACE_DEFAULT_KEYFRAME_INTERVAL);
+  tms = malloc(sizeof(struct traffic_matrix_t *) * num_indices);
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    for (uint32_t j = 0; j < num_pairs; ++j) {
+      if (cur->bws[j].bw != 0)
+        cur->bws[j].bw *= 1 + ((bw_t)rand() / (bw_t)RAND_MAX - 0.5f) * 0.04f;
+    }
+    tms[i] = malloc(tm_size);
+    memcpy(tms[i], cur, tm_size);
+    traffic_matrix_trace_add(dense, tms[i], i * 100);
+  }
+  traffic_matrix_trace_save(dense);
+
+  /* Less than half the raw TMs, and below the busy pairs stored as full
+   * words (plus the bitmap) */
+  raw_size = num_indices * tm_size;
+  size_t words_size = num_indices * (num_pairs / 8 + nbusy * sizeof(uint32_t));
+  assert(dense->largest_seek * 2 < raw_size);
+  assert(dense->largest_seek * 10 < words_size * 9);
+
+  loaded = load_sample_trace(10, "sample-packed-dense-trace");
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    struct traffic_matrix_t *tm = 0;
+    traffic_matrix_trace_get(loaded, i * 100, &tm);
+    is_tm_equal(tm, tms[i]);
+    traffic_matrix_free(tm);
+    traffic_matrix_free(tms[i]);
+  }
+  free(tms);
+
+  traffic_matrix_free(cur);
+  traffic_matrix_trace_free(loaded);
+  traffic_matrix_trace_free(dense);
+  remove("sample-packed-dense-trace.index");
+  remove("sample-packed-dense-trace.data");
+}
+
+void test_tm_trace_format(void) {
+  uint16_t num_indices = 20;
+  uint32_t num_tors = 16, num_pods = 4;
+  uint32_t pod_of_tor[16];
+  for (uint32_t i = 0; i < num_tors; ++i)
+    pod_of_tor[i] = i / 4;
+
+  struct traffic_matrix_t **tms = malloc(sizeof(struct traffic_matrix_t *) * num_indices);
+  struct traffic_matrix_trace_t *trace = traffic_matrix_trace_create(10, 10, "sample-format-trace");
+  traffic_matrix_trace_set_meta(trace, num_tors, num_pods, pod_of_tor);
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    traffic_matrix_random(&tms[i], num_tors, 10, 1);
+    traffic_matrix_trace_add(trace, tms[i], i * 100);
+  }
+
+  /* Verified marks are in memory only */
+  struct traffic_matrix_t *first = 0;
+  traffic_matrix_trace_get(trace, 0, &first);
+  assert(trace->indices[0].flags & TRACE_INDEX_VERIFIED);
+  traffic_matrix_free(first);
+  traffic_matrix_trace_save(trace);
+
+  /* The metadata is in the header, no need for the .data file */
+  struct traffic_matrix_trace_meta_t meta;
+  struct traffic_matrix_trace_index_t *indices = 0;
+  assert(traffic_matrix_trace_read_meta("sample-format-trace", &meta, &indices) == SUCCESS);
+  assert(meta.version == TRACE_VERSION_2);
+  assert(meta.num_indices == num_indices);
+  assert(meta.num_tors == num_tors && meta.num_pods == num_pods);
+  assert(meta.time_step == 100);
+  assert(memcmp(meta.pod_of_tor, pod_of_tor, sizeof(pod_of_tor)) == 0);
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    assert(indices[i].flags & TRACE_INDEX_CHECKSUM);
+    assert(!(indices[i].flags & TRACE_INDEX_VERIFIED));
+  }
+  traffic_matrix_trace_meta_free(&meta);
+
+  /* Each TM is checksummed on its first read only */
+  struct traffic_matrix_trace_t *loaded = load_sample_trace(10, "sample-format-trace");
+  assert(loaded->meta.num_pods == num_pods);
+  traffic_matrix_trace_get(loaded, 100, &first);
+  traffic_matrix_free(first);
+  assert(loaded->indices[1].flags & TRACE_INDEX_VERIFIED);
+  assert(!(loaded->indices[2].flags & TRACE_INDEX_VERIFIED));
+  assert(traffic_matrix_trace_verify(loaded) == 0);
+  assert(loaded->indices[2].flags & TRACE_INDEX_VERIFIED);
+  traffic_matrix_trace_free(loaded);
+
+  /* Hand write a version 1 index for the same .data file */
+  FILE *v1 = fopen("sample-format-v1.index", "wb");
+  uint64_t count = num_indices;
+  fwrite(&count, sizeof(count), 1, v1);
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    fwrite(&indices[i].seek, sizeof(uint64_t), 1, v1);
+    fwrite(&indices[i].time, sizeof(trace_time_t), 1, v1);
+    fwrite(&indices[i].size, sizeof(uint64_t), 1, v1);
+  }
+  fclose(v1);
+  rename("sample-format-trace.data", "sample-format-v1.data");
+
+  loaded = load_sample_trace(10, "sample-format-v1");
+  assert(loaded->meta.version == TRACE_VERSION_1);
+  assert(loaded->num_indices == num_indices);
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    struct traffic_matrix_t *tm = 0;
+    traffic_matrix_trace_get(loaded, i * 100, &tm);
+    is_tm_equal(tm, tms[i]);
+    traffic_matrix_free(tm);
+  }
+  traffic_matrix_trace_free(loaded);
+
+  /* Flip a byte of a TM: verification should catch it */
+  FILE *data = fopen("sample-format-v1.data", "rb+");
+  fseek(data, (long)(indices[3].seek + indices[3].size - 1), SEEK_SET);
+  int c = fgetc(data);
+  fseek(data, (long)(indices[3].seek + indices[3].size - 1), SEEK_SET);
+  fputc(c ^ 0xff, data);
+  fclose(data);
+  rename("sample-format-v1.data", "sample-format-trace.data");
+
+  loaded = load_sample_trace(10, "sample-format-trace");
+  assert(traffic_matrix_trace_verify(loaded) == 1);
+  traffic_matrix_trace_free(loaded);
+
+  for (uint32_t i = 0; i < num_indices; ++i)
+    traffic_matrix_free(tms[i]);
+  free(tms);
+  free(indices);
+  traffic_matrix_trace_free(trace);
+  remove("sample-format-trace.index");
+  remove("sample-format-trace.data");
+  remove("sample-format-v1.index");
+}
+
+void test_tm_trace_writer(void) {
+  uint32_t num_indices = 60, num_tors = 16;
+  struct traffic_matrix_t **tms = malloc(sizeof(struct traffic_matrix_t *) * num_indices);
+  for (uint32_t i = 0; i < num_indices; ++i)
+    traffic_matrix_random(&tms[i], num_tors, 10, 0.5);
+  size_t tm_size = sizeof(struct traffic_matrix_t) + sizeof(struct pair_bw_t) * tms[0]->num_pairs;
+
+  /* Raw and packed, with buffers smaller than one TM and a few TMs large */
+  unsigned keyframes[] = {0, 0, 8};
+  size_t buffers[] = {tm_size / 2, tm_size * 5 + 7, 0};
+  for (uint32_t t = 0; t < 3; ++t) {
+    struct traffic_matrix_trace_t *trace = traffic_matrix_trace_create(10, 10, "sample-writer-trace");
+    traffic_matrix_trace_compress(trace, keyframes[t]);
+
+    /* First half through a writer, then the other half appended to the loaded trace */
+    struct traffic_matrix_trace_writer_t *writer = traffic_matrix_trace_writer_open(trace, buffers[t]);
+    for (uint32_t i = 0; i < num_indices / 2; ++i)
+      traffic_matrix_trace_writer_add(writer, tms[i], i * 100);
+    traffic_matrix_trace_writer_close(writer);
+    traffic_matrix_trace_free(trace);
+
+    trace = load_sample_trace(10, "sample-writer-trace");
+    writer = traffic_matrix_trace_writer_open(trace, buffers[t]);
+    for (uint32_t i = num_indices / 2; i < num_indices; ++i)
+      traffic_matrix_trace_writer_add(writer, tms[i], i * 100);
+    traffic_matrix_trace_writer_close(writer);
+    traffic_matrix_trace_free(trace);
+
+    trace = load_sample_trace(10, "sample-writer-trace");
+    assert(trace->num_indices == num_indices);
+    assert(traffic_matrix_trace_verify(trace) == 0);
+    for (uint32_t i = 0; i < num_indices; ++i) {
+      struct traffic_matrix_t *tm = 0;
+      traffic_matrix_trace_get(trace, i * 100, &tm);
+      is_tm_equal(tm, tms[i]);
+      traffic_matrix_free(tm);
+    }
+    traffic_matrix_trace_free(trace);
+  }
+
+  for (uint32_t i = 0; i < num_indices; ++i)
+    traffic_matrix_free(tms[i]);
+  free(tms);
+  remove("sample-writer-trace.index");
+  remove("sample-writer-trace.data");
+}
+
+void test_rollup(void) {
+  uint32_t num_indices = 200, num_tors = 12, num_pods = 3;
+  uint32_t pod_of_tor[12];
+  for (uint32_t i = 0; i < num_tors; ++i)
+    pod_of_tor[i] = i / 4;
+
+  struct traffic_matrix_t **tms = malloc(sizeof(struct traffic_matrix_t *) * num_indices);
+  struct traffic_matrix_trace_t *trace = traffic_matrix_trace_create(10, 10, "sample-rollup-trace");
+  for (uint32_t i = 0; i < num_indices; ++i) {
+    traffic_matrix_random(&tms[i], num_tors, 10, 1);
+    traffic_matrix_trace_add(trace, tms[i], i * 100);
+  }
+  traffic_matrix_trace_save(trace);
+  traffic_matrix_trace_free(trace);
+  trace = load_sample_trace(10, "sample-rollup-trace");
+
+  /* Built (and saved) the first time, mapped afterwards */
+  assert(trace_rollup_load(trace, num_tors, num_pods, pod_of_tor) == 0);
+  struct trace_rollup_t *built = trace_rollup_get(trace, num_tors, num_pods, pod_of_tor);
+  assert(!built->_mapped);
+  struct trace_rollup_t *rollup = trace_rollup_get(trace, num_tors, num_pods, pod_of_tor);
+  assert(rollup->_mapped && rollup->num_tms == num_indices);
+
+  /* Compare windows (within a block and across a few blocks) against going
+   * through the ToR pairs */
+  uint32_t cols = TRACE_ROLLUP_COLS(num_pods);
+  double (*tots)[7] = malloc(sizeof(double[7]) * num_indices);
+  for (uint64_t n = 0; n < num_indices; ++n) {
+    memset(tots[n], 0, sizeof(double[7]));
+    for (uint32_t s = 0; s < num_tors; ++s) {
+      for (uint32_t d = 0; d < num_tors; ++d) {
+        bw_t bw = tms[n]->bws[s * num_tors + d].bw;
+        tots[n][TRACE_ROLLUP_OUT(pod_of_tor[s])] += bw;
+        tots[n][TRACE_ROLLUP_IN(num_pods, pod_of_tor[d])] += bw;
+        if (pod_of_tor[s] != pod_of_tor[d])
+          tots[n][TRACE_ROLLUP_CORE(num_pods)] += bw;
+      }
+    }
+
+    bw_t const *matrix = trace_rollup_pod_matrix(rollup, n);
+    bw_t const *expected = trace_rollup_pod_matrix(built, n);
+    assert(memcmp(matrix, expected, sizeof(bw_t) * num_pods * num_pods) == 0);
+  }
+
+  uint64_t windows[][2] = {
+    {5, 17}, {0, num_indices}, {3, 150}, {31, 34}, {32, 64}, {40, 1}, {190, 50}};
+  for (uint32_t w = 0; w < sizeof(windows) / sizeof(windows[0]); ++w) {
+    uint64_t start = windows[w][0], end = MIN(start + windows[w][1], num_indices);
+    struct trace_rollup_stats_t stats[7];
+    trace_rollup_window(rollup, start, windows[w][1], stats);
+
+    double sums[7] = {0}, mins[7], maxs[7] = {0};
+    for (uint32_t c = 0; c < cols; ++c)
+      mins[c] = INFINITY;
+    for (uint64_t n = start; n < end; ++n) {
+      for (uint32_t c = 0; c < cols; ++c) {
+        sums[c] += tots[n][c];
+        mins[c] = MIN(mins[c], tots[n][c]);
+        maxs[c] = MAX(maxs[c], tots[n][c]);
+      }
+    }
+
+    for (uint32_t c = 0; c < cols; ++c) {
+      assert(fabs(stats[c].mean - sums[c] / (double)(end - start)) < 1e-3);
+      assert(fabs(stats[c].min - mins[c]) < 1e-3);
+      assert(fabs(stats[c].max - maxs[c]) < 1e-3);
+    }
+  }
+  free(tots);
+  trace_rollup_free(rollup);
+  trace_rollup_free(built);
+
+  /* Cached rollups stay on the trace */
+  struct trace_rollup_t *cached = trace_rollup_cached(trace, num_tors, num_pods, pod_of_tor);
+  assert(cached == trace->rollup && cached->num_tms == num_indices);
+  assert(trace_rollup_cached(trace, num_tors, num_pods, pod_of_tor) == cached);
+
+  /* A different pod mapping or a changed trace invalidates the rollup */
+  uint32_t pods_crc = cached->pods_crc;
+  pod_of_tor[0] = 1;
+  assert(trace_rollup_load(trace, num_tors, num_pods, pod_of_tor) == 0);
+  assert(trace_rollup_cached(trace, num_tors, num_pods, pod_of_tor)->pods_crc != pods_crc);
+  pod_of_tor[0] = 0;
+  traffic_matrix_trace_add(trace, tms[0], num_indices * 100);
+  assert(trace_rollup_load(trace, num_tors, num_pods, pod_of_tor) == 0);
+  cached = trace_rollup_cached(trace, num_tors, num_pods, pod_of_tor);
+  assert(cached->num_tms == num_indices + 1);
+
+  for (uint32_t i = 0; i < num_indices; ++i)
+    traffic_matrix_free(tms[i]);
+  free(tms);
+  traffic_matrix_trace_free(trace);
+  remove("sample-rollup-trace.index");
+  remove("sample-rollup-trace.data");
+  remove("sample-rollup-trace.rollup");
+}
+
 void test_predictor(void) {
   // So here's how the code should look:
   //
@@ -656,6 +1335,754 @@ void test_rvar_bucket(void) {
   r->free(r);
 }
 
+void test_rvar_power(void) {
+  int index = 0;
+  struct rvar_t *r = (struct rvar_t*)monte_carlo_rvar(_mc_run, 2, &index);
+
+  struct rvar_t *r1 = rvar_power(r, 1, 1);
+  assert(AEQ(r1->expected(r1), 0.5));
+
+  struct rvar_t *r0 = rvar_power(r, 0, 1);
+  assert(AEQ(r0->expected(r0), 0));
+  assert(AEQ(r0->percentile(r0, 1), 1));
+
+  /* Compare against repeated convolution */
+  struct rvar_t *rb = (struct rvar_t *)r->to_bucket(r, 1);
+  struct rvar_t *acc = rb->copy(rb), *tmp = 0;
+  for (uint32_t k = 2; k <= 7; ++k) {
+    tmp = acc->convolve(acc, rb, 1);
+    acc->free(acc);
+    acc = tmp;
+
+    struct rvar_t *rk = rvar_power(r, k, 1);
+    assert(AEQ(rk->percentile(rk, 0.5), acc->percentile(acc, 0.5)));
+    assert(AEQ(rk->percentile(rk, 0.5), (k * 0.5 + 0.5)));
+
+    /* Bucket compression is lossy, but squaring compresses fewer times than
+     * the linear convolution does */
+    assert(fabs(rk->expected(rk) - k * 0.5) <= fabs(acc->expected(acc) - k * 0.5) + EPS);
+    if (k <= 4)
+      assert(AEQ(rk->expected(rk), (k * 0.5)));
+    rk->free(rk);
+  }
+
+  acc->free(acc);
+  rb->free(rb);
+  r0->free(r0);
+  r1->free(r1);
+  r->free(r);
+}
+
+void test_rvar_sketch(void) {
+  int index = 0;
+  uint32_t nsamples = 100000;
+
+  /* Samples are 0 ... nsamples-1 */
+  struct rvar_t *r = (struct rvar_t *)monte_carlo_sketch_rvar(
+      _mc_run, nsamples, &index, RVAR_SKETCH_DEFAULT_K);
+  struct rvar_sketch_t *sk = (struct rvar_sketch_t *)r;
+  assert(sk->count == nsamples);
+
+  /* Memory should be bounded */
+  uint32_t nitems = 0;
+  for (uint32_t h = 0; h < sk->nlevels; ++h)
+    nitems += sk->sizes[h];
+  assert(nitems < 4 * RVAR_SKETCH_DEFAULT_K);
+
+  assert(AEQ(r->expected(r), (nsamples - 1) / 2.0));
+  assert(AEQ(r->percentile(r, 0), 0));
+  assert(AEQ(r->percentile(r, 1), (nsamples - 1)));
+
+  /* Percentiles within 2% rank error */
+  float ps[] = {0.1, 0.25, 0.5, 0.75, 0.9, 0.99};
+  for (uint32_t i = 0; i < sizeof(ps)/sizeof(float); ++i) {
+    rvar_type_t val = r->percentile(r, ps[i]);
+    assert(abs(val / nsamples - ps[i]) < 0.02);
+  }
+
+  /* Adding samples after a query shouldn't reuse the stale sorted view */
+  struct rvar_t *grow = rvar_sketch_create(RVAR_SKETCH_DEFAULT_K);
+  for (uint32_t i = 0; i < 1000; ++i)
+    rvar_sketch_add(grow, 1);
+  assert(AEQ(grow->percentile(grow, 0.9), 1));
+  for (uint32_t i = 0; i < 9000; ++i)
+    rvar_sketch_add(grow, 2);
+  assert(AEQ(grow->percentile(grow, 0.5), 2));
+  grow->free(grow);
+
+  /* Merging two halves should look like the whole */
+  struct rvar_t *lo = rvar_sketch_create(RVAR_SKETCH_DEFAULT_K);
+  struct rvar_t *hi = rvar_sketch_create(RVAR_SKETCH_DEFAULT_K);
+  for (uint32_t i = 0; i < nsamples; ++i) {
+    rvar_sketch_add(i < nsamples / 2 ? lo : hi, i);
+  }
+  rvar_sketch_merge(lo, hi);
+  assert(AEQ(lo->expected(lo), r->expected(r)));
+  assert(abs(lo->percentile(lo, 0.5) / nsamples - 0.5) < 0.02);
+
+  /* Serialization round trip */
+  size_t size = 0;
+  char *data = lo->serialize(lo, &size);
+  struct rvar_t *de = rvar_deserialize(data);
+  free(data);
+  assert(de->_type == SKETCHED);
+  assert(AEQ(de->expected(de), lo->expected(lo)));
+  assert(AEQ(de->percentile(de, 0.3), lo->percentile(lo, 0.3)));
+
+  /* Bucketing and convolving against a sampled rvar */
+  struct rvar_bucket_t *rb = r->to_bucket(r, 1000);
+  rvar_type_t cdf = 0;
+  for (uint32_t i = 0; i < rb->nbuckets; ++i)
+    cdf += rb->buckets[i].prob;
+  assert(AEQ(cdf, 1));
+
+  struct rvar_t *fixed = rvar_fixed(1);
+  struct rvar_t *sum = r->convolve(r, fixed, 1000);
+  assert(abs(sum->expected(sum) - (r->expected(r) + 1)) / nsamples < 0.02);
+
+  sum->free(sum);
+  fixed->free(fixed);
+  rb->free((struct rvar_t *)rb);
+  de->free(de);
+  hi->free(hi);
+  lo->free(lo);
+  r->free(r);
+}
+
+void test_rvar_sparse(void) {
+  /* 90% zero with a thin tail */
+  struct bucket_t buckets[] = {{0, 0.9}, {3, 0.06}, {7, 0.04}};
+  struct rvar_t *rb = rvar_from_buckets(buckets, 3, 1);
+  struct rvar_t *rs = rvar_to_sparse(rb, 1);
+
+  assert(rs->_type == SPARSE);
+  assert(AEQ(rvar_zero_mass(rs), 0.9));
+  assert(AEQ(rs->expected(rs), rb->expected(rb)));
+  assert(AEQ(rs->percentile(rs, 0.5), rb->percentile(rb, 0.5)));
+  assert(AEQ(rs->percentile(rs, 0.95), rb->percentile(rb, 0.95)));
+
+  /* Bucketing rounds the tail and merges the values in the same bucket */
+  struct rvar_bucket_t *coarse = rs->to_bucket(rs, 0.2);
+  assert(coarse->nbuckets == 2);
+  assert(AEQ(coarse->buckets[0].val, 0) && AEQ(coarse->buckets[0].prob, 0.96));
+  assert(AEQ(coarse->buckets[1].val, 5) && AEQ(coarse->buckets[1].prob, 0.04));
+  coarse->free((struct rvar_t *)coarse);
+
+  /* Convolution should match the bucketed convolution */
+  struct rvar_t *bb = rb->convolve(rb, rb, 1);
+  struct rvar_t *ss = rs->convolve(rs, rs, 1);
+  struct rvar_t *sb = rs->convolve(rs, rb, 1);
+  assert(ss->_type == SPARSE && sb->_type == SPARSE);
+  assert(AEQ(rvar_zero_mass(ss), 0.81));
+  assert(AEQ(ss->expected(ss), bb->expected(bb)));
+  assert(AEQ(sb->expected(sb), ss->expected(ss)));
+  assert(AEQ(ss->percentile(ss, 0.5), bb->percentile(bb, 0.5)));
+
+  /* Composition */
+  struct rvar_t *rvs[] = {rs, ss};
+  double dists[] = {0.5, 0.5};
+  struct rvar_t *comp = rvar_compose_with_distributions(rvs, dists, 2);
+  assert(comp->_type == SPARSE);
+  assert(AEQ(rvar_zero_mass(comp), (0.9 + 0.81)/2));
+  assert(AEQ(comp->expected(comp), (rs->expected(rs) + ss->expected(ss))/2));
+
+  /* Serialization round trip */
+  size_t size = 0;
+  char *data = comp->serialize(comp, &size);
+  struct rvar_t *de = rvar_deserialize(data);
+  free(data);
+  assert(AEQ(de->expected(de), comp->expected(comp)));
+  assert(AEQ(rvar_zero_mass(de), rvar_zero_mass(comp)));
+
+  de->free(de);
+  comp->free(comp);
+  sb->free(sb);
+  ss->free(ss);
+  bb->free(bb);
+  rs->free(rs);
+  rb->free(rb);
+}
+
+void test_rvar_compose(void) {
+  /* Compose a few overlapping distributions and compare against sorting all
+   * the buckets */
+  unsigned const nrvars = 5, nbuckets = 40;
+  struct rvar_t *rvars[5];
+  double dists[5];
+  struct bucket_t *all = malloc(sizeof(struct bucket_t) * nrvars * nbuckets);
+  rvar_type_t dsum = 0;
+
+  for (uint32_t i = 0; i < nrvars; ++i) {
+    dists[i] = i + 1;
+    dsum += dists[i];
+  }
+
+  unsigned nall = 0;
+  for (uint32_t i = 0; i < nrvars; ++i) {
+    struct bucket_t buckets[40];
+    for (uint32_t j = 0; j < nbuckets; ++j) {
+      buckets[j].val = i * 3 + j * 2;
+      buckets[j].prob = 1.0 / nbuckets;
+    }
+    rvars[i] = rvar_from_buckets(buckets, nbuckets, 1);
+
+    struct rvar_bucket_t *rb = (struct rvar_bucket_t *)rvars[i];
+    for (uint32_t j = 0; j < rb->nbuckets; ++j) {
+      all[nall].val = rb->buckets[j].val;
+      all[nall].prob = rb->buckets[j].prob * dists[i] / dsum;
+      nall++;
+    }
+  }
+
+  struct rvar_t *comp = rvar_compose_with_distributions(rvars, dists, nrvars);
+  struct rvar_t *sorted = rvar_from_buckets(all, nall, 1);
+  assert(AEQ(comp->expected(comp), sorted->expected(sorted)));
+  assert(AEQ(comp->percentile(comp, 0.5), sorted->percentile(sorted, 0.5)));
+  assert(AEQ(comp->percentile(comp, 0.9), sorted->percentile(sorted, 0.9)));
+
+  /* The _into variant should produce the same buckets */
+  struct bucket_t *out = malloc(sizeof(struct bucket_t) * rvar_compose_size(rvars, nrvars));
+  rvar_type_t bucket_size = 0;
+  unsigned nout = rvar_compose_with_distributions_into(rvars, dists, nrvars, out, &bucket_size);
+  struct rvar_bucket_t *cb = (struct rvar_bucket_t *)comp;
+  assert(nout == cb->nbuckets);
+  assert(bucket_size == 1);
+  for (uint32_t i = 0; i < nout; ++i) {
+    assert(AEQ(out[i].val, cb->buckets[i].val));
+    assert(AEQ(out[i].prob, cb->buckets[i].prob));
+  }
+
+  free(out);
+  free(all);
+  sorted->free(sorted);
+  comp->free(comp);
+  for (uint32_t i = 0; i < nrvars; ++i)
+    rvars[i]->free(rvars[i]);
+}
+
+void test_rvar_bucket_limit(void) {
+  struct bucket_t buckets[100], copy[100];
+  for (uint32_t i = 0; i < 100; ++i) {
+    buckets[i].val = i * i;
+    buckets[i].prob = 0.01;
+  }
+  memcpy(copy, buckets, sizeof(buckets));
+
+  struct rvar_t *unbounded = rvar_from_buckets(buckets, 100, 1);
+
+  rvar_rebin_error(1);
+  rvar_bucket_limit_set(8);
+  struct rvar_t *bounded = rvar_from_buckets(copy, 100, 1);
+  rvar_bucket_limit_set(0);
+
+  struct rvar_bucket_t *rb = (struct rvar_bucket_t *)bounded;
+  assert(rb->nbuckets <= 8);
+  assert(rb->nbuckets < ((struct rvar_bucket_t *)unbounded)->nbuckets);
+
+  /* Mass and mean are kept */
+  rvar_type_t mass = 0;
+  for (uint32_t i = 0; i < rb->nbuckets; ++i)
+    mass += rb->buckets[i].prob;
+  assert(AEQ(mass, 1));
+  assert(AEQ(bounded->expected(bounded), unbounded->expected(unbounded)));
+  assert(rvar_rebin_error(1) > 0);
+  assert(rvar_rebin_error(0) == 0);
+
+  bounded->free(bounded);
+  unbounded->free(unbounded);
+}
+
+rvar_type_t _mc_run_value(void *data) {
+  return *(rvar_type_t *)data;
+}
+
+static int _float_comp_test(void const *v1, void const *v2) {
+  rvar_type_t f1 = *(rvar_type_t const *)v1;
+  rvar_type_t f2 = *(rvar_type_t const *)v2;
+  return (f1 > f2) - (f1 < f2);
+}
+
+void test_rvar_sample_sort(void) {
+  /* Big enough to go through the radix sort, with negatives and dups */
+  uint32_t nvals = 5000;
+  rvar_type_t *vals = malloc(sizeof(rvar_type_t) * nvals);
+  rvar_type_t *ref = malloc(sizeof(rvar_type_t) * nvals);
+  for (uint32_t i = 0; i < nvals; ++i) {
+    vals[i] = ((rvar_type_t)((i * 7919) % 1013) - 500.25) * 1e-3;
+    ref[i] = vals[i];
+  }
+  vals[17] = -0.0; ref[17] = -0.0;
+  qsort(ref, nvals, sizeof(rvar_type_t), _float_comp_test);
+
+  struct rvar_t *rv = rvar_sample_create_with_vals(vals, nvals);
+  struct rvar_sample_t *rs = (struct rvar_sample_t *)rv;
+
+  /* Sorted on creation so the rvar can be shared between threads */
+  assert(rs->sorted == 1);
+  assert(rs->low == ref[0] && rs->high == ref[nvals - 1]);
+  assert(rv->percentile(rv, 0) == ref[0]);
+  assert(rv->percentile(rv, 1) == ref[nvals - 1]);
+  for (uint32_t i = 0; i < nvals; ++i) {
+    assert(rs->vals[i] == ref[i]);
+  }
+
+  /* Copies keep the ordering */
+  struct rvar_t *copy = rv->copy(rv);
+  assert(((struct rvar_sample_t *)copy)->sorted == 1);
+  assert(((struct rvar_sample_t *)copy)->low == ref[0]);
+
+  /* Sorted constructor doesn't touch the data */
+  rvar_type_t *svals = malloc(sizeof(rvar_type_t) * nvals);
+  memcpy(svals, ref, sizeof(rvar_type_t) * nvals);
+  struct rvar_t *sorted = rvar_sample_create_with_sorted_vals(svals, nvals);
+  assert(AEQ(sorted->expected(sorted), rv->expected(rv)));
+  assert(sorted->percentile(sorted, 0.5) == rv->percentile(rv, 0.5));
+
+  sorted->free(sorted);
+  copy->free(copy);
+  rv->free(rv);
+  free(ref);
+}
+
+void test_monte_carlo_bucket(void) {
+  struct pool_t *pool = pool_create(4);
+  uint32_t nsteps = 10000;
+  rvar_type_t *vals = malloc(sizeof(rvar_type_t) * nsteps);
+  rvar_type_t *copy = malloc(sizeof(rvar_type_t) * nsteps);
+  for (uint32_t i = 0; i < nsteps; ++i) {
+    vals[i] = (rvar_type_t)((i * 7919) % 100) - 20.5;
+    copy[i] = vals[i];
+  }
+
+  struct rvar_bucket_t *hist = monte_carlo_parallel_bucket_rvar(
+      _mc_run_value, vals, nsteps, sizeof(rvar_type_t), pool, 1);
+  struct rvar_t *sample = rvar_sample_create_with_vals(copy, nsteps);
+  struct rvar_bucket_t *rb = sample->to_bucket(sample, 1);
+
+  assert(hist->nbuckets == rb->nbuckets);
+  for (uint32_t i = 0; i < hist->nbuckets; ++i) {
+    assert(AEQ(hist->buckets[i].val, rb->buckets[i].val));
+    assert(AEQ(hist->buckets[i].prob, rb->buckets[i].prob));
+  }
+
+  /* Values simulated elsewhere are bucketized the same way */
+  struct monte_carlo_hist_t *vh = monte_carlo_hist_create(1);
+  for (uint32_t i = 0; i < nsteps; ++i) {
+    monte_carlo_hist_add(vh, vals[i]);
+  }
+  struct rvar_bucket_t *fv = monte_carlo_hist_rvar(vh);
+  monte_carlo_hist_free(vh);
+  assert(fv->nbuckets == hist->nbuckets);
+  for (uint32_t i = 0; i < hist->nbuckets; ++i) {
+    assert(AEQ(fv->buckets[i].val, hist->buckets[i].val));
+    assert(AEQ(fv->buckets[i].prob, hist->buckets[i].prob));
+  }
+  fv->free((struct rvar_t *)fv);
+
+  /* Far apart samples only cost their own buckets */
+  struct monte_carlo_hist_t *mh = monte_carlo_hist_create(1);
+  monte_carlo_hist_add(mh, -1e12);
+  monte_carlo_hist_add(mh, 0.5);
+  monte_carlo_hist_add(mh, 1e12);
+  monte_carlo_hist_add(mh, 1e12);
+  assert(monte_carlo_hist_count(mh) == 4);
+  struct rvar_bucket_t *far = monte_carlo_hist_rvar(mh);
+  assert(far->nbuckets == 3);
+  assert(far->buckets[0].val == -1e12 && far->buckets[1].val == 0);
+  assert(far->buckets[2].val == 1e12 && AEQ(far->buckets[2].prob, 0.5));
+  far->free((struct rvar_t *)far);
+  monte_carlo_hist_free(mh);
+
+  /* Chunked sketches should see every sample */
+  struct rvar_sketch_t *sk = monte_carlo_parallel_sketch_rvar(
+      _mc_run_value, vals, nsteps, sizeof(rvar_type_t), pool, RVAR_SKETCH_DEFAULT_K);
+  assert(sk->count == nsteps);
+  assert(AEQ(sk->expected((struct rvar_t *)sk), sample->expected(sample)));
+
+  sk->free((struct rvar_t *)sk);
+  rb->free((struct rvar_t *)rb);
+  hist->free((struct rvar_t *)hist);
+  sample->free(sample);
+  free(vals);
+  pool_free(pool);
+}
+
+static void _mc_run_multi(void *data, rvar_type_t **vals, unsigned nvars) {
+  rvar_type_t val = *(rvar_type_t *)data;
+  for (uint32_t j = 0; j < nvars; ++j) {
+    *vals[j] = val * (rvar_type_t)(j + 1);
+  }
+}
+
+void test_monte_carlo_multi(void) {
+  struct pool_t *pool = pool_create(4);
+  uint32_t nsteps = 1000, nvars = 3;
+  rvar_type_t *vals = malloc(sizeof(rvar_type_t) * nsteps);
+  for (uint32_t i = 0; i < nsteps; ++i) {
+    vals[i] = (rvar_type_t)((i * 7919) % 100);
+  }
+
+  /* Parallel runs are returned in order */
+  rvar_type_t **ret = monte_carlo_parallel_ordered_multi_rvar(
+      _mc_run_multi, vals, nsteps, sizeof(rvar_type_t), nvars, pool);
+  for (uint32_t j = 0; j < nvars; ++j) {
+    for (uint32_t i = 0; i < nsteps; ++i) {
+      assert(ret[j][i] == vals[i] * (j + 1));
+    }
+    free(ret[j]);
+  }
+  free(ret);
+
+  /* The serial version feeds the same data to every run */
+  struct rvar_sample_t **rvs = monte_carlo_multi_rvar(_mc_run_multi, 10, nvars, &vals[1]);
+  for (uint32_t j = 0; j < nvars; ++j) {
+    struct rvar_t *rv = (struct rvar_t *)rvs[j];
+    assert(rvs[j]->num_samples == 10);
+    assert(AEQ(rv->expected(rv), (vals[1] * (j + 1))));
+    rv->free(rv);
+  }
+  free(rvs);
+  free(vals);
+  pool_free(pool);
+}
+
+static void _pool_add(void *data) {
+  __atomic_fetch_add((unsigned *)data, 1, __ATOMIC_RELAXED);
+}
+
+static void _pool_mark_worker(void *data) {
+  unsigned *seen = (unsigned *)data;
+  unsigned id = pool_worker_id();
+  assert(id < 3);
+  __atomic_fetch_add(&seen[id], 1, __ATOMIC_RELAXED);
+}
+
+void test_pool(void) {
+  struct pool_t *pool = pool_create(3);
+  assert(pool_size(pool) == 3);
+
+  /* Two callers sharing the pool wait on their own futures */
+  unsigned counts[2] = {0};
+  struct pool_future_t futures[2];
+  pool_future_init(&futures[0]);
+  pool_future_init(&futures[1]);
+  for (uint32_t i = 0; i < 1000; ++i) {
+    pool_submit(pool, &futures[i % 2], _pool_add, &counts[i % 2]);
+  }
+  pool_future_wait(&futures[0]);
+  assert(__atomic_load_n(&counts[0], __ATOMIC_RELAXED) == 500);
+  pool_future_wait(&futures[1]);
+  assert(counts[1] == 500);
+
+  /* The same workers are reused across monte carlo calls */
+  rvar_type_t vals[64];
+  for (uint32_t i = 0; i < 64; ++i) vals[i] = i;
+  for (uint32_t round = 0; round < 100; ++round) {
+    rvar_type_t *ret = monte_carlo_parallel_ordered_rvar(
+        _mc_run_value, vals, 64, sizeof(rvar_type_t), pool);
+    for (uint32_t i = 0; i < 64; ++i) assert(ret[i] == vals[i]);
+    free(ret);
+  }
+
+  /* Every job runs on a worker, and only there we have a worker id */
+  unsigned seen[3] = {0};
+  assert(pool_worker_id() == POOL_NOT_A_WORKER);
+  for (uint32_t i = 0; i < 300; ++i) {
+    pool_submit(pool, &futures[0], _pool_mark_worker, seen);
+  }
+  pool_future_wait(&futures[0]);
+  assert(seen[0] + seen[1] + seen[2] == 300);
+
+  /* Broadcasts run exactly once on every worker */
+  memset(seen, 0, sizeof(seen));
+  pool_broadcast(pool, _pool_mark_worker, seen);
+  assert(seen[0] == 1 && seen[1] == 1 && seen[2] == 1);
+
+  /* Pinned workers spread over the allowed cpus and keep on working */
+  pool_pin(pool);
+  for (uint32_t i = 0; i < 3; ++i) {
+    assert(pool_worker_cpu(pool, i) == affinity_cpu(i));
+    assert(pool_worker_node(pool, i) >= -1);
+  }
+  memset(seen, 0, sizeof(seen));
+  for (uint32_t i = 0; i < 300; ++i) {
+    pool_submit(pool, &futures[0], _pool_mark_worker, seen);
+  }
+  pool_future_wait(&futures[0]);
+  assert(seen[0] + seen[1] + seen[2] == 300);
+
+  pool_future_destroy(&futures[0]);
+  pool_future_destroy(&futures[1]);
+  pool_free(pool);
+}
+
+struct _queue_consumer_t {
+  struct queue_t *queue;
+  uint64_t sum;
+};
+
+static void _queue_consume(void *data) {
+  struct _queue_consumer_t *consumer = (struct _queue_consumer_t *)data;
+  void *item = 0;
+  while (queue_pop(consumer->queue, &item)) {
+    __atomic_fetch_add(&consumer->sum, (uint64_t)(uintptr_t)item, __ATOMIC_RELAXED);
+  }
+}
+
+void test_queue(void) {
+  struct pool_t *pool = pool_create(3);
+  struct queue_t *queue = queue_create(4);
+  struct _queue_consumer_t consumer = {queue, 0};
+
+  /* The producer is bounded by the queue, the consumers drain it and stop
+   * once it's closed */
+  struct pool_future_t future;
+  pool_future_init(&future);
+  for (uint32_t i = 0; i < 3; ++i) {
+    pool_submit(pool, &future, _queue_consume, &consumer);
+  }
+  for (uintptr_t i = 1; i <= 1000; ++i) {
+    queue_push(queue, (void *)i);
+  }
+  queue_close(queue);
+  pool_future_wait(&future);
+  assert(consumer.sum == 1000 * 1001 / 2);
+
+  void *item = 0;
+  assert(queue_pop(queue, &item) == 0);
+
+  pool_future_destroy(&future);
+  queue_free(queue);
+  pool_free(pool);
+}
+
+void test_dataplane_arena(void) {
+  struct dataplane_t dp = {0};
+
+  /* Allocations are aligned and spill over to new blocks */
+  char *ptrs[64];
+  for (uint32_t i = 0; i < 64; ++i) {
+    ptrs[i] = dataplane_alloc(&dp, 4096 + i);
+    assert(((uintptr_t)ptrs[i] % 16) == 0);
+    memset(ptrs[i], (int)i, 4096 + i);
+  }
+  for (uint32_t i = 0; i < 64; ++i) {
+    assert(ptrs[i][4095 + i] == (char)i);
+  }
+  assert(dp.arena->next != 0);
+
+  /* Rewinding merges the blocks so the next dataplane fits in one */
+  dataplane_init(&dp);
+  assert(dp.arena && dp.arena->next == 0);
+  for (uint32_t i = 0; i < 64; ++i) {
+    dataplane_alloc(&dp, 4096 + i);
+  }
+  assert(dp.arena->next == 0);
+
+  dataplane_free_resources(&dp);
+  assert(dp.arena == 0);
+}
+
+/* Mop that drains (at most) one switch */
+struct _test_mop_t {
+  struct mop_t;
+  switch_id_t sw;
+  int drain;
+};
+
+static int _test_mop_pre(struct mop_t *mop, struct network_t *net) {
+  struct _test_mop_t *tm = (struct _test_mop_t *)mop;
+  if (tm->drain)
+    jupiter_drain_switch(net, tm->sw);
+  return 0;
+}
+
+static int _test_mop_post(struct mop_t *mop, struct network_t *net) {
+  struct _test_mop_t *tm = (struct _test_mop_t *)mop;
+  if (tm->drain)
+    jupiter_undrain_switch(net, tm->sw);
+  return 0;
+}
+
+/* Predictor iterator over a fixed list of samples */
+struct _test_pred_iter_t {
+  struct predictor_iterator_t;
+  struct traffic_matrix_t **tms;
+  unsigned nsamples, duration, sample;
+};
+
+static int _test_pred_iter_end(struct predictor_iterator_t *iter) {
+  struct _test_pred_iter_t *it = (struct _test_pred_iter_t *)iter;
+  return it->sample >= it->nsamples;
+}
+
+static int _test_pred_iter_next(struct predictor_iterator_t *iter) {
+  ((struct _test_pred_iter_t *)iter)->sample++;
+  return 1;
+}
+
+static unsigned _test_pred_iter_cur_into(
+    struct predictor_iterator_t *iter, struct traffic_matrix_t **tms) {
+  struct _test_pred_iter_t *it = (struct _test_pred_iter_t *)iter;
+  for (uint32_t i = 0; i < it->duration; ++i) {
+    struct traffic_matrix_t *tm = it->tms[it->sample * it->duration + i];
+    size_t size = sizeof(struct traffic_matrix_t) + sizeof(struct pair_bw_t) * tm->num_pairs;
+    if (!tms[i])
+      tms[i] = malloc(size);
+    memcpy(tms[i], tm, size);
+  }
+  return it->duration;
+}
+
+static struct network_t *_test_clone_network(struct expr_t const *expr) {
+  return jupiter_network_create(4, 2, 2, 4, 10);
+}
+
+void test_exec_stream(void) {
+  uint32_t nsamples = 8, duration = 2, nmops = 3, first = 3;
+
+  struct expr_t expr;
+  memset(&expr, 0, sizeof(struct expr_t));
+  expr.mop_duration = duration;
+  expr.num_threads = 3;
+  expr.clone_network = _test_clone_network;
+  expr.risk_violation_cost = risk_cost_string_to_func("linear-100-1-1000");
+
+  struct traffic_matrix_t **tms = malloc(sizeof(struct traffic_matrix_t *) * nsamples * duration);
+  for (uint32_t i = 0; i < nsamples * duration; ++i) {
+    traffic_matrix_random(&tms[i], 8, 40, 0.8);
+  }
+
+  /* No-op, one agg drained, two aggs of the same pod drained */
+  struct network_t *net = _test_clone_network(&expr);
+  struct _test_mop_t mop_data[3];
+  struct mop_t *mops[3];
+  memset(mop_data, 0, sizeof(mop_data));
+  for (uint32_t m = 0; m < nmops; ++m) {
+    mop_data[m].pre = _test_mop_pre;
+    mop_data[m].post = _test_mop_post;
+    mop_data[m].drain = (m != 0);
+    mop_data[m].sw = jupiter_get_agg(net, 0, m - (m != 0));
+    mops[m] = (struct mop_t *)&mop_data[m];
+  }
+
+  /* Serial costs of the same samples */
+  struct risk_cost_func_t *func = expr.risk_violation_cost;
+  struct dataplane_t dp = {0};
+  rvar_type_t expected[3][8];
+  rvar_type_t total = 0;
+  for (uint32_t m = 0; m < nmops; ++m) {
+    _test_mop_pre(mops[m], net);
+    for (uint32_t s = 0; s < nsamples; ++s) {
+      expected[m][s] = 0;
+      for (uint32_t i = 0; i < duration; ++i) {
+        struct traffic_matrix_t *tm = tms[s * duration + i];
+        net->set_traffic(net, tm);
+        net->get_dataplane(net, &dp);
+        maxmin(&dp);
+        int violations = dataplane_count_violations(&dp, expr.promised_throughput);
+        expected[m][s] += func->cost(func, (rvar_type_t)violations/(rvar_type_t)tm->num_pairs);
+      }
+      total += expected[m][s];
+    }
+    _test_mop_post(mops[m], net);
+  }
+  assert(total > 0);
+
+  struct _test_pred_iter_t iter;
+  memset(&iter, 0, sizeof(iter));
+  iter.end = _test_pred_iter_end;
+  iter.next = _test_pred_iter_next;
+  iter.cur_into = _test_pred_iter_cur_into;
+  iter.tms = tms;
+  iter.nsamples = nsamples;
+  iter.duration = duration;
+
+  /* Two rounds: the iterator is left after the last sample pulled */
+  struct exec_t *exec = malloc(sizeof(struct exec_t));
+  memset(exec, 0, sizeof(struct exec_t));
+  rvar_type_t **r1 = exec_simulate_stream(
+      exec, &expr, mops, nmops, (struct predictor_iterator_t *)&iter, first);
+  assert(iter.sample == first);
+  rvar_type_t **r2 = exec_simulate_stream(
+      exec, &expr, mops, nmops, (struct predictor_iterator_t *)&iter, nsamples - first);
+  assert(iter.sample == nsamples);
+
+  for (uint32_t m = 0; m < nmops; ++m) {
+    for (uint32_t s = 0; s < nsamples; ++s) {
+      rvar_type_t val = (s < first) ? r1[m][s] : r2[m][s - first];
+      assert(AEQ(val, expected[m][s]));
+    }
+    free(r1[m]);
+    free(r2[m]);
+  }
+  free(r1);
+  free(r2);
+
+  /* The workers' networks are left without any mop */
+  for (uint32_t i = 0; i < exec->nnet_dp; ++i) {
+    assert(exec->net_dp[i].mop == 0);
+  }
+  exec_free(exec);
+
+  dataplane_free_resources(&dp);
+  net->free(net);
+  for (uint32_t i = 0; i < nsamples * duration; ++i) {
+    free(tms[i]);
+  }
+  free(tms);
+  free(func);
+}
+
+static void _test_sampling_fill(struct pug_sampling_t *s, rvar_type_t lo, rvar_type_t hi) {
+  rvar_type_t vals[10];
+  for (uint32_t i = 0; i < 10; ++i) {
+    vals[i] = (i % 2) ? hi : lo;
+  }
+  pug_sampling_init(s);
+  pug_sampling_add(s, vals, 10);
+}
+
+void test_pug_sampling(void) {
+  struct expr_t expr;
+  memset(&expr, 0, sizeof(struct expr_t));
+  expr.pug_adaptive_error = 0.05;
+
+  /* 0: noisy and expensive, but the empty subplan is never dominated
+   * 1: noisy and dominated by 2
+   * 2: noisy and the cheapest
+   * 3: converged (no variance)
+   * 4: not enough samples for an interval */
+  struct pug_sampling_t samples[5];
+  _test_sampling_fill(&samples[0], 500, 700);
+  _test_sampling_fill(&samples[1], 50, 150);
+  _test_sampling_fill(&samples[2], 5, 15);
+  _test_sampling_fill(&samples[3], 42, 42);
+  pug_sampling_init(&samples[4]);
+  rvar_type_t one = 1000;
+  pug_sampling_add(&samples[4], &one, 1);
+
+  assert(samples[2].nvals == 10 && AEQ(pug_sampling_mean(&samples[2]), 10));
+  assert(monte_carlo_hist_count(samples[2].hist) == 10);
+  assert(pug_sampling_halfwidth(&samples[3]) == 0);
+  assert(isinf(pug_sampling_halfwidth(&samples[4])));
+
+  pug_sampling_stop(&expr, samples, 5);
+  assert(samples[0].active);
+  assert(!samples[1].active);
+  assert(samples[2].active);
+  assert(!samples[3].active);
+  assert(samples[4].active);
+
+  /* Inactive subplans stay inactive */
+  pug_sampling_stop(&expr, samples, 5);
+  assert(!samples[1].active && !samples[3].active);
+
+  for (uint32_t i = 0; i < 5; ++i) {
+    pug_sampling_free(&samples[i]);
+  }
+}
+
 void test_planner(void) {
     struct jupiter_located_switch_t switches[] = {
         {1, JST_CORE, 3, 0},
@@ -839,11 +2266,34 @@ int main(int argc, char **argv) {
   //TEST(jupiter_cluster);
   //TEST(tm_read_load);
   //TEST(tm_trace);
+  TEST(config);
+  TEST(tm_trace_mmap);
+  TEST(tm_trace_concurrent);
+  TEST(cache2q);
+  TEST(tm_trace_prefetch);
+  TEST(tm_trace_find);
+  TEST(tm_trace_packed);
+  TEST(tm_trace_format);
+  TEST(tm_trace_writer);
+  TEST(rollup);
   //TEST(ewma);
   //TEST(group_state);
   //TEST(dual_state);
   //TEST(tri_state);
   TEST(rvar_bucket);
+  TEST(rvar_power);
+  TEST(rvar_sketch);
+  TEST(rvar_sparse);
+  TEST(rvar_compose);
+  TEST(rvar_bucket_limit);
+  TEST(rvar_sample_sort);
+  TEST(monte_carlo_bucket);
+  TEST(monte_carlo_multi);
+  TEST(pool);
+  TEST(queue);
+  TEST(dataplane_arena);
+  TEST(exec_stream);
+  TEST(pug_sampling);
   //TEST(planner);
   //TEST(array);
   //TEST(twiddle);
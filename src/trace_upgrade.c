@@ -0,0 +1,85 @@
+#include "util/common.h"
+#include "util/log.h"
+#include "traffic.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void usage(char const *arg) {
+  warn("\n  usage: %s [INPUT] [OUTPUT] [NUM PODS (optional)] [KEYFRAME (optional)]\n\n"
+       "  Rewrites the trace INPUT (of any version) as a version %d trace\n"
+       "  with checksums and metadata.  If NUM PODS is given the ToRs are\n"
+       "  assigned to pods contiguously.  KEYFRAME sets the keyframe\n"
+       "  interval of the packed output (0 stores the TMs raw).", arg,
+       TRACE_VERSION_2);
+  exit(1);
+}
+
+static void _print_meta(char const *name, struct traffic_matrix_trace_meta_t const *meta) {
+  info("%s: version %u, %lu TMs, %u ToRs, %u pods, step %ld.",
+      name, meta->version, (unsigned long)meta->num_indices,
+      meta->num_tors, meta->num_pods, (long)meta->time_step);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3 || argc > 5)
+    usage(argv[0]);
+
+  char const *input  = argv[1];
+  char const *output = argv[2];
+  uint32_t num_pods  = argc > 3 ? (uint32_t)atoi(argv[3]) : 0;
+  uint32_t keyframe  = argc > 4 ? (uint32_t)atoi(argv[4]) : TRACE_DEFAULT_KEYFRAME_INTERVAL;
+
+  struct traffic_matrix_trace_meta_t meta;
+  if (traffic_matrix_trace_read_meta(input, &meta, 0) != SUCCESS)
+    panic("Couldn't read the trace %s.", input);
+  _print_meta(input, &meta);
+  traffic_matrix_trace_meta_free(&meta);
+
+  struct traffic_matrix_trace_t *in = traffic_matrix_trace_load(50, input);
+  traffic_matrix_trace_advise(in, TRACE_ACCESS_SEQUENTIAL);
+
+  struct traffic_matrix_trace_t *out = traffic_matrix_trace_create(50, in->num_indices, output);
+  traffic_matrix_trace_compress(out, keyframe);
+  struct traffic_matrix_trace_writer_t *writer = traffic_matrix_trace_writer_open(out, 0);
+
+  uint32_t num_tors = 0;
+  uint32_t *pod_of_tor = 0;
+  for (uint32_t i = 0; i < in->num_indices; ++i) {
+    trace_time_t key = 0;
+    struct traffic_matrix_t *tm = 0;
+    traffic_matrix_trace_get_nth_key(in, i, &key);
+    traffic_matrix_trace_get(in, key, &tm);
+
+    if (i == 0) {
+      num_tors = (uint32_t)sqrt(tm->num_pairs);
+      if (num_pods) {
+        if (num_pods > num_tors)
+          panic("More pods (%u) than ToRs (%u).", num_pods, num_tors);
+        pod_of_tor = malloc(sizeof(uint32_t) * num_tors);
+        uint32_t per_pod = (num_tors + num_pods - 1) / num_pods;
+        for (uint32_t t = 0; t < num_tors; ++t)
+          pod_of_tor[t] = t / per_pod;
+      }
+      traffic_matrix_trace_set_meta(out, num_tors, num_pods, pod_of_tor);
+    }
+
+    traffic_matrix_trace_writer_add(writer, tm, key);
+    traffic_matrix_free(tm);
+  }
+
+  traffic_matrix_trace_writer_close(writer);
+  traffic_matrix_trace_free(out);
+  traffic_matrix_trace_free(in);
+  free(pod_of_tor);
+
+  struct traffic_matrix_trace_t *check = traffic_matrix_trace_load(50, output);
+  uint64_t corrupted = traffic_matrix_trace_verify(check);
+  if (corrupted)
+    panic("%lu TMs of %s failed verification.", (unsigned long)corrupted, output);
+  _print_meta(output, &check->meta);
+  traffic_matrix_trace_free(check);
+
+  return 0;
+}
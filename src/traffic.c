@@ -1,15 +1,240 @@
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "util/affinity.h"
+#include "util/checksum.h"
 #include "util/common.h"
 #include "util/log.h"
+#include "util/queue.h"
+#include "rollup.h"
 #include "traffic.h"
 
+#include "khash.h"
+
 #define TM_SIZE(p) (p->num_pairs * sizeof(struct pair_bw_t) + sizeof(struct traffic_matrix_t))
 
+/* Packed TM records.
+ *
+ * Raw records are the TM struct dumped verbatim (zero padded to 8 bytes so
+ * that the views into the mapped file are aligned).  Packed records start with
+ * TM_PACKED_MAGIC where raw records keep num_pairs, followed by a bitmap of the
+ * pairs that are stored and the stored values (as bits).  Keyframes store the
+ * non-zero bandwidths.  The rest only store the pairs whose bandwidth differs
+ * from their keyframe, as the XOR of the two so that decoding is a single
+ * pass over the keyframe.  Decoding a record never needs more than its
+ * keyframe, so random access stays cheap.
+ *
+ * The stored values are bit packed like in Gorilla: a bandwidth that changed a
+ * little keeps the sign, the exponent, and the top of the mantissa of its
+ * keyframe, so its XOR has a run of leading (and often trailing) zeros.  Each
+ * value is either
+ *
+ *   '1', 5 bits of leading zeros, 5 bits of (length - 1), length bits
+ *   '0', length bits (same leading/trailing zeros as the previous value)
+ *
+ * where the length bits are the ones between the leading and trailing zeros.
+ * The bits are written least significant first.
+ */
+#define TM_PACKED_MAGIC 0xFFFFFFFFu
+
+enum _tm_packed_kind {
+  _TM_PACKED_KEY = 0,
+  _TM_PACKED_DELTA = 1,
+};
+
+struct _tm_packed_t {
+  uint32_t magic;
+  uint32_t num_pairs;
+  uint32_t kind;
+  uint32_t nvals;
+
+  // Keyframe of delta records
+  uint64_t ref_seek, ref_size;
+
+  // Bytes of the packed values
+  uint64_t vals_size;
+
+  // Followed by uint64_t bitmap[_TM_PACKED_WORDS] and the packed values
+};
+
+_Static_assert(sizeof(bw_t) == sizeof(uint32_t), "Packed records store bw_t as 32 bits.");
+
+#define _TM_PACKED_WORDS(n) (((size_t)(n) + 63) / 64)
+
+// Largest packed value: the control bits and all 32 bits
+#define _TM_PACKED_MAX_BITS (1 + 5 + 5 + 32)
+
+static size_t _tm_packed_size(uint32_t num_pairs, uint64_t vals_size) {
+  size_t size = sizeof(struct _tm_packed_t) +
+    _TM_PACKED_WORDS(num_pairs) * sizeof(uint64_t) + (size_t)vals_size;
+  return (size + 7) & ~(size_t)7;
+}
+
+static size_t _tm_raw_size(uint32_t num_pairs) {
+  size_t size = sizeof(struct traffic_matrix_t) + sizeof(struct pair_bw_t) * num_pairs;
+  return (size + 7) & ~(size_t)7;
+}
+
+static inline int _tm_record_is_packed(char const *rec) {
+  uint32_t magic = 0;
+  memcpy(&magic, rec, sizeof(magic));
+  return magic == TM_PACKED_MAGIC;
+}
+
+static void _tm_packed_check(struct _tm_packed_t const *hdr, size_t size) {
+  if (hdr->nvals > hdr->num_pairs ||
+      hdr->vals_size > ((uint64_t)hdr->nvals * _TM_PACKED_MAX_BITS + 7) / 8 ||
+      _tm_packed_size(hdr->num_pairs, hdr->vals_size) != size)
+    panic("Corrupted packed TM in the trace (num_pairs = %u, size = %lu).",
+        hdr->num_pairs, (unsigned long)size);
+}
+
+/* Bit stream of the packed values */
+struct _tm_bits_t {
+  unsigned char *buf;
+  size_t size;  // In bytes
+  size_t pos;   // In bits
+};
+
+static void _tm_bits_put(struct _tm_bits_t *bits, uint32_t val, unsigned n) {
+  unsigned done = 0;
+  while (done < n) {
+    unsigned off = (unsigned)(bits->pos % 8);
+    unsigned take = MIN(8 - off, n - done);
+    uint32_t chunk = (val >> done) & ((1u << take) - 1);
+    bits->buf[bits->pos / 8] |= (unsigned char)(chunk << off);
+    done += take;
+    bits->pos += take;
+  }
+}
+
+/* n is at most 32 so the bits span at most 5 bytes */
+static uint32_t _tm_bits_get(struct _tm_bits_t *bits, unsigned n) {
+  if (bits->pos + n > bits->size * 8)
+    panic("Corrupted packed TM values (%lu bits).", (unsigned long)bits->pos);
+
+  size_t byte = bits->pos / 8;
+  unsigned off = (unsigned)(bits->pos % 8);
+  size_t nbytes = (off + n + 7) / 8;
+  uint64_t word = 0;
+  for (size_t i = 0; i < nbytes; ++i)
+    word |= (uint64_t)bits->buf[byte + i] << (8 * i);
+
+  bits->pos += n;
+  return (uint32_t)((word >> off) & ((1ull << n) - 1));
+}
+
+/* Packs tm into a new record: the non-zero pairs, or the pairs that differ
+ * from ref (XOR'ed with it) if there is one */
+static char *_tm_pack(
+    struct traffic_matrix_t const *tm, struct traffic_matrix_t const *ref,
+    uint64_t ref_seek, uint64_t ref_size, size_t *size) {
+  uint32_t num_pairs = tm->num_pairs;
+  size_t words = _TM_PACKED_WORDS(num_pairs);
+  size_t cap = _tm_packed_size(num_pairs,
+      ((uint64_t)num_pairs * _TM_PACKED_MAX_BITS + 7) / 8);
+
+  char *rec = malloc(cap);
+  memset(rec, 0, cap);
+  uint64_t *bitmap = (uint64_t *)(rec + sizeof(struct _tm_packed_t));
+  struct _tm_bits_t vals = {
+    .buf = (unsigned char *)(bitmap + words),
+    .size = cap - sizeof(struct _tm_packed_t) - words * sizeof(uint64_t),
+    .pos = 0,
+  };
+
+  // Leading/trailing zeros of the last value that spelled them out
+  unsigned lead = 0, trail = 0, len = 0;
+  uint32_t nvals = 0;
+  for (uint32_t i = 0; i < num_pairs; ++i) {
+    uint32_t bits = 0, ref_bits = 0;
+    memcpy(&bits, &tm->bws[i].bw, sizeof(bits));
+    if (ref)
+      memcpy(&ref_bits, &ref->bws[i].bw, sizeof(ref_bits));
+
+    bits ^= ref_bits;
+    if (!bits)
+      continue;
+
+    bitmap[i / 64] |= 1ull << (i % 64);
+    nvals++;
+
+    unsigned bl = (unsigned)__builtin_clz(bits), bt = (unsigned)__builtin_ctz(bits);
+    if (len && bl >= lead && bt >= trail) {
+      _tm_bits_put(&vals, 0, 1);
+    } else {
+      lead = bl; trail = bt; len = 32 - bl - bt;
+      _tm_bits_put(&vals, 1, 1);
+      _tm_bits_put(&vals, lead, 5);
+      _tm_bits_put(&vals, len - 1, 5);
+    }
+    _tm_bits_put(&vals, bits >> trail, len);
+  }
+
+  struct _tm_packed_t hdr = {
+    .magic = TM_PACKED_MAGIC, .num_pairs = num_pairs,
+    .kind = ref ? _TM_PACKED_DELTA : _TM_PACKED_KEY, .nvals = nvals,
+    .ref_seek = ref_seek, .ref_size = ref_size,
+    .vals_size = (vals.pos + 7) / 8,
+  };
+  memcpy(rec, &hdr, sizeof(hdr));
+
+  *size = _tm_packed_size(num_pairs, hdr.vals_size);
+  return rec;
+}
+
+/* XORs the values of the packed record into out, so out should be zero for
+ * keyframes and hold the decoded keyframe for deltas.  Records aren't
+ * necessarily aligned in the data file, hence the memcpys. */
+static void _tm_unpack_into(char const *rec, struct traffic_matrix_t *out) {
+  struct _tm_packed_t hdr;
+  memcpy(&hdr, rec, sizeof(hdr));
+
+  size_t words = _TM_PACKED_WORDS(hdr.num_pairs);
+  char const *bitmap = rec + sizeof(struct _tm_packed_t);
+  struct _tm_bits_t vals = {
+    .buf = (unsigned char *)(bitmap + words * sizeof(uint64_t)),
+    .size = (size_t)hdr.vals_size,
+    .pos = 0,
+  };
+  uint32_t *bws = (uint32_t *)out->bws;
+
+  unsigned trail = 0, len = 0;
+  for (size_t w = 0; w < words; ++w) {
+    uint64_t bits = 0;
+    memcpy(&bits, bitmap + w * sizeof(uint64_t), sizeof(bits));
+    while (bits) {
+      size_t i = w * 64 + (size_t)__builtin_ctzll(bits);
+      if (i >= hdr.num_pairs)
+        panic("Corrupted packed TM bitmap (pair %lu).", (unsigned long)i);
+
+      if (_tm_bits_get(&vals, 1)) {
+        unsigned lead = _tm_bits_get(&vals, 5);
+        len = _tm_bits_get(&vals, 5) + 1;
+        if (lead + len > 32)
+          panic("Corrupted packed TM value (pair %lu).", (unsigned long)i);
+        trail = 32 - lead - len;
+      } else if (!len) {
+        panic("Corrupted packed TM value (pair %lu).", (unsigned long)i);
+      }
+
+      bws[i] ^= _tm_bits_get(&vals, len) << trail;
+      bits &= bits - 1;
+    }
+  }
+}
+
+static void _tmti_read_ahead(struct traffic_matrix_trace_iter_t *iter);
+
 void _tmti_begin(struct traffic_matrix_trace_iter_t *iter) {
     iter->state = iter->_begin;
+    iter->_ahead = 0;
 }
 
 int _tmti_next(struct traffic_matrix_trace_iter_t *iter) {
@@ -18,6 +243,7 @@ int _tmti_next(struct traffic_matrix_trace_iter_t *iter) {
         iter->state = iter->_end;
         return 0;
     }
+    _tmti_read_ahead(iter);
     return 1;
 }
 
@@ -26,18 +252,24 @@ unsigned _tmti_length(struct traffic_matrix_trace_iter_t *iter) {
 }
 
 struct traffic_matrix_t *_tmti_get_nocopy(struct traffic_matrix_trace_iter_t *iter) {
-  panic_txt("TMTI doesn't support copy semantics. Use get.");
-  return 0;
+  /* Only mapped traces have views, the callers fall back to get */
+  if (!iter->trace->map)
+    return 0;
+
+  trace_time_t time;
+  if (traffic_matrix_trace_get_nth_key(iter->trace, iter->state, &time) != SUCCESS)
+    return 0;
+
+  /* Views are read-only even though the iterator interface says otherwise */
+  return (struct traffic_matrix_t *)traffic_matrix_trace_get_nocopy(iter->trace, time);
 }
 
 void _tmti_go_to(struct traffic_matrix_trace_iter_t *iter, trace_time_t time) {
-  for (uint32_t i = 0; i < iter->trace->num_indices; ++i) {
-    trace_time_t cur = 0;
-    traffic_matrix_trace_get_nth_key(iter->trace, i, &cur);
-    if (cur == time) {
-      iter->state = i;
-      return;
-    }
+  iter->_ahead = 0;
+  uint32_t nth = 0;
+  if (traffic_matrix_trace_find_key(iter->trace, time, &nth) == SUCCESS) {
+    iter->state = nth;
+    return;
   }
 
   iter->state = iter->_end;
@@ -64,6 +296,7 @@ static struct traffic_matrix_trace_iter_t *_tmt_iter(
         struct traffic_matrix_trace_t *trace) {
     struct traffic_matrix_trace_iter_t *iter = malloc(sizeof(struct traffic_matrix_trace_iter_t));
     iter->state = 0;
+    iter->_ahead = 0;
     iter->trace = trace;
     iter->begin = _tmti_begin;
     iter->go_to = _tmti_go_to;
@@ -179,6 +412,13 @@ struct traffic_matrix_t *traffic_matrix_multiply(
 
 
 struct traffic_matrix_t *traffic_matrix_add(
+  struct traffic_matrix_t const *left, 
+  struct traffic_matrix_t const *right) {
+  return traffic_matrix_add_into(0, left, right);
+}
+
+struct traffic_matrix_t *traffic_matrix_add_into(
+  struct traffic_matrix_t *output,
   struct traffic_matrix_t const *left, 
   struct traffic_matrix_t const *right) {
   if (!left || !right)
@@ -189,9 +429,14 @@ struct traffic_matrix_t *traffic_matrix_add(
 
   pair_id_t num_pairs = left->num_pairs;
 
-  struct traffic_matrix_t *output = malloc(
-      sizeof(struct traffic_matrix_t) +
-      sizeof(struct pair_bw_t) * num_pairs);
+  if (!output) {
+    output = malloc(
+        sizeof(struct traffic_matrix_t) +
+        sizeof(struct pair_bw_t) * num_pairs);
+  } else if (output->num_pairs != num_pairs) {
+    panic("Output traffic matrix has %u pairs, expected %u.",
+        output->num_pairs, num_pairs);
+  }
 
   output->num_pairs = num_pairs;
 
@@ -208,17 +453,174 @@ struct traffic_matrix_t *traffic_matrix_add(
 }
 
 
-/* Does not take the ownership of tm, so don't forget to free */
-void traffic_matrix_trace_add(
+static size_t _trace_default_cache_budget = 0;
+static unsigned _trace_default_keyframe_interval = 0;
+
+/* Keys are usually consecutive (or multiples of the interval), so mix them up
+ * before picking a shard */
+static inline
+unsigned _shard(trace_time_t key) {
+  return (unsigned)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> 32) % TRACE_CACHE_SHARDS;
+}
+
+static void _traffic_matrix_cache_free(void *tm) {
+  traffic_matrix_free((struct traffic_matrix_t *)tm);
+}
+
+/* Splits the budget of the trace over its shards.  Without an explicit budget
+ * we need the size of a TM, so this waits until there is one. */
+static
+void _traffic_matrix_trace_size_cache(
+    struct traffic_matrix_trace_t *trace, size_t tm_size) {
+  size_t budget = trace->cache_budget;
+  if (budget == 0)
+    budget = (size_t)trace->num_caches * tm_size;
+
+  // Every shard should at least be able to hold one TM
+  size_t shard_budget = MAX((budget + TRACE_CACHE_SHARDS - 1) / TRACE_CACHE_SHARDS, tm_size);
+  for (unsigned i = 0; i < TRACE_CACHE_SHARDS; ++i) {
+    pthread_mutex_lock(&trace->cache_locks[i]);
+    cache2q_set_budget(trace->caches[i], shard_budget);
+    pthread_mutex_unlock(&trace->cache_locks[i]);
+  }
+}
+
+KHASH_SET_INIT_INT64(trace_keys)
+
+struct traffic_matrix_trace_writer_t {
+  struct traffic_matrix_trace_t *trace;
+
+  // Data that isn't written yet, and where it goes in the .data file
+  char    *buf;
+  size_t   used, cap;
+  uint64_t seek;
+
+  // Keys of the trace, to reject duplicates without going through the index
+  khash_t(trace_keys) *keys;
+};
+
+static void _traffic_matrix_trace_writer_flush(struct traffic_matrix_trace_writer_t *writer) {
+  if (!writer->used)
+    return;
+
+  FILE *fdata = writer->trace->fdata;
+  fseek(fdata, (long)writer->seek, SEEK_SET);
+  if (fwrite(writer->buf, writer->used, 1, fdata) != 1)
+    panic_txt("Couldn't dump the traffic matrices!");
+  fflush(fdata);
+
+  writer->seek += writer->used;
+  writer->used = 0;
+}
+
+/* Appends data to the end of the .data file: through the buffer of the bulk
+ * writer if there is one, otherwise straight to the file (the caller seeks
+ * and flushes). */
+static void _traffic_matrix_trace_write(
+    struct traffic_matrix_trace_t *trace, void const *data, size_t size) {
+  struct traffic_matrix_trace_writer_t *writer = trace->writer;
+  if (!writer) {
+    if (size && fwrite(data, size, 1, trace->fdata) != 1)
+      panic_txt("Couldn't dump the traffic matrix!");
+    return;
+  }
+
+  if (writer->used + size > writer->cap)
+    _traffic_matrix_trace_writer_flush(writer);
+
+  if (size > writer->cap) {
+    // Doesn't fit in the buffer anyways
+    FILE *fdata = trace->fdata;
+    fseek(fdata, (long)writer->seek, SEEK_SET);
+    if (fwrite(data, size, 1, fdata) != 1)
+      panic_txt("Couldn't dump the traffic matrix!");
+    writer->seek += size;
+    return;
+  }
+
+  memcpy(writer->buf + writer->used, data, size);
+  writer->used += size;
+}
+
+/* Writes tm as a raw record (without the in-memory save pointer, so that the
+ * bytes, and the checksum, only depend on the TM) and returns the size of the
+ * record */
+static
+uint64_t _traffic_matrix_trace_write_raw(
     struct traffic_matrix_trace_t *trace,
-    struct traffic_matrix_t *tm,
-    trace_time_t key) {
+    struct traffic_matrix_t const *tm, uint32_t *checksum) {
+  struct traffic_matrix_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.num_pairs = tm->num_pairs;
+
+  static char const zeros[8] = {0};
+  size_t bws = sizeof(struct pair_bw_t) * tm->num_pairs;
+  size_t size = _tm_raw_size(tm->num_pairs);
+  size_t pad = size - sizeof(hdr) - bws;
+  _traffic_matrix_trace_write(trace, &hdr, sizeof(hdr));
+  _traffic_matrix_trace_write(trace, tm->bws, bws);
+  if (pad)
+    _traffic_matrix_trace_write(trace, zeros, pad);
+
+  uint32_t crc = checksum_crc32(0, &hdr, sizeof(hdr));
+  crc = checksum_crc32(crc, tm->bws, bws);
+  *checksum = checksum_crc32(crc, zeros, pad);
+  return size;
+}
 
-  struct traffic_matrix_t *tm_exists = 0;
-  traffic_matrix_trace_get(trace, key, &tm_exists);
-  if (tm_exists)
-    panic("Cannot add a TM that already has an associated key (%d).", key);
+/* Writes tm packed at seek and returns the size of the record.  Every
+ * keyframe_interval'th TM (or whenever the previous keyframe isn't usable) is
+ * a keyframe, the rest are deltas against the last keyframe. */
+static
+uint64_t _traffic_matrix_trace_pack(
+    struct traffic_matrix_trace_t *trace,
+    struct traffic_matrix_t const *tm, uint64_t seek, uint32_t *checksum) {
+  struct traffic_matrix_t *keyframe = trace->_keyframe;
+  int is_key = (keyframe == 0 ||
+      keyframe->num_pairs != tm->num_pairs ||
+      trace->_since_keyframe >= trace->keyframe_interval);
+
+  size_t size = 0;
+  char *rec = 0;
+  if (is_key) {
+    rec = _tm_pack(tm, 0, 0, 0, &size);
+  } else {
+    rec = _tm_pack(tm, keyframe, trace->_keyframe_seek, trace->_keyframe_size, &size);
+  }
+
+  _traffic_matrix_trace_write(trace, rec, size);
+  *checksum = checksum_crc32(0, rec, size);
+  free(rec);
+
+  if (is_key) {
+    free(keyframe);
+    trace->_keyframe = malloc(TM_SIZE(tm));
+    memcpy(trace->_keyframe, tm, TM_SIZE(tm));
+    trace->_keyframe_seek = seek;
+    trace->_keyframe_size = size;
+    trace->_since_keyframe = 0;
+  }
+  trace->_since_keyframe++;
+
+  return size;
+}
+
+void traffic_matrix_trace_compress(
+    struct traffic_matrix_trace_t *trace, unsigned keyframe_interval) {
+  trace->keyframe_interval = keyframe_interval;
+}
+
+void traffic_matrix_trace_set_default_compression(unsigned keyframe_interval) {
+  _trace_default_keyframe_interval = keyframe_interval;
+}
 
+/* Writes tm at the end of the .data file and indexes it (the caller checks
+ * that key is new) */
+static
+void _traffic_matrix_trace_append(
+    struct traffic_matrix_trace_t *trace,
+    struct traffic_matrix_t const *tm,
+    trace_time_t key) {
   if (trace->num_indices == trace->cap_indices) {
     trace->cap_indices *= 2;
     size_t size         = sizeof(struct traffic_matrix_trace_index_t) * trace->cap_indices;
@@ -226,11 +628,18 @@ void traffic_matrix_trace_add(
   }
 
   struct traffic_matrix_trace_index_t *idx = &trace->indices[trace->num_indices];
-  idx->size = TM_SIZE(tm);
   idx->time = key;
 
-  fseek(trace->fdata, (long)trace->largest_seek, SEEK_SET);
-  traffic_matrix_save(tm, trace->fdata);
+  if (!trace->writer)
+    fseek(trace->fdata, (long)trace->largest_seek, SEEK_SET);
+  if (trace->keyframe_interval) {
+    idx->size = _traffic_matrix_trace_pack(trace, tm, trace->largest_seek, &idx->checksum);
+  } else {
+    idx->size = _traffic_matrix_trace_write_raw(trace, tm, &idx->checksum);
+  }
+  idx->flags = TRACE_INDEX_CHECKSUM;
+  if (!trace->writer)
+    fflush(trace->fdata);
 
   if (trace->num_indices == 0) {
     idx->seek = 0;
@@ -242,6 +651,72 @@ void traffic_matrix_trace_add(
 
   trace->_optimized = 0; // Not optimized anymore (index is not sorted).
   trace->num_indices++;
+
+  if (trace->num_indices == 1)
+    _traffic_matrix_trace_size_cache(trace, TM_SIZE(tm));
+}
+
+/* Does not take the ownership of tm, so don't forget to free */
+void traffic_matrix_trace_add(
+    struct traffic_matrix_trace_t *trace,
+    struct traffic_matrix_t *tm,
+    trace_time_t key) {
+
+  struct traffic_matrix_t *tm_exists = 0;
+  traffic_matrix_trace_get(trace, key, &tm_exists);
+  if (tm_exists)
+    panic("Cannot add a TM that already has an associated key (%d).", key);
+
+  _traffic_matrix_trace_append(trace, tm, key);
+}
+
+struct traffic_matrix_trace_writer_t *traffic_matrix_trace_writer_open(
+    struct traffic_matrix_trace_t *trace, size_t buffer) {
+  if (trace->writer)
+    panic_txt("The trace already has a writer.");
+
+  struct traffic_matrix_trace_writer_t *writer =
+    malloc(sizeof(struct traffic_matrix_trace_writer_t));
+  writer->trace = trace;
+  writer->cap = buffer ? buffer : TRACE_WRITER_DEFAULT_BUFFER;
+  writer->buf = malloc(writer->cap);
+  writer->used = 0;
+  writer->seek = trace->largest_seek;
+
+  writer->keys = kh_init(trace_keys);
+  kh_resize(trace_keys, writer->keys, (khint_t)(trace->num_indices * 2 + 16));
+  for (uint64_t i = 0; i < trace->num_indices; ++i) {
+    int absent = 0;
+    kh_put(trace_keys, writer->keys, (khint64_t)trace->indices[i].time, &absent);
+  }
+
+  trace->writer = writer;
+  return writer;
+}
+
+void traffic_matrix_trace_writer_add(
+    struct traffic_matrix_trace_writer_t *writer,
+    struct traffic_matrix_t const *tm,
+    trace_time_t key) {
+  int absent = 0;
+  kh_put(trace_keys, writer->keys, (khint64_t)key, &absent);
+  if (absent < 0)
+    panic("Couldn't insert key %ld in the key set.", (long)key);
+  if (!absent)
+    panic("Cannot add a TM that already has an associated key (%ld).", (long)key);
+
+  _traffic_matrix_trace_append(writer->trace, tm, key);
+}
+
+void traffic_matrix_trace_writer_close(struct traffic_matrix_trace_writer_t *writer) {
+  struct traffic_matrix_trace_t *trace = writer->trace;
+  _traffic_matrix_trace_writer_flush(writer);
+  trace->writer = 0;
+  traffic_matrix_trace_save(trace);
+
+  kh_destroy(trace_keys, writer->keys);
+  free(writer->buf);
+  free(writer);
 }
 
 static
@@ -249,20 +724,37 @@ int _compare_indices(void const* v1, void const *v2) {
   struct traffic_matrix_trace_index_t *t1 = (struct traffic_matrix_trace_index_t *)v1;
   struct traffic_matrix_trace_index_t *t2 = (struct traffic_matrix_trace_index_t *)v2;
 
-  return (t1->time - t2->time);
+  // time is 64 bits, the difference doesn't fit in an int
+  return (t1->time > t2->time) - (t1->time < t2->time);
 }
 
+/* Sorts the index the first time around.  Concurrent readers may race to get
+ * here, so only one of them sorts and the rest wait for it. */
 static
 void _traffic_matrix_trace_optimize(struct traffic_matrix_trace_t *trace) {
-  if (trace->_optimized)
+  if (__atomic_load_n(&trace->_optimized, __ATOMIC_ACQUIRE))
     return;
 
-  qsort(trace->indices,
-      trace->num_indices,
-      sizeof(struct traffic_matrix_trace_index_t),
-      _compare_indices);
+  pthread_mutex_lock(&trace->optimize_lock);
+  if (!trace->_optimized) {
+    qsort(trace->indices,
+        trace->num_indices,
+        sizeof(struct traffic_matrix_trace_index_t),
+        _compare_indices);
+
+    // Traces are usually sampled at a fixed interval
+    trace_time_t step = 0;
+    if (trace->num_indices > 1)
+      step = trace->indices[1].time - trace->indices[0].time;
+    for (uint64_t i = 2; i < trace->num_indices && step; ++i) {
+      if (trace->indices[i].time - trace->indices[i-1].time != step)
+        step = 0;
+    }
+    trace->_step = step;
 
-  trace->_optimized = 1;
+    __atomic_store_n(&trace->_optimized, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&trace->optimize_lock);
 }
 
 struct traffic_matrix_trace_index_t *_traffic_matrix_trace_get_idx(
@@ -270,6 +762,16 @@ struct traffic_matrix_trace_index_t *_traffic_matrix_trace_get_idx(
   if ((trace->num_indices) == 0)
     return 0;
 
+  if (trace->_step) {
+    trace_time_t offset = key - trace->indices[0].time;
+    if (offset < 0 || offset % trace->_step != 0)
+      return 0;
+    uint64_t nth = (uint64_t)(offset / trace->_step);
+    if (nth >= trace->num_indices)
+      return 0;
+    return &trace->indices[nth];
+  }
+
   int begin = 0, end = trace->num_indices-1;
   int mid = 0;
 
@@ -289,46 +791,206 @@ struct traffic_matrix_trace_index_t *_traffic_matrix_trace_get_idx(
   }
 }
 
-static inline
-uint16_t _hash(trace_time_t key, uint16_t cache_size) {
-  // Have to deal with negative keys
-  return key & (cache_size - 1);
+
+/* Checks the record of index against its checksum on its first read only:
+ * the .data file is append-only, so a record that matched once still does.
+ * Concurrent first reads may both checksum the record, which is harmless. */
+static void _traffic_matrix_trace_check_record(
+    struct traffic_matrix_trace_index_t *index, char const *rec) {
+  uint32_t flags = __atomic_load_n(&index->flags, __ATOMIC_ACQUIRE);
+  if (!(flags & TRACE_INDEX_CHECKSUM) || (flags & TRACE_INDEX_VERIFIED))
+    return;
+
+  if (checksum_crc32(0, rec, (size_t)index->size) != index->checksum)
+    panic("Checksum mismatch for the TM at %ld.", (long)index->time);
+  __atomic_fetch_or(&index->flags, TRACE_INDEX_VERIFIED, __ATOMIC_RELEASE);
 }
 
-struct traffic_matrix_t *_traffic_matrix_trace_get_key_in_cache(
+/* Returns the view of index in the mapped data file, or 0 if it isn't mapped,
+ * the record is packed (there is nothing to point at before decoding), or the
+ * record isn't aligned (raw records of older traces weren't padded).  The
+ * record is checked against its checksum like any other read. */
+static struct traffic_matrix_t const *_traffic_matrix_trace_view(
     struct traffic_matrix_trace_t *trace,
-    trace_time_t key) {
-  struct traffic_matrix_trace_cache_t *cache =
-    &trace->caches[_hash(key, trace->num_caches)];
-  if (!cache->is_set)
+    struct traffic_matrix_trace_index_t *index) {
+  if (!trace->map || index->seek + index->size > trace->map_size)
     return 0;
-  if (cache->time != key)
+  if (index->seek % 8 != 0)
+    return 0;
+
+  char const *rec = trace->map + index->seek;
+  if (_tm_record_is_packed(rec))
     return 0;
-  return cache->tm;
+
+  _traffic_matrix_trace_check_record(index, rec);
+  return (struct traffic_matrix_t const *)rec;
 }
 
-static
-void _traffic_matrix_trace_set_key_in_cache(
+struct traffic_matrix_t const *traffic_matrix_trace_get_nocopy(
     struct traffic_matrix_trace_t *trace,
-    trace_time_t key,
-    struct traffic_matrix_t *tm
-    ) {
+    trace_time_t key) {
+  if (!trace->map)
+    return 0;
+
+  _traffic_matrix_trace_optimize(trace);
+
+  struct traffic_matrix_trace_index_t *index = 
+    _traffic_matrix_trace_get_idx(trace, key);
+  if (!index)
+    return 0;
 
-  if (tm == 0) {
+  return _traffic_matrix_trace_view(trace, index);
+}
+
+static int _trace_madvise_flag(enum TRACE_ACCESS access) {
+  switch (access) {
+    case TRACE_ACCESS_SEQUENTIAL: return MADV_SEQUENTIAL;
+    case TRACE_ACCESS_RANDOM:     return MADV_RANDOM;
+    default:                      return MADV_NORMAL;
+  }
+}
+
+void traffic_matrix_trace_advise(
+    struct traffic_matrix_trace_t *trace,
+    enum TRACE_ACCESS access) {
+  if (!trace->map)
     return;
+
+  if (madvise((void *)trace->map, trace->map_size, _trace_madvise_flag(access)) != 0)
+    warn("Couldn't madvise the trace (%d).", access);
+}
+
+int traffic_matrix_trace_map(
+    struct traffic_matrix_trace_t *trace,
+    enum TRACE_ACCESS access) {
+  if (trace->map)
+    return SUCCESS;
+
+  /* Make sure whatever we wrote is in the file before mapping it */
+  fflush(trace->fdata);
+
+  int fd = fileno(trace->fdata);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0)
+    return FAILURE;
+
+  size_t size = (size_t)st.st_size;
+  void *map = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return FAILURE;
+
+  trace->map = (char const *)map;
+  trace->map_size = size;
+  traffic_matrix_trace_advise(trace, access);
+
+  return SUCCESS;
+}
+
+static uint64_t _trace_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Reads size bytes at seek from the data file with pread, so that concurrent
+ * readers don't fight over the FILE cursor */
+static void _traffic_matrix_trace_pread(
+    struct traffic_matrix_trace_t *trace,
+    uint64_t seek, size_t size, char *buf) {
+  int fd = fileno(trace->fdata);
+  size_t done = 0;
+  while (done < size) {
+    ssize_t nread = pread(fd, buf + done, size - done, (off_t)(seek + done));
+    if (nread < 0 && errno == EINTR)
+      continue;
+    if (nread < 0)
+      panic_txt("Error reading from file.");
+    if (nread == 0)
+      panic("Reached the end of file! Tried to read %lu got %lu",
+          (unsigned long)size, (unsigned long)done);
+    done += (size_t)nread;
   }
+}
+
+/* The bytes of the record at seek: straight from the map if possible,
+ * otherwise read into *buf (which the caller frees) */
+static char const *_traffic_matrix_trace_record(
+    struct traffic_matrix_trace_t *trace,
+    uint64_t seek, size_t size, char **buf) {
+  *buf = 0;
+  if (trace->map && seek + size <= trace->map_size)
+    return trace->map + seek;
+
+  *buf = malloc(size);
+  _traffic_matrix_trace_pread(trace, seek, size, *buf);
+  return *buf;
+}
+
+/* Number of pairs of the TM at index without reading the whole record */
+static uint32_t _traffic_matrix_trace_record_pairs(
+    struct traffic_matrix_trace_t *trace,
+    struct traffic_matrix_trace_index_t const *index) {
+  uint32_t head[2] = {0};
+  if (index->size < sizeof(head))
+    panic("Invalid TM size in the index: %lu", (unsigned long)index->size);
+
+  char *buf = 0;
+  char const *rec = _traffic_matrix_trace_record(trace, index->seek, sizeof(head), &buf);
+  memcpy(head, rec, sizeof(head));
+  free(buf);
+  return head[0] == TM_PACKED_MAGIC ? head[1] : head[0];
+}
+
+/* Reads (and decodes if need be) the TM at index into a new TM */
+static struct traffic_matrix_t *_traffic_matrix_trace_load_record(
+    struct traffic_matrix_trace_t *trace,
+    struct traffic_matrix_trace_index_t *index) {
+  size_t size = (size_t)index->size;
+  if (size < sizeof(struct traffic_matrix_t))
+    panic("Invalid TM size in the index: %lu", (unsigned long)size);
+
+  char *buf = 0;
+  char const *rec = _traffic_matrix_trace_record(trace, index->seek, size, &buf);
+  _traffic_matrix_trace_check_record(index, rec);
+
+  struct traffic_matrix_t *ret = 0;
+  if (_tm_record_is_packed(rec)) {
+    struct _tm_packed_t hdr;
+    memcpy(&hdr, rec, sizeof(hdr));
+    _tm_packed_check(&hdr, size);
+
+    ret = traffic_matrix_zero(hdr.num_pairs);
+    if (hdr.kind == _TM_PACKED_DELTA) {
+      char *kbuf = 0;
+      char const *key = _traffic_matrix_trace_record(
+          trace, hdr.ref_seek, (size_t)hdr.ref_size, &kbuf);
+      struct _tm_packed_t khdr;
+      memcpy(&khdr, key, sizeof(khdr));
+      if (!_tm_record_is_packed(key) || khdr.kind != _TM_PACKED_KEY ||
+          khdr.num_pairs != hdr.num_pairs)
+        panic("Corrupted keyframe at %lu.", (unsigned long)hdr.ref_seek);
+      _tm_packed_check(&khdr, (size_t)hdr.ref_size);
+
+      _tm_unpack_into(key, ret);
+      free(kbuf);
+    }
+    _tm_unpack_into(rec, ret);
+    free(buf);
+  } else {
+    if (buf) {
+      ret = (struct traffic_matrix_t *)buf;
+    } else {
+      ret = malloc(size);
+      memcpy(ret, rec, size);
+    }
 
-  struct traffic_matrix_trace_cache_t *cache =
-    &trace->caches[_hash(key, trace->num_caches)];
-  if (cache->is_set) {
-    //info("Invalidating cache for key: %llu with hash %u", key, _hash(key, trace->num_caches));
-    free(cache->tm);
-    cache->tm = 0;
+    /* Older traces didn't pad the raw records */
+    if (TM_SIZE(ret) != size && _tm_raw_size(ret->num_pairs) != size)
+      panic("Corrupted TM in the trace (num_pairs = %u, size = %lu).",
+          ret->num_pairs, (unsigned long)size);
   }
 
-  cache->is_set = 1;
-  cache->time = key;
-  cache->tm = tm;
+  return ret;
 }
 
 void traffic_matrix_trace_get(
@@ -336,19 +998,42 @@ void traffic_matrix_trace_get(
     trace_time_t key,
     struct traffic_matrix_t **tm) {
 
+  // Mapped traces copy raw TMs straight out of the page cache (no caching
+  // needed).  Packed TMs go through the cache so that we don't decode them on
+  // every get.
+  if (trace->map) {
+    _traffic_matrix_trace_optimize(trace);
+    struct traffic_matrix_trace_index_t *index =
+      _traffic_matrix_trace_get_idx(trace, key);
+    if (index && index->seek + index->size <= trace->map_size &&
+        !_tm_record_is_packed(trace->map + index->seek)) {
+      // Page faults on the map are the stalls here
+      uint64_t start = _trace_now_ns();
+      *tm = _traffic_matrix_trace_load_record(trace, index);
+      __atomic_add_fetch(&trace->stall_ns, _trace_now_ns() - start, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
   // If the key is in cache
-  struct traffic_matrix_t *t = 
-    _traffic_matrix_trace_get_key_in_cache(trace, key);
+  unsigned shard = _shard(key);
+  struct cache2q_t *cache = trace->caches[shard];
+  pthread_mutex_t *lock = &trace->cache_locks[shard];
   struct traffic_matrix_t *ret = 0;
+  pthread_mutex_lock(lock);
+  struct traffic_matrix_t *t = (struct traffic_matrix_t *)cache2q_get(cache, key);
   if (t) {
     ret = malloc(TM_SIZE(t));
     memcpy(ret, t, TM_SIZE(t));
+  }
+  pthread_mutex_unlock(lock);
+
+  if (ret) {
     *tm = ret;
     return;
   }
   
-  if (trace->_optimized == 0)
-    _traffic_matrix_trace_optimize(trace);
+  _traffic_matrix_trace_optimize(trace);
 
   struct traffic_matrix_trace_index_t *index = 
     _traffic_matrix_trace_get_idx(trace, key);
@@ -358,52 +1043,324 @@ void traffic_matrix_trace_get(
     return;
   }
 
-  // Move to that location in the file
-  fseek(trace->fdata, (long)index->seek, SEEK_SET);
-  struct traffic_matrix_t *cache_obj = traffic_matrix_load(trace->fdata);
-  _traffic_matrix_trace_set_key_in_cache(trace, key, cache_obj);
-
+  // Read it without touching the (shared) file cursor
+  uint64_t start = _trace_now_ns();
+  struct traffic_matrix_t *cache_obj = _traffic_matrix_trace_load_record(trace, index);
+  __atomic_add_fetch(&trace->stall_ns, _trace_now_ns() - start, __ATOMIC_RELAXED);
   ret = malloc(TM_SIZE(cache_obj));
   memcpy(ret, cache_obj, TM_SIZE(cache_obj));
+
+  pthread_mutex_lock(lock);
+  cache2q_put(cache, key, cache_obj, TM_SIZE(cache_obj));
+  pthread_mutex_unlock(lock);
+
   *tm = ret;
 }
 
+/* Read-ahead thread of a trace.  Iterators push the positions they are about
+ * to visit and the thread brings them in: raw TMs of mapped traces only need
+ * a MADV_WILLNEED on the record, the rest are read (and decoded) into the
+ * cache. */
+struct trace_prefetcher_t {
+  struct traffic_matrix_trace_t *trace;
+  struct queue_t *queue;
+  unsigned depth;
+  pthread_t thread;
+};
+
+static unsigned _trace_default_prefetch = 0;
+
+static void _trace_prefetch_one(
+    struct traffic_matrix_trace_t *trace, uint32_t nth) {
+  struct traffic_matrix_trace_index_t *index = &trace->indices[nth];
+
+  int mapped = trace->map && index->seek + index->size <= trace->map_size;
+  if (mapped && !_tm_record_is_packed(trace->map + index->seek)) {
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)(trace->map + index->seek) & ~(page - 1);
+    uintptr_t end = (uintptr_t)(trace->map + index->seek + index->size);
+    (void) madvise((void *)begin, end - begin, MADV_WILLNEED);
+  } else {
+    unsigned shard = _shard(index->time);
+    pthread_mutex_t *lock = &trace->cache_locks[shard];
+
+    pthread_mutex_lock(lock);
+    int cached = cache2q_contains(trace->caches[shard], index->time);
+    pthread_mutex_unlock(lock);
+    if (cached)
+      return;
+
+    struct traffic_matrix_t *tm = _traffic_matrix_trace_load_record(trace, index);
+    pthread_mutex_lock(lock);
+    if (!cache2q_contains(trace->caches[shard], index->time)) {
+      cache2q_put(trace->caches[shard], index->time, tm, TM_SIZE(tm));
+      tm = 0;
+    }
+    pthread_mutex_unlock(lock);
+    traffic_matrix_free(tm);
+  }
+
+  __atomic_add_fetch(&trace->prefetched, 1, __ATOMIC_RELAXED);
+}
+
+static void *_trace_prefetch_worker(void *data) {
+  struct trace_prefetcher_t *pf = (struct trace_prefetcher_t *)data;
+  void *item = 0;
+  while (queue_pop(pf->queue, &item))
+    _trace_prefetch_one(pf->trace, (uint32_t)(uintptr_t)item);
+  return 0;
+}
+
+/* Hands the next few positions of a moving iterator to the read-ahead thread.
+ * This never blocks: if the thread is behind, we try again on the next step. */
+static void _tmti_read_ahead(struct traffic_matrix_trace_iter_t *iter) {
+  struct traffic_matrix_trace_t *trace = iter->trace;
+  struct trace_prefetcher_t *pf = trace->prefetcher;
+  if (!pf)
+    return;
+
+  _traffic_matrix_trace_optimize(trace);
+
+  uint32_t limit = (uint32_t)MIN((uint64_t)iter->state + 1 + pf->depth,
+      MIN((uint64_t)iter->_end, trace->num_indices));
+  if (iter->_ahead <= iter->state)
+    iter->_ahead = iter->state + 1;
+
+  while (iter->_ahead < limit &&
+         queue_try_push(pf->queue, (void *)(uintptr_t)iter->_ahead))
+    iter->_ahead++;
+}
+
+void traffic_matrix_trace_prefetch(
+    struct traffic_matrix_trace_t *trace, unsigned depth) {
+  struct trace_prefetcher_t *pf = trace->prefetcher;
+  if (pf) {
+    trace->prefetcher = 0;
+    queue_close(pf->queue);
+    pthread_join(pf->thread, 0);
+    queue_free(pf->queue);
+    free(pf);
+  }
+
+  if (depth == 0)
+    return;
+
+  pf = malloc(sizeof(struct trace_prefetcher_t));
+  pf->trace = trace;
+  pf->depth = depth;
+  pf->queue = queue_create(depth);
+  if (pthread_create(&pf->thread, 0, _trace_prefetch_worker, pf) != 0)
+    panic_txt("Couldn't create the read-ahead thread.");
+  trace->prefetcher = pf;
+}
+
+void traffic_matrix_trace_set_default_prefetch(unsigned depth) {
+  _trace_default_prefetch = depth;
+}
+
+/* Version 2 .index files:
+ *
+ *   struct _trace_header_t
+ *   uint32_t pod_of_tor[num_tors]         (only if num_pods != 0)
+ *   struct traffic_matrix_trace_index_t[num_indices]
+ *
+ * Everything is in the byte order of the machine that wrote the file, which
+ * the header records: readers refuse files of the other order rather than
+ * misreading them.
+ */
+#define TRACE_MAGIC "JANUSTRC"
+#define TRACE_ENDIAN_MARK 0x01020304u
+
+struct _trace_header_t {
+  char     magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint64_t num_indices;
+  uint32_t num_tors, num_pods;
+  int64_t  time_step;
+  uint32_t index_entry_size;
+  uint32_t reserved;
+};
+
+_Static_assert(sizeof(struct _trace_header_t) == 48, "Trace header layout changed.");
+_Static_assert(sizeof(struct traffic_matrix_trace_index_t) == 32, "Trace index layout changed.");
+
+/* Version 1 index entries */
+struct _trace_index_v1_t {
+  uint64_t     seek;
+  trace_time_t time;
+  uint64_t     size;
+};
+
+/* Reads the header (or the count of version 1 files) of the .index file and
+ * leaves the cursor at the first index entry */
 static
-uint64_t _traffic_matrix_trace_index_count(FILE *index) {
-  uint64_t size = 0;
+int _traffic_matrix_trace_read_header(
+    FILE *index, struct traffic_matrix_trace_meta_t *meta) {
+  memset(meta, 0, sizeof(struct traffic_matrix_trace_meta_t));
   fseek(index, 0, SEEK_SET);
-  // XXX: Bad idea: if the data-structures change we cannot just "read" the files anymore
-  //      Better way is to properly read and write the relevant parts by "hand."
-  (void) !fread(&size, sizeof(size), 1, index);
-  return size;
+
+  struct _trace_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  size_t nread = fread(&hdr, 1, sizeof(hdr), index);
+  if (nread < sizeof(hdr) || memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+    // Version 1: just the number of indices
+    meta->version = TRACE_VERSION_1;
+    fseek(index, 0, SEEK_SET);
+    if (fread(&meta->num_indices, sizeof(meta->num_indices), 1, index) != 1)
+      meta->num_indices = 0;
+    return SUCCESS;
+  }
+
+  if (hdr.endian != TRACE_ENDIAN_MARK) {
+    warn("Trace was written on a machine with a different byte order (%x).", hdr.endian);
+    return FAILURE;
+  }
+
+  if (hdr.version != TRACE_VERSION_2 ||
+      hdr.index_entry_size != sizeof(struct traffic_matrix_trace_index_t)) {
+    warn("Unsupported trace version (%u).", hdr.version);
+    return FAILURE;
+  }
+
+  meta->version = hdr.version;
+  meta->num_indices = hdr.num_indices;
+  meta->num_tors = hdr.num_tors;
+  meta->num_pods = hdr.num_pods;
+  meta->time_step = hdr.time_step;
+
+  if (meta->num_pods) {
+    size_t size = sizeof(uint32_t) * meta->num_tors;
+    meta->pod_of_tor = malloc(size);
+    if (fread(meta->pod_of_tor, 1, size, index) != size) {
+      free(meta->pod_of_tor);
+      meta->pod_of_tor = 0;
+      warn("Couldn't read the pod mapping of the trace (%u ToRs).", meta->num_tors);
+      return FAILURE;
+    }
+  }
+
+  return SUCCESS;
+}
+
+/* Reads meta->num_indices entries (of meta->version) into indices */
+static
+int _traffic_matrix_trace_read_entries(
+    FILE *index, struct traffic_matrix_trace_meta_t const *meta,
+    struct traffic_matrix_trace_index_t *indices) {
+  if (meta->version == TRACE_VERSION_2) {
+    size_t size = sizeof(struct traffic_matrix_trace_index_t) * meta->num_indices;
+    if (fread(indices, 1, size, index) != size)
+      return FAILURE;
+    for (uint64_t i = 0; i < meta->num_indices; ++i)
+      indices[i].flags &= ~(uint32_t)TRACE_INDEX_VERIFIED;
+    return SUCCESS;
+  }
+
+  for (uint64_t i = 0; i < meta->num_indices; ++i) {
+    struct _trace_index_v1_t entry;
+    if (fread(&entry, sizeof(entry), 1, index) != 1)
+      return FAILURE;
+    indices[i].seek = entry.seek;
+    indices[i].time = entry.time;
+    indices[i].size = entry.size;
+    indices[i].checksum = 0;
+    indices[i].flags = 0;
+  }
+  return SUCCESS;
+}
+
+int traffic_matrix_trace_read_meta(
+    char const *name,
+    struct traffic_matrix_trace_meta_t *meta,
+    struct traffic_matrix_trace_index_t **indices) {
+  char fname[PATH_MAX] = {0};
+  (void) strncat(fname, name, PATH_MAX - 1);
+  (void) strncat(fname, ".index", PATH_MAX - 1);
+
+  FILE *index = fopen(fname, "rb");
+  if (!index)
+    return FAILURE;
+
+  int ret = _traffic_matrix_trace_read_header(index, meta);
+  if (ret == SUCCESS && indices) {
+    *indices = malloc(sizeof(struct traffic_matrix_trace_index_t) * MAX(meta->num_indices, 1));
+    ret = _traffic_matrix_trace_read_entries(index, meta, *indices);
+    if (ret != SUCCESS) {
+      free(*indices);
+      *indices = 0;
+    }
+  }
+
+  fclose(index);
+  return ret;
+}
+
+void traffic_matrix_trace_meta_free(struct traffic_matrix_trace_meta_t *meta) {
+  free(meta->pod_of_tor);
+  meta->pod_of_tor = 0;
+}
+
+void traffic_matrix_trace_set_meta(
+    struct traffic_matrix_trace_t *trace,
+    uint32_t num_tors, uint32_t num_pods, uint32_t const *pod_of_tor) {
+  traffic_matrix_trace_meta_free(&trace->meta);
+  trace->meta.num_tors = num_tors;
+  trace->meta.num_pods = pod_of_tor ? num_pods : 0;
+  if (trace->meta.num_pods) {
+    size_t size = sizeof(uint32_t) * num_tors;
+    trace->meta.pod_of_tor = malloc(size);
+    memcpy(trace->meta.pod_of_tor, pod_of_tor, size);
+  }
 }
 
 struct traffic_matrix_trace_t *traffic_matrix_trace_create(
     uint16_t num_caches,
     uint16_t cap_indices, const char *name) {
-  num_caches = upper_pow2(num_caches);
   size_t index_size = sizeof(struct traffic_matrix_trace_index_t) * cap_indices;
-  size_t cache_size = sizeof(struct traffic_matrix_trace_cache_t) * num_caches;
   size_t size = sizeof(struct traffic_matrix_trace_t);
 
   struct traffic_matrix_trace_t *trace = malloc(size);
 
   trace->indices = (struct traffic_matrix_trace_index_t *)malloc(index_size);
-  trace->caches = (struct traffic_matrix_trace_cache_t *)malloc(cache_size);
-
-  memset(trace->caches, 0, cache_size);
   memset(trace->indices, 0, index_size);
 
   trace->_optimized = 0;
+  trace->_step = 0;
 
+  // The caches are sized once we know how large the TMs are
+  for (unsigned i = 0; i < TRACE_CACHE_SHARDS; ++i)
+    trace->caches[i] = cache2q_create(0, _traffic_matrix_cache_free);
   trace->num_caches = num_caches;
+  trace->cache_budget = _trace_default_cache_budget;
+  trace->prefetcher = 0;
+  trace->writer = 0;
+  trace->stall_ns = 0;
+  trace->prefetched = 0;
+  trace->keyframe_interval = _trace_default_keyframe_interval;
+  trace->_keyframe = 0;
+  trace->_keyframe_seek = trace->_keyframe_size = 0;
+  trace->_since_keyframe = 0;
+  memset(&trace->meta, 0, sizeof(trace->meta));
+  trace->meta.version = TRACE_VERSION_2;
 
   // Zero indices at the moment
   trace->num_indices = 0;
   trace->cap_indices = cap_indices;
   trace->largest_seek = 0;
+  trace->map = 0;
+  trace->map_size = 0;
+  trace->rollup = 0;
+  trace->name = name ? strdup(name) : 0;
   trace->iter = _tmt_iter;
 
+  if (pthread_mutex_init(&trace->optimize_lock, 0) != 0)
+    panic_txt("Couldn't initiate the mutex.");
+  for (unsigned i = 0; i < TRACE_CACHE_SHARDS; ++i) {
+    if (pthread_mutex_init(&trace->cache_locks[i], 0) != 0)
+      panic_txt("Couldn't initiate the mutex.");
+  }
+
   if (name != 0) {
     char fname[PATH_MAX] = {0};
     char fdata[PATH_MAX] = {0};
@@ -427,16 +1384,17 @@ struct traffic_matrix_trace_t *traffic_matrix_trace_create(
   return trace;
 }
 
+/* Reads the indices that follow the header (the cursor should be right after
+ * it) */
 static
 void _traffic_matrix_trace_load_indices(struct traffic_matrix_trace_t *trace) {
-  fseek(trace->findex, 0 + sizeof(trace->num_indices), SEEK_SET);
-
   size_t size = sizeof(struct traffic_matrix_trace_index_t) * trace->num_indices;
 
-  // XXX: Bad idea: if the data-structures change we cannot just "read" the files anymore
-  //      Better way is to properly read and write the relevant parts by "hand."
-  size_t nread = fread(trace->indices, 1, size, trace->findex); 
-  if (nread != size) {
+  // The indices are read by all the simulation threads, spread them across
+  // the NUMA nodes (before they are touched) rather than keeping them on ours.
+  affinity_interleave(trace->indices, size);
+
+  if (_traffic_matrix_trace_read_entries(trace->findex, &trace->meta, trace->indices) != SUCCESS) {
     panic_txt("Couldn't load the indices.");
   }
 
@@ -447,22 +1405,50 @@ void _traffic_matrix_trace_load_indices(struct traffic_matrix_trace_t *trace) {
     if (seek_idx > trace->largest_seek) {
       trace->largest_seek = seek_idx;
     }
+    index++;
   }
 }
 
+/* Always writes a version 2 index.  Loaded traces have their .index opened
+ * for appending, so the file is truncated first rather than seeked. */
 static
 void _traffic_matrix_trace_save_indices(struct traffic_matrix_trace_t *trace) {
+  _traffic_matrix_trace_optimize(trace);
+  trace->meta.version = TRACE_VERSION_2;
+  trace->meta.num_indices = trace->num_indices;
+  trace->meta.time_step = trace->_step;
+
+  fflush(trace->findex);
+  if (ftruncate(fileno(trace->findex), 0) != 0)
+    panic_txt("Couldn't truncate the index file.");
   fseek(trace->findex, 0, SEEK_SET);
-  // XXX: Bad idea: if the data-structures change we cannot just "read" the files anymore
-  //      Better way is to properly read and write the relevant parts by "hand."
-  size_t written = fwrite(&trace->num_indices, 1, sizeof(trace->num_indices), trace->findex);
-  if (written != sizeof(trace->num_indices)) {
-    panic("Couldn't save indices count: wrote %d instead of %d", written, sizeof(trace->num_indices));
+
+  struct _trace_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+  hdr.version = TRACE_VERSION_2;
+  hdr.endian = TRACE_ENDIAN_MARK;
+  hdr.num_indices = trace->num_indices;
+  hdr.num_tors = trace->meta.num_tors;
+  hdr.num_pods = trace->meta.num_pods;
+  hdr.time_step = trace->meta.time_step;
+  hdr.index_entry_size = sizeof(struct traffic_matrix_trace_index_t);
+
+  if (fwrite(&hdr, sizeof(hdr), 1, trace->findex) != 1)
+    panic_txt("Couldn't save the trace header.");
+
+  if (hdr.num_pods) {
+    size_t size = sizeof(uint32_t) * hdr.num_tors;
+    if (fwrite(trace->meta.pod_of_tor, 1, size, trace->findex) != size)
+      panic_txt("Couldn't save the pod mapping.");
   }
+
+  /* Whatever was verified in memory is checked again after a reload */
+  for (uint64_t i = 0; i < trace->num_indices; ++i)
+    trace->indices[i].flags &= ~(uint32_t)TRACE_INDEX_VERIFIED;
+
   size_t size = sizeof(struct traffic_matrix_trace_index_t) * trace->num_indices;
-  // XXX: Bad idea: if the data-structures change we cannot just "read" the files anymore
-  //      Better way is to properly read and write the relevant parts by "hand."
-  written = fwrite(trace->indices, 1, size, trace->findex);
+  size_t written = fwrite(trace->indices, 1, size, trace->findex);
   if (written != size) {
     panic("Couldn't save indices: wrote %d instead of %d.", written, size);
   }
@@ -470,7 +1456,9 @@ void _traffic_matrix_trace_save_indices(struct traffic_matrix_trace_t *trace) {
 }
 
 void traffic_matrix_trace_save(struct traffic_matrix_trace_t *trace) {
-  // Anything else we need to do?
+  // The index shouldn't point past the data
+  if (trace->writer)
+    _traffic_matrix_trace_writer_flush(trace->writer);
   _traffic_matrix_trace_save_indices(trace);
 }
 
@@ -493,17 +1481,53 @@ struct traffic_matrix_trace_t *traffic_matrix_trace_load(
     panic_txt("Couldn't find the associated index or data file.");
   }
 
-  uint64_t indices = _traffic_matrix_trace_index_count(index);
+  struct traffic_matrix_trace_meta_t meta;
+  if (_traffic_matrix_trace_read_header(index, &meta) != SUCCESS)
+    panic("Couldn't read the header of %.40s.", fname);
+
+  uint64_t indices = meta.num_indices;
   struct traffic_matrix_trace_t *trace = traffic_matrix_trace_create(num_caches, indices, 0);
   trace->fdata = data;
   trace->num_indices = indices;
   trace->findex = index;
+  trace->meta = meta;
+  trace->name = strdup(name);
 
   _traffic_matrix_trace_load_indices(trace);
+  if (trace->num_indices > 0)
+    _traffic_matrix_trace_size_cache(trace, sizeof(struct traffic_matrix_t) +
+        sizeof(struct pair_bw_t) * _traffic_matrix_trace_record_pairs(trace, &trace->indices[0]));
+
+  if (traffic_matrix_trace_map(trace, TRACE_ACCESS_NORMAL) != SUCCESS)
+    info("Couldn't map %.40s, reading it through the file.", fdata);
+
+  if (_trace_default_prefetch)
+    traffic_matrix_trace_prefetch(trace, _trace_default_prefetch);
 
   return trace;
 }
 
+uint64_t traffic_matrix_trace_verify(struct traffic_matrix_trace_t *trace) {
+  uint64_t corrupted = 0;
+  for (uint64_t i = 0; i < trace->num_indices; ++i) {
+    struct traffic_matrix_trace_index_t *index = &trace->indices[i];
+    if (!(index->flags & TRACE_INDEX_CHECKSUM))
+      continue;
+
+    char *buf = 0;
+    char const *rec = _traffic_matrix_trace_record(
+        trace, index->seek, (size_t)index->size, &buf);
+    if (checksum_crc32(0, rec, (size_t)index->size) != index->checksum) {
+      warn("Checksum mismatch for the TM at %ld.", (long)index->time);
+      corrupted++;
+    } else {
+      __atomic_fetch_or(&index->flags, TRACE_INDEX_VERIFIED, __ATOMIC_RELEASE);
+    }
+    free(buf);
+  }
+  return corrupted;
+}
+
 void traffic_matrix_trace_print_index(struct traffic_matrix_trace_t *t) {
   for (uint64_t i = 0; i < t->num_indices; ++i) {
     //struct traffic_matrix_trace_index_t *index = &t->indices[i];
@@ -529,22 +1553,77 @@ void traffic_matrix_trace_for_each(struct traffic_matrix_trace_t *t,
 }
 
 void traffic_matrix_trace_free(struct traffic_matrix_trace_t *t) {
-  struct traffic_matrix_trace_cache_t *cache = t->caches;
-  for (uint16_t i = 0; i < t->num_caches; ++i) {
-    if (cache->is_set) {
-      free(cache->tm);
-    }
-    cache++;
-  }
+  traffic_matrix_trace_prefetch(t, 0);
+
+  for (unsigned i = 0; i < TRACE_CACHE_SHARDS; ++i)
+    cache2q_free(t->caches[i]);
+
+  if (t->map)
+    munmap((void *)t->map, t->map_size);
 
   fclose(t->fdata);
   fclose(t->findex);
 
-  free(t->caches);
+  free(t->_keyframe);
+  free(t->name);
+  traffic_matrix_trace_meta_free(&t->meta);
+  if (t->rollup)
+    trace_rollup_free(t->rollup);
+
+  pthread_mutex_destroy(&t->optimize_lock);
+  for (unsigned i = 0; i < TRACE_CACHE_SHARDS; ++i)
+    pthread_mutex_destroy(&t->cache_locks[i]);
+
   free(t->indices);
   free(t);
 }
 
+void traffic_matrix_trace_set_default_cache_budget(size_t bytes) {
+  _trace_default_cache_budget = bytes;
+}
+
+void traffic_matrix_trace_set_cache_budget(
+    struct traffic_matrix_trace_t *trace, size_t bytes) {
+  trace->cache_budget = bytes;
+  if (trace->num_indices > 0)
+    _traffic_matrix_trace_size_cache(trace, sizeof(struct traffic_matrix_t) +
+        sizeof(struct pair_bw_t) * _traffic_matrix_trace_record_pairs(trace, &trace->indices[0]));
+}
+
+void traffic_matrix_trace_cache_stats(
+    struct traffic_matrix_trace_t *trace, struct cache2q_stats_t *stats) {
+  memset(stats, 0, sizeof(struct cache2q_stats_t));
+  for (unsigned i = 0; i < TRACE_CACHE_SHARDS; ++i) {
+    struct cache2q_stats_t shard = {0};
+    pthread_mutex_lock(&trace->cache_locks[i]);
+    cache2q_stats(trace->caches[i], &shard);
+    pthread_mutex_unlock(&trace->cache_locks[i]);
+
+    stats->hits += shard.hits;
+    stats->misses += shard.misses;
+    stats->evictions += shard.evictions;
+    stats->ghost_hits += shard.ghost_hits;
+    stats->bytes += shard.bytes;
+    stats->entries += shard.entries;
+  }
+}
+
+void traffic_matrix_trace_cache_report(
+    struct traffic_matrix_trace_t *trace, char const *name) {
+  struct cache2q_stats_t stats = {0};
+  traffic_matrix_trace_cache_stats(trace, &stats);
+  info("Trace cache (%s): %lu hits, %lu misses (%lu ghost hits), "
+      "%lu evictions, %lu TMs in %lu bytes.",
+      name,
+      (unsigned long)stats.hits, (unsigned long)stats.misses,
+      (unsigned long)stats.ghost_hits, (unsigned long)stats.evictions,
+      (unsigned long)stats.entries, (unsigned long)stats.bytes);
+  info("Trace I/O (%s): stalled %.3f ms on reads, %lu TMs read ahead.",
+      name,
+      (double)__atomic_load_n(&trace->stall_ns, __ATOMIC_RELAXED) / 1e6,
+      (unsigned long)__atomic_load_n(&trace->prefetched, __ATOMIC_RELAXED));
+}
+
 struct traffic_matrix_t *traffic_matrix_zero(pair_id_t num_pairs) {
   size_t size = sizeof(struct traffic_matrix_t) +
       sizeof(struct pair_bw_t) * num_pairs;
@@ -560,13 +1639,26 @@ int traffic_matrix_trace_get_nth_key(
   if (index >= trace->num_indices)
     return FAILURE;
 
-  if (!trace->_optimized)
-    _traffic_matrix_trace_optimize(trace);
+  _traffic_matrix_trace_optimize(trace);
 
   *ret =trace->indices[index].time;
   return SUCCESS;
 }
 
+int traffic_matrix_trace_find_key(
+    struct traffic_matrix_trace_t *trace,
+    trace_time_t key, uint32_t *ret) {
+  _traffic_matrix_trace_optimize(trace);
+
+  struct traffic_matrix_trace_index_t *index =
+    _traffic_matrix_trace_get_idx(trace, key);
+  if (!index)
+    return FAILURE;
+
+  *ret = (uint32_t)(index - trace->indices);
+  return SUCCESS;
+}
+
 #define TO_TTIT(x) struct traffic_matrix_trace_iter_tms_t *ttit = (struct traffic_matrix_trace_iter_tms_t *)(x)
 
 void _ttit_begin(struct traffic_matrix_trace_iter_t *iter) {
@@ -626,6 +1718,7 @@ struct traffic_matrix_trace_iter_t *traffic_matrix_iter_from_tms(
   struct traffic_matrix_trace_iter_tms_t *iter = 
     malloc(sizeof(struct traffic_matrix_trace_iter_tms_t));
 
+  iter->trace = 0;
   iter->tms = tm;
   iter->tms_length = size - 1;
 
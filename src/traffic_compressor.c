@@ -1,40 +1,62 @@
 #include "util/common.h"
 #include "util/log.h"
+#include "util/pool.h"
 #include "traffic.h"
 
 #include <assert.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include "khash.h"
 #define NET_MAX 64
 
-KHASH_MAP_INIT_STR(net_entity, char *)
+KHASH_MAP_INIT_STR(net_entity, uint32_t)
 
 void usage(char const *arg) {
-  warn("\n  usage: %s [TM PATH] [OUTPUT]\n\n"
+  warn("\n  usage: %s [-p] [TM PATH] [OUTPUT]\n\n"
        "  Accept traffic matrix files from the interpolate.py output\n"
        "  And outputs a compressed format usable by the rest of the\n"
-       "  toolkit.", arg
+       "  toolkit.  The traffic matrices are stored raw, or packed\n"
+       "  with -p (see traffic_matrix_trace_compress).", arg
       );
   exit(1);
 }
 
-void insert_tor_pod(khash_t(net_entity) *table, char const *tor, char const *pod) {
-    khiter_t iter = kh_get(net_entity, table, tor);
-    if (iter != kh_end(table)) return;
-
+/* Returns the id of name in table: names get consecutive ids in the order
+ * they are first seen */
+uint32_t entity_id(khash_t(net_entity) *table, char const *name) {
     int absent = 0;
-    iter = kh_put(net_entity, table, tor, &absent);
-    if (absent) kh_key(table, iter) = strdup(tor);
-    kh_value(table, iter) = strdup(pod);
+    khiter_t iter = kh_put(net_entity, table, name, &absent);
+    if (absent) {
+      kh_key(table, iter) = strdup(name);
+      kh_value(table, iter) = kh_size(table) - 1;
+    }
+    return kh_value(table, iter);
 }
 
-uint32_t load_keys(char const *fdir) {
+void free_entities(khash_t(net_entity) *table) {
+  for (khiter_t k = kh_begin(table); k != kh_end(table); ++k) {
+    if (!kh_exist(table, k)) continue;
+    free((char *)kh_key(table, k));
+  }
+  kh_destroy(net_entity, table);
+}
+
+/* Reads the ToR pairs of key.tsv.  The TM files list the pairs in the same
+ * order, source ToR major, so the ToRs are numbered in the order they first
+ * show up as a source (and the pods in the order they first show up).  Sets
+ * *pod_of_tor (which the caller frees) and *num_pods, and returns the number
+ * of ToRs. */
+uint32_t load_keys(char const *fdir, uint32_t **pod_of_tor, uint32_t *num_pods) {
   char path[PATH_MAX] = {0};
   (void) strncat(path, fdir, PATH_MAX - 1);
   (void) strncat(path, "/key.tsv", PATH_MAX - 1);
@@ -44,31 +66,29 @@ uint32_t load_keys(char const *fdir) {
     panic("Couldn't find the file %s", path);
 
   char tor1[NET_MAX], tor2[NET_MAX], pod1[NET_MAX], pod2[NET_MAX];
-  khash_t(net_entity) *h = kh_init(net_entity);
+  khash_t(net_entity) *tors = kh_init(net_entity);
+  khash_t(net_entity) *pods = kh_init(net_entity);
+  uint32_t *pod_ids = 0;
+  uint32_t cap = 0;
 
   info_txt("Loading keys.");
-  while (!feof(keys)) {
-    fscanf(keys, "%s\t%s\t%s\t%s\t0\t0 ", tor1, tor2, pod1, pod2);
-    insert_tor_pod(h, tor1, pod1);
-    insert_tor_pod(h, tor2, pod2);
+  while (fscanf(keys, "%63s\t%63s\t%63s\t%63s\t0\t0 ", tor1, tor2, pod1, pod2) == 4) {
+    uint32_t tor = entity_id(tors, tor1);
+    if (tor >= cap) {
+      cap = MAX(cap * 2, 64);
+      pod_ids = realloc(pod_ids, sizeof(uint32_t) * cap);
+    }
+    pod_ids[tor] = entity_id(pods, pod1);
   }
+  fclose(keys);
 
-  uint32_t tor_count = kh_size(h);
-  for (khiter_t k = kh_begin(h); k != kh_end(h); ++k) {
-    if (!kh_exist(h, k)) continue;
-
-    char *val = kh_value(h, k);
-    char const* key = kh_key(h, k);
-    // TODO: Save file ...
-    //info("Tor: %s, Pod: %s", key, val);
+  uint32_t tor_count = kh_size(tors);
+  *num_pods = kh_size(pods);
+  *pod_of_tor = pod_ids;
+  info("Finished loading keys: %u ToRs in %u pods.", tor_count, *num_pods);
 
-    kh_del(net_entity, h, k);
-    free(val);
-    free((char*) key);
-  }
-  info_txt("Finished loading keys.");
-
-  kh_destroy(net_entity, h);
+  free_entities(tors);
+  free_entities(pods);
   return tor_count;
 }
 
@@ -97,115 +117,285 @@ void print_name(char const *name, void *nil) {
   (void)(nil);
 }
 
+/* Parses the float at *pos (skipping the white space before it) and moves
+ * *pos past it.  Returns 0 if there is no number before end.
+ *
+ * The TM files are plain decimals (e.g., 10.0, 1.5e-3), so we parse them by
+ * hand instead of going through fscanf/strtod and the locale machinery for
+ * every one of the millions of values.  Anything unusual (inf, nan, hex) goes
+ * to strtod. */
+static int _parse_bw(char const **pos, char const *end, bw_t *ret) {
+  static double const pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+  char const *p = *pos;
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+    p++;
+  if (p == end)
+    return 0;
+
+  char const *token = p;
+  int negative = 0;
+  if (*p == '-' || *p == '+')
+    negative = (*p++ == '-');
+
+  uint64_t mantissa = 0;
+  int exponent = 0, digits = 0, significant = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+    if (significant < 19) {
+      mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+      if (mantissa) significant++;
+    } else {
+      exponent++;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+      if (significant < 19) {
+        mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        exponent--;
+        if (mantissa) significant++;
+      }
+    }
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E') && digits) {
+    char const *e = p + 1;
+    int eneg = 0, eval = 0;
+    if (e < end && (*e == '-' || *e == '+'))
+      eneg = (*e++ == '-');
+    if (e < end && *e >= '0' && *e <= '9') {
+      for (; e < end && *e >= '0' && *e <= '9'; ++e)
+        eval = MIN(eval * 10 + (*e - '0'), 1000);
+      exponent += eneg ? -eval : eval;
+      p = e;
+    }
+  }
+
+  int delimited = (p == end || *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r');
+  if (!digits || !delimited || exponent < -22 || exponent > 22) {
+    /* Let strtod deal with it */
+    char buf[64] = {0};
+    char const *tend = token;
+    while (tend < end && !(*tend == ' ' || *tend == '\t' || *tend == '\n' || *tend == '\r'))
+      tend++;
+    size_t len = MIN((size_t)(tend - token), sizeof(buf) - 1);
+    memcpy(buf, token, len);
+    char *parsed = 0;
+    double val = strtod(buf, &parsed);
+    if (parsed == buf)
+      panic("Couldn't parse the value: %s", buf);
+    *ret = (bw_t)val;
+    *pos = tend;
+    return 1;
+  }
+
+  double val = (double)mantissa;
+  val = exponent < 0 ? val / pow10[-exponent] : val * pow10[exponent];
+  *ret = (bw_t)(negative ? -val : val);
+  *pos = p;
+  return 1;
+}
+
+/* Reads the TM in the file dir/name.  The files don't have the diagonal (a
+ * ToR doesn't send traffic to itself), which is zero in the TM. */
 struct traffic_matrix_t *file_to_tm(
     char const *name, char const *dir, 
     uint32_t tor_count) {
   char fname[PATH_MAX+1]= {0};
   (void) strncat(fname, dir, PATH_MAX);
   (void) strncat(fname, name, PATH_MAX);
-  
-  FILE *file = fopen(fname, "r");
-  bw_t bw = 0;
+
+  int fd = open(fname, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+    panic("Couldn't open the file: %s", fname);
+
+  size_t fsize = (size_t)st.st_size;
+  char const *text = "";
+  if (fsize) {
+    text = mmap(0, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED)
+      panic("Couldn't map the file: %s", fname);
+    madvise((void *)text, fsize, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
   size_t size = sizeof(struct traffic_matrix_t) +
     sizeof(struct pair_bw_t) * tor_count * tor_count;
   struct traffic_matrix_t *tm = malloc(size);
   struct pair_bw_t *bws = tm->bws;
-
-  int src = 0, dst  = 0;
-  uint64_t iterator   = 0;
-  float max_traffic = 0;
-
-  fseek(file, 0, SEEK_SET);
-  while (!feof(file)) {
-    if (src == dst) {
-      bws->bw = 0;
-      bws++;
-      dst += 1;
-      iterator++;
+  tm->num_pairs = tor_count * tor_count;
+
+  char const *pos = text, *end = text + fsize;
+  for (uint32_t src = 0; src < tor_count; ++src) {
+    for (uint32_t dst = 0; dst < tor_count; ++dst, ++bws) {
+      if (src == dst) {
+        bws->bw = 0;
+        continue;
+      }
+
+      if (!_parse_bw(&pos, end, &bws->bw))
+        panic("%s is missing values (%u ToRs).", fname, tor_count);
     }
+  }
 
-    fscanf(file, "%f ", &bw);
-    bws->bw = bw;
-    bws++;
+  bw_t extra = 0;
+  if (_parse_bw(&pos, end, &extra))
+    panic("%s has more values than expected (%u ToRs).", fname, tor_count);
 
-    max_traffic = (max_traffic < bw) ? bw : max_traffic;
+  if (fsize)
+    munmap((void *)text, fsize);
 
-    dst += 1;
+  return tm;
+}
 
-    if (dst == tor_count) {
-      dst = 0;
-      src += 1;
-    }
+/* A TM file and its parsed TM */
+struct _tm_file_t {
+  char       *name;
+  trace_time_t key;
 
-    iterator++;
-  }
+  char const *dir;
+  uint32_t    tor_count;
 
-  /* TODO: Not sure what was wrong with the old code that requires me to insert
-   * this line ... */
-  bws->bw = 0;
-  iterator++;
+  struct traffic_matrix_t *tm;
+  int         done;
 
-  tm->num_pairs = iterator;
-  assert(iterator == tor_count * tor_count);
-  fclose(file);
+  pthread_mutex_t *lock;
+  pthread_cond_t  *parsed;
+};
 
-  return tm;
+static int _tm_file_cmp(void const *v1, void const *v2) {
+  struct _tm_file_t const *f1 = v1;
+  struct _tm_file_t const *f2 = v2;
+  if (f1->key < f2->key) return -1;
+  if (f1->key > f2->key) return  1;
+  return 0;
 }
 
-struct _trace_metadata {
-  struct traffic_matrix_trace_t *trace;
-  char const *dir;
-  uint32_t tor_count;
+struct _tm_files_t {
+  struct _tm_file_t *files;
+  uint32_t count, cap;
 };
 
-void add_tm_to_trace(char const *name, void *_metadata) {
-  struct _trace_metadata *metadata = 
-    (struct _trace_metadata *)_metadata;
-  char *tokens = strdup(name);
-
+void add_tm_file(char const *name, void *_files) {
+  struct _tm_files_t *files = (struct _tm_files_t *)_files;
   if (name[0] != '0')
     return;
 
-  char *split = strtok(tokens, ".");
-  int key = atoi(split);
-  struct traffic_matrix_t *tm =
-    file_to_tm(name, metadata->dir, metadata->tor_count); 
+  if (files->count == files->cap) {
+    files->cap = MAX(files->cap * 2, 64);
+    files->files = realloc(files->files, sizeof(struct _tm_file_t) * files->cap);
+  }
 
-  info("Serialized traffic matrix @key: %d", key);
-  traffic_matrix_trace_add(
-      metadata->trace, tm, key);
+  struct _tm_file_t *file = &files->files[files->count++];
+  memset(file, 0, sizeof(struct _tm_file_t));
+  file->name = strdup(name);
+  file->key = atoi(name);
+}
 
-  free(tm);
-  free(tokens);
+static void _parse_tm_file(void *data) {
+  struct _tm_file_t *file = (struct _tm_file_t *)data;
+  struct traffic_matrix_t *tm = file_to_tm(file->name, file->dir, file->tor_count);
+
+  pthread_mutex_lock(file->lock);
+  file->tm = tm;
+  file->done = 1;
+  pthread_cond_broadcast(file->parsed);
+  pthread_mutex_unlock(file->lock);
 }
 
-void load_traffic(char const *fdir, const char *output, uint32_t tor_count) {
+/* The files are parsed by the pool, at most TRAFFIC_COMPRESSOR_WINDOW per
+ * worker ahead of the writer.  This thread is the only writer and appends the
+ * TMs to the trace in key order. */
+#define TRAFFIC_COMPRESSOR_WINDOW 4
+#define TRAFFIC_COMPRESSOR_BUFFER (64 << 20)
+
+void load_traffic(char const *fdir, const char *output, uint32_t tor_count,
+    uint32_t num_pods, uint32_t const *pod_of_tor, int pack) {
   struct traffic_matrix_trace_t *trace = 
     traffic_matrix_trace_create(50, 100, output);
+  if (pack)
+    traffic_matrix_trace_compress(trace, TRACE_DEFAULT_KEYFRAME_INTERVAL);
+  traffic_matrix_trace_set_meta(trace, tor_count, num_pods, pod_of_tor);
+
+  struct _tm_files_t files = {0};
+  for_file_in_dir(fdir, add_tm_file, (void *)&files);
+  qsort(files.files, files.count, sizeof(struct _tm_file_t), _tm_file_cmp);
+
+  pthread_mutex_t lock;
+  pthread_cond_t parsed;
+  pthread_mutex_init(&lock, 0);
+  pthread_cond_init(&parsed, 0);
+
+  struct pool_t *pool = pool_create(0);
+  struct pool_future_t future;
+  pool_future_init(&future);
+  uint32_t window = pool_size(pool) * TRAFFIC_COMPRESSOR_WINDOW;
+  struct traffic_matrix_trace_writer_t *writer =
+    traffic_matrix_trace_writer_open(trace, TRAFFIC_COMPRESSOR_BUFFER);
+
+  for (uint32_t i = 0; i < files.count; ++i) {
+    files.files[i].dir = fdir;
+    files.files[i].tor_count = tor_count;
+    files.files[i].lock = &lock;
+    files.files[i].parsed = &parsed;
+  }
+
+  uint32_t submitted = 0;
+  for (; submitted < MIN(window, files.count); ++submitted)
+    pool_submit(pool, &future, _parse_tm_file, &files.files[submitted]);
+
+  for (uint32_t i = 0; i < files.count; ++i) {
+    struct _tm_file_t *file = &files.files[i];
+    pthread_mutex_lock(&lock);
+    while (!file->done)
+      pthread_cond_wait(&parsed, &lock);
+    pthread_mutex_unlock(&lock);
+
+    if (submitted < files.count) {
+      pool_submit(pool, &future, _parse_tm_file, &files.files[submitted]);
+      submitted++;
+    }
+
+    info("Serialized traffic matrix @key: %ld", (long)file->key);
+    traffic_matrix_trace_writer_add(writer, file->tm, file->key);
 
-  struct _trace_metadata metadata = {
-    .trace =  trace,
-    .dir = fdir,
-    .tor_count = tor_count,
-  };
+    free(file->tm);
+    free(file->name);
+  }
 
-  for_file_in_dir(
-      fdir, add_tm_to_trace, (void *)&metadata);
+  pool_future_wait(&future);
+  pool_future_destroy(&future);
+  pool_free(pool);
+  pthread_cond_destroy(&parsed);
+  pthread_mutex_destroy(&lock);
+  free(files.files);
 
-  traffic_matrix_trace_save(trace);
+  traffic_matrix_trace_writer_close(writer);
   traffic_matrix_trace_free(trace);
 }
 
 int main(int argc, char **argv) {
-  if (argc != 3)
+  int opt = 0, pack = 0;
+  while ((opt = getopt(argc, argv, "p")) != -1) {
+    switch (opt) {
+      case 'p': pack = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (argc - optind != 2)
     usage(argv[0]);
 
-  char const *fdir   = argv[1];
-  char const *output = argv[2];
-  (void)(output);
+  char const *fdir   = argv[optind];
+  char const *output = argv[optind + 1];
 
-  uint32_t tor_count = load_keys(fdir);
-  load_traffic(fdir, output, tor_count);
+  uint32_t num_pods = 0, *pod_of_tor = 0;
+  uint32_t tor_count = load_keys(fdir, &pod_of_tor, &num_pods);
+  load_traffic(fdir, output, tor_count, num_pods, pod_of_tor, pack);
+  free(pod_of_tor);
 
   return 0;
 }
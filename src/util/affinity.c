@@ -0,0 +1,120 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+#include "util/common.h"
+#include "util/log.h"
+#include "util/affinity.h"
+
+unsigned affinity_ncpus(void) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    int count = CPU_COUNT(&set);
+    if (count > 0)
+      return (unsigned)count;
+  }
+#endif
+  long ncores = get_ncores();
+  return ncores > 0 ? (unsigned)ncores : 1;
+}
+
+int affinity_cpu(unsigned n) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+    unsigned idx = n % (unsigned)CPU_COUNT(&set);
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (!CPU_ISSET(cpu, &set))
+        continue;
+      if (idx-- == 0)
+        return (int)cpu;
+    }
+  }
+#endif
+  return (int)(n % affinity_ncpus());
+}
+
+int affinity_pin_self(int cpu) {
+#ifdef __linux__
+  if (cpu < 0 || cpu >= CPU_SETSIZE)
+    return -1;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET((size_t)cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set);
+#else
+  (void)(cpu);
+  return -1;
+#endif
+}
+
+int affinity_node_of_cpu(int cpu) {
+#ifdef HAVE_LIBNUMA
+  if (numa_available() != -1)
+    return numa_node_of_cpu(cpu);
+#endif
+
+#ifdef __linux__
+  /* The node of a cpu shows up as /sys/devices/system/cpu/cpuX/nodeY */
+  char path[PATH_MAX] = {0};
+  for (int node = 0; node < 1024; ++node) {
+    snprintf(path, PATH_MAX - 1, "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+    if (access(path, F_OK) == 0)
+      return node;
+  }
+#endif
+  return -1;
+}
+
+void *affinity_alloc_local(size_t size) {
+#ifdef HAVE_LIBNUMA
+  if (numa_available() != -1)
+    return numa_alloc_local(size);
+#endif
+  return malloc(size);
+}
+
+void affinity_free(void *ptr, size_t size) {
+  if (!ptr) return;
+#ifdef HAVE_LIBNUMA
+  if (numa_available() != -1) {
+    numa_free(ptr, size);
+    return;
+  }
+#endif
+  (void)(size);
+  free(ptr);
+}
+
+void affinity_interleave(void *ptr, size_t size) {
+#ifdef HAVE_LIBNUMA
+  if (!ptr || size == 0 || numa_available() == -1 || numa_max_node() == 0)
+    return;
+
+  /* Only whole pages can be moved around */
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t begin = ((uintptr_t)ptr + page - 1) & ~(page - 1);
+  uintptr_t end = ((uintptr_t)ptr + size) & ~(page - 1);
+  if (end > begin)
+    numa_interleave_memory((void *)begin, end - begin, numa_all_nodes_ptr);
+#else
+  (void)(ptr); (void)(size);
+#endif
+}
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "khash.h"
+
+#include "util/common.h"
+#include "util/log.h"
+#include "util/cache2q.h"
+
+/* Keep at least this many ghosts around, even if the cache is tiny */
+#define CACHE2Q_MIN_GHOSTS 16
+
+enum _c2q_list_id {
+  _C2Q_IN = 0,
+  _C2Q_MAIN,
+  _C2Q_GHOST,
+};
+
+struct _c2q_entry_t {
+  int64_t key;
+  void   *value;
+  size_t  size;
+  enum _c2q_list_id list;
+
+  struct _c2q_entry_t *prev, *next;
+};
+
+/* Head is the most recently inserted (or used) entry */
+struct _c2q_list_t {
+  struct _c2q_entry_t *head, *tail;
+  size_t bytes, count;
+};
+
+KHASH_MAP_INIT_INT64(c2q, struct _c2q_entry_t *)
+
+struct cache2q_t {
+  khash_t(c2q) *table;
+  struct _c2q_list_t lists[3];
+
+  size_t budget;
+  cache2q_free_t free_value;
+
+  uint64_t hits, misses, evictions, ghost_hits;
+};
+
+static void _c2q_unlink(struct cache2q_t *cache, struct _c2q_entry_t *entry) {
+  struct _c2q_list_t *list = &cache->lists[entry->list];
+  if (entry->prev) entry->prev->next = entry->next;
+  else list->head = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else list->tail = entry->prev;
+
+  entry->prev = entry->next = 0;
+  list->bytes -= entry->size;
+  list->count -= 1;
+}
+
+static void _c2q_push(struct cache2q_t *cache,
+    struct _c2q_entry_t *entry, enum _c2q_list_id id) {
+  struct _c2q_list_t *list = &cache->lists[id];
+  entry->list = id;
+  entry->prev = 0;
+  entry->next = list->head;
+  if (list->head) list->head->prev = entry;
+  list->head = entry;
+  if (!list->tail) list->tail = entry;
+
+  list->bytes += entry->size;
+  list->count += 1;
+}
+
+static void _c2q_drop(struct cache2q_t *cache, struct _c2q_entry_t *entry) {
+  _c2q_unlink(cache, entry);
+  khiter_t k = kh_get(c2q, cache->table, (khint64_t)entry->key);
+  if (k != kh_end(cache->table))
+    kh_del(c2q, cache->table, k);
+
+  if (entry->value && cache->free_value)
+    cache->free_value(entry->value);
+  free(entry);
+}
+
+static void _c2q_release_value(struct cache2q_t *cache, struct _c2q_entry_t *entry) {
+  if (entry->value && cache->free_value)
+    cache->free_value(entry->value);
+  entry->value = 0;
+  entry->size = 0;
+}
+
+static size_t _c2q_resident_bytes(struct cache2q_t const *cache) {
+  return cache->lists[_C2Q_IN].bytes + cache->lists[_C2Q_MAIN].bytes;
+}
+
+static void _c2q_evict(struct cache2q_t *cache) {
+  struct _c2q_list_t *in = &cache->lists[_C2Q_IN];
+  struct _c2q_list_t *main = &cache->lists[_C2Q_MAIN];
+  struct _c2q_list_t *ghost = &cache->lists[_C2Q_GHOST];
+
+  while (_c2q_resident_bytes(cache) > cache->budget) {
+    if (in->tail && (in->bytes > cache->budget / 4 || !main->tail)) {
+      /* Demote the oldest FIFO entry to a ghost */
+      struct _c2q_entry_t *entry = in->tail;
+      _c2q_unlink(cache, entry);
+      _c2q_release_value(cache, entry);
+      _c2q_push(cache, entry, _C2Q_GHOST);
+    } else {
+      _c2q_drop(cache, main->tail);
+    }
+    cache->evictions++;
+  }
+
+  size_t max_ghosts = MAX(in->count + main->count, CACHE2Q_MIN_GHOSTS);
+  while (ghost->count > max_ghosts)
+    _c2q_drop(cache, ghost->tail);
+}
+
+struct cache2q_t *cache2q_create(size_t budget, cache2q_free_t free_value) {
+  struct cache2q_t *cache = malloc(sizeof(struct cache2q_t));
+  memset(cache, 0, sizeof(struct cache2q_t));
+  cache->table = kh_init(c2q);
+  cache->budget = budget;
+  cache->free_value = free_value;
+  return cache;
+}
+
+size_t cache2q_budget(struct cache2q_t const *cache) {
+  return cache->budget;
+}
+
+void cache2q_set_budget(struct cache2q_t *cache, size_t budget) {
+  cache->budget = budget;
+  _c2q_evict(cache);
+}
+
+void *cache2q_get(struct cache2q_t *cache, int64_t key) {
+  khiter_t k = kh_get(c2q, cache->table, (khint64_t)key);
+  if (k == kh_end(cache->table)) {
+    cache->misses++;
+    return 0;
+  }
+
+  struct _c2q_entry_t *entry = kh_value(cache->table, k);
+  if (entry->list == _C2Q_GHOST) {
+    cache->misses++;
+    return 0;
+  }
+
+  /* Hits in the FIFO don't count as reuse (they are likely correlated) */
+  if (entry->list == _C2Q_MAIN) {
+    _c2q_unlink(cache, entry);
+    _c2q_push(cache, entry, _C2Q_MAIN);
+  }
+
+  cache->hits++;
+  return entry->value;
+}
+
+int cache2q_contains(struct cache2q_t const *cache, int64_t key) {
+  khiter_t k = kh_get(c2q, cache->table, (khint64_t)key);
+  if (k == kh_end(cache->table))
+    return 0;
+  return kh_value(cache->table, k)->list != _C2Q_GHOST;
+}
+
+void cache2q_put(struct cache2q_t *cache, int64_t key, void *value, size_t size) {
+  int absent = 0;
+  khiter_t k = kh_put(c2q, cache->table, (khint64_t)key, &absent);
+  if (absent < 0)
+    panic("Couldn't insert key %ld in the cache.", (long)key);
+
+  if (absent) {
+    struct _c2q_entry_t *entry = malloc(sizeof(struct _c2q_entry_t));
+    memset(entry, 0, sizeof(struct _c2q_entry_t));
+    entry->key = key;
+    entry->value = value;
+    entry->size = size;
+    kh_value(cache->table, k) = entry;
+    _c2q_push(cache, entry, _C2Q_IN);
+  } else {
+    struct _c2q_entry_t *entry = kh_value(cache->table, k);
+    enum _c2q_list_id id = entry->list;
+    if (id == _C2Q_GHOST) {
+      /* Seen again shortly after leaving the FIFO: it's worth keeping */
+      cache->ghost_hits++;
+      id = _C2Q_MAIN;
+    }
+
+    _c2q_unlink(cache, entry);
+    _c2q_release_value(cache, entry);
+    entry->value = value;
+    entry->size = size;
+    _c2q_push(cache, entry, id);
+  }
+
+  _c2q_evict(cache);
+}
+
+void cache2q_stats(struct cache2q_t const *cache, struct cache2q_stats_t *stats) {
+  stats->hits = cache->hits;
+  stats->misses = cache->misses;
+  stats->evictions = cache->evictions;
+  stats->ghost_hits = cache->ghost_hits;
+  stats->bytes = _c2q_resident_bytes(cache);
+  stats->entries = cache->lists[_C2Q_IN].count + cache->lists[_C2Q_MAIN].count;
+}
+
+void cache2q_free(struct cache2q_t *cache) {
+  for (unsigned i = 0; i < 3; ++i) {
+    struct _c2q_entry_t *entry = cache->lists[i].head;
+    while (entry) {
+      struct _c2q_entry_t *next = entry->next;
+      if (entry->value && cache->free_value)
+        cache->free_value(entry->value);
+      free(entry);
+      entry = next;
+    }
+  }
+
+  kh_destroy(c2q, cache->table);
+  free(cache);
+}
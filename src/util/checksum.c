@@ -0,0 +1,25 @@
+#include <pthread.h>
+
+#include "util/checksum.h"
+
+static uint32_t _crc32_table[256];
+static pthread_once_t _crc32_once = PTHREAD_ONCE_INIT;
+
+static void _crc32_init(void) {
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; ++j)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : (crc >> 1);
+    _crc32_table[i] = crc;
+  }
+}
+
+uint32_t checksum_crc32(uint32_t crc, void const *data, size_t size) {
+  pthread_once(&_crc32_once, _crc32_init);
+
+  unsigned char const *ptr = (unsigned char const *)data;
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i)
+    crc = _crc32_table[(crc ^ ptr[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
@@ -1,11 +1,15 @@
+#include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
-
-#include "thpool/thpool.h"
+#include <string.h>
 
 #include "algo/array.h"
 #include "algo/rvar.h"
+#include "khash.h"
 #include "util/common.h"
+#include "util/log.h"
 #include "util/monte_carlo.h"
+#include "util/pool.h"
 
 struct rvar_sample_t *monte_carlo_rvar(
     rvar_type_t (*single_run)(void *data),
@@ -23,57 +27,332 @@ struct rvar_sample_t *monte_carlo_rvar(
   return (struct rvar_sample_t *)rvar_sample_create_with_vals(vals, nsteps);
 }
 
-struct _monte_carlo_parallel_t {
-  void *data;
-  unsigned index;
-  rvar_type_t *vals;
+struct rvar_sample_t **monte_carlo_multi_rvar(
+    monte_carlo_run_multi_t run,
+    unsigned nsteps, unsigned nvars, void *data) {
+  rvar_type_t **vals = malloc(sizeof(rvar_type_t *) * nvars);
+  rvar_type_t **slots = malloc(sizeof(rvar_type_t *) * nvars);
+  for (uint32_t j = 0; j < nvars; ++j) {
+    vals[j] = malloc(sizeof(rvar_type_t) * nsteps);
+  }
+
+  for (uint32_t i = 0; i < nsteps; ++i) {
+    for (uint32_t j = 0; j < nvars; ++j) {
+      slots[j] = &vals[j][i];
+    }
+    run(data, slots, nvars);
+  }
+
+  struct rvar_sample_t **ret = malloc(sizeof(struct rvar_sample_t *) * nvars);
+  for (uint32_t j = 0; j < nvars; ++j) {
+    ret[j] = (struct rvar_sample_t *)rvar_sample_create_with_vals(vals[j], nsteps);
+  }
+
+  free(slots);
+  free(vals);
+  return ret;
+}
+
+struct rvar_sample_t *monte_carlo_parallel_rvar(
+    monte_carlo_run_t run, void *data,
+    unsigned nsteps, unsigned dsize, struct pool_t *pool) {
+  rvar_type_t *vals = monte_carlo_parallel_ordered_rvar(run, data, nsteps, dsize, pool);
+
+  struct rvar_sample_t *rv = (struct rvar_sample_t *)rvar_sample_create_with_vals(vals, nsteps);
+  return rv;
+}
+
+struct rvar_sketch_t *monte_carlo_sketch_rvar(
+    monte_carlo_run_t run,
+    unsigned nsteps, void *data, unsigned k) {
+  struct rvar_t *ret = rvar_sketch_create(k);
+  for (unsigned i = 0; i < nsteps; ++i) {
+    rvar_sketch_add(ret, run(data));
+  }
+
+  return (struct rvar_sketch_t *)ret;
+}
+
+/* Monte carlo jobs that work on a chunk of the data and accumulate the
+ * results locally, i.e., no locking and no per-sample storage.  The results
+ * of the chunks are merged at the end. */
+struct _monte_carlo_chunk_t {
+  char *data;
+  unsigned dsize;
+  unsigned begin, end;
   monte_carlo_run_t runner;
+
+  /* Local histogram */
+  struct monte_carlo_hist_t *hist;
+
+  /* Local sketch */
+  struct rvar_t *sketch;
+
+  /* Ordered runs: out[i] is the result of the i'th step */
+  rvar_type_t *out;
+
+  /* Multi-variable runs: vals[j][i] is the j'th variable of the i'th step */
+  monte_carlo_run_multi_t multi_runner;
+  unsigned nvars;
+  rvar_type_t **vals;
 };
 
-static void _mcpd_rvar_runner(void *data) {
-  struct _monte_carlo_parallel_t *mpcd = (struct _monte_carlo_parallel_t *)data;
-  rvar_type_t ret = mpcd->runner(mpcd->data);
-  mpcd->vals[mpcd->index] = ret;
+/* Splits nsteps into chunks of several steps each: a few chunks per worker so
+ * that the idle workers can steal the leftovers of the slow ones, but not one
+ * job per step so the per-job overhead is amortized.  The chunk size adapts to
+ * the number of steps and workers. */
+#define MC_CHUNKS_PER_WORKER 8
+
+static struct _monte_carlo_chunk_t *
+_monte_carlo_chunks(monte_carlo_run_t run, void *data, unsigned nsteps,
+    unsigned dsize, struct pool_t *pool, unsigned *ret_nchunks) {
+  unsigned nchunks = MIN(nsteps, pool_size(pool) * MC_CHUNKS_PER_WORKER);
+  if (nchunks == 0)
+    nchunks = 1;
+
+  struct _monte_carlo_chunk_t *chunks = malloc(sizeof(struct _monte_carlo_chunk_t) * nchunks);
+  memset(chunks, 0, sizeof(struct _monte_carlo_chunk_t) * nchunks);
+
+  unsigned per_chunk = nsteps / nchunks, rem = nsteps % nchunks, begin = 0;
+  for (uint32_t i = 0; i < nchunks; ++i) {
+    chunks[i].data = (char *)data;
+    chunks[i].dsize = dsize;
+    chunks[i].runner = run;
+    chunks[i].begin = begin;
+    begin += per_chunk + (i < rem);
+    chunks[i].end = begin;
+  }
+
+  *ret_nchunks = nchunks;
+  return chunks;
+}
+
+/* Histogram buckets are keyed by floor(val / bucket_size).  Keys beyond
+ * +/-2^52 can't be told apart in a double anyway. */
+#define MC_HIST_MAX_KEY 4503599627370496.0
+
+KHASH_MAP_INIT_INT64(mc_hist, uint64_t)
+
+struct monte_carlo_hist_t {
+  rvar_type_t bucket_size;
+  uint64_t count;
+  khash_t(mc_hist) *bins;
+};
+
+struct monte_carlo_hist_t *monte_carlo_hist_create(rvar_type_t bucket_size) {
+  if (!(bucket_size > 0))
+    panic("Invalid histogram bucket size: %f", bucket_size);
+
+  struct monte_carlo_hist_t *hist = malloc(sizeof(struct monte_carlo_hist_t));
+  hist->bucket_size = bucket_size;
+  hist->count = 0;
+  hist->bins = kh_init(mc_hist);
+  return hist;
+}
+
+static void
+_mc_hist_add_count(struct monte_carlo_hist_t *hist, int64_t key, uint64_t count) {
+  int absent = 0;
+  khiter_t k = kh_put(mc_hist, hist->bins, (khint64_t)key, &absent);
+  if (absent)
+    kh_value(hist->bins, k) = 0;
+  kh_value(hist->bins, k) += count;
+  hist->count += count;
+}
+
+void monte_carlo_hist_add(struct monte_carlo_hist_t *hist, rvar_type_t val) {
+  double key = floor(val / hist->bucket_size);
+  if (!isfinite(key) || fabs(key) > MC_HIST_MAX_KEY)
+    panic("Cannot bucketize a monte carlo sample of %f.", val);
+
+  _mc_hist_add_count(hist, (int64_t)key, 1);
+}
+
+void monte_carlo_hist_merge(
+    struct monte_carlo_hist_t *hist, struct monte_carlo_hist_t const *other) {
+  if (hist->bucket_size != other->bucket_size)
+    panic("Merging histograms with different bucket sizes: %f vs. %f",
+        hist->bucket_size, other->bucket_size);
+
+  for (khiter_t k = kh_begin(other->bins); k != kh_end(other->bins); ++k) {
+    if (!kh_exist(other->bins, k)) continue;
+    _mc_hist_add_count(hist, (int64_t)kh_key(other->bins, k), kh_value(other->bins, k));
+  }
+}
+
+uint64_t monte_carlo_hist_count(struct monte_carlo_hist_t const *hist) {
+  return hist->count;
+}
+
+static int _mc_hist_bucket_cmp(void const *a, void const *b) {
+  rvar_type_t va = ((struct bucket_t const *)a)->val;
+  rvar_type_t vb = ((struct bucket_t const *)b)->val;
+  return (va > vb) - (va < vb);
+}
+
+struct rvar_bucket_t *monte_carlo_hist_rvar(struct monte_carlo_hist_t const *hist) {
+  struct rvar_bucket_t *ret = (struct rvar_bucket_t *)rvar_bucket_create(hist->bucket_size);
+  unsigned nbins = kh_size(hist->bins);
+  ret->buckets = malloc(sizeof(struct bucket_t) * (nbins ? nbins : 1));
+
+  for (khiter_t k = kh_begin(hist->bins); k != kh_end(hist->bins); ++k) {
+    if (!kh_exist(hist->bins, k)) continue;
+
+    struct bucket_t *bucket = &ret->buckets[ret->nbuckets++];
+    bucket->val = (rvar_type_t)(int64_t)kh_key(hist->bins, k) * hist->bucket_size;
+    bucket->prob = (rvar_type_t)kh_value(hist->bins, k) / (rvar_type_t)hist->count;
+  }
+
+  qsort(ret->buckets, ret->nbuckets, sizeof(struct bucket_t), _mc_hist_bucket_cmp);
+  return ret;
+}
+
+void monte_carlo_hist_free(struct monte_carlo_hist_t *hist) {
+  kh_destroy(mc_hist, hist->bins);
+  free(hist);
+}
+
+static void _mcpd_ordered_runner(void *data) {
+  struct _monte_carlo_chunk_t *chunk = (struct _monte_carlo_chunk_t *)data;
+  for (uint32_t i = chunk->begin; i < chunk->end; ++i) {
+    chunk->out[i] = chunk->runner(chunk->data + (size_t)chunk->dsize * i);
+  }
 }
 
 rvar_type_t *monte_carlo_parallel_ordered_rvar(
     monte_carlo_run_t run, void *data,
-    unsigned nsteps, unsigned dsize, unsigned num_threads
+    unsigned nsteps, unsigned dsize, struct pool_t *pool
 ) {
-  if (num_threads == 0) {
-    num_threads = get_ncores() - 1;
-    if (num_threads == 0)
-      num_threads = 1;
+  struct pool_future_t future;
+  pool_future_init(&future);
+
+  rvar_type_t *vals = malloc(sizeof(rvar_type_t) * nsteps);
+
+  unsigned nchunks = 0;
+  struct _monte_carlo_chunk_t *chunks = _monte_carlo_chunks(
+      run, data, nsteps, dsize, pool, &nchunks);
+  for (uint32_t i = 0; i < nchunks; ++i) {
+    chunks[i].out = vals;
+    pool_submit(pool, &future, _mcpd_ordered_runner, &chunks[i]);
   }
 
-  threadpool thpool = thpool_init((int)num_threads);
+  pool_future_wait(&future);
+  pool_future_destroy(&future);
+  free(chunks);
 
-  struct _monte_carlo_parallel_t *mcpd = malloc(sizeof(struct _monte_carlo_parallel_t) * nsteps);
-  rvar_type_t *vals = malloc(sizeof(rvar_type_t) * nsteps);
+  return vals;
+}
 
-  for (uint32_t i = 0; i < nsteps; ++i) {
-    mcpd[i].data = ((char *)data) + (dsize * i);
-    mcpd[i].index = i;
-    mcpd[i].vals = vals;
-    mcpd[i].runner = run;
+static void _mcpd_hist_runner(void *data) {
+  struct _monte_carlo_chunk_t *chunk = (struct _monte_carlo_chunk_t *)data;
+  for (uint32_t i = chunk->begin; i < chunk->end; ++i) {
+    monte_carlo_hist_add(chunk->hist, chunk->runner(chunk->data + (size_t)chunk->dsize * i));
   }
+}
 
-  for (uint32_t i = 0; i < nsteps; ++i) {
-    thpool_add_work(thpool, _mcpd_rvar_runner, &mcpd[i]);
+struct rvar_bucket_t *monte_carlo_parallel_bucket_rvar(
+    monte_carlo_run_t run, void *data,
+    unsigned nsteps, unsigned dsize, struct pool_t *pool,
+    rvar_type_t bucket_size) {
+  struct pool_future_t future;
+  pool_future_init(&future);
+
+  unsigned nchunks = 0;
+  struct _monte_carlo_chunk_t *chunks = _monte_carlo_chunks(
+      run, data, nsteps, dsize, pool, &nchunks);
+  for (uint32_t i = 0; i < nchunks; ++i) {
+    chunks[i].hist = monte_carlo_hist_create(bucket_size);
+    pool_submit(pool, &future, _mcpd_hist_runner, &chunks[i]);
   }
 
-  thpool_wait(thpool);
-  thpool_destroy(thpool);
-  free(mcpd);
+  pool_future_wait(&future);
+  pool_future_destroy(&future);
 
-  return vals;
+  /* Merge the local histograms */
+  struct monte_carlo_hist_t *hist = chunks[0].hist;
+  for (uint32_t i = 1; i < nchunks; ++i) {
+    monte_carlo_hist_merge(hist, chunks[i].hist);
+    monte_carlo_hist_free(chunks[i].hist);
+  }
+  free(chunks);
+
+  struct rvar_bucket_t *ret = monte_carlo_hist_rvar(hist);
+  monte_carlo_hist_free(hist);
+
+  return ret;
 }
 
-struct rvar_sample_t *monte_carlo_parallel_rvar(
+static void _mcpd_sketch_runner(void *data) {
+  struct _monte_carlo_chunk_t *chunk = (struct _monte_carlo_chunk_t *)data;
+  for (uint32_t i = chunk->begin; i < chunk->end; ++i) {
+    rvar_sketch_add(chunk->sketch, chunk->runner(chunk->data + (size_t)chunk->dsize * i));
+  }
+}
+
+struct rvar_sketch_t *monte_carlo_parallel_sketch_rvar(
     monte_carlo_run_t run, void *data,
-    unsigned nsteps, unsigned dsize, unsigned num_threads) {
-  rvar_type_t *vals = monte_carlo_parallel_ordered_rvar(run, data, nsteps, dsize, num_threads);
+    unsigned nsteps, unsigned dsize, struct pool_t *pool, unsigned k) {
+  struct pool_future_t future;
+  pool_future_init(&future);
 
-  struct rvar_sample_t *rv = (struct rvar_sample_t *)rvar_sample_create_with_vals(vals, nsteps);
-  return rv;
+  unsigned nchunks = 0;
+  struct _monte_carlo_chunk_t *chunks = _monte_carlo_chunks(
+      run, data, nsteps, dsize, pool, &nchunks);
+  for (uint32_t i = 0; i < nchunks; ++i) {
+    chunks[i].sketch = rvar_sketch_create(k);
+    pool_submit(pool, &future, _mcpd_sketch_runner, &chunks[i]);
+  }
+
+  pool_future_wait(&future);
+  pool_future_destroy(&future);
+
+  /* Merge the local sketches */
+  struct rvar_t *sketch = chunks[0].sketch;
+  for (uint32_t i = 1; i < nchunks; ++i) {
+    rvar_sketch_merge(sketch, chunks[i].sketch);
+    chunks[i].sketch->free(chunks[i].sketch);
+  }
+  free(chunks);
+
+  return (struct rvar_sketch_t *)sketch;
+}
+
+static void _mcpd_multi_runner(void *data) {
+  struct _monte_carlo_chunk_t *chunk = (struct _monte_carlo_chunk_t *)data;
+  rvar_type_t **slots = malloc(sizeof(rvar_type_t *) * chunk->nvars);
+  for (uint32_t i = chunk->begin; i < chunk->end; ++i) {
+    for (uint32_t j = 0; j < chunk->nvars; ++j) {
+      slots[j] = &chunk->vals[j][i];
+    }
+    chunk->multi_runner(chunk->data + (size_t)chunk->dsize * i, slots, chunk->nvars);
+  }
+  free(slots);
+}
+
+rvar_type_t **monte_carlo_parallel_ordered_multi_rvar(
+    monte_carlo_run_multi_t run, void *data,
+    unsigned nsteps, unsigned dsize, unsigned nvars, struct pool_t *pool) {
+  struct pool_future_t future;
+  pool_future_init(&future);
+
+  rvar_type_t **vals = malloc(sizeof(rvar_type_t *) * nvars);
+  for (uint32_t j = 0; j < nvars; ++j) {
+    vals[j] = malloc(sizeof(rvar_type_t) * nsteps);
+  }
+
+  unsigned nchunks = 0;
+  struct _monte_carlo_chunk_t *chunks = _monte_carlo_chunks(
+      0, data, nsteps, dsize, pool, &nchunks);
+  for (uint32_t i = 0; i < nchunks; ++i) {
+    chunks[i].multi_runner = run;
+    chunks[i].nvars = nvars;
+    chunks[i].vals = vals;
+    pool_submit(pool, &future, _mcpd_multi_runner, &chunks[i]);
+  }
+
+  pool_future_wait(&future);
+  pool_future_destroy(&future);
+  free(chunks);
+
+  return vals;
 }
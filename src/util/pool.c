@@ -0,0 +1,387 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util/affinity.h"
+#include "util/common.h"
+#include "util/log.h"
+#include "util/pool.h"
+
+#define POOL_DEQUE_INIT_CAP 64
+
+struct pool_job_t {
+  pool_func_t func;
+  void *arg;
+  struct pool_future_t *future;
+};
+
+/* Per worker deque: the owner pushes and pops at the bottom (LIFO, the data
+ * is still warm in its cache) and the thieves take from the top (FIFO, the
+ * oldest and typically the largest pieces of work).
+ *
+ * Each deque has its own lock so the only contention is between a worker and
+ * the thieves of that worker, as opposed to everyone on one queue. */
+struct pool_deque_t {
+  pthread_mutex_t lock;
+  struct pool_job_t *jobs;  /* Circular buffer */
+  unsigned cap;
+  unsigned top, bottom;     /* Jobs are in [top, bottom) (mod cap) */
+};
+
+struct _pool_worker_t {
+  struct pool_t *pool;
+  unsigned id;
+  pthread_t thread;
+
+  /* Last broadcast this worker ran */
+  unsigned bcast_seen;
+
+  /* Where the worker is pinned (-1 if it isn't) */
+  int cpu, node;
+
+  /* Counters for pool_report: only the worker itself writes them */
+  uint64_t jobs, steals;
+  uint64_t busy_ns;
+};
+
+struct pool_t {
+  struct _pool_worker_t *workers;
+  struct pool_deque_t *deques;
+  unsigned nthreads;
+
+  /* Number of jobs sitting in the deques */
+  unsigned njobs;
+
+  /* Number of workers that are (about to be) asleep */
+  unsigned nsleepers;
+
+  /* Round robin deque for the jobs submitted from outside the pool */
+  unsigned next;
+
+  /* Idle workers sleep on this */
+  pthread_mutex_t lock;
+  pthread_cond_t  ready;
+
+  /* Broadcast job: every worker runs it once when bcast_gen changes */
+  pthread_mutex_t bcast_lock;
+  pool_func_t bcast_func;
+  void *bcast_arg;
+  unsigned bcast_gen;
+  struct pool_future_t bcast_future;
+
+  /* Set when the pool is being freed */
+  int stop;
+
+  /* Creation time, to compute the utilization of the workers */
+  uint64_t created_ns;
+};
+
+static __thread struct pool_t *_pool_current = 0;
+static __thread unsigned _pool_worker_id = POOL_NOT_A_WORKER;
+
+static uint64_t _pool_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void _pool_deque_init(struct pool_deque_t *dq) {
+  dq->cap = POOL_DEQUE_INIT_CAP;
+  dq->jobs = malloc(sizeof(struct pool_job_t) * dq->cap);
+  dq->top = dq->bottom = 0;
+  if (pthread_mutex_init(&dq->lock, 0) != 0)
+    panic("Couldn't initiate the mutex: %p", &dq->lock);
+}
+
+static void _pool_deque_free(struct pool_deque_t *dq) {
+  pthread_mutex_destroy(&dq->lock);
+  free(dq->jobs);
+}
+
+static void _pool_deque_push(struct pool_deque_t *dq, struct pool_job_t const *job) {
+  pthread_mutex_lock(&dq->lock);
+  if (dq->bottom - dq->top == dq->cap) {
+    unsigned cap = dq->cap * 2;
+    struct pool_job_t *jobs = malloc(sizeof(struct pool_job_t) * cap);
+    for (unsigned i = dq->top; i != dq->bottom; ++i) {
+      jobs[i % cap] = dq->jobs[i % dq->cap];
+    }
+    free(dq->jobs);
+    dq->jobs = jobs;
+    dq->cap = cap;
+  }
+  dq->jobs[dq->bottom % dq->cap] = *job;
+  dq->bottom++;
+  pthread_mutex_unlock(&dq->lock);
+}
+
+/* Pop from the bottom (owner) or the top (thief) of the deque */
+static int _pool_deque_pop(struct pool_deque_t *dq, int steal, struct pool_job_t *job) {
+  int ret = 0;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->bottom != dq->top) {
+    if (steal) {
+      *job = dq->jobs[dq->top % dq->cap];
+      dq->top++;
+    } else {
+      dq->bottom--;
+      *job = dq->jobs[dq->bottom % dq->cap];
+    }
+    ret = 1;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return ret;
+}
+
+static void _pool_future_done(struct pool_future_t *future) {
+  pthread_mutex_lock(&future->lock);
+  future->pending--;
+  if (future->pending == 0)
+    pthread_cond_broadcast(&future->done);
+  pthread_mutex_unlock(&future->lock);
+}
+
+/* Find a job: first our own deque, then steal from the others */
+static int _pool_find_job(struct pool_t *pool, unsigned id, struct pool_job_t *job) {
+  if (__atomic_load_n(&pool->njobs, __ATOMIC_SEQ_CST) == 0)
+    return 0;
+
+  if (_pool_deque_pop(&pool->deques[id], 0, job))
+    return 1;
+
+  for (unsigned i = 1; i < pool->nthreads; ++i) {
+    if (_pool_deque_pop(&pool->deques[(id + i) % pool->nthreads], 1, job)) {
+      pool->workers[id].steals++;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void *_pool_worker(void *data) {
+  struct _pool_worker_t *worker = (struct _pool_worker_t *)data;
+  struct pool_t *pool = worker->pool;
+  unsigned id = worker->id;
+  struct pool_job_t job;
+
+  _pool_current = pool;
+  _pool_worker_id = id;
+
+  while (1) {
+    unsigned gen = __atomic_load_n(&pool->bcast_gen, __ATOMIC_SEQ_CST);
+    if (gen != worker->bcast_seen) {
+      worker->bcast_seen = gen;
+      pool->bcast_func(pool->bcast_arg);
+      _pool_future_done(&pool->bcast_future);
+      continue;
+    }
+
+    if (_pool_find_job(pool, id, &job)) {
+      __atomic_sub_fetch(&pool->njobs, 1, __ATOMIC_SEQ_CST);
+      uint64_t start = _pool_now_ns();
+      job.func(job.arg);
+      worker->busy_ns += _pool_now_ns() - start;
+      worker->jobs++;
+      _pool_future_done(job.future);
+      continue;
+    }
+
+    /* Nothing to do: sleep until somebody submits a job.  nsleepers lets the
+     * submitters skip the lock when everyone is busy. */
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->nsleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool->njobs, __ATOMIC_SEQ_CST) == 0 && !pool->stop &&
+           __atomic_load_n(&pool->bcast_gen, __ATOMIC_SEQ_CST) == worker->bcast_seen)
+      pthread_cond_wait(&pool->ready, &pool->lock);
+    __atomic_sub_fetch(&pool->nsleepers, 1, __ATOMIC_SEQ_CST);
+
+    /* Drain the deques before leaving */
+    int stop = pool->stop && __atomic_load_n(&pool->njobs, __ATOMIC_SEQ_CST) == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (stop)
+      break;
+  }
+
+  return 0;
+}
+
+struct pool_t *pool_create(unsigned nthreads) {
+  if (nthreads == 0) {
+    long ncores = get_ncores() - 1;
+    nthreads = ncores > 0 ? (unsigned)ncores : 1;
+  }
+
+  struct pool_t *pool = malloc(sizeof(struct pool_t));
+  memset(pool, 0, sizeof(struct pool_t));
+  pool->nthreads = nthreads;
+  pool->created_ns = _pool_now_ns();
+  pool->workers = malloc(sizeof(struct _pool_worker_t) * nthreads);
+  pool->deques = malloc(sizeof(struct pool_deque_t) * nthreads);
+
+  if (pthread_mutex_init(&pool->lock, 0) != 0)
+    panic("Couldn't initiate the mutex: %p", &pool->lock);
+  if (pthread_cond_init(&pool->ready, 0) != 0)
+    panic("Couldn't initiate the condition variable: %p", &pool->ready);
+  if (pthread_mutex_init(&pool->bcast_lock, 0) != 0)
+    panic("Couldn't initiate the mutex: %p", &pool->bcast_lock);
+  pool_future_init(&pool->bcast_future);
+
+  for (uint32_t i = 0; i < nthreads; ++i) {
+    _pool_deque_init(&pool->deques[i]);
+  }
+
+  for (uint32_t i = 0; i < nthreads; ++i) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].id = i;
+    pool->workers[i].bcast_seen = 0;
+    pool->workers[i].cpu = pool->workers[i].node = -1;
+    pool->workers[i].jobs = pool->workers[i].steals = 0;
+    pool->workers[i].busy_ns = 0;
+    if (pthread_create(&pool->workers[i].thread, 0, _pool_worker, &pool->workers[i]) != 0)
+      panic("Couldn't create the worker thread: %u", i);
+  }
+
+  return pool;
+}
+
+unsigned pool_size(struct pool_t const *pool) {
+  return pool->nthreads;
+}
+
+unsigned pool_worker_id(void) {
+  return _pool_worker_id;
+}
+
+void pool_submit(struct pool_t *pool, struct pool_future_t *future,
+    pool_func_t func, void *arg) {
+  struct pool_job_t job = {func, arg, future};
+
+  pthread_mutex_lock(&future->lock);
+  future->pending++;
+  pthread_mutex_unlock(&future->lock);
+
+  /* Workers push to their own deque, everyone else spreads the jobs */
+  unsigned id = _pool_worker_id;
+  if (_pool_current != pool)
+    id = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->nthreads;
+
+  _pool_deque_push(&pool->deques[id], &job);
+  __atomic_add_fetch(&pool->njobs, 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&pool->nsleepers, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+void pool_broadcast(struct pool_t *pool, pool_func_t func, void *arg) {
+  /* One broadcast at a time */
+  pthread_mutex_lock(&pool->bcast_lock);
+
+  pool->bcast_future.pending = pool->nthreads;
+  pthread_mutex_lock(&pool->lock);
+  pool->bcast_func = func;
+  pool->bcast_arg = arg;
+  __atomic_add_fetch(&pool->bcast_gen, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&pool->ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  pool_future_wait(&pool->bcast_future);
+  pthread_mutex_unlock(&pool->bcast_lock);
+}
+
+static void _pool_pin_worker(void *arg) {
+  struct pool_t *pool = (struct pool_t *)arg;
+  struct _pool_worker_t *worker = &pool->workers[_pool_worker_id];
+
+  int cpu = affinity_cpu(worker->id);
+  if (affinity_pin_self(cpu) != 0) {
+    warn("Couldn't pin worker %u to cpu %d.", worker->id, cpu);
+    return;
+  }
+
+  worker->cpu = cpu;
+  worker->node = affinity_node_of_cpu(cpu);
+}
+
+void pool_pin(struct pool_t *pool) {
+  pool_broadcast(pool, _pool_pin_worker, pool);
+}
+
+int pool_worker_cpu(struct pool_t const *pool, unsigned id) {
+  return pool->workers[id].cpu;
+}
+
+int pool_worker_node(struct pool_t const *pool, unsigned id) {
+  return pool->workers[id].node;
+}
+
+void pool_report(struct pool_t const *pool) {
+  double elapsed = (double)(_pool_now_ns() - pool->created_ns);
+  uint64_t jobs = 0, steals = 0;
+  double busy = 0;
+
+  for (unsigned i = 0; i < pool->nthreads; ++i) {
+    struct _pool_worker_t const *w = &pool->workers[i];
+    info("Worker %u (cpu: %d, node: %d): %lu jobs, %lu steals, %.2f%% busy",
+        i, w->cpu, w->node, (unsigned long)w->jobs, (unsigned long)w->steals,
+        elapsed > 0 ? 100.0 * (double)w->busy_ns / elapsed : 0.0);
+    jobs += w->jobs;
+    steals += w->steals;
+    busy += (double)w->busy_ns;
+  }
+
+  info("Pool: %u workers, %lu jobs, %lu steals, %.2f%% utilization over %.3fs",
+      pool->nthreads, (unsigned long)jobs, (unsigned long)steals,
+      elapsed > 0 ? 100.0 * busy / (elapsed * pool->nthreads) : 0.0,
+      elapsed / 1e9);
+}
+
+void pool_free(struct pool_t *pool) {
+  if (!pool) return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (uint32_t i = 0; i < pool->nthreads; ++i) {
+    pthread_join(pool->workers[i].thread, 0);
+  }
+
+  for (uint32_t i = 0; i < pool->nthreads; ++i) {
+    _pool_deque_free(&pool->deques[i]);
+  }
+
+  pool_future_destroy(&pool->bcast_future);
+  pthread_mutex_destroy(&pool->bcast_lock);
+  pthread_cond_destroy(&pool->ready);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->deques);
+  free(pool->workers);
+  free(pool);
+}
+
+void pool_future_init(struct pool_future_t *future) {
+  future->pending = 0;
+  if (pthread_mutex_init(&future->lock, 0) != 0)
+    panic("Couldn't initiate the mutex: %p", &future->lock);
+  if (pthread_cond_init(&future->done, 0) != 0)
+    panic("Couldn't initiate the condition variable: %p", &future->done);
+}
+
+void pool_future_wait(struct pool_future_t *future) {
+  pthread_mutex_lock(&future->lock);
+  while (future->pending != 0)
+    pthread_cond_wait(&future->done, &future->lock);
+  pthread_mutex_unlock(&future->lock);
+}
+
+void pool_future_destroy(struct pool_future_t *future) {
+  pthread_cond_destroy(&future->done);
+  pthread_mutex_destroy(&future->lock);
+}
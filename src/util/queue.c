@@ -0,0 +1,103 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "util/log.h"
+#include "util/queue.h"
+
+struct queue_t {
+  void **items;          /* Circular buffer */
+  unsigned cap;
+  unsigned head, size;
+
+  int closed;
+
+  pthread_mutex_t lock;
+  pthread_cond_t  not_empty;
+  pthread_cond_t  not_full;
+};
+
+struct queue_t *queue_create(unsigned cap) {
+  if (cap == 0)
+    panic_txt("Queue capacity should be positive.");
+
+  struct queue_t *queue = malloc(sizeof(struct queue_t));
+  queue->items = malloc(sizeof(void *) * cap);
+  queue->cap = cap;
+  queue->head = queue->size = 0;
+  queue->closed = 0;
+
+  if (pthread_mutex_init(&queue->lock, 0) != 0)
+    panic("Couldn't initiate the mutex: %p", &queue->lock);
+  if (pthread_cond_init(&queue->not_empty, 0) != 0)
+    panic("Couldn't initiate the condition variable: %p", &queue->not_empty);
+  if (pthread_cond_init(&queue->not_full, 0) != 0)
+    panic("Couldn't initiate the condition variable: %p", &queue->not_full);
+
+  return queue;
+}
+
+void queue_push(struct queue_t *queue, void *item) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->size == queue->cap)
+    pthread_cond_wait(&queue->not_full, &queue->lock);
+
+  if (queue->closed)
+    panic_txt("Pushing to a closed queue.");
+
+  queue->items[(queue->head + queue->size) % queue->cap] = item;
+  queue->size++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+int queue_try_push(struct queue_t *queue, void *item) {
+  pthread_mutex_lock(&queue->lock);
+  if (queue->closed)
+    panic_txt("Pushing to a closed queue.");
+
+  if (queue->size == queue->cap) {
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+  }
+
+  queue->items[(queue->head + queue->size) % queue->cap] = item;
+  queue->size++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+  return 1;
+}
+
+int queue_pop(struct queue_t *queue, void **item) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->size == 0 && !queue->closed)
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+  if (queue->size == 0) {
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+  }
+
+  *item = queue->items[queue->head];
+  queue->head = (queue->head + 1) % queue->cap;
+  queue->size--;
+  pthread_cond_signal(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+  return 1;
+}
+
+void queue_close(struct queue_t *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+void queue_free(struct queue_t *queue) {
+  if (!queue) return;
+
+  pthread_cond_destroy(&queue->not_full);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_mutex_destroy(&queue->lock);
+  free(queue->items);
+  free(queue);
+}